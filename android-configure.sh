@@ -24,6 +24,7 @@ OPTION_TRY_64=no
 OPTION_HELP=no
 OPTION_STATIC=no
 OPTION_MINGW=no
+OPTION_IOTHREAD=no
 
 GLES_INCLUDE=
 GLES_LIBS=
@@ -77,6 +78,8 @@ for opt do
   ;;
   --no-gles) GLES_PROBE=no
   ;;
+  --iothread) OPTION_IOTHREAD=yes
+  ;;
   *)
     echo "unknown option '$opt', use --help"
     exit 1
@@ -109,6 +112,7 @@ EOF
     echo "  --gles-include=PATH      specify path to GLES emulation headers"
     echo "  --gles-libs=PATH         specify path to GLES emulation host libraries"
     echo "  --no-gles                disable GLES emulation support"
+    echo "  --iothread               run the virtual CPU in its own thread (Linux only)"
     echo ""
     exit 1
 fi
@@ -516,6 +520,34 @@ feature_check_header HAVE_BYTESWAP_H      "<byteswap.h>"
 feature_check_header HAVE_MACHINE_BSWAP_H "<machine/bswap.h>"
 feature_check_header HAVE_FNMATCH_H       "<fnmatch.h>"
 
+# check whether we can use the Linux native AIO interface
+#
+CONFIG_LINUX_AIO=no
+case "$TARGET_OS" in
+    linux-*)
+        feature_check_header HAVE_LINUX_AIO_ABI_H "<linux/aio_abi.h>"
+        feature_check_header HAVE_SYS_EVENTFD_H   "<sys/eventfd.h>"
+        if [ "$HAVE_LINUX_AIO_ABI_H" = "yes" -a "$HAVE_SYS_EVENTFD_H" = "yes" ] ; then
+            CONFIG_LINUX_AIO=yes
+        fi
+        ;;
+esac
+
+# check whether preadv()/pwritev() can be used for vectored block I/O
+#
+HAVE_PREADV=no
+if [ "$TARGET_OS" = "$OS" ] ; then
+cat > $TMPC << EOF
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+int main(void) {
+        return preadv(0, 0, 0, 0) + pwritev(0, 0, 0, 0);
+}
+EOF
+feature_check_link HAVE_PREADV
+fi
+
 # Build the config.make file
 #
 
@@ -565,6 +597,9 @@ fi
 if [ $OPTION_STATIC = yes ] ; then
     echo "CONFIG_STATIC_EXECUTABLE := true" >> $config_mk
 fi
+if [ $CONFIG_LINUX_AIO = yes ] ; then
+    echo "CONFIG_LINUX_AIO := true" >> $config_mk
+fi
 
 if [ -n "$ANDROID_SDK_TOOLS_REVISION" ] ; then
     echo "ANDROID_SDK_TOOLS_REVISION := $ANDROID_SDK_TOOLS_REVISION" >> $config_mk
@@ -623,6 +658,27 @@ case "$TARGET_OS" in
         ;;
 esac
 
+if [ "$CONFIG_LINUX_AIO" = "yes" ] ; then
+    echo "#define CONFIG_LINUX_AIO    1" >> $config_h
+fi
+
+if [ "$HAVE_PREADV" = "yes" ] ; then
+    echo "#define CONFIG_PREADV       1" >> $config_h
+fi
+
+# the vCPU thread is kicked with a real-time signal
+if [ "$OPTION_IOTHREAD" = "yes" ] ; then
+    case "$TARGET_OS" in
+        linux-*)
+            echo "#define CONFIG_IOTHREAD     1" >> $config_h
+            ;;
+        *)
+            echo "ERROR: --iothread is only supported on Linux hosts"
+            exit 1
+            ;;
+    esac
+fi
+
 case "$TARGET_OS" in
     linux-*|darwin-*)
         echo "#define CONFIG_MADVISE  1" >> $config_h
@@ -54,6 +54,11 @@ extern int tracing;
 extern int trace_cache_miss;
 extern int trace_all_addr;
 
+// Set to gzip the trace files, and to the size after which a trace
+// stream continues in a new file (0 for no limit).
+extern int trace_compress;
+extern uint64_t trace_segment_size;
+
 // Trace process/thread operations
 extern void trace_switch(int pid);
 extern void trace_fork(int tgid, int pid);
@@ -49,6 +49,7 @@
 #include "android/hw-events.h"
 #include "user-events.h"
 #include "android/hw-sensors.h"
+#include "android/hw-qemud.h"
 #include "android/keycode-array.h"
 #include "android/charmap.h"
 #include "android/display-core.h"
@@ -2584,6 +2585,38 @@ do_sensors_status( ControlClient client, char* args )
     return 0;
 }
 
+/* replay a sensor trace file, stop it, or tell how much of it is left */
+static int
+do_sensors_replay( ControlClient client, char* args )
+{
+    int status;
+
+    if (! args) {
+        int pending = android_sensors_replay_pending();
+        if (pending > 0)
+            control_write( client, "replaying, %d samples left\r\n", pending );
+        else
+            control_write( client, "no sensor trace is being replayed\r\n" );
+        return 0;
+    }
+
+    if (!strcmp( args, "stop" )) {
+        android_sensors_replay_stop();
+        return 0;
+    }
+
+    status = android_sensors_replay_start( args );
+    if (status == SENSOR_STATUS_NO_SERVICE) {
+        control_write( client, "KO: No sensor service found!\r\n" );
+        return -1;
+    }
+    if (status != SENSOR_STATUS_OK) {
+        control_write( client, "KO: could not load sensor trace '%s'\r\n", args );
+        return -1;
+    }
+    return 0;
+}
+
 /* Sensor commands for get/set sensor values and get available sensor names. */
 static const CommandDefRec sensor_commands[] =
 {
@@ -2599,6 +2632,65 @@ static const CommandDefRec sensor_commands[] =
       "'set <sensorname> <value-a>[:<value-b>[:<value-c>]]' set the values of a given sensor.\r\n",
       NULL, do_sensors_set, NULL },
 
+    { "replay", "replay a sensor trace file",
+      "'replay <file>' replays the sensor samples of a trace file, with lines of\r\n"
+      "the form '<time> <sensorname> <value-a>[:<value-b>[:<value-c>]]', <time>\r\n"
+      "being in seconds. 'replay stop' stops the replay, 'replay' alone tells\r\n"
+      "how many samples are left.\r\n",
+      NULL, do_sensors_replay, NULL },
+
+    { NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/********************************************************************************************/
+/********************************************************************************************/
+/*****                                                                                 ******/
+/*****                          Q E M U D   C O M M A N D S                            ******/
+/*****                                                                                 ******/
+/********************************************************************************************/
+/********************************************************************************************/
+
+/* list all qemud services with their clients and traffic counters */
+static int
+do_qemud_status( ControlClient client, char* args )
+{
+    QemudServiceStats*  stats;
+    int                 count, nn;
+
+    count = qemud_get_service_stats( NULL, 0 );
+    if (count == 0) {
+        control_write( client, "no qemud service registered\r\n" );
+        return 0;
+    }
+
+    stats = malloc( count * sizeof(*stats) );
+    if (stats == NULL) {
+        control_write( client, "KO: Memory allocation failed.\r\n" );
+        return -1;
+    }
+    count = qemud_get_service_stats( stats, count );
+
+    for (nn = 0; nn < count; nn++) {
+        QemudServiceStats*  st = &stats[nn];
+
+        control_write( client, "%-16s clients: %d  recv: %llu msgs %llu bytes  sent: %llu msgs %llu bytes\r\n",
+                       st->name, st->num_clients,
+                       (unsigned long long)st->recv_msgs,
+                       (unsigned long long)st->recv_bytes,
+                       (unsigned long long)st->send_msgs,
+                       (unsigned long long)st->send_bytes );
+    }
+    free( stats );
+    return 0;
+}
+
+static const CommandDefRec  qemud_commands[] =
+{
+    { "status", "list qemud services and their traffic",
+      "'status': list all qemud services with their number of clients, and the number of\r\n"
+      "messages and bytes received from and sent to them.\r\n",
+      NULL, do_qemud_status, NULL },
+
     { NULL, NULL, NULL, NULL, NULL, NULL }
 };
 
@@ -2983,6 +3075,10 @@ static const CommandDefRec   main_commands[] =
       "allows you to request the emulator sensors\r\n", NULL,
       NULL, sensor_commands },
 
+    { "qemud", "qemud service statistics",
+      "allows you to inspect the qemud services and their clients\r\n", NULL,
+      NULL, qemud_commands },
+
     { NULL, NULL, NULL, NULL, NULL, NULL }
 };
 
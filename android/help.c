@@ -718,6 +718,26 @@ help_no_snapshot_update_time(stralloc_t*  out)
     );
 }
 
+static void
+help_snapshot_lazy_load(stralloc_t*  out)
+{
+    PRINTF(
+    "  Resume from the snapshot before guest RAM is read back: each part\n"
+    "  of RAM is restored when it is first accessed, and the rest in the\n"
+    "  background. Only supported on Linux hosts.\n\n"
+    );
+}
+
+static void
+help_snapshot_direct_io(stralloc_t*  out)
+{
+    PRINTF(
+    "  Open the snapshot storage file with O_DIRECT, so that saving a\n"
+    "  snapshot does not fill the host page cache with guest RAM. This\n"
+    "  trades cache pressure for raw disk throughput.\n\n"
+    );
+}
+
 static void
 help_snapshot_list(stralloc_t*  out)
 {
@@ -938,6 +958,26 @@ help_trace(stralloc_t*  out)
     );
 }
 
+static void
+help_trace_compress(stralloc_t*  out)
+{
+    PRINTF(
+    "  when used with '-trace <name>', compress each trace file with gzip as it\n"
+    "  is written. the files get a '.gz' suffix and must be decompressed before\n"
+    "  they are given to 'traceview'.\n\n"
+    );
+}
+
+static void
+help_trace_segment(stralloc_t*  out)
+{
+    PRINTF(
+    "  when used with '-trace <name>', start a new file for a trace stream every\n"
+    "  <size> megabytes. segments are named <file>.001, <file>.002, ... and can\n"
+    "  be concatenated back, in order, to form the complete stream.\n\n"
+    );
+}
+
 #ifdef CONFIG_MEMCHECK
 static void
 help_memcheck(stralloc_t*  out)
@@ -14,6 +14,7 @@
 #include "android/utils/misc.h"
 #include "android/utils/system.h"
 #include "android/utils/bufprint.h"
+#include "android/utils/intmap.h"
 #include "android/looper.h"
 #include "hw/hw.h"
 #include "hw/goldfish_pipe.h"
@@ -46,7 +47,7 @@
 /* Version number of snapshots code. Increment whenever the data saved
  * or the layout in which it is saved is changed.
  */
-#define QEMUD_SAVE_VERSION 2
+#define QEMUD_SAVE_VERSION 3
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 
@@ -212,9 +213,47 @@ typedef enum {
 #  define  LEGACY_CHANNEL_OFFSET  4
 #endif
 
+/* in bulk mode, negotiated by the daemon with a "bulk:<max>" control
+ * message, the header is binary instead:
+ *
+ *   offset  size  description
+ *     0      2    little-endian channel id
+ *     2      4    little-endian payload size, up to the negotiated max
+ */
+#define  BULK_CHANNEL_OFFSET  0
+#define  BULK_LENGTH_OFFSET   2
+
 /* length of the framed header */
 #define  FRAME_HEADER_SIZE  4
 
+static __inline__ void
+put_le16( uint8_t*  p, unsigned  val )
+{
+    p[0] = (uint8_t) val;
+    p[1] = (uint8_t)(val >> 8);
+}
+
+static __inline__ void
+put_le32( uint8_t*  p, unsigned  val )
+{
+    p[0] = (uint8_t) val;
+    p[1] = (uint8_t)(val >> 8);
+    p[2] = (uint8_t)(val >> 16);
+    p[3] = (uint8_t)(val >> 24);
+}
+
+static __inline__ unsigned
+get_le16( const uint8_t*  p )
+{
+    return p[0] | (p[1] << 8);
+}
+
+static __inline__ unsigned
+get_le32( const uint8_t*  p )
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
 #define  BUFFER_SIZE    MAX_SERIAL_PAYLOAD
 
 /* out of convenience, the incoming message is zero-terminated
@@ -233,13 +272,19 @@ typedef struct QemudSerial {
 #if SUPPORT_LEGACY_QEMUD
     QemudVersion  version;
 #endif
+    /* bulk mode, and the max payload of a packet in both directions */
+    ABool         bulk;
+    int           max_payload;
     QemudSink     header[1];
     QemudSink     payload[1];
-    uint8_t       data0[MAX_SERIAL_PAYLOAD+1];
+    uint8_t       data0[MAX_FRAME_PAYLOAD+1];
 
     /* receiver */
     QemudSerialReceive  recv_func;    /* receiver callback */
     void*               recv_opaque;  /* receiver user-specific data */
+
+    /* clients connected through this port, by channel id */
+    AIntMap*            channels;
 } QemudSerial;
 
 
@@ -261,16 +306,18 @@ qemud_serial_save(QEMUFile* f, QemudSerial* s)
 #if SUPPORT_LEGACY_QEMUD
     qemu_put_be32(f, s->version);
 #endif
+    qemu_put_be32(f, s->bulk);
+    qemu_put_be32(f, s->max_payload);
     qemud_sink_save(f, s->header);
     qemud_sink_save(f, s->payload);
-    qemu_put_be32(f, MAX_SERIAL_PAYLOAD+1);
-    qemu_put_buffer(f, s->data0, MAX_SERIAL_PAYLOAD+1);
+    qemu_put_be32(f, s->max_payload+1);
+    qemu_put_buffer(f, s->data0, s->max_payload+1);
 }
 
 /* Load the state of a QemudSerial from a snapshot file.
  */
 static int
-qemud_serial_load(QEMUFile* f, QemudSerial* s)
+qemud_serial_load(QEMUFile* f, QemudSerial* s, int version)
 {
     /* state of incoming packets from the serial port */
     s->need_header = qemu_get_be32(f);
@@ -280,6 +327,18 @@ qemud_serial_load(QEMUFile* f, QemudSerial* s)
 #if SUPPORT_LEGACY_QEMUD
     s->version = qemu_get_be32(f);
 #endif
+    if (version >= 3) {
+        s->bulk        = qemu_get_be32(f);
+        s->max_payload = qemu_get_be32(f);
+    } else {
+        s->bulk        = 0;
+        s->max_payload = MAX_SERIAL_PAYLOAD;
+    }
+    if (s->max_payload < MAX_SERIAL_PAYLOAD || s->max_payload > MAX_FRAME_PAYLOAD) {
+        D("%s: load failed: invalid max payload (%d)\n",
+          __FUNCTION__, s->max_payload);
+        return -EIO;
+    }
     qemud_sink_load(f, s->header);
     qemud_sink_load(f, s->payload);
 
@@ -287,10 +346,10 @@ qemud_serial_load(QEMUFile* f, QemudSerial* s)
     s->header->buff = s->payload->buff = s->data0;
 
     int len = qemu_get_be32(f);
-    if (len - 1 > MAX_SERIAL_PAYLOAD) {
+    if (len - 1 > MAX_FRAME_PAYLOAD) {
         D("%s: load failed: size of saved payload buffer (%d) exceeds "
           "current maximum (%d)\n",
-          __FUNCTION__, len - 1, MAX_SERIAL_PAYLOAD);
+          __FUNCTION__, len - 1, MAX_FRAME_PAYLOAD);
         return -EIO;
     }
     int ret;
@@ -323,6 +382,47 @@ qemud_serial_can_read( void*  opaque )
     return qemud_sink_needed(s->payload);
 }
 
+/* extract the payload length and channel id from the header in 'data0' */
+static void
+qemud_serial_get_header( QemudSerial*  s )
+{
+    if (s->bulk) {
+        s->in_size    = (int) get_le32( s->data0 + BULK_LENGTH_OFFSET );
+        s->in_channel = get_le16( s->data0 + BULK_CHANNEL_OFFSET );
+        return;
+    }
+
+#if SUPPORT_LEGACY_QEMUD
+    if (s->version == QEMUD_VERSION_UNKNOWN) {
+        /* if we receive "001200" as the first header, then we
+         * detected a legacy qemud daemon. See the comments
+         * in qemud_serial_send_legacy_probe() for details.
+         */
+        if ( !memcmp(s->data0, "001200", 6) ) {
+            D("%s: legacy qemud detected.", __FUNCTION__);
+            s->version = QEMUD_VERSION_LEGACY;
+            /* tell the modem to use legacy emulation mode */
+            amodem_set_legacy(android_modem);
+        } else {
+            D("%s: normal qemud detected.", __FUNCTION__);
+            s->version = QEMUD_VERSION_NORMAL;
+        }
+    }
+
+    if (s->version == QEMUD_VERSION_LEGACY) {
+        s->in_size     = hex2int( s->data0 + LEGACY_LENGTH_OFFSET,  LENGTH_SIZE );
+        s->in_channel  = hex2int( s->data0 + LEGACY_CHANNEL_OFFSET, CHANNEL_SIZE );
+    } else {
+        s->in_size     = hex2int( s->data0 + LENGTH_OFFSET,  LENGTH_SIZE );
+        s->in_channel  = hex2int( s->data0 + CHANNEL_OFFSET, CHANNEL_SIZE );
+    }
+#else
+    /* extract payload length + channel id */
+    s->in_size     = hex2int( s->data0 + LENGTH_OFFSET,  LENGTH_SIZE );
+    s->in_channel  = hex2int( s->data0 + CHANNEL_OFFSET, CHANNEL_SIZE );
+#endif
+}
+
 /* called by the charpipe to read data from the serial
  * port. 'len' cannot be more than the value returned
  * by 'qemud_serial_can_read'.
@@ -345,6 +445,7 @@ qemud_serial_read( void*  opaque, const uint8_t*  from, int  len )
 
             from += avail;
             len  -= avail;
+            s->overflow -= avail;
             continue;
         }
 
@@ -353,35 +454,7 @@ qemud_serial_read( void*  opaque, const uint8_t*  from, int  len )
             if (!qemud_sink_fill(s->header, (const uint8_t**)&from, &len))
                 break;
 
-#if SUPPORT_LEGACY_QEMUD
-            if (s->version == QEMUD_VERSION_UNKNOWN) {
-                /* if we receive "001200" as the first header, then we
-                 * detected a legacy qemud daemon. See the comments
-                 * in qemud_serial_send_legacy_probe() for details.
-                 */
-                if ( !memcmp(s->data0, "001200", 6) ) {
-                    D("%s: legacy qemud detected.", __FUNCTION__);
-                    s->version = QEMUD_VERSION_LEGACY;
-                    /* tell the modem to use legacy emulation mode */
-                    amodem_set_legacy(android_modem);
-                } else {
-                    D("%s: normal qemud detected.", __FUNCTION__);
-                    s->version = QEMUD_VERSION_NORMAL;
-                }
-            }
-
-            if (s->version == QEMUD_VERSION_LEGACY) {
-                s->in_size     = hex2int( s->data0 + LEGACY_LENGTH_OFFSET,  LENGTH_SIZE );
-                s->in_channel  = hex2int( s->data0 + LEGACY_CHANNEL_OFFSET, CHANNEL_SIZE );
-            } else {
-                s->in_size     = hex2int( s->data0 + LENGTH_OFFSET,  LENGTH_SIZE );
-                s->in_channel  = hex2int( s->data0 + CHANNEL_OFFSET, CHANNEL_SIZE );
-            }
-#else
-            /* extract payload length + channel id */
-            s->in_size     = hex2int( s->data0 + LENGTH_OFFSET,  LENGTH_SIZE );
-            s->in_channel  = hex2int( s->data0 + CHANNEL_OFFSET, CHANNEL_SIZE );
-#endif
+            qemud_serial_get_header(s);
             s->header->used = 0;
 
             if (s->in_size <= 0 || s->in_channel < 0) {
@@ -389,7 +462,7 @@ qemud_serial_read( void*  opaque, const uint8_t*  from, int  len )
                 continue;
             }
 
-            if (s->in_size > MAX_SERIAL_PAYLOAD) {
+            if (s->in_size > s->max_payload) {
                 D("%s: ignoring huge serial packet: length=%d channel=%1",
                   __FUNCTION__, s->in_size, s->in_channel);
                 s->overflow = s->in_size;
@@ -494,6 +567,9 @@ qemud_serial_init( QemudSerial*        s,
     s->recv_opaque  = recv_opaque;
     s->need_header  = 1;
     s->overflow     = 0;
+    s->bulk         = 0;
+    s->max_payload  = MAX_SERIAL_PAYLOAD;
+    s->channels     = aintMap_new();
 
     qemud_sink_reset( s->header, HEADER_SIZE, s->data0 );
     s->in_size      = 0;
@@ -511,6 +587,26 @@ qemud_serial_init( QemudSerial*        s,
                            s );
 }
 
+/* write the header of a packet of 'len' bytes for 'channel' */
+static void
+qemud_serial_put_header( QemudSerial*  s, uint8_t*  header, int  channel, int  len )
+{
+    if (s->bulk) {
+        put_le16(header + BULK_CHANNEL_OFFSET, channel);
+        put_le32(header + BULK_LENGTH_OFFSET,  len);
+        return;
+    }
+#if SUPPORT_LEGACY_QEMUD
+    if (s->version == QEMUD_VERSION_LEGACY) {
+        int2hex(header + LEGACY_LENGTH_OFFSET,  LENGTH_SIZE,  len);
+        int2hex(header + LEGACY_CHANNEL_OFFSET, CHANNEL_SIZE, channel);
+        return;
+    }
+#endif
+    int2hex(header + LENGTH_OFFSET,  LENGTH_SIZE,  len);
+    int2hex(header + CHANNEL_OFFSET, CHANNEL_SIZE, channel);
+}
+
 /* send a message to the serial port. This will add the necessary
  * header.
  */
@@ -540,22 +636,11 @@ qemud_serial_send( QemudSerial*    s,
     while (len > 0)
     {
         avail = len;
-        if (avail > MAX_SERIAL_PAYLOAD)
-            avail = MAX_SERIAL_PAYLOAD;
+        if (avail > s->max_payload)
+            avail = s->max_payload;
 
         /* write this packet's header */
-#if SUPPORT_LEGACY_QEMUD
-        if (s->version == QEMUD_VERSION_LEGACY) {
-            int2hex(header + LEGACY_LENGTH_OFFSET,  LENGTH_SIZE,  avail);
-            int2hex(header + LEGACY_CHANNEL_OFFSET, CHANNEL_SIZE, channel);
-        } else {
-            int2hex(header + LENGTH_OFFSET,  LENGTH_SIZE,  avail);
-            int2hex(header + CHANNEL_OFFSET, CHANNEL_SIZE, channel);
-        }
-#else
-        int2hex(header + LENGTH_OFFSET,  LENGTH_SIZE,  avail);
-        int2hex(header + CHANNEL_OFFSET, CHANNEL_SIZE, channel);
-#endif
+        qemud_serial_put_header(s, header, channel, avail);
         T("%s: '%.*s'", __FUNCTION__, HEADER_SIZE, header);
         qemu_chr_write(s->cs, header, HEADER_SIZE);
 
@@ -657,6 +742,8 @@ struct QemudClient {
 
     /* framing support */
     int               framing;
+    /* use binary frame headers, for clients of "qemud-bulk" pipes */
+    ABool             bulk;
     ABool             need_header;
     ABool             closing;
     QemudSink         header[1];
@@ -686,11 +773,60 @@ _is_pipe_client(QemudClient* client)
 
 static void  qemud_service_remove_client( QemudService*  service,
                                           QemudClient*   client );
+static void  qemud_service_count_recv( QemudService*  service, int  msglen );
+static void  qemud_service_count_send( QemudService*  service, int  msglen );
+
+/* frame headers are 4-char hex strings, or little-endian 32-bit values
+ * for bulk clients. the latter are limited to MAX_FRAME_PAYLOAD too.
+ */
+static void
+qemud_client_put_frame_header( QemudClient*  c, uint8_t*  header, int  len )
+{
+    if (c->bulk)
+        put_le32(header, len);
+    else
+        int2hex(header, FRAME_HEADER_SIZE, len);
+}
+
+/* returns the frame size in 'header', or -1 if it is corrupted */
+static int
+qemud_client_get_frame_header( QemudClient*  c, const uint8_t*  header )
+{
+    unsigned  len;
+
+    if (!c->bulk)
+        return hex2int(header, FRAME_HEADER_SIZE);
+
+    len = get_le32(header);
+    if (len > MAX_FRAME_PAYLOAD)
+        return -1;
+    return (int)len;
+}
+
+/* remove a serial QemudClient from its port's channel map. this must be
+ * done before its channel id is changed.
+ */
+static void
+qemud_client_unmap_channel( QemudClient*  c )
+{
+    QemudSerial*  serial;
+    int           channel;
+
+    if (_is_pipe_client(c))
+        return;
+
+    serial  = c->ProtocolSelector.Serial.serial;
+    channel = c->ProtocolSelector.Serial.channel;
+    if (channel >= 0 && aintMap_get(serial->channels, channel) == c)
+        aintMap_del(serial->channels, channel);
+}
 
 /* remove a QemudClient from global list */
 static void
 qemud_client_remove( QemudClient*  c )
 {
+    qemud_client_unmap_channel(c);
+
     c->pref[0] = c->next;
     if (c->next)
         c->next->pref = c->pref;
@@ -720,6 +856,7 @@ qemud_client_recv( void*  opaque, uint8_t*  msg, int  msglen )
 
     /* no framing, things are simple */
     if (!c->framing) {
+        qemud_service_count_recv(c->service, msglen);
         if (c->clie_recv)
             c->clie_recv( c->clie_opaque, msg, msglen, c );
         return;
@@ -736,9 +873,10 @@ qemud_client_recv( void*  opaque, uint8_t*  msg, int  msglen )
         c->need_header == 1          &&
         qemud_sink_needed(c->header) == 0)
     {
-        int  len = hex2int( msg, FRAME_HEADER_SIZE );
+        int  len = qemud_client_get_frame_header( c, msg );
 
         if (len >= 0 && msglen == len + FRAME_HEADER_SIZE) {
+            qemud_service_count_recv(c->service, len);
             if (c->clie_recv)
                 c->clie_recv( c->clie_opaque,
                               msg+FRAME_HEADER_SIZE,
@@ -759,7 +897,8 @@ qemud_client_recv( void*  opaque, uint8_t*  msg, int  msglen )
             if (!qemud_sink_fill(c->header, (const uint8_t**)&msg, &msglen))
                 break;
 
-            frame_size = hex2int(c->header0, 4);
+            frame_size = qemud_client_get_frame_header(c, c->header0);
+            c->header->used = 0;
             if (frame_size == 0) {
                 D("%s: ignoring empty frame", __FUNCTION__);
                 continue;
@@ -773,7 +912,6 @@ qemud_client_recv( void*  opaque, uint8_t*  msg, int  msglen )
             AARRAY_NEW(data, frame_size+1);  /* +1 for terminating zero */
             qemud_sink_reset(c->payload, frame_size, data);
             c->need_header = 0;
-            c->header->used = 0;
         }
 
         /* read the payload */
@@ -787,6 +925,7 @@ qemud_client_recv( void*  opaque, uint8_t*  msg, int  msglen )
         /* Technically, calling 'clie_recv' can destroy client object 'c'
          * if it decides to close the connection, so ensure we don't
          * use/dereference it after the call. */
+        qemud_service_count_recv(c->service, c->payload->size);
         if (c->clie_recv)
             c->clie_recv( c->clie_opaque, c->payload->buff, c->payload->size, c );
 
@@ -916,6 +1055,7 @@ qemud_client_alloc( int               channel_id,
         c->protocol = QEMUD_PROTOCOL_SERIAL;
         c->ProtocolSelector.Serial.serial   = serial;
         c->ProtocolSelector.Serial.channel  = channel_id;
+        aintMap_set(serial->channels, channel_id, c);
     }
     c->param       = client_param ? ASTRDUP(client_param) : NULL;
     c->clie_opaque = clie_opaque;
@@ -936,10 +1076,12 @@ qemud_client_alloc( int               channel_id,
 }
 
 /* forward */
+typedef struct QemudMultiplexer  QemudMultiplexer;
+
 static void  qemud_service_save_name( QEMUFile* f, QemudService* s );
 static char* qemud_service_load_name( QEMUFile* f );
-static QemudService* qemud_service_find(  QemudService*  service_list,
-                                          const char*    service_name );
+static QemudService* qemud_service_find(  QemudMultiplexer*  m,
+                                          const char*        service_name );
 static QemudClient*  qemud_service_connect_client(  QemudService  *sv,
                                                     int           channel_id,
                                                     const char* client_param);
@@ -979,14 +1121,14 @@ qemud_serial_client_save(QEMUFile* f, QemudClient* c)
  * loaded along with the pipe to which they were attached.
  */
 static int
-qemud_serial_client_load(QEMUFile* f, QemudService* current_services, int version )
+qemud_serial_client_load(QEMUFile* f, QemudMultiplexer* m, int version )
 {
     char *service_name = qemud_service_load_name(f);
     if (service_name == NULL)
         return -EIO;
     char* param = qemu_get_string(f);
     /* get current service instance */
-    QemudService *sv = qemud_service_find(current_services, service_name);
+    QemudService *sv = qemud_service_find(m, service_name);
     if (sv == NULL) {
         D("%s: load failed: unknown service \"%s\"\n",
           __FUNCTION__, service_name);
@@ -1076,8 +1218,48 @@ struct QemudService {
     QemudServiceLoad     serv_load;
     void*                serv_opaque;
     QemudService*        next;
+    QemudService*        next_hash;  /* next with the same name hash */
+
+    /* traffic counters, see qemud_get_service_stats() */
+    uint64_t             recv_msgs;
+    uint64_t             recv_bytes;
+    uint64_t             send_msgs;
+    uint64_t             send_bytes;
 };
 
+/* hash a service name for the multiplexer's service map */
+static int
+qemud_service_hash( const char*  name )
+{
+    unsigned  h = 2166136261U;
+
+    while (*name)
+        h = (h ^ (uint8_t)*name++) * 16777619U;
+
+    return (int)h;
+}
+
+/* account for a message received from, or sent to, one of the service's
+ * clients. 'service' is NULL for the control channel.
+ */
+static void
+qemud_service_count_recv( QemudService*  service, int  msglen )
+{
+    if (service != NULL) {
+        service->recv_msgs  += 1;
+        service->recv_bytes += msglen;
+    }
+}
+
+static void
+qemud_service_count_send( QemudService*  service, int  msglen )
+{
+    if (service != NULL) {
+        service->send_msgs  += 1;
+        service->send_bytes += msglen;
+    }
+}
+
 /* Create a new QemudService object */
 static QemudService*
 qemud_service_new( const char*          name,
@@ -1165,20 +1347,6 @@ qemud_service_connect_client(QemudService *sv,
     return client;
 }
 
-/* find a registered service by name.
- */
-static QemudService*
-qemud_service_find( QemudService*  service_list, const char*  service_name)
-{
-    QemudService*  sv = NULL;
-    for (sv = service_list; sv != NULL; sv = sv->next) {
-        if (!strcmp(sv->name, service_name)) {
-            break;
-        }
-    }
-    return sv;
-}
-
 /* Save the name of the given service.
  */
 static void
@@ -1234,17 +1402,17 @@ qemud_service_save(QEMUFile* f, QemudService* s)
  * of that service to mirror the loaded state. If the service is not running,
  * the load process is aborted.
  *
- * Parameter 'current_services' should be the list of active services.
+ * Parameter 'm' is the multiplexer holding the active services.
  */
 static int
-qemud_service_load(  QEMUFile*  f, QemudService*  current_services  )
+qemud_service_load(  QEMUFile*  f, QemudMultiplexer*  m  )
 {
     char* service_name = qemud_service_load_name(f);
     if (service_name == NULL)
         return -EIO;
 
     /* get current service instance */
-    QemudService *sv = qemud_service_find(current_services, service_name);
+    QemudService *sv = qemud_service_find(m, service_name);
     if (sv == NULL) {
         D("%s: loading failed: service \"%s\" not available\n",
           __FUNCTION__, service_name);
@@ -1283,14 +1451,30 @@ qemud_service_load(  QEMUFile*  f, QemudService*  current_services  )
  * to handle channel 0, i.e. the control channel used to handle
  * connections and disconnections of clients.
  */
-typedef struct QemudMultiplexer  QemudMultiplexer;
-
 struct QemudMultiplexer {
     QemudSerial    serial[1];
     QemudClient*   clients;
     QemudService*  services;
+    /* services by name hash, colliding ones are chained with 'next_hash' */
+    AIntMap*       services_map;
 };
 
+/* find a registered service by name.
+ */
+static QemudService*
+qemud_service_find( QemudMultiplexer*  m, const char*  service_name)
+{
+    QemudService*  sv = aintMap_get(m->services_map,
+                                    qemud_service_hash(service_name));
+
+    for ( ; sv != NULL; sv = sv->next_hash) {
+        if (!strcmp(sv->name, service_name)) {
+            break;
+        }
+    }
+    return sv;
+}
+
 /* this is the serial_recv callback that is called
  * whenever an incoming message arrives through the serial port
  */
@@ -1301,17 +1485,15 @@ qemud_multiplexer_serial_recv( void*     opaque,
                                int       msglen )
 {
     QemudMultiplexer*  m = opaque;
-    QemudClient*       c = m->clients;
+    QemudClient*       c = aintMap_get(m->serial->channels, channel);
 
     /* dispatch to an existing client if possible
      * note that channel 0 is handled by a special
      * QemudClient that is setup in qemud_multiplexer_init()
      */
-    for ( ; c != NULL; c = c->next ) {
-        if (!_is_pipe_client(c) && c->ProtocolSelector.Serial.channel == channel) {
-            qemud_client_recv(c, msg, msglen);
-            return;
-        }
+    if (c != NULL) {
+        qemud_client_recv(c, msg, msglen);
+        return;
     }
 
     D("%s: ignoring %d bytes for unknown channel %d",
@@ -1329,7 +1511,7 @@ qemud_multiplexer_connect( QemudMultiplexer*  m,
                            int                channel_id )
 {
     /* find the corresponding registered service by name */
-    QemudService*  sv = qemud_service_find(m->services, service_name);
+    QemudService*  sv = qemud_service_find(m, service_name);
     if (sv == NULL) {
         D("%s: no registered '%s' service", __FUNCTION__, service_name);
         return -1;
@@ -1354,20 +1536,19 @@ static void
 qemud_multiplexer_disconnect( QemudMultiplexer*  m,
                               int                channel )
 {
-    QemudClient*  c;
+    QemudClient*  c = aintMap_get(m->serial->channels, channel);
 
     /* find the client by its channel id, then disconnect it */
-    for (c = m->clients; c; c = c->next) {
-        if (!_is_pipe_client(c) && c->ProtocolSelector.Serial.channel == channel) {
-            D("%s: disconnecting client %d",
-              __FUNCTION__, channel);
-            /* note thatt this removes the client from
-             * m->clients automatically.
-             */
-            c->ProtocolSelector.Serial.channel = -1; /* no need to send disconnect:<id> */
-            qemud_client_disconnect(c, 0);
-            return;
-        }
+    if (c != NULL) {
+        D("%s: disconnecting client %d",
+          __FUNCTION__, channel);
+        /* note thatt this removes the client from
+         * m->clients automatically.
+         */
+        qemud_client_unmap_channel(c);
+        c->ProtocolSelector.Serial.channel = -1; /* no need to send disconnect:<id> */
+        qemud_client_disconnect(c, 0);
+        return;
     }
     D("%s: disconnecting unknown channel %d",
       __FUNCTION__, channel);
@@ -1394,6 +1575,7 @@ qemud_multiplexer_disconnect_noncontrol( QemudMultiplexer*  m )
               __FUNCTION__, c->ProtocolSelector.Serial.channel);
             D("%s: disconnecting client %d\n",
               __FUNCTION__, c->ProtocolSelector.Serial.channel);
+            qemud_client_unmap_channel(c);
             c->ProtocolSelector.Serial.channel = -1; /* do not send disconnect:<id> */
             qemud_client_disconnect(c, 0);
         }
@@ -1476,6 +1658,40 @@ qemud_multiplexer_control_recv( void*         opaque,
         return;
     }
 
+    /* handle bulk mode requests.
+     * format: "bulk:<max>" where <max> is a 4-hex string giving the
+     * largest payload the daemon can receive in a single packet.
+     * the answer is "ok:bulk:<max>" with the negotiated size, after
+     * which both sides use binary packet headers (see qemud_serial_put_header).
+     * the daemon must use them for anything it sends after the request.
+     */
+    if (msglen == 9 && !memcmp(msg, "bulk:", 5)) {
+        QemudSerial*  serial = mult->serial;
+        int           max    = hex2int(msg+5, 4);
+
+#if SUPPORT_LEGACY_QEMUD
+        if (serial->version == QEMUD_VERSION_LEGACY)
+            max = -1;
+#endif
+        if (max < MAX_SERIAL_PAYLOAD || serial->bulk) {
+            D("%s: refusing bulk mode: '%.*s'", __FUNCTION__, msglen, msg);
+            p = bufprint(tmp, end, "ko:bulk");
+            qemud_serial_send(serial, 0, 0, (uint8_t*)tmp, p-tmp);
+            return;
+        }
+        if (max > MAX_FRAME_PAYLOAD)
+            max = MAX_FRAME_PAYLOAD;
+
+        p = bufprint(tmp, end, "ok:bulk:%04x", max);
+        qemud_serial_send(serial, 0, 0, (uint8_t*)tmp, p-tmp);
+
+        /* the next incoming header is decoded once we return */
+        serial->bulk        = 1;
+        serial->max_payload = max;
+        D("%s: bulk mode enabled, max payload %d", __FUNCTION__, max);
+        return;
+    }
+
 #if SUPPORT_LEGACY_QEMUD
     /* an ok:connect:<service>:<id> message can be received if we're
      * talking to a legacy qemud daemon, i.e. one running in a 1.0 or
@@ -1544,6 +1760,8 @@ qemud_multiplexer_init( QemudMultiplexer*  mult,
 {
     QemudClient*  control;
 
+    mult->services_map = aintMap_new();
+
     /* initialize serial handler */
     qemud_serial_init( mult->serial,
                        serial_cs,
@@ -1601,23 +1819,26 @@ qemud_client_new( QemudService*     service,
     return c;
 }
 
-/* Caches a service message into the client's descriptor.
+/* Caches a service message, preceded by 'hdrlen' bytes of 'hdr', into the
+ * client's descriptor.
  *
  * See comments on QemudPipeMessage structure for more info.
  */
 static void
-_qemud_pipe_cache_buffer(QemudClient* client, const uint8_t*  msg, int  msglen)
+_qemud_pipe_cache_buffer(QemudClient* client, const uint8_t* hdr, int hdrlen,
+                         const uint8_t*  msg, int  msglen)
 {
     QemudPipeMessage* buf;
     QemudPipeMessage** ins_at = &client->ProtocolSelector.Pipe.messages;
 
     /* Allocate descriptor big enough to contain message as well. */
-    buf = (QemudPipeMessage*)malloc(msglen + sizeof(QemudPipeMessage));
+    buf = (QemudPipeMessage*)malloc(hdrlen + msglen + sizeof(QemudPipeMessage));
     if (buf != NULL) {
         /* Message starts right after the descriptor. */
         buf->message = (uint8_t*)buf + sizeof(QemudPipeMessage);
-        buf->size = msglen;
-        memcpy(buf->message, msg, msglen);
+        buf->size = hdrlen + msglen;
+        memcpy(buf->message, hdr, hdrlen);
+        memcpy(buf->message + hdrlen, msg, msglen);
         buf->offset = 0;
         buf->next = NULL;
         while (*ins_at != NULL) {
@@ -1631,13 +1852,15 @@ _qemud_pipe_cache_buffer(QemudClient* client, const uint8_t*  msg, int  msglen)
 }
 
 /* Sends service message to the client.
+ *
+ * Pipes have no MTU, so the message is queued as a whole, with its
+ * frame header if needed, instead of being split in serial-sized packets.
  */
 static void
 _qemud_pipe_send(QemudClient*  client, const uint8_t*  msg, int  msglen)
 {
     uint8_t   frame[FRAME_HEADER_SIZE];
-    int       avail, len = msglen;
-    int framing = client->framing;
+    int       framelen = 0;
 
     if (msglen <= 0)
         return;
@@ -1645,33 +1868,14 @@ _qemud_pipe_send(QemudClient*  client, const uint8_t*  msg, int  msglen)
     D("%s: len=%3d '%s'",
       __FUNCTION__, msglen, quote_bytes((const void*)msg, msglen));
 
-    if (framing) {
-        len += FRAME_HEADER_SIZE;
+    /* insert frame header when needed */
+    if (client->framing) {
+        qemud_client_put_frame_header(client, frame, msglen);
+        framelen = FRAME_HEADER_SIZE;
     }
 
-    /* packetize the payload for the serial MTU */
-    while (len > 0)
-    {
-        avail = len;
-        if (avail > MAX_SERIAL_PAYLOAD)
-            avail = MAX_SERIAL_PAYLOAD;
-
-        /* insert frame header when needed */
-        if (framing) {
-            int2hex(frame, FRAME_HEADER_SIZE, msglen);
-            T("%s: '%.*s'", __FUNCTION__, FRAME_HEADER_SIZE, frame);
-            _qemud_pipe_cache_buffer(client, frame, FRAME_HEADER_SIZE);
-            avail  -= FRAME_HEADER_SIZE;
-            len    -= FRAME_HEADER_SIZE;
-            framing = 0;
-        }
-
-        /* write message content */
-        T("%s: '%.*s'", __FUNCTION__, avail, msg);
-        _qemud_pipe_cache_buffer(client, msg, avail);
-        msg += avail;
-        len -= avail;
-    }
+    T("%s: '%.*s'", __FUNCTION__, msglen, msg);
+    _qemud_pipe_cache_buffer(client, frame, framelen, msg, msglen);
 }
 
 /* this can be used by a service implementation to send an answer
@@ -1680,6 +1884,9 @@ _qemud_pipe_send(QemudClient*  client, const uint8_t*  msg, int  msglen)
 void
 qemud_client_send ( QemudClient*  client, const uint8_t*  msg, int  msglen )
 {
+    if (msglen > 0)
+        qemud_service_count_send(client->service, msglen);
+
     if (_is_pipe_client(client)) {
         _qemud_pipe_send(client, msg, msglen);
     } else {
@@ -1783,12 +1990,12 @@ qemud_save(QEMUFile* f, void* opaque)
  * snapshot was made.
  */
 static int
-qemud_load_services( QEMUFile*  f, QemudService*  current_services )
+qemud_load_services( QEMUFile*  f, QemudMultiplexer*  m )
 {
     int i, ret;
     int service_count = qemu_get_be32(f);
     for (i = 0; i < service_count; i++) {
-        if ((ret = qemud_service_load(f, current_services)))
+        if ((ret = qemud_service_load(f, m)))
             return ret;
     }
 
@@ -1816,7 +2023,7 @@ qemud_load_clients(QEMUFile* f, QemudMultiplexer* m, int version )
     int client_count = qemu_get_be32(f);
     int i, ret;
     for (i = 0; i < client_count; i++) {
-        if ((ret = qemud_serial_client_load(f, m->services, version))) {
+        if ((ret = qemud_serial_client_load(f, m, version))) {
             return ret;
         }
     }
@@ -1833,9 +2040,9 @@ qemud_load(QEMUFile *f, void* opaque, int version)
 
     int ret;
 
-    if ((ret = qemud_serial_load(f, m->serial)))
+    if ((ret = qemud_serial_load(f, m->serial, version)))
         return ret;
-    if ((ret = qemud_load_services(f, m->services)))
+    if ((ret = qemud_load_services(f, m)))
         return ret;
     if ((ret = qemud_load_clients(f, m, version)))
         return ret;
@@ -1892,13 +2099,13 @@ _load_pipe_message(QEMUFile* f)
 /* This is a callback that gets invoked when guest is connecting to the service.
  *
  * Here we will create a new client as well as pipe descriptor representing new
- * connection.
+ * connection. 'bulk' is set for connections through the "qemud-bulk" pipe.
  */
 static void*
-_qemudPipe_init(void* hwpipe, void* _looper, const char* args)
+_qemudPipe_open(void* hwpipe, void* _looper, const char* args, ABool bulk)
 {
     QemudMultiplexer *m = _multiplexer;
-    QemudService* sv = m->services;
+    QemudService* sv;
     QemudClient* client;
     QemudPipe* pipe = NULL;
     char service_name[512];
@@ -1930,9 +2137,7 @@ _qemudPipe_init(void* hwpipe, void* _looper, const char* args)
     service_name[srv_name_len] = '\0';
 
     /* Lookup registered service by its name. */
-    while (sv != NULL && strcmp(sv->name, service_name)) {
-        sv = sv->next;
-    }
+    sv = qemud_service_find(m, service_name);
     if (sv == NULL) {
         D("%s: Service '%s' has not been registered!", __FUNCTION__, service_name);
         return NULL;
@@ -1942,6 +2147,7 @@ _qemudPipe_init(void* hwpipe, void* _looper, const char* args)
      * is a pipe client. */
     client = qemud_service_connect_client(sv, -1, client_args);
     if (client != NULL) {
+        client->bulk = bulk;
         ANEW0(pipe);
         pipe->hwpipe = hwpipe;
         pipe->looper = _looper;
@@ -1953,6 +2159,18 @@ _qemudPipe_init(void* hwpipe, void* _looper, const char* args)
     return pipe;
 }
 
+static void*
+_qemudPipe_init(void* hwpipe, void* _looper, const char* args)
+{
+    return _qemudPipe_open(hwpipe, _looper, args, 0);
+}
+
+static void*
+_qemudBulkPipe_init(void* hwpipe, void* _looper, const char* args)
+{
+    return _qemudPipe_open(hwpipe, _looper, args, 1);
+}
+
 /* Called when the guest wants to close the channel.
 */
 static void
@@ -2126,7 +2344,8 @@ _qemudPipe_save(void* opaque, QEMUFile* f )
 }
 
 static void*
-_qemudPipe_load(void* hwpipe, void* pipeOpaque, const char* args, QEMUFile* f)
+_qemudPipe_restore(void* hwpipe, void* pipeOpaque, const char* args, QEMUFile* f,
+                   ABool bulk)
 {
     QemudPipe* qemud_pipe = NULL;
     char* param;
@@ -2134,7 +2353,7 @@ _qemudPipe_load(void* hwpipe, void* pipeOpaque, const char* args, QEMUFile* f)
     if (service_name == NULL)
         return NULL;
     /* get service instance for the loading client*/
-    QemudService *sv = qemud_service_find(_multiplexer->services, service_name);
+    QemudService *sv = qemud_service_find(_multiplexer, service_name);
     if (sv == NULL) {
         D("%s: load failed: unknown service \"%s\"\n",
           __FUNCTION__, service_name);
@@ -2148,6 +2367,7 @@ _qemudPipe_load(void* hwpipe, void* pipeOpaque, const char* args, QEMUFile* f)
     QemudClient* c = qemud_service_connect_client(sv, -1, param);
     if(c == NULL)
         return NULL;
+    c->bulk = bulk;
 
     /* Load pending messages. */
     c->ProtocolSelector.Pipe.messages = _load_pipe_message(f);
@@ -2205,6 +2425,18 @@ _qemudPipe_load(void* hwpipe, void* pipeOpaque, const char* args, QEMUFile* f)
     return qemud_pipe;
 }
 
+static void*
+_qemudPipe_load(void* hwpipe, void* pipeOpaque, const char* args, QEMUFile* f)
+{
+    return _qemudPipe_restore(hwpipe, pipeOpaque, args, f, 0);
+}
+
+static void*
+_qemudBulkPipe_load(void* hwpipe, void* pipeOpaque, const char* args, QEMUFile* f)
+{
+    return _qemudPipe_restore(hwpipe, pipeOpaque, args, f, 1);
+}
+
 /* QEMUD pipe functions.
  */
 static const GoldfishPipeFuncs _qemudPipe_funcs = {
@@ -2218,6 +2450,21 @@ static const GoldfishPipeFuncs _qemudPipe_funcs = {
     _qemudPipe_load,
 };
 
+/* Same as above, for clients that connected through "qemud-bulk" and use
+ * binary frame headers. Guests that don't know about it simply fail to open
+ * that pipe and fall back to "qemud".
+ */
+static const GoldfishPipeFuncs _qemudBulkPipe_funcs = {
+    _qemudBulkPipe_init,
+    _qemudPipe_closeFromGuest,
+    _qemudPipe_sendBuffers,
+    _qemudPipe_recvBuffers,
+    _qemudPipe_poll,
+    _qemudPipe_wakeOn,
+    _qemudPipe_save,
+    _qemudBulkPipe_load,
+};
+
 /* Initializes QEMUD pipe interface.
  */
 static void
@@ -2226,7 +2473,10 @@ _android_qemud_pipe_init(void)
     static ABool _qemud_pipe_initialized = false;
 
     if (!_qemud_pipe_initialized) {
-        goldfish_pipe_add_type( "qemud", looper_newCore(), &_qemudPipe_funcs );
+        void*  looper = looper_newCore();
+
+        goldfish_pipe_add_type( "qemud", looper, &_qemudPipe_funcs );
+        goldfish_pipe_add_type( "qemud-bulk", looper, &_qemudBulkPipe_funcs );
         _qemud_pipe_initialized = true;
     }
 }
@@ -2305,6 +2555,7 @@ qemud_service_register( const char*          service_name,
 {
     QemudService*      sv;
     QemudMultiplexer*  m  = _multiplexer;
+    int                hash;
 
     android_qemud_init();
 
@@ -2315,10 +2566,39 @@ qemud_service_register( const char*          service_name,
                            serv_save,
                            serv_load,
                            &m->services);
+
+    /* newer services shadow older ones with the same name */
+    hash = qemud_service_hash(service_name);
+    sv->next_hash = aintMap_set(m->services_map, hash, sv);
+
     D("Registered QEMUD service %s", service_name);
     return sv;
 }
 
+/* fill 'stats' with the counters of up to 'max' services, and return
+ * the total number of registered services.
+ */
+int
+qemud_get_service_stats( QemudServiceStats*  stats, int  max )
+{
+    QemudService*  sv;
+    int            count = 0;
+
+    for (sv = _multiplexer->services; sv != NULL; sv = sv->next, count++) {
+        if (count < max) {
+            QemudServiceStats*  st = &stats[count];
+
+            st->name        = sv->name;
+            st->num_clients = sv->num_clients;
+            st->recv_msgs   = sv->recv_msgs;
+            st->recv_bytes  = sv->recv_bytes;
+            st->send_msgs   = sv->send_msgs;
+            st->send_bytes  = sv->send_bytes;
+        }
+    }
+    return count;
+}
+
 /* broadcast a given message to all clients of a given QemudService
  */
 extern void
@@ -146,4 +146,21 @@ extern void           qemud_service_broadcast( QemudService*   sv,
                                                const uint8_t*  msg,
                                                int             msglen );
 
+/* Traffic counters of a given service, as seen by the emulator.
+ */
+typedef struct {
+    const char*  name;
+    int          num_clients;
+    uint64_t     recv_msgs;   /* messages received from clients */
+    uint64_t     recv_bytes;
+    uint64_t     send_msgs;   /* messages sent to clients */
+    uint64_t     send_bytes;
+} QemudServiceStats;
+
+/* Fills 'stats' with the counters of up to 'max' registered services, and
+ * returns the total number of services.
+ */
+extern int            qemud_get_service_stats( QemudServiceStats*  stats,
+                                               int                 max );
+
 #endif /* _android_qemud_h */
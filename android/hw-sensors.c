@@ -14,6 +14,7 @@
 #include "android/hw-sensors.h"
 #include "android/utils/debug.h"
 #include "android/utils/misc.h"
+#include "android/utils/path.h"
 #include "android/utils/system.h"
 #include "android/hw-qemud.h"
 #include "android/globals.h"
@@ -162,10 +163,59 @@ typedef struct {
  *   was "taken" by this code. This is adjusted by the HAL module to
  *   emulated system time (using the first sync: to compute an adjustment
  *   offset).
+ *
+ * - the HAL module can send "set-binary:<count>" to switch the client to
+ *   binary reports, batching up to <count> samples per message. This code
+ *   replies with "binary:<count>" giving the batch size actually used
+ *   (older emulators do not reply at all). "set-binary:0" goes back to
+ *   the text reports above.
+ *
+ *   In binary mode, each message is a little-endian header followed by
+ *   <count> fixed-size records:
+ *
+ *      header:  'S' 'N' 'S' 'B'  u16 version (1)  u16 count
+ *      record:  i64 time_ns  u32 sensor_id  f32 values[3]
+ *
+ *   where <time_ns> is the VM time in nano-seconds of the sample. The
+ *   timer samples each enabled sensor every <delay> ms (1 ms minimum
+ *   instead of 20 ms), but values pushed through android_sensors_set()
+ *   or a replayed trace are reported as individual samples with their
+ *   own timestamp, and a sensor is not sampled again by the timer until
+ *   <delay> ms after its last pushed sample. A message is sent when the batch
+ *   is full, or when its oldest sample has waited for <count> periods.
  */
 #define  HEADER_SIZE  4
 #define  BUFFER_SIZE  512
 
+#define  SENSORS_BINARY_MAGIC        "SNSB"
+#define  SENSORS_BINARY_VERSION      1
+#define  SENSORS_BINARY_HEADER_SIZE  8
+#define  SENSORS_BINARY_RECORD_SIZE  24
+#define  SENSORS_BATCH_MAX           64
+
+/* the binary mode and batch size of a client are saved in the upper
+ * bits of its enabled mask, so snapshots taken by older emulators load
+ * as text mode clients.
+ */
+#define  SENSORS_SAVE_MASK           0x0000ffff
+#define  SENSORS_SAVE_BATCH_SHIFT    16
+#define  SENSORS_SAVE_BINARY         0x80000000
+
+/* a sensor trace being replayed, see android_sensors_replay_start() */
+typedef struct {
+    int64_t  time_ns;   /* relative to the start of the trace */
+    int      sensor;
+    float    values[3];
+} SensorSample;
+
+typedef struct {
+    SensorSample*  samples;
+    int            count;
+    int            next;
+    int64_t        start_ns;   /* VM time of the trace's time 0 */
+    QEMUTimer*     timer;
+} SensorReplay;
+
 typedef struct HwSensorClient   HwSensorClient;
 
 typedef struct {
@@ -173,6 +223,7 @@ typedef struct {
     Sensor              sensors[MAX_SENSORS];
     HwSensorClient*     clients;
     AndroidSensorsPort* sensors_port;
+    SensorReplay        replay[1];
 } HwSensors;
 
 struct HwSensorClient {
@@ -182,6 +233,15 @@ struct HwSensorClient {
     QEMUTimer*       timer;
     uint32_t         enabledMask;
     int32_t          delay_ms;
+    /* binary mode state */
+    char             binary;
+    int              batchMax;
+    int              batchCount;
+    int64_t          batchStartNs;  /* VM time the oldest record was queued */
+    int64_t          nextTickNs;
+    int64_t          lastPushNs[MAX_SENSORS];
+    uint8_t          batch[SENSORS_BINARY_HEADER_SIZE +
+                           SENSORS_BATCH_MAX*SENSORS_BINARY_RECORD_SIZE];
 };
 
 static void
@@ -232,6 +292,7 @@ _hwSensorClient_new( HwSensors*  sensors )
     cl->sensors     = sensors;
     cl->enabledMask = 0;
     cl->delay_ms    = 800;
+    cl->batchMax    = 1;
     cl->timer       = qemu_new_timer_ns(vm_clock, _hwSensorClient_tick, cl);
 
     cl->next         = sensors->clients;
@@ -281,6 +342,122 @@ _hwSensorClient_enabled( HwSensorClient*  cl, int  sensorId )
     return (cl->enabledMask & (1 << sensorId)) != 0;
 }
 
+static void
+_sensorsPutLe16( uint8_t*  p, unsigned  val )
+{
+    p[0] = (uint8_t) val;
+    p[1] = (uint8_t)(val >> 8);
+}
+
+static void
+_sensorsPutLe32( uint8_t*  p, uint32_t  val )
+{
+    p[0] = (uint8_t) val;
+    p[1] = (uint8_t)(val >> 8);
+    p[2] = (uint8_t)(val >> 16);
+    p[3] = (uint8_t)(val >> 24);
+}
+
+static void
+_sensorsPutFloat( uint8_t*  p, float  val )
+{
+    union { float f; uint32_t u; }  u;
+
+    u.f = val;
+    _sensorsPutLe32(p, u.u);
+}
+
+/* send the pending binary records, if any, as a single message */
+static void
+_hwSensorClient_flush( HwSensorClient*  cl )
+{
+    int  count = cl->batchCount;
+
+    if (count == 0)
+        return;
+
+    memcpy(cl->batch, SENSORS_BINARY_MAGIC, 4);
+    _sensorsPutLe16(cl->batch + 4, SENSORS_BINARY_VERSION);
+    _sensorsPutLe16(cl->batch + 6, count);
+
+    T("%s: %d records", __FUNCTION__, count);
+    qemud_client_send(cl->client, cl->batch,
+                      SENSORS_BINARY_HEADER_SIZE + count*SENSORS_BINARY_RECORD_SIZE);
+    cl->batchCount = 0;
+}
+
+/* queue one binary record with the current value of a sensor */
+static void
+_hwSensorClient_addSample( HwSensorClient*  cl, int  sensorId, int64_t  time_ns )
+{
+    Sensor*   sensor = &cl->sensors->sensors[sensorId];
+    uint8_t*  p;
+
+    if (cl->batchCount == 0)
+        cl->batchStartNs = qemu_get_clock_ns(vm_clock);
+
+    p = cl->batch + SENSORS_BINARY_HEADER_SIZE +
+        cl->batchCount*SENSORS_BINARY_RECORD_SIZE;
+
+    _sensorsPutLe32(p,      (uint32_t) time_ns);
+    _sensorsPutLe32(p + 4,  (uint32_t)(time_ns >> 32));
+    _sensorsPutLe32(p + 8,  sensorId);
+    _sensorsPutFloat(p + 12, sensor->u.value.a);
+    _sensorsPutFloat(p + 16, sensor->u.value.b);
+    _sensorsPutFloat(p + 20, sensor->u.value.c);
+
+    if (++cl->batchCount >= cl->batchMax)
+        _hwSensorClient_flush(cl);
+}
+
+/* forward */
+static void  _hwSensors_replayDue( HwSensors*  h );
+
+/* binary mode version of _hwSensorClient_tick() */
+static void
+_hwSensorClient_tickBinary( HwSensorClient*  cl )
+{
+    int64_t  delay = cl->delay_ms;
+    int64_t  now_ns = qemu_get_clock_ns(vm_clock);
+    int64_t  next_ns;
+    int      nn;
+
+    if (delay < 1)
+        delay = 1;
+    delay *= 1000000LL;  /* convert to nanoseconds */
+
+    /* apply the trace samples that are due first, so that records stay
+     * in time order, then skip the sensors that got a sample pushed
+     * during the last period.
+     */
+    _hwSensors_replayDue(cl->sensors);
+
+    for (nn = 0; nn < MAX_SENSORS; nn++) {
+        if (_hwSensorClient_enabled(cl, nn) &&
+            now_ns - cl->lastPushNs[nn] >= delay)
+            _hwSensorClient_addSample(cl, nn, now_ns);
+    }
+
+    if (cl->batchCount > 0 &&
+        now_ns - cl->batchStartNs >= delay*cl->batchMax)
+        _hwSensorClient_flush(cl);
+
+    if (cl->enabledMask == 0) {
+        _hwSensorClient_flush(cl);
+        return;
+    }
+
+    /* keep to the period when the timer fires late, rather than adding
+     * the latency to every interval
+     */
+    next_ns = cl->nextTickNs + delay;
+    if (next_ns <= now_ns || next_ns > now_ns + delay)
+        next_ns = now_ns + delay;
+
+    cl->nextTickNs = next_ns;
+    qemu_mod_timer(cl->timer, next_ns);
+}
+
 /* this function is called periodically to send sensor reports
  * to the HAL module, and re-arm the timer if necessary
  */
@@ -295,6 +472,11 @@ _hwSensorClient_tick( void*  opaque )
     Sensor*          sensor;
     char             buffer[128];
 
+    if (cl->binary) {
+        _hwSensorClient_tickBinary(cl);
+        return;
+    }
+
     if (_hwSensorClient_enabled(cl, ANDROID_SENSOR_ACCELERATION)) {
         sensor = &hw->sensors[ANDROID_SENSOR_ACCELERATION];
         snprintf(buffer, sizeof buffer, "acceleration:%g:%g:%g",
@@ -401,6 +583,35 @@ _hwSensorClient_receive( HwSensorClient*  cl, uint8_t*  msg, int  msglen )
         return;
     }
 
+    /* "set-binary:<count>" is used to switch to batched binary
+     * reports of up to <count> samples, or back to text with 0.
+     */
+    if (msglen > 11 && !memcmp(msg, "set-binary:", 11)) {
+        char  buff[16];
+        int   count = atoi((const char*)msg+11);
+
+        _hwSensorClient_flush(cl);
+        if (count <= 0) {
+            cl->binary = 0;
+            count      = 0;
+        } else {
+            if (count > SENSORS_BATCH_MAX)
+                count = SENSORS_BATCH_MAX;
+            cl->binary   = 1;
+            cl->batchMax = count;
+            memset(cl->lastPushNs, 0, sizeof cl->lastPushNs);
+        }
+        D("%s: %s reports, %d samples per message", __FUNCTION__,
+          cl->binary ? "binary" : "text", count);
+
+        snprintf(buff, sizeof buff, "binary:%d", count);
+        _hwSensorClient_send(cl, (const uint8_t*)buff, strlen(buff));
+
+        if (cl->enabledMask != 0)
+            _hwSensorClient_tick(cl);
+        return;
+    }
+
     /* "set:<name>:<state>" is used to enable/disable a given
      * sensor. <state> must be 0 or 1
      */
@@ -458,9 +669,13 @@ static void
 _hwSensorClient_save( QEMUFile*  f, QemudClient*  client, void*  opaque  )
 {
     HwSensorClient* sc = opaque;
+    uint32_t        mask = sc->enabledMask;
+
+    if (sc->binary)
+        mask |= SENSORS_SAVE_BINARY | (sc->batchMax << SENSORS_SAVE_BATCH_SHIFT);
 
     qemu_put_be32(f, sc->delay_ms);
-    qemu_put_be32(f, sc->enabledMask);
+    qemu_put_be32(f, mask);
     qemu_put_timer(f, sc->timer);
 }
 
@@ -469,11 +684,24 @@ static int
 _hwSensorClient_load( QEMUFile*  f, QemudClient*  client, void*  opaque  )
 {
     HwSensorClient* sc = opaque;
+    uint32_t        mask;
 
     sc->delay_ms = qemu_get_be32(f);
-    sc->enabledMask = qemu_get_be32(f);
+    mask = qemu_get_be32(f);
     qemu_get_timer(f, sc->timer);
 
+    /* records that were not sent when the snapshot was taken are lost */
+    sc->enabledMask = mask & SENSORS_SAVE_MASK;
+    sc->binary      = (mask & SENSORS_SAVE_BINARY) != 0;
+    sc->batchMax    = (mask & ~SENSORS_SAVE_BINARY) >> SENSORS_SAVE_BATCH_SHIFT;
+    sc->batchCount  = 0;
+    memset(sc->lastPushNs, 0, sizeof sc->lastPushNs);
+
+    if (sc->batchMax < 1)
+        sc->batchMax = 1;
+    if (sc->batchMax > SENSORS_BATCH_MAX)
+        sc->batchMax = SENSORS_BATCH_MAX;
+
     return 0;
 }
 
@@ -507,6 +735,162 @@ _hwSensors_setSensorValue( HwSensors*  h, int sensor_id, float a, float b, float
     s->u.value.c = c;
 }
 
+/* report the current value of a sensor, taken at 'time_ns', to all
+ * binary mode clients that enabled it
+ */
+static void
+_hwSensors_pushSample( HwSensors*  h, int sensor_id, int64_t  time_ns )
+{
+    HwSensorClient*  cl;
+
+    for (cl = h->clients; cl != NULL; cl = cl->next) {
+        if (cl->binary && _hwSensorClient_enabled(cl, sensor_id)) {
+            _hwSensorClient_addSample(cl, sensor_id, time_ns);
+            cl->lastPushNs[sensor_id] = time_ns;
+        }
+    }
+}
+
+/* stop replaying a sensor trace, if any */
+static void
+_hwSensors_stopReplay( HwSensors*  h )
+{
+    SensorReplay*  r = h->replay;
+
+    if (r->timer)
+        qemu_del_timer(r->timer);
+
+    AFREE(r->samples);
+    r->samples = NULL;
+    r->count   = 0;
+    r->next    = 0;
+}
+
+/* apply all trace samples that are due, then re-arm the timer for the
+ * next one. each sample is reported with its own time in the trace, not
+ * the time at which the timer fired.
+ */
+static void
+_hwSensors_replayDue( HwSensors*  h )
+{
+    SensorReplay*  r = h->replay;
+    int64_t        now_ns;
+
+    if (r->count == 0)
+        return;
+
+    now_ns = qemu_get_clock_ns(vm_clock);
+
+    while (r->next < r->count) {
+        SensorSample*  sample  = &r->samples[r->next];
+        int64_t        time_ns = r->start_ns + sample->time_ns;
+
+        if (time_ns > now_ns) {
+            qemu_mod_timer(r->timer, time_ns);
+            return;
+        }
+        r->next++;
+
+        if (!h->sensors[sample->sensor].enabled)
+            continue;
+
+        _hwSensors_setSensorValue(h, sample->sensor, sample->values[0],
+                                  sample->values[1], sample->values[2]);
+        _hwSensors_pushSample(h, sample->sensor, time_ns);
+    }
+
+    D("%s: replayed %d samples", __FUNCTION__, r->count);
+    _hwSensors_stopReplay(h);
+}
+
+static void
+_hwSensors_replayTick( void*  opaque )
+{
+    _hwSensors_replayDue(opaque);
+}
+
+/* parse a sensor trace, see android_sensors_replay_start() for the format.
+ * returns the number of samples, or -1 on error.
+ */
+static int
+_hwSensors_parseTrace( const char*  path, char*  text, SensorSample*  *psamples )
+{
+    SensorSample*  samples = NULL;
+    int            count = 0, capacity = 0;
+    int            lineno = 0;
+    double         first = 0., last = 0.;
+    char*          line = text;
+
+    while (line != NULL && *line) {
+        char*          end = strchr(line, '\n');
+        char*          p;
+        char*          name;
+        double         time;
+        int            id, nn;
+        SensorSample*  sample;
+
+        if (end != NULL)
+            *end++ = 0;
+        lineno++;
+
+        p = line;
+        line = end;
+
+        while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+        if (*p == 0 || *p == '#')
+            continue;
+
+        time = strtod(p, &p);
+        while (*p == ' ' || *p == '\t') p++;
+        name = p;
+        while (*p && *p != ' ' && *p != '\t') p++;
+        if (*p)
+            *p++ = 0;
+
+        id = _sensorIdFromName(name);
+        if (id < 0) {
+            E("%s:%d: unknown sensor name '%s'", path, lineno, name);
+            goto FAIL;
+        }
+        if (count == 0)
+            first = last = time;
+        if (time < last) {
+            E("%s:%d: sample time goes backwards", path, lineno);
+            goto FAIL;
+        }
+        last = time;
+
+        if (count == capacity) {
+            capacity += capacity/2 + 64;
+            AARRAY_RENEW(samples, capacity);
+        }
+        sample = &samples[count++];
+        sample->time_ns = (int64_t)((time - first) * 1e9 + 0.5);
+        sample->sensor  = id;
+
+        for (nn = 0; nn < 3; nn++) {
+            sample->values[nn] = 0.;
+            while (*p == ' ' || *p == '\t') p++;
+            if (*p == 0 || *p == '\r')
+                continue;
+            sample->values[nn] = strtof(p, &p);
+            if (*p == ':')
+                p++;
+        }
+    }
+
+    if (count == 0) {
+        E("%s: no sensor samples", path);
+        goto FAIL;
+    }
+    *psamples = samples;
+    return count;
+
+FAIL:
+    AFREE(samples);
+    return -1;
+}
+
 /* Saves available sensors to allow checking availability when loaded.
  */
 static void
@@ -610,6 +994,11 @@ _hwSensors_load( QEMUFile*  f, QemudService*  s, void*  opaque)
         h->sensors[i].enabled = 0;
     }
 
+    /* a trace is replayed against the VM clock of the session that
+     * started it, which does not carry over to the restored state.
+     */
+    _hwSensors_stopReplay(h);
+
     return 0;
 }
 
@@ -796,6 +1185,7 @@ android_sensors_set( int sensor_id, float a, float b, float c )
         return SENSOR_STATUS_NO_SERVICE;
 
     _hwSensors_setSensorValue(hw, sensor_id, a, b, c);
+    _hwSensors_pushSample(hw, sensor_id, qemu_get_clock_ns(vm_clock));
 
     return SENSOR_STATUS_OK;
 }
@@ -811,3 +1201,56 @@ android_sensors_get_sensor_status( int sensor_id )
 
     return hw->sensors[sensor_id].enabled;
 }
+
+/* Start replaying a sensor trace file */
+extern int
+android_sensors_replay_start( const char*  path )
+{
+    HwSensors*     hw = _sensorsState;
+    SensorReplay*  r  = hw->replay;
+    SensorSample*  samples;
+    char*          text;
+    int            count;
+
+    if (hw->service == NULL)
+        return SENSOR_STATUS_NO_SERVICE;
+
+    text = path_load_file(path, NULL);
+    if (text == NULL) {
+        E("could not read sensor trace %s: %s", path, strerror(errno));
+        return SENSOR_STATUS_UNKNOWN;
+    }
+    count = _hwSensors_parseTrace(path, text, &samples);
+    free(text);
+    if (count < 0)
+        return SENSOR_STATUS_UNKNOWN;
+
+    _hwSensors_stopReplay(hw);
+    if (r->timer == NULL)
+        r->timer = qemu_new_timer_ns(vm_clock, _hwSensors_replayTick, hw);
+
+    r->samples  = samples;
+    r->count    = count;
+    r->next     = 0;
+    r->start_ns = qemu_get_clock_ns(vm_clock);
+    D("%s: replaying %d samples from %s", __FUNCTION__, count, path);
+
+    _hwSensors_replayDue(hw);
+    return SENSOR_STATUS_OK;
+}
+
+/* Stop replaying the current sensor trace, if any */
+extern void
+android_sensors_replay_stop( void )
+{
+    _hwSensors_stopReplay(_sensorsState);
+}
+
+/* Get the number of trace samples left to replay */
+extern int
+android_sensors_replay_pending( void )
+{
+    SensorReplay*  r = _sensorsState->replay;
+
+    return r->count - r->next;
+}
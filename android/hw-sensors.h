@@ -78,4 +78,22 @@ extern const char* android_sensors_get_name_from_id( int sensor_id );
 /* Get sensor from sensor id */
 extern uint8_t android_sensors_get_sensor_status( int sensor_id );
 
+/* Start replaying a sensor trace file. Each line of the trace is
+ *
+ *    <time> <sensorname> <value-a>[:<value-b>[:<value-c>]]
+ *
+ * where <time> is in seconds and must not decrease; the first sample
+ * is applied immediately and the others at the same offsets of the VM
+ * clock. Empty lines and lines starting with '#' are ignored. Clients
+ * in binary mode receive each sample with its trace timestamp.
+ * Replaces any trace that is already being replayed.
+ */
+extern int android_sensors_replay_start( const char* path );
+
+/* Stop replaying the current sensor trace, if any */
+extern void android_sensors_replay_stop( void );
+
+/* Get the number of trace samples left to replay */
+extern int android_sensors_replay_pending( void );
+
 #endif /* _android_gps_h */
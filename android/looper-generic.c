@@ -11,6 +11,7 @@
 */
 
 #include "android/utils/assert.h"
+#include "android/utils/intmap.h"
 #include "android/utils/reflist.h"
 #include "android/utils/refset.h"
 #include "android/utils/system.h"
@@ -150,6 +151,7 @@ struct GLoopIo {
     unsigned    wanted;
     unsigned    ready;
     GLooper*    looper;
+    GLoopIo*    fdNext;    /* next waiter on the same fd */
 };
 
 static void glooper_delPendingIo(GLooper* looper, GLoopIo* io);
@@ -217,6 +219,11 @@ gloopio_free(void* impl)
     if (io->ready != 0)
         glooper_delPendingIo(io->looper, io);
 
+    /* Stop watching the fd, it is usually closed right after this */
+    if (io->wanted != 0) {
+        glooper_modifyFd(io->looper, io->fd, io->wanted, 0);
+        io->wanted = 0;
+    }
     glooper_delIo(io->looper, io);
     AFREE(io);
 }
@@ -266,6 +273,7 @@ struct GLooper {
     GLoopTimer*  activeTimers; /* sorted list of active timers */
 
     ARefSet      ios[1];        /* set of all i/o waiters */
+    AIntMap*     iosByFd;       /* fd -> list of i/o waiters */
     ARefSet      pendingIos[1]; /* list of pending i/o waiters */
     int          numActiveIos;  /* number of active LoopIo objects */
 
@@ -320,12 +328,28 @@ static void
 glooper_addIo(GLooper* looper, GLoopIo* io)
 {
     arefSet_add(looper->ios, io);
+    io->fdNext = aintMap_set(looper->iosByFd, io->fd, io);
 }
 
 static void
 glooper_delIo(GLooper* looper, GLoopIo* io)
 {
+    GLoopIo*  head = aintMap_get(looper->iosByFd, io->fd);
+
     arefSet_del(looper->ios, io);
+
+    if (head == io) {
+        if (io->fdNext != NULL)
+            aintMap_set(looper->iosByFd, io->fd, io->fdNext);
+        else
+            aintMap_del(looper->iosByFd, io->fd);
+    } else {
+        while (head != NULL && head->fdNext != io)
+            head = head->fdNext;
+        if (head != NULL)
+            head->fdNext = io->fdNext;
+    }
+    io->fdNext = NULL;
 }
 
 static void
@@ -390,28 +414,34 @@ glooper_run(Looper*  ll, Duration loop_deadline_ms)
         if (ret < 0) { /* error, force stop ! */
             break;
         }
+
+        /* Forget what the previous pass reported, waiters that are not
+         * ready anymore are not visited below */
+        {
+            GLoopIo* io;
+            AREFSET_FOREACH(looper->pendingIos,io,{
+                io->ready = 0;
+            });
+            arefSet_clear(looper->pendingIos);
+        }
+
         if (ret > 0) {
             unsigned ready;
             GLoopIo* io;
-
-            /* Add io waiters to the pending list */
-            AREFSET_FOREACH(looper->ios, io, {
-                if (io->wanted == 0)
-                    continue;
-
-                ready = 0;
-
-                if (iolooper_is_read(iol, io->fd))
-                    ready |= LOOP_IO_READ;
-
-                if (iolooper_is_write(iol, io->fd))
-                    ready |= LOOP_IO_WRITE;
-
-                io->ready = ready;
-                if (ready != 0) {
-                    arefSet_add(looper->pendingIos, io);
+            int      cursor = 0;
+            int      fd;
+
+            /* Add io waiters of the ready fds to the pending list, the
+             * cost only depends on the number of fds that are ready */
+            while ((ready = iolooper_next_ready(iol, &cursor, &fd)) != 0) {
+                io = aintMap_get(looper->iosByFd, fd);
+                for ( ; io != NULL; io = io->fdNext) {
+                    io->ready = ready & io->wanted;
+                    if (io->ready != 0) {
+                        arefSet_add(looper->pendingIos, io);
+                    }
                 }
-            });
+            }
         }
 
         /* Do we have any expired timers here ? */
@@ -452,7 +482,6 @@ glooper_run(Looper*  ll, Duration loop_deadline_ms)
             AREFSET_FOREACH(looper->pendingIos,io,{
                 io->callback(io->opaque,io->fd,io->ready);
             });
-            arefSet_clear(looper->pendingIos);
         }
 
         if (deadline > loop_deadline_ms)
@@ -471,6 +500,8 @@ glooper_free(Looper* ll)
 
     arefSet_done(looper->ios);
     arefSet_done(looper->pendingIos);
+    aintMap_free(looper->iosByFd);
+    looper->iosByFd = NULL;
 
     iolooper_free(looper->iolooper);
     looper->iolooper = NULL;
@@ -485,6 +516,7 @@ Looper*  looper_newGeneric(void)
     ANEW0(looper);
 
     looper->iolooper = iolooper_new();
+    looper->iosByFd  = aintMap_new();
 
     looper->looper.now        = glooper_now;
     looper->looper.timer_init = glooper_timer_init;
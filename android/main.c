@@ -873,6 +873,14 @@ int main(int argc, char **argv)
         if (opts->no_snapshot_update_time) {
             args[n++] = "-snapshot-no-time-update";
         }
+
+        if (opts->snapshot_lazy_load) {
+            args[n++] = "-snapshot-lazy-load";
+        }
+
+        if (opts->snapshot_direct_io) {
+            args[n++] = "-snapshot-direct-io";
+        }
     }
 
     if (!opts->logcat || opts->logcat[0] == 0) {
@@ -991,6 +999,13 @@ int main(int argc, char **argv)
         args[n++] = opts->trace;
         args[n++] = "-tracing";
         args[n++] = "off";
+        if (opts->trace_compress) {
+            args[n++] = "-trace-compress";
+        }
+        if (opts->trace_segment) {
+            args[n++] = "-trace-segment";
+            args[n++] = opts->trace_segment;
+        }
     }
 
     /* Pass boot properties to the core. */
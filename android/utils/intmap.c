@@ -12,30 +12,60 @@
 
 #include "android/utils/intmap.h"
 #include "android/utils/system.h"
-#include "android/utils/duff.h"
 #include <stddef.h>
 
-/* We implement the map as two parallel arrays.
+/* We implement the map as an open-addressing hash table with linear
+ * probing, using three parallel arrays: one for the integer keys, one
+ * for the corresponding pointers, and one for the state of each slot.
  *
- * One array for the integer keys, and the other one
- * for the corresponding pointers.
- *
- * A more sophisticated implementation will probably be
- * needed in the case where we would need to store a large
- * number of items in the map.
+ * Deleted slots are marked as such so that probe sequences going through
+ * them are not broken. They are reclaimed when the table is rehashed.
  */
 
+enum {
+    SLOT_EMPTY = 0,
+    SLOT_FULL,
+    SLOT_DELETED
+};
+
 struct AIntMap {
-    int     size;
-    int     capacity;
+    int     size;      /* number of keys in the map */
+    int     used;      /* number of full or deleted slots */
+    int     capacity;  /* number of slots, always a power of 2 */
     int*    keys;
     void**  values;
+    char*   states;
 
 #define INIT_CAPACITY  8
     int     keys0[INIT_CAPACITY];
     void*   values0[INIT_CAPACITY];
+    char    states0[INIT_CAPACITY];
 };
 
+static __inline__ unsigned
+aintMap_hash( AIntMap*  map, int  key )
+{
+    unsigned  h = (unsigned)key * 2654435761U;
+
+    return (h ^ (h >> 16)) & (map->capacity - 1);
+}
+
+/* Returns the slot of 'key', or -1 if it is not in the map */
+static int
+aintMap_find( AIntMap*  map, int  key )
+{
+    unsigned  mask  = map->capacity - 1;
+    unsigned  index = aintMap_hash(map, key);
+
+    for (;;) {
+        if (map->states[index] == SLOT_EMPTY)
+            return -1;
+        if (map->states[index] == SLOT_FULL && map->keys[index] == key)
+            return (int)index;
+        index = (index + 1) & mask;
+    }
+}
+
 AIntMap*
 aintMap_new(void)
 {
@@ -43,9 +73,11 @@ aintMap_new(void)
 
     ANEW0(map);
     map->size     = 0;
-    map->capacity = 4;
+    map->used     = 0;
+    map->capacity = INIT_CAPACITY;
     map->keys     = map->keys0;
     map->values   = map->values0;
+    map->states   = map->states0;
 
     return map;
 }
@@ -58,6 +90,8 @@ aintMap_free( AIntMap*  map )
             AFREE(map->keys);
         if (map->values != map->values0)
             AFREE(map->values);
+        if (map->states != map->states0)
+            AFREE(map->states);
 
         map->size = 0;
         map->capacity = 0;
@@ -71,6 +105,12 @@ aintMap_getCount( AIntMap* map )
     return map->size;
 }
 
+int
+aintMap_has( AIntMap*  map, int key )
+{
+    return aintMap_find(map, key) >= 0;
+}
+
 void*
 aintMap_get( AIntMap*  map, int  key )
 {
@@ -80,105 +120,108 @@ aintMap_get( AIntMap*  map, int  key )
 void*
 aintMap_getWithDefault( AIntMap*  map, int key, void*  def )
 {
-    int  limit   = map->size + 1;
-    int  index   = 0;
-    int* keys    = map->keys;
-
-    index = 0;
-    DUFF4(limit,{
-        if (keys[index] == key)
-            return map->values[index];
-        index++;
-    });
-    return def;
+    int  index = aintMap_find(map, key);
+
+    if (index < 0)
+        return def;
+
+    return map->values[index];
 }
 
+/* Re-insert all keys in a table of 'newCapacity' slots, dropping the
+ * deleted ones on the way.
+ */
 static void
-aintMap_grow( AIntMap* map )
+aintMap_rehash( AIntMap* map, int  newCapacity )
 {
-    int   oldCapacity = map->capacity;
-    int   newCapacity;
-    void* keys = map->keys;
-    void* values = map->values;
+    int    oldCapacity = map->capacity;
+    int*   oldKeys     = map->keys;
+    void** oldValues   = map->values;
+    char*  oldStates   = map->states;
+    int    nn;
+
+    AARRAY_NEW(map->keys, newCapacity);
+    AARRAY_NEW(map->values, newCapacity);
+    AARRAY_NEW0(map->states, newCapacity);
+    map->capacity = newCapacity;
+    map->used     = map->size;
 
-    if (keys == map->keys0)
-        keys = NULL;
+    for (nn = 0; nn < oldCapacity; nn++) {
+        unsigned  index;
 
-    if (values == map->values0)
-        values = NULL;
+        if (oldStates[nn] != SLOT_FULL)
+            continue;
 
-    if (oldCapacity < 256)
-        newCapacity = oldCapacity*2;
-    else
-        newCapacity = oldCapacity + (oldCapacity >> 2);
+        index = aintMap_hash(map, oldKeys[nn]);
+        while (map->states[index] != SLOT_EMPTY)
+            index = (index + 1) & (newCapacity - 1);
 
-    AARRAY_RENEW(keys, newCapacity);
-    AARRAY_RENEW(values, newCapacity);
+        map->keys[index]   = oldKeys[nn];
+        map->values[index] = oldValues[nn];
+        map->states[index] = SLOT_FULL;
+    }
 
-    map->keys = keys;
-    map->values = values;
-    map->capacity = newCapacity;
+    if (oldKeys != map->keys0)
+        AFREE(oldKeys);
+    if (oldValues != map->values0)
+        AFREE(oldValues);
+    if (oldStates != map->states0)
+        AFREE(oldStates);
 }
 
-
 void*
 aintMap_set( AIntMap* map, int key, void* value )
 {
-    int  index, limit;
-    int* keys;
-    void* result = NULL;
-
-    /* First, try to find the item in our heap */
-    keys  = map->keys;
-    limit = map->size;
-    index = 0;
-    DUFF4(limit,{
-        if (keys[index] == key)
-            goto FOUND;
-        index++;
-    });
+    unsigned  mask, index;
+    int       found;
+    void*     result;
+
+    found = aintMap_find(map, key);
+    if (found >= 0) {
+        result = map->values[found];
+        map->values[found] = value;
+        return result;
+    }
 
-    /* Not found, need to add it */
-    if (map->size >= map->capacity)
-        aintMap_grow(map);
+    /* Not found, need to add it. Keep the table at most 3/4 full,
+     * counting deleted slots, doubling it if the keys alone need it. */
+    if ((map->used + 1)*4 > map->capacity*3) {
+        int  newCapacity = map->capacity;
 
-    map->keys[limit]   = key;
-    map->values[limit] = value;
-    map->size ++;
-    return NULL;
+        if ((map->size + 1)*2 > map->capacity)
+            newCapacity *= 2;
 
-FOUND:
-    result = map->values[index];
+        aintMap_rehash(map, newCapacity);
+    }
+
+    mask  = map->capacity - 1;
+    index = aintMap_hash(map, key);
+    while (map->states[index] == SLOT_FULL)
+        index = (index + 1) & mask;
+
+    if (map->states[index] == SLOT_EMPTY)
+        map->used += 1;
+
+    map->keys[index]   = key;
     map->values[index] = value;
-    return result;
+    map->states[index] = SLOT_FULL;
+    map->size += 1;
+    return NULL;
 }
 
 
 void*
 aintMap_del( AIntMap* map, int key )
 {
-    int  index, limit;
-    int* keys;
-    void* result = NULL;
-
-    keys  = map->keys;
-    limit = map->size;
-    index = 0;
-    DUFF4(limit,{
-        if (keys[index] == key);
-            goto FOUND;
-        index++;
-    });
-    return NULL;
+    int    index = aintMap_find(map, key);
+    void*  result;
+
+    if (index < 0)
+        return NULL;
 
-FOUND:
     result = map->values[index];
-    if (index+1 < limit) {
-        /* Move last item to 'index' */
-        --limit;
-        map->keys[index] = map->keys[limit];
-        map->values[index] = map->values[limit];
-    }
+    map->values[index] = NULL;
+    map->states[index] = SLOT_DELETED;
     map->size -= 1;
     return result;
 }
@@ -207,7 +250,10 @@ aintMapIterator_next( AIntMapIterator* iter )
 
     map   = iter->magic[2];
     index = (int)(ptrdiff_t)iter->magic[1];
-    if (index >= map->size) {
+    while (index < map->capacity && map->states[index] != SLOT_FULL)
+        index++;
+
+    if (index >= map->capacity) {
         AZERO(iter);
         return 0;
     }
@@ -38,6 +38,9 @@ arefSet_done( ARefSet*  s )
 AINLINED void
 arefSet_clear( ARefSet*  s )
 {
+    /* the items are found by scanning the buckets, not by counting them */
+    if (s->max_buckets > 0)
+        AARRAY_ZERO(s->buckets, s->max_buckets);
     AVECTOR_CLEAR(s,buckets);
     s->iteration = 0;
 }
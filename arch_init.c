@@ -28,6 +28,11 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#ifdef __linux__
+#include <signal.h>
+#include <sched.h>
+#include "qemu-thread.h"
+#endif
 #include "config.h"
 #include "monitor.h"
 #include "sysemu.h"
@@ -336,6 +341,415 @@ int ram_save_live(QEMUFile *f, int stage, void *opaque)
     return (stage == 2) && (expected_time <= migrate_max_downtime());
 }
 
+/***********************************************************/
+/* lazy ram restore */
+
+/* With -snapshot-lazy-load, ram_load() only records where each page lives
+ * in the mapped snapshot, and guest RAM is left inaccessible.  The first
+ * access to a chunk, from a fault or through qemu_get_ram_ptr(), restores
+ * it; a background thread restores the rest.  A chunk is filled in a
+ * private mapping that then replaces the protected one with mremap(), so no
+ * thread ever sees it half restored.
+ */
+
+int ram_lazy_active;
+
+#ifdef __linux__
+#define LAZY_CHUNK_BITS 21
+#define LAZY_CHUNK_SIZE (1 << LAZY_CHUNK_BITS)
+
+/* how often the main loop checks whether the restore has completed */
+#define LAZY_REAP_MS 100
+
+enum {
+    LAZY_PENDING,
+    LAZY_BUSY,
+    LAZY_DONE,
+};
+
+typedef struct LazyPage {
+    const uint8_t *src;     /* saved contents, NULL to fill with 'fill' */
+    int fill;               /* -1 while the page wasn't seen in the stream */
+    int owned;              /* src is a copy allocated for this page */
+} LazyPage;
+
+typedef struct LazyBlock {
+    uint8_t *host;
+    ram_addr_t length;
+    int first_page;
+    int first_chunk;
+} LazyBlock;
+
+static struct {
+    LazyBlock *blocks;
+    int nb_blocks;
+    LazyPage *pages;
+    int nb_pages;
+    volatile int *chunks;
+    int nb_chunks;
+    int loading;
+    volatile int pending;
+    volatile int stop;
+    int thread_started;
+    int handler_installed;
+    QemuThread thread;
+    QEMUFileMapping *mapping;
+    QEMUTimer *timer;
+    struct sigaction old_segv;
+} lazy;
+
+static LazyBlock *lazy_find_block(const uint8_t *host)
+{
+    int i;
+
+    for (i = 0; i < lazy.nb_blocks; i++) {
+        LazyBlock *b = &lazy.blocks[i];
+        if (host >= b->host && host < b->host + b->length) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static LazyPage *lazy_find_page(const uint8_t *host)
+{
+    LazyBlock *b = lazy_find_block(host);
+
+    if (!b) {
+        return NULL;
+    }
+    return &lazy.pages[b->first_page + ((host - b->host) >> TARGET_PAGE_BITS)];
+}
+
+static void lazy_restore_chunk(LazyBlock *b, int chunk)
+{
+    volatile int *state = &lazy.chunks[b->first_chunk + chunk];
+    ram_addr_t offset = (ram_addr_t)chunk << LAZY_CHUNK_BITS;
+    size_t len = MIN(LAZY_CHUNK_SIZE, b->length - offset);
+    LazyPage *p = &lazy.pages[b->first_page + (offset >> TARGET_PAGE_BITS)];
+    uint8_t *buf;
+    size_t i;
+
+    if (!__sync_bool_compare_and_swap(state, LAZY_PENDING, LAZY_BUSY)) {
+        /* another thread is restoring it */
+        while (*state != LAZY_DONE) {
+            sched_yield();
+        }
+        return;
+    }
+
+    buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        abort();
+    }
+    for (i = 0; i < len; i += TARGET_PAGE_SIZE, p++) {
+        if (p->src) {
+            memcpy(buf + i, p->src, TARGET_PAGE_SIZE);
+        } else if (p->fill) {
+            memset(buf + i, p->fill, TARGET_PAGE_SIZE);
+        }
+    }
+    if (mremap(buf, len, len, MREMAP_MAYMOVE | MREMAP_FIXED,
+               b->host + offset) == MAP_FAILED) {
+        abort();
+    }
+    __sync_synchronize();
+    *state = LAZY_DONE;
+    __sync_fetch_and_sub(&lazy.pending, 1);
+}
+
+void ram_lazy_fault(void *host)
+{
+    LazyBlock *b = lazy_find_block(host);
+    int chunk;
+
+    if (b) {
+        chunk = ((uint8_t *)host - b->host) >> LAZY_CHUNK_BITS;
+        if (lazy.chunks[b->first_chunk + chunk] != LAZY_DONE) {
+            lazy_restore_chunk(b, chunk);
+        }
+    }
+}
+
+static void lazy_segv_handler(int sig, siginfo_t *info, void *ctx)
+{
+    if (lazy_find_block(info->si_addr)) {
+        ram_lazy_fault(info->si_addr);
+        return;
+    }
+    /* not ours: hand it to the previous handler, leaving ours in place */
+    if (lazy.old_segv.sa_handler == SIG_DFL ||
+        lazy.old_segv.sa_handler == SIG_IGN) {
+        /* a real crash: let the access fault again and kill the process */
+        signal(SIGSEGV, SIG_DFL);
+    } else if (lazy.old_segv.sa_flags & SA_SIGINFO) {
+        lazy.old_segv.sa_sigaction(sig, info, ctx);
+    } else {
+        lazy.old_segv.sa_handler(sig);
+    }
+}
+
+static void *lazy_prefetch_thread(void *opaque)
+{
+    int i, c, n;
+
+    for (i = 0; i < lazy.nb_blocks && !lazy.stop; i++) {
+        LazyBlock *b = &lazy.blocks[i];
+        n = (b->length + LAZY_CHUNK_SIZE - 1) >> LAZY_CHUNK_BITS;
+        for (c = 0; c < n && !lazy.stop; c++) {
+            if (lazy.chunks[b->first_chunk + c] == LAZY_PENDING) {
+                lazy_restore_chunk(b, c);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void lazy_finish(void)
+{
+    int i;
+
+    if (lazy.thread_started) {
+        lazy.stop = 1;
+        pthread_join(lazy.thread.thread, NULL);
+    }
+    if (lazy.handler_installed) {
+        sigaction(SIGSEGV, &lazy.old_segv, NULL);
+    }
+    if (lazy.timer) {
+        qemu_del_timer(lazy.timer);
+        qemu_free_timer(lazy.timer);
+    }
+    if (lazy.mapping) {
+        qemu_file_release_mapping(lazy.mapping);
+    }
+    for (i = 0; i < lazy.nb_pages; i++) {
+        if (lazy.pages[i].owned) {
+            qemu_free((void *)lazy.pages[i].src);
+        }
+    }
+    qemu_free(lazy.pages);
+    qemu_free((void *)lazy.chunks);
+    qemu_free(lazy.blocks);
+    memset(&lazy, 0, sizeof(lazy));
+    ram_lazy_active = 0;
+}
+
+static void lazy_reap(void *opaque)
+{
+    if (lazy.pending == 0) {
+        if (!ram_lazy_active) {
+            lazy_finish();
+            return;
+        }
+        /* give threads that saw the flag a tick to leave ram_lazy_fault()
+           before the tables go away */
+        ram_lazy_active = 0;
+    }
+    qemu_mod_timer(lazy.timer, qemu_get_clock_ms(rt_clock) + LAZY_REAP_MS);
+}
+
+/* Restore whatever is still pending and drop the snapshot mapping; must be
+ * called before the snapshot storage is modified. */
+void ram_lazy_flush(void)
+{
+    int i, c, n;
+
+    if (!lazy.blocks) {
+        return;
+    }
+    if (lazy.thread_started) {
+        lazy.stop = 1;
+        pthread_join(lazy.thread.thread, NULL);
+        lazy.thread_started = 0;
+    }
+    for (i = 0; i < lazy.nb_blocks; i++) {
+        LazyBlock *b = &lazy.blocks[i];
+        n = (b->length + LAZY_CHUNK_SIZE - 1) >> LAZY_CHUNK_BITS;
+        for (c = 0; c < n; c++) {
+            if (lazy.chunks[b->first_chunk + c] != LAZY_DONE) {
+                lazy_restore_chunk(b, c);
+            }
+        }
+    }
+    ram_lazy_active = 0;
+    if (!vm_running) {
+        lazy_finish();
+    }
+    /* otherwise the vCPU may still be looking at the tables, lazy_reap()
+       frees them */
+}
+
+static void lazy_begin(QEMUFile *f)
+{
+    RAMBlock *block;
+    LazyBlock *b;
+    int i;
+
+    ram_lazy_flush();
+    if (!lazy_ram_restore || kvm_enabled()) {
+        return;
+    }
+    lazy.mapping = qemu_file_hold_mapping(f);
+    if (!lazy.mapping) {
+        return;
+    }
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        lazy.nb_blocks++;
+    }
+    lazy.blocks = qemu_mallocz(lazy.nb_blocks * sizeof(LazyBlock));
+    b = lazy.blocks;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        /* memory provided by a device is left alone, and chunks are
+           swapped in whole host pages */
+        if ((block->flags & RAM_PREALLOC_MASK) ||
+            ((uintptr_t)block->host | block->length) & (getpagesize() - 1)) {
+            continue;
+        }
+        b->host = block->host;
+        b->length = block->length;
+        b->first_page = lazy.nb_pages;
+        b->first_chunk = lazy.nb_chunks;
+        lazy.nb_pages += block->length >> TARGET_PAGE_BITS;
+        lazy.nb_chunks += (block->length + LAZY_CHUNK_SIZE - 1) >>
+                          LAZY_CHUNK_BITS;
+        b++;
+    }
+    lazy.nb_blocks = b - lazy.blocks;
+
+    lazy.pages = qemu_mallocz(lazy.nb_pages * sizeof(LazyPage));
+    for (i = 0; i < lazy.nb_pages; i++) {
+        lazy.pages[i].fill = -1;
+    }
+    lazy.chunks = qemu_mallocz(lazy.nb_chunks * sizeof(int));
+    for (i = 0; i < lazy.nb_chunks; i++) {
+        lazy.chunks[i] = LAZY_DONE;
+    }
+    lazy.loading = 1;
+}
+
+static int lazy_load_page(QEMUFile *f, void *host)
+{
+    LazyPage *p;
+
+    if (!lazy.loading || !(p = lazy_find_page(host))) {
+        return 0;
+    }
+    if (p->owned) {
+        qemu_free((void *)p->src);
+        p->owned = 0;
+    }
+    p->fill = 0;
+    p->src = qemu_get_mapped_buffer(f, TARGET_PAGE_SIZE);
+    if (!p->src) {
+        uint8_t *copy = qemu_malloc(TARGET_PAGE_SIZE);
+        qemu_get_buffer(f, copy, TARGET_PAGE_SIZE);
+        p->src = copy;
+        p->owned = 1;
+    }
+    return 1;
+}
+
+static int lazy_fill_page(void *host, int ch)
+{
+    LazyPage *p;
+
+    if (!lazy.loading || !(p = lazy_find_page(host))) {
+        return 0;
+    }
+    if (p->owned) {
+        qemu_free((void *)p->src);
+        p->owned = 0;
+    }
+    p->src = NULL;
+    p->fill = ch;
+    return 1;
+}
+
+/* Called once the whole VM state is loaded. */
+void ram_lazy_start(void)
+{
+    struct sigaction act;
+    LazyPage *p;
+    int i, j;
+
+    if (!lazy.loading) {
+        return;
+    }
+    lazy.loading = 0;
+
+    for (i = 0; i < lazy.nb_blocks; i++) {
+        LazyBlock *b = &lazy.blocks[i];
+        p = &lazy.pages[b->first_page];
+        for (j = 0; j < b->length >> TARGET_PAGE_BITS; j++, p++) {
+            /* pages missing from the stream keep their current contents */
+            if (p->fill < 0) {
+                uint8_t *copy = qemu_malloc(TARGET_PAGE_SIZE);
+                memcpy(copy, b->host + ((ram_addr_t)j << TARGET_PAGE_BITS),
+                       TARGET_PAGE_SIZE);
+                p->src = copy;
+                p->owned = 1;
+                p->fill = 0;
+            }
+        }
+    }
+
+    memset(&act, 0, sizeof(act));
+    sigemptyset(&act.sa_mask);
+    act.sa_sigaction = lazy_segv_handler;
+    act.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &act, &lazy.old_segv);
+    lazy.handler_installed = 1;
+
+    for (i = 0; i < lazy.nb_chunks; i++) {
+        lazy.chunks[i] = LAZY_PENDING;
+    }
+    lazy.pending = lazy.nb_chunks;
+    ram_lazy_active = 1;
+
+    for (i = 0; i < lazy.nb_blocks; i++) {
+        if (mprotect(lazy.blocks[i].host, lazy.blocks[i].length,
+                     PROT_NONE) < 0) {
+            ram_lazy_flush();
+            return;
+        }
+    }
+
+    lazy.timer = qemu_new_timer_ms(rt_clock, lazy_reap, NULL);
+    qemu_mod_timer(lazy.timer, qemu_get_clock_ms(rt_clock) + LAZY_REAP_MS);
+    qemu_thread_create(&lazy.thread, lazy_prefetch_thread, NULL);
+    lazy.thread_started = 1;
+}
+#else
+void ram_lazy_fault(void *host)
+{
+}
+
+void ram_lazy_flush(void)
+{
+}
+
+static void lazy_begin(QEMUFile *f)
+{
+}
+
+static int lazy_load_page(QEMUFile *f, void *host)
+{
+    return 0;
+}
+
+static int lazy_fill_page(void *host, int ch)
+{
+    return 0;
+}
+
+void ram_lazy_start(void)
+{
+}
+#endif
+
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
                                             int flags)
@@ -382,6 +796,7 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
         addr &= TARGET_PAGE_MASK;
 
         if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
+            lazy_begin(f);
             if (version_id != 3) {
                 if (addr != ram_bytes_total()) {
                     return -EINVAL;
@@ -431,22 +846,37 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
+            if (lazy_fill_page(host, ch)) {
+                /* restored on first access */
+            } else {
+                memset(host, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu())) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
-            }
+                if (ch == 0 &&
+                    (!kvm_enabled() || kvm_has_sync_mmu())) {
+                    qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+                }
 #endif
+            }
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
+            uint8_t *buf;
 
             if (version_id != 3)
                 host = qemu_get_ram_ptr(addr);
             else
                 host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (!lazy_load_page(f, host)) {
+                /* copy straight from a mapped snapshot when possible */
+                buf = host;
+                qemu_get_buffer_in_place(f, &buf, TARGET_PAGE_SIZE);
+                if (buf != host) {
+                    memcpy(host, buf, TARGET_PAGE_SIZE);
+                }
+            }
         }
         if (qemu_file_has_error(f)) {
             return -EIO;
@@ -1645,11 +1645,17 @@ static void bdrv_stats_iter(QObject *data, void *opaque)
                         " wr_bytes=%" PRId64
                         " rd_operations=%" PRId64
                         " wr_operations=%" PRId64
+                        " queue_depth=%" PRId64
+                        " max_queue_depth=%" PRId64
+                        " merged_requests=%" PRId64
                         "\n",
                         qdict_get_int(qdict, "rd_bytes"),
                         qdict_get_int(qdict, "wr_bytes"),
                         qdict_get_int(qdict, "rd_operations"),
-                        qdict_get_int(qdict, "wr_operations"));
+                        qdict_get_int(qdict, "wr_operations"),
+                        qdict_get_int(qdict, "queue_depth"),
+                        qdict_get_int(qdict, "max_queue_depth"),
+                        qdict_get_int(qdict, "merged_requests"));
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -1657,22 +1663,48 @@ void bdrv_stats_print(Monitor *mon, const QObject *data)
     qlist_iter(qobject_to_qlist(data), bdrv_stats_iter, mon);
 }
 
+/* The AIO backends count queued and merged requests on the protocol
+   driver (bs->file of a format driver), report them on every layer above
+   it as well.  */
+static void bdrv_aio_stats(BlockDriverState *bs, int64_t *queue_depth,
+                           int64_t *max_queue_depth, uint64_t *merged_reqs)
+{
+    *queue_depth = 0;
+    *max_queue_depth = 0;
+    *merged_reqs = 0;
+    for (; bs != NULL; bs = bs->file) {
+        *queue_depth += bs->aio_queue_depth;
+        if (bs->aio_max_queue_depth > *max_queue_depth) {
+            *max_queue_depth = bs->aio_max_queue_depth;
+        }
+        *merged_reqs += bs->aio_merged_reqs;
+    }
+}
+
 static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
 {
     QObject *res;
     QDict *dict;
+    int64_t queue_depth, max_queue_depth;
+    uint64_t merged_reqs;
+
+    bdrv_aio_stats(bs, &queue_depth, &max_queue_depth, &merged_reqs);
 
     res = qobject_from_jsonf("{ 'stats': {"
                              "'rd_bytes': %" PRId64 ","
                              "'wr_bytes': %" PRId64 ","
                              "'rd_operations': %" PRId64 ","
                              "'wr_operations': %" PRId64 ","
-                             "'wr_highest_offset': %" PRId64
+                             "'wr_highest_offset': %" PRId64 ","
+                             "'queue_depth': %" PRId64 ","
+                             "'max_queue_depth': %" PRId64 ","
+                             "'merged_requests': %" PRId64
                              "} }",
                              bs->rd_bytes, bs->wr_bytes,
                              bs->rd_ops, bs->wr_ops,
                              bs->wr_highest_sector *
-                             (uint64_t)BDRV_SECTOR_SIZE);
+                             (uint64_t)BDRV_SECTOR_SIZE,
+                             queue_depth, max_queue_depth, merged_reqs);
     dict  = qobject_to_qdict(res);
 
     if (*bs->device_name) {
@@ -1778,6 +1810,38 @@ int bdrv_load_vmstate(BlockDriverState *bs, uint8_t *buf,
     return -ENOTSUP;
 }
 
+/* Map up to *size bytes of saved VM state in place; NULL means the caller
+ * has to fall back to bdrv_load_vmstate. */
+uint8_t *bdrv_map_vmstate(BlockDriverState *bs, int64_t pos, int *size,
+                          int keep)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return NULL;
+    if (drv->bdrv_map_vmstate)
+        return drv->bdrv_map_vmstate(bs, pos, size, keep);
+    if (bs->file)
+        return bdrv_map_vmstate(bs->file, pos, size, keep);
+    return NULL;
+}
+
+uint8_t *bdrv_map(BlockDriverState *bs, int64_t offset, int *size, int keep)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv || !drv->bdrv_map)
+        return NULL;
+    return drv->bdrv_map(bs, offset, size, keep);
+}
+
+void bdrv_unmap(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_unmap)
+        drv->bdrv_unmap(bs);
+    if (bs->file)
+        bdrv_unmap(bs->file);
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event)
 {
     BlockDriver *drv = bs->drv;
@@ -59,6 +59,13 @@ void bdrv_info_stats(Monitor *mon, QObject **ret_data);
 
 void bdrv_init(void);
 void bdrv_init_with_whitelist(void);
+
+/* number of L2 tables each qcow2 image keeps in memory, 0 for the default */
+extern int qcow2_l2_cache_size;
+/* decompressed chunks kept per cloop/dmg image, 0 for the default */
+extern int bdrv_compressed_cache_size;
+/* chunks of cloop/dmg images decompressed ahead of sequential reads */
+extern int bdrv_compressed_readahead;
 BlockDriver *bdrv_find_protocol(const char *filename);
 BlockDriver *bdrv_find_format(const char *format_name);
 BlockDriver *bdrv_find_whitelisted_format(const char *format_name);
@@ -224,6 +231,11 @@ int bdrv_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
 
 int bdrv_load_vmstate(BlockDriverState *bs, uint8_t *buf,
                       int64_t pos, int size);
+uint8_t *bdrv_map_vmstate(BlockDriverState *bs, int64_t pos, int *size,
+                          int keep);
+
+uint8_t *bdrv_map(BlockDriverState *bs, int64_t offset, int *size, int keep);
+void bdrv_unmap(BlockDriverState *bs);
 
 #define BDRV_SECTORS_PER_DIRTY_CHUNK 2048
 
@@ -0,0 +1,448 @@
+/*
+ * Decompressed chunk cache for the compressed read-only image formats
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "block.h"
+#include "block/chunk-cache.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+/*
+ * cloop and dmg images can only be decompressed a whole chunk at a time.
+ * The cache keeps the most recently used chunks decompressed. When a guest
+ * reads sequentially, the next chunks are decompressed ahead of time on a
+ * worker thread. The compressed data is still read by the caller, so the
+ * worker never touches the block layer.
+ */
+
+/* number of chunks cached per image, 0 selects CHUNK_CACHE_SIZE */
+int bdrv_compressed_cache_size;
+/* number of chunks decompressed ahead of sequential reads, 0 disables it */
+int bdrv_compressed_readahead;
+
+#define CHUNK_INVALID   0xffffffff
+
+typedef struct ChunkCacheEntry {
+    uint8_t *data;
+    uint32_t chunk;
+    /* being decompressed by the worker thread */
+    int pending;
+    /* read ahead and not looked up yet */
+    int unused;
+    QTAILQ_ENTRY(ChunkCacheEntry) lru_link;
+} ChunkCacheEntry;
+
+typedef struct ChunkCacheJob {
+    ChunkCacheEntry *entry;
+    uint8_t *in;
+    size_t in_len;
+    size_t out_len;
+    QSIMPLEQ_ENTRY(ChunkCacheJob) next;
+} ChunkCacheJob;
+
+struct ChunkCache {
+    int size;
+    size_t chunk_size;
+    ChunkCacheEntry *entries;
+    /* most recently used first */
+    QTAILQ_HEAD(ChunkCacheLRU, ChunkCacheEntry) lru;
+    /* last entry handed out, which the caller may still be reading */
+    ChunkCacheEntry *current;
+
+    int readahead;
+    uint32_t last_chunk;
+    int sequential;
+
+#ifndef _WIN32
+    /* the fields below are protected by lock once the worker runs */
+    pthread_t thread;
+    int thread_started;
+    int quit;
+    int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    QSIMPLEQ_HEAD(, ChunkCacheJob) jobs;
+    z_stream zstream;
+#endif
+};
+
+int chunk_inflate(z_stream *zstream, uint8_t *in, size_t in_len,
+                  uint8_t *out, size_t out_len)
+{
+    int ret;
+
+    zstream->next_in = in;
+    zstream->avail_in = in_len;
+    zstream->next_out = out;
+    zstream->avail_out = out_len;
+    ret = inflateReset(zstream);
+    if (ret != Z_OK) {
+        return -1;
+    }
+    ret = inflate(zstream, Z_FINISH);
+    if (ret != Z_STREAM_END || zstream->total_out != out_len) {
+        return -1;
+    }
+    return 0;
+}
+
+#ifndef _WIN32
+static void chunk_cache_lock(ChunkCache *c)
+{
+    pthread_mutex_lock(&c->lock);
+}
+
+static void chunk_cache_unlock(ChunkCache *c)
+{
+    pthread_mutex_unlock(&c->lock);
+}
+#else
+static void chunk_cache_lock(ChunkCache *c)
+{
+}
+
+static void chunk_cache_unlock(ChunkCache *c)
+{
+}
+#endif
+
+ChunkCache *chunk_cache_create(size_t chunk_size)
+{
+    ChunkCache *c;
+    int i, size;
+
+    size = bdrv_compressed_cache_size;
+    if (size <= 0) {
+        size = CHUNK_CACHE_SIZE;
+    } else if (size < 2) {
+        /* one for the caller, one to decompress the next chunk into */
+        size = 2;
+    } else if (size > CHUNK_CACHE_SIZE_MAX) {
+        size = CHUNK_CACHE_SIZE_MAX;
+    }
+
+    c = qemu_mallocz(sizeof(*c));
+#ifndef _WIN32
+    c->readahead = MIN(bdrv_compressed_readahead, CHUNK_READAHEAD_MAX);
+    /* keep room for the chunk being read besides the read-ahead window */
+    if (c->readahead > 0 && size < c->readahead + 2) {
+        size = c->readahead + 2;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->job_cond, NULL);
+    pthread_cond_init(&c->done_cond, NULL);
+    QSIMPLEQ_INIT(&c->jobs);
+#endif
+    c->size = size;
+    c->chunk_size = chunk_size;
+    c->last_chunk = CHUNK_INVALID;
+    c->entries = qemu_mallocz(size * sizeof(ChunkCacheEntry));
+
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < size; i++) {
+        c->entries[i].data = qemu_malloc(chunk_size);
+        c->entries[i].chunk = CHUNK_INVALID;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_link);
+    }
+    return c;
+}
+
+void chunk_cache_destroy(ChunkCache *c)
+{
+    int i;
+
+    if (c == NULL) {
+        return;
+    }
+
+#ifndef _WIN32
+    if (c->thread_started) {
+        ChunkCacheJob *job;
+
+        chunk_cache_lock(c);
+        c->quit = 1;
+        pthread_cond_signal(&c->job_cond);
+        chunk_cache_unlock(c);
+        pthread_join(c->thread, NULL);
+
+        while ((job = QSIMPLEQ_FIRST(&c->jobs)) != NULL) {
+            QSIMPLEQ_REMOVE_HEAD(&c->jobs, next);
+            qemu_free(job->in);
+            qemu_free(job);
+        }
+        inflateEnd(&c->zstream);
+    }
+    pthread_cond_destroy(&c->done_cond);
+    pthread_cond_destroy(&c->job_cond);
+    pthread_mutex_destroy(&c->lock);
+#endif
+
+    for (i = 0; i < c->size; i++) {
+        qemu_free(c->entries[i].data);
+    }
+    qemu_free(c->entries);
+    qemu_free(c);
+}
+
+static ChunkCacheEntry *chunk_cache_find(ChunkCache *c, uint32_t chunk)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].chunk == chunk) {
+            return &c->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the decompressed data of 'chunk', or NULL if it is not cached.
+ * Waits for the worker thread if the chunk is being read ahead.
+ *
+ * The pointer stays valid until the next call to chunk_cache_lookup() or
+ * chunk_cache_alloc().
+ */
+uint8_t *chunk_cache_lookup(ChunkCache *c, uint32_t chunk)
+{
+    ChunkCacheEntry *e;
+
+    chunk_cache_lock(c);
+    e = chunk_cache_find(c, chunk);
+#ifndef _WIN32
+    while (e != NULL && e->pending) {
+        pthread_cond_wait(&c->done_cond, &c->lock);
+        /* a failed read-ahead invalidates the entry */
+        if (e->chunk != chunk) {
+            e = NULL;
+        }
+    }
+#endif
+    if (e != NULL) {
+        QTAILQ_REMOVE(&c->lru, e, lru_link);
+        QTAILQ_INSERT_HEAD(&c->lru, e, lru_link);
+        e->unused = 0;
+        c->current = e;
+    }
+    chunk_cache_unlock(c);
+
+    return e ? e->data : NULL;
+}
+
+/* Returns true if 'chunk' is cached or being read ahead. */
+int chunk_cache_contains(ChunkCache *c, uint32_t chunk)
+{
+    int ret;
+
+    chunk_cache_lock(c);
+    ret = chunk_cache_find(c, chunk) != NULL;
+    chunk_cache_unlock(c);
+
+    return ret;
+}
+
+/*
+ * Takes the least recently used entry that is neither being read ahead nor
+ * still in use by the caller. Chunks that were read ahead but not used yet
+ * are only taken when nothing else is left, so that a small cache does not
+ * throw away the read-ahead window before the guest gets there.
+ */
+static ChunkCacheEntry *chunk_cache_evict(ChunkCache *c)
+{
+    ChunkCacheEntry *e, *victim = NULL;
+
+    QTAILQ_FOREACH_REVERSE(e, &c->lru, ChunkCacheLRU, lru_link) {
+        if (e->pending || e == c->current) {
+            continue;
+        }
+        if (!e->unused) {
+            victim = e;
+            break;
+        }
+        if (victim == NULL) {
+            victim = e;
+        }
+    }
+    /* there are fewer pending entries than the read-ahead window */
+    assert(victim != NULL);
+    e = victim;
+
+    e->chunk = CHUNK_INVALID;
+    e->unused = 0;
+    QTAILQ_REMOVE(&c->lru, e, lru_link);
+    QTAILQ_INSERT_HEAD(&c->lru, e, lru_link);
+    return e;
+}
+
+/*
+ * Returns a buffer for the caller to decompress a chunk into. The buffer
+ * only becomes visible to lookups after chunk_cache_insert().
+ */
+uint8_t *chunk_cache_alloc(ChunkCache *c)
+{
+    ChunkCacheEntry *e;
+
+    chunk_cache_lock(c);
+    e = chunk_cache_evict(c);
+    c->current = e;
+    chunk_cache_unlock(c);
+
+    return e->data;
+}
+
+void chunk_cache_insert(ChunkCache *c, uint8_t *data, uint32_t chunk)
+{
+    chunk_cache_lock(c);
+    assert(c->current != NULL && c->current->data == data);
+    c->current->chunk = chunk;
+    chunk_cache_unlock(c);
+}
+
+/*
+ * Called for every chunk a read touches. Returns the number of chunks
+ * following 'chunk' that should be read ahead, which is non-zero once
+ * the guest has read a few chunks in a row.
+ */
+int chunk_cache_readahead_count(ChunkCache *c, uint32_t chunk)
+{
+    if (chunk == c->last_chunk) {
+        return 0;
+    }
+    if (chunk == c->last_chunk + 1) {
+        c->sequential++;
+    } else {
+        c->sequential = 0;
+    }
+    c->last_chunk = chunk;
+
+    return c->sequential >= 2 ? c->readahead : 0;
+}
+
+#ifndef _WIN32
+static void *chunk_cache_thread(void *opaque)
+{
+    ChunkCache *c = opaque;
+    ChunkCacheJob *job;
+    int ret;
+
+    chunk_cache_lock(c);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&c->jobs) && !c->quit) {
+            pthread_cond_wait(&c->job_cond, &c->lock);
+        }
+        if (c->quit) {
+            break;
+        }
+        job = QSIMPLEQ_FIRST(&c->jobs);
+        QSIMPLEQ_REMOVE_HEAD(&c->jobs, next);
+        chunk_cache_unlock(c);
+
+        ret = chunk_inflate(&c->zstream, job->in, job->in_len,
+                            job->entry->data, job->out_len);
+
+        chunk_cache_lock(c);
+        if (ret < 0) {
+            /* the chunk is decompressed again when it is actually read */
+            job->entry->chunk = CHUNK_INVALID;
+        }
+        job->entry->pending = 0;
+        c->pending--;
+        pthread_cond_broadcast(&c->done_cond);
+
+        qemu_free(job->in);
+        qemu_free(job);
+    }
+    chunk_cache_unlock(c);
+
+    return NULL;
+}
+
+static int chunk_cache_start_thread(ChunkCache *c)
+{
+    sigset_t set, oldset;
+    int ret;
+
+    if (inflateInit(&c->zstream) != Z_OK) {
+        return -1;
+    }
+
+    /* block all signals, they are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    ret = pthread_create(&c->thread, NULL, chunk_cache_thread, c);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (ret != 0) {
+        inflateEnd(&c->zstream);
+        return -1;
+    }
+    c->thread_started = 1;
+    return 0;
+}
+#endif
+
+/*
+ * Queues the zlib compressed data 'in' of 'chunk' for decompression on the
+ * worker thread. Takes ownership of 'in', which must have been allocated
+ * with qemu_malloc().
+ */
+void chunk_cache_inflate_async(ChunkCache *c, uint32_t chunk,
+                               uint8_t *in, size_t in_len, size_t out_len)
+{
+#ifndef _WIN32
+    ChunkCacheJob *job;
+
+    if (!c->thread_started && chunk_cache_start_thread(c) < 0) {
+        c->readahead = 0;
+        qemu_free(in);
+        return;
+    }
+
+    chunk_cache_lock(c);
+    if (c->pending >= c->readahead) {
+        /* the worker is behind, e.g. after a seek */
+        chunk_cache_unlock(c);
+        qemu_free(in);
+        return;
+    }
+    c->pending++;
+
+    job = qemu_malloc(sizeof(*job));
+    job->in = in;
+    job->in_len = in_len;
+    job->out_len = out_len;
+    job->entry = chunk_cache_evict(c);
+    job->entry->chunk = chunk;
+    job->entry->pending = 1;
+    job->entry->unused = 1;
+    QSIMPLEQ_INSERT_TAIL(&c->jobs, job, next);
+    pthread_cond_signal(&c->job_cond);
+    chunk_cache_unlock(c);
+#else
+    qemu_free(in);
+#endif
+}
@@ -0,0 +1,49 @@
+/*
+ * Decompressed chunk cache for the compressed read-only image formats
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef BLOCK_CHUNK_CACHE_H
+#define BLOCK_CHUNK_CACHE_H
+
+#include <zlib.h>
+
+/* decompressed chunks kept per image unless set with -compressed-cache */
+#define CHUNK_CACHE_SIZE        16
+#define CHUNK_CACHE_SIZE_MAX    256
+
+#define CHUNK_READAHEAD_MAX     16
+
+typedef struct ChunkCache ChunkCache;
+
+ChunkCache *chunk_cache_create(size_t chunk_size);
+void chunk_cache_destroy(ChunkCache *c);
+uint8_t *chunk_cache_lookup(ChunkCache *c, uint32_t chunk);
+int chunk_cache_contains(ChunkCache *c, uint32_t chunk);
+uint8_t *chunk_cache_alloc(ChunkCache *c);
+void chunk_cache_insert(ChunkCache *c, uint8_t *data, uint32_t chunk);
+int chunk_cache_readahead_count(ChunkCache *c, uint32_t chunk);
+void chunk_cache_inflate_async(ChunkCache *c, uint32_t chunk,
+                               uint8_t *in, size_t in_len, size_t out_len);
+
+int chunk_inflate(z_stream *zstream, uint8_t *in, size_t in_len,
+                  uint8_t *out, size_t out_len);
+
+#endif
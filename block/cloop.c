@@ -24,6 +24,7 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "module.h"
+#include "block/chunk-cache.h"
 #include <zlib.h>
 
 typedef struct BDRVCloopState {
@@ -33,7 +34,9 @@ typedef struct BDRVCloopState {
     uint32_t sectors_per_block;
     uint32_t current_block;
     uint8_t *compressed_block;
+    /* data of current_block, owned by the cache */
     uint8_t *uncompressed_block;
+    ChunkCache *cache;
     z_stream zstream;
 } BDRVCloopState;
 
@@ -86,7 +89,7 @@ static int cloop_open(BlockDriverState *bs, int flags)
 
     /* initialize zlib engine */
     s->compressed_block = qemu_malloc(max_compressed_block_size+1);
-    s->uncompressed_block = qemu_malloc(s->block_size);
+    s->cache = chunk_cache_create(s->block_size);
     if(inflateInit(&s->zstream) != Z_OK)
 	goto cloop_close;
     s->current_block=s->n_blocks;
@@ -99,31 +102,58 @@ cloop_close:
     return -1;
 }
 
+/* Hands the blocks following block_num to the cache's worker thread. */
+static void cloop_readahead(BlockDriverState *bs, uint32_t block_num, int count)
+{
+    BDRVCloopState *s = bs->opaque;
+    uint32_t i, bytes;
+    uint8_t *buf;
+
+    for (i = block_num + 1; i <= block_num + count; i++) {
+        if (i + 1 >= s->n_blocks) {
+            break;
+        }
+        if (chunk_cache_contains(s->cache, i)) {
+            continue;
+        }
+        bytes = s->offsets[i+1] - s->offsets[i];
+        buf = qemu_malloc(bytes);
+        if (bdrv_pread(bs->file, s->offsets[i], buf, bytes) != bytes) {
+            qemu_free(buf);
+            break;
+        }
+        chunk_cache_inflate_async(s->cache, i, buf, bytes, s->block_size);
+    }
+}
+
 static inline int cloop_read_block(BlockDriverState *bs, int block_num)
 {
     BDRVCloopState *s = bs->opaque;
 
     if(s->current_block != block_num) {
-	int ret;
+	int ret, readahead;
         uint32_t bytes = s->offsets[block_num+1]-s->offsets[block_num];
 
-        ret = bdrv_pread(bs->file, s->offsets[block_num], s->compressed_block,
-                         bytes);
-        if (ret != bytes)
-            return -1;
-
-	s->zstream.next_in = s->compressed_block;
-	s->zstream.avail_in = bytes;
-	s->zstream.next_out = s->uncompressed_block;
-	s->zstream.avail_out = s->block_size;
-	ret = inflateReset(&s->zstream);
-	if(ret != Z_OK)
-	    return -1;
-	ret = inflate(&s->zstream, Z_FINISH);
-	if(ret != Z_STREAM_END || s->zstream.total_out != s->block_size)
-	    return -1;
-
+	s->current_block = s->n_blocks;
+	s->uncompressed_block = chunk_cache_lookup(s->cache, block_num);
+	if (s->uncompressed_block == NULL) {
+            ret = bdrv_pread(bs->file, s->offsets[block_num],
+                             s->compressed_block, bytes);
+            if (ret != bytes)
+                return -1;
+
+	    s->uncompressed_block = chunk_cache_alloc(s->cache);
+	    if (chunk_inflate(&s->zstream, s->compressed_block, bytes,
+	                      s->uncompressed_block, s->block_size) < 0)
+	        return -1;
+	    chunk_cache_insert(s->cache, s->uncompressed_block, block_num);
+	}
 	s->current_block = block_num;
+
+	readahead = chunk_cache_readahead_count(s->cache, block_num);
+	if (readahead > 0) {
+	    cloop_readahead(bs, block_num, readahead);
+	}
     }
     return 0;
 }
@@ -150,7 +180,7 @@ static void cloop_close(BlockDriverState *bs)
     if(s->n_blocks>0)
 	free(s->offsets);
     free(s->compressed_block);
-    free(s->uncompressed_block);
+    chunk_cache_destroy(s->cache);
     inflateEnd(&s->zstream);
 }
 
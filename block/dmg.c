@@ -25,6 +25,7 @@
 #include "block_int.h"
 #include "bswap.h"
 #include "module.h"
+#include "block/chunk-cache.h"
 #include <zlib.h>
 
 typedef struct BDRVDMGState {
@@ -44,7 +45,9 @@ typedef struct BDRVDMGState {
     uint64_t* sectorcounts;
     uint32_t current_chunk;
     uint8_t *compressed_chunk;
+    /* data of current_chunk, owned by the cache */
     uint8_t *uncompressed_chunk;
+    ChunkCache *cache;
     z_stream zstream;
 } BDRVDMGState;
 
@@ -171,7 +174,7 @@ static int dmg_open(BlockDriverState *bs, int flags)
 
     /* initialize zlib engine */
     s->compressed_chunk = qemu_malloc(max_compressed_size+1);
-    s->uncompressed_chunk = qemu_malloc(512*max_sectors_per_chunk);
+    s->cache = chunk_cache_create(512*max_sectors_per_chunk);
     if(inflateInit(&s->zstream) != Z_OK)
 	goto fail;
 
@@ -208,18 +211,48 @@ static inline uint32_t search_chunk(BDRVDMGState* s,int sector_num)
     return s->n_chunks; /* error */
 }
 
+/*
+ * Hands the zlib compressed chunks following 'chunk' to the cache's worker
+ * thread. Copied and zeroed chunks are cheap enough to load on demand.
+ */
+static void dmg_readahead(BlockDriverState *bs, uint32_t chunk, int count)
+{
+    BDRVDMGState *s = bs->opaque;
+    uint32_t i;
+    uint8_t *buf;
+
+    for (i = chunk + 1; i <= chunk + count && i < s->n_chunks; i++) {
+        if (s->types[i] != 0x80000005 || chunk_cache_contains(s->cache, i)) {
+            continue;
+        }
+        buf = qemu_malloc(s->lengths[i]);
+        if (bdrv_pread(bs->file, s->offsets[i], buf, s->lengths[i]) !=
+            s->lengths[i]) {
+            qemu_free(buf);
+            break;
+        }
+        chunk_cache_inflate_async(s->cache, i, buf, s->lengths[i],
+                                  512 * s->sectorcounts[i]);
+    }
+}
+
 static inline int dmg_read_chunk(BlockDriverState *bs, int sector_num)
 {
     BDRVDMGState *s = bs->opaque;
 
     if(!is_sector_in_chunk(s,s->current_chunk,sector_num)) {
-	int ret;
+	int ret, readahead;
 	uint32_t chunk = search_chunk(s,sector_num);
 
 	if(chunk>=s->n_chunks)
 	    return -1;
 
 	s->current_chunk = s->n_chunks;
+	s->uncompressed_chunk = chunk_cache_lookup(s->cache, chunk);
+	if (s->uncompressed_chunk != NULL) {
+	    goto done;
+	}
+	s->uncompressed_chunk = chunk_cache_alloc(s->cache);
 	switch(s->types[chunk]) {
 	case 0x80000005: { /* zlib compressed */
 	    int i;
@@ -238,15 +271,9 @@ static inline int dmg_read_chunk(BlockDriverState *bs, int sector_num)
 	    if (ret != s->lengths[chunk])
 		return -1;
 
-	    s->zstream.next_in = s->compressed_chunk;
-	    s->zstream.avail_in = s->lengths[chunk];
-	    s->zstream.next_out = s->uncompressed_chunk;
-	    s->zstream.avail_out = 512*s->sectorcounts[chunk];
-	    ret = inflateReset(&s->zstream);
-	    if(ret != Z_OK)
-		return -1;
-	    ret = inflate(&s->zstream, Z_FINISH);
-	    if(ret != Z_STREAM_END || s->zstream.total_out != 512*s->sectorcounts[chunk])
+	    if (chunk_inflate(&s->zstream, s->compressed_chunk,
+	                      s->lengths[chunk], s->uncompressed_chunk,
+	                      512*s->sectorcounts[chunk]) < 0)
 		return -1;
 	    break; }
 	case 1: /* copy */
@@ -259,7 +286,14 @@ static inline int dmg_read_chunk(BlockDriverState *bs, int sector_num)
 	    memset(s->uncompressed_chunk, 0, 512*s->sectorcounts[chunk]);
 	    break;
 	}
+	chunk_cache_insert(s->cache, s->uncompressed_chunk, chunk);
+done:
 	s->current_chunk = chunk;
+
+	readahead = chunk_cache_readahead_count(s->cache, chunk);
+	if (readahead > 0) {
+	    dmg_readahead(bs, chunk, readahead);
+	}
     }
     return 0;
 }
@@ -291,7 +325,7 @@ static void dmg_close(BlockDriverState *bs)
 	free(s->sectorcounts);
     }
     free(s->compressed_chunk);
-    free(s->uncompressed_chunk);
+    chunk_cache_destroy(s->cache);
     inflateEnd(&s->zstream);
 }
 
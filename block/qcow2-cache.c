@@ -0,0 +1,237 @@
+/*
+ * L2 table and refcount block cache for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+/*
+ * Tables are kept in their on-disk (big endian) format. Lookups go through
+ * a hash of the table offset; eviction picks the least recently used table.
+ * An offset of 0 marks an unused entry, since the image header always lives
+ * there.
+ */
+
+typedef struct Qcow2CacheEntry {
+    void *table;
+    uint64_t offset;
+    int dirty;
+    QLIST_ENTRY(Qcow2CacheEntry) hash_link;
+    QTAILQ_ENTRY(Qcow2CacheEntry) lru_link;
+} Qcow2CacheEntry;
+
+struct Qcow2Cache {
+    int size;
+    int table_size;
+    int table_bits;
+    int hash_mask;
+    int writeback;
+    uint8_t *tables;
+    Qcow2CacheEntry *entries;
+    QLIST_HEAD(Qcow2CacheBucket, Qcow2CacheEntry) *hash;
+    /* most recently used first */
+    QTAILQ_HEAD(Qcow2CacheLRU, Qcow2CacheEntry) lru;
+};
+
+Qcow2Cache *qcow2_cache_create(int num_tables, int table_bits)
+{
+    Qcow2Cache *c;
+    int i, hash_size;
+
+    c = qemu_mallocz(sizeof(*c));
+    c->size = num_tables;
+    c->table_bits = table_bits;
+    c->table_size = 1 << table_bits;
+    c->tables = qemu_malloc((size_t)num_tables << table_bits);
+    c->entries = qemu_mallocz(num_tables * sizeof(Qcow2CacheEntry));
+
+    /* keep the chains short: at least two buckets per table */
+    hash_size = 1;
+    while (hash_size < 2 * num_tables) {
+        hash_size <<= 1;
+    }
+    c->hash_mask = hash_size - 1;
+    c->hash = qemu_mallocz(hash_size * sizeof(*c->hash));
+
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].table = c->tables + ((size_t)i << table_bits);
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_link);
+    }
+    return c;
+}
+
+void qcow2_cache_destroy(Qcow2Cache *c)
+{
+    if (c == NULL) {
+        return;
+    }
+    qemu_free(c->hash);
+    qemu_free(c->entries);
+    qemu_free(c->tables);
+    qemu_free(c);
+}
+
+static inline int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset >> c->table_bits) & c->hash_mask;
+}
+
+static Qcow2CacheEntry *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CacheEntry *e;
+
+    QLIST_FOREACH(e, &c->hash[qcow2_cache_hash(c, offset)], hash_link) {
+        if (e->offset == offset) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static Qcow2CacheEntry *qcow2_cache_entry_of(Qcow2Cache *c, void *table)
+{
+    int i = ((uint8_t *)table - c->tables) >> c->table_bits;
+
+    assert(i >= 0 && i < c->size);
+    return &c->entries[i];
+}
+
+static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2CacheEntry *e,
+                                   int table_size)
+{
+    int ret;
+
+    if (!e->dirty) {
+        return 0;
+    }
+    ret = bdrv_pwrite_sync(bs->file, e->offset, e->table, table_size);
+    if (ret < 0) {
+        return ret;
+    }
+    e->dirty = 0;
+    return 0;
+}
+
+static void qcow2_cache_entry_drop(Qcow2Cache *c, Qcow2CacheEntry *e)
+{
+    if (e->offset != 0) {
+        QLIST_REMOVE(e, hash_link);
+        e->offset = 0;
+    }
+    e->dirty = 0;
+    QTAILQ_REMOVE(&c->lru, e, lru_link);
+    QTAILQ_INSERT_TAIL(&c->lru, e, lru_link);
+}
+
+/*
+ * Returns the cached copy of the table at 'offset' in '*table'. On a miss
+ * the least recently used table is written back if needed and reused; its
+ * contents are then read from the image when 'read' is set, or left for
+ * the caller to fill in otherwise.
+ *
+ * The pointer stays valid until the table is evicted by a later call.
+ */
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+                    void **table, int read)
+{
+    Qcow2CacheEntry *e;
+    int ret;
+
+    e = qcow2_cache_lookup(c, offset);
+    if (e == NULL) {
+        e = QTAILQ_LAST(&c->lru, Qcow2CacheLRU);
+        ret = qcow2_cache_entry_flush(bs, e, c->table_size);
+        if (ret < 0) {
+            return ret;
+        }
+        qcow2_cache_entry_drop(c, e);
+
+        if (read) {
+            ret = bdrv_pread(bs->file, offset, e->table, c->table_size);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        e->offset = offset;
+        QLIST_INSERT_HEAD(&c->hash[qcow2_cache_hash(c, offset)], e, hash_link);
+    }
+
+    QTAILQ_REMOVE(&c->lru, e, lru_link);
+    QTAILQ_INSERT_HEAD(&c->lru, e, lru_link);
+    *table = e->table;
+    return 0;
+}
+
+/*
+ * Records a modification of 'table'. In write-through mode the caller has
+ * already written the change to the image and nothing needs to be done.
+ */
+void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
+{
+    if (c->writeback) {
+        qcow2_cache_entry_of(c, table)->dirty = 1;
+    }
+}
+
+/* Forgets 'table' without writing it back, e.g. after a failed update. */
+void qcow2_cache_discard(Qcow2Cache *c, void *table)
+{
+    qcow2_cache_entry_drop(c, qcow2_cache_entry_of(c, table));
+}
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i, ret, result = 0;
+
+    for (i = 0; i < c->size; i++) {
+        ret = qcow2_cache_entry_flush(bs, &c->entries[i], c->table_size);
+        if (ret < 0 && result == 0) {
+            result = ret;
+        }
+    }
+    return result;
+}
+
+/*
+ * Switches between write-through and write-back. Leaving write-back mode
+ * writes all pending tables to the image.
+ */
+int qcow2_cache_set_writeback(BlockDriverState *bs, Qcow2Cache *c,
+                              int writeback)
+{
+    c->writeback = writeback;
+    if (!writeback) {
+        return qcow2_cache_flush(bs, c);
+    }
+    return 0;
+}
+
+/* Drops every table. Pending write-back data is lost. */
+void qcow2_cache_reset(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        qcow2_cache_entry_drop(c, &c->entries[i]);
+    }
+}
@@ -34,25 +34,6 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
 
 static int cache_refcount_updates = 0;
 
-static int write_refcount_block(BlockDriverState *bs)
-{
-    BDRVQcowState *s = bs->opaque;
-    size_t size = s->cluster_size;
-
-    if (s->refcount_block_cache_offset == 0) {
-        return 0;
-    }
-
-    BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE);
-    if (bdrv_pwrite_sync(bs->file, s->refcount_block_cache_offset,
-            s->refcount_block_cache, size) < 0)
-    {
-        return -EIO;
-    }
-
-    return 0;
-}
-
 /*********************************************************/
 /* refcount handling */
 
@@ -61,7 +42,8 @@ int qcow2_refcount_init(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     int ret, refcount_table_size2, i;
 
-    s->refcount_block_cache = qemu_malloc(s->cluster_size);
+    s->refcount_block_cache = qcow2_cache_create(REFCOUNT_CACHE_SIZE,
+                                                 s->cluster_bits);
     refcount_table_size2 = s->refcount_table_size * sizeof(uint64_t);
     s->refcount_table = qemu_malloc(refcount_table_size2);
     if (s->refcount_table_size > 0) {
@@ -81,32 +63,33 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    qemu_free(s->refcount_block_cache);
+    qcow2_cache_destroy(s->refcount_block_cache);
     qemu_free(s->refcount_table);
 }
 
 
+/*
+ * Makes the refcount block at refcount_block_offset the current one, reading
+ * it from the image unless it is still cached. With 'read' clear the block is
+ * about to be initialized by the caller and its old contents do not matter.
+ */
 static int load_refcount_block(BlockDriverState *bs,
-                               int64_t refcount_block_offset)
+                               int64_t refcount_block_offset, int read)
 {
     BDRVQcowState *s = bs->opaque;
+    void *table;
     int ret;
 
-    if (cache_refcount_updates) {
-        ret = write_refcount_block(bs);
-        if (ret < 0) {
-            return ret;
-        }
-    }
-
     BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_LOAD);
-    ret = bdrv_pread(bs->file, refcount_block_offset, s->refcount_block_cache,
-                     s->cluster_size);
+    ret = qcow2_cache_get(bs, s->refcount_block_cache, refcount_block_offset,
+                          &table, read);
     if (ret < 0) {
+        s->refcount_block_offset = 0;
         return ret;
     }
 
-    s->refcount_block_cache_offset = refcount_block_offset;
+    s->refcount_block = table;
+    s->refcount_block_offset = refcount_block_offset;
     return 0;
 }
 
@@ -128,16 +111,16 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     refcount_block_offset = s->refcount_table[refcount_table_index];
     if (!refcount_block_offset)
         return 0;
-    if (refcount_block_offset != s->refcount_block_cache_offset) {
+    if (refcount_block_offset != s->refcount_block_offset) {
         /* better than nothing: return allocated if read error */
-        ret = load_refcount_block(bs, refcount_block_offset);
+        ret = load_refcount_block(bs, refcount_block_offset, 1);
         if (ret < 0) {
             return ret;
         }
     }
     block_index = cluster_index &
         ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-    return be16_to_cpu(s->refcount_block_cache[block_index]);
+    return be16_to_cpu(s->refcount_block[block_index]);
 }
 
 /*
@@ -193,8 +176,8 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 
         /* If it's already there, we're done */
         if (refcount_block_offset) {
-            if (refcount_block_offset != s->refcount_block_cache_offset) {
-                ret = load_refcount_block(bs, refcount_block_offset);
+            if (refcount_block_offset != s->refcount_block_offset) {
+                ret = load_refcount_block(bs, refcount_block_offset, 1);
                 if (ret < 0) {
                     return ret;
                 }
@@ -226,7 +209,7 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
      */
 
     if (cache_refcount_updates) {
-        ret = write_refcount_block(bs);
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
         if (ret < 0) {
             return ret;
         }
@@ -246,13 +229,16 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 
     if (in_same_refcount_block(s, new_block, cluster_index << s->cluster_bits)) {
         /* Zero the new refcount block before updating it */
-        memset(s->refcount_block_cache, 0, s->cluster_size);
-        s->refcount_block_cache_offset = new_block;
+        ret = load_refcount_block(bs, new_block, 0);
+        if (ret < 0) {
+            goto fail_block;
+        }
+        memset(s->refcount_block, 0, s->cluster_size);
 
         /* The block describes itself, need to update the cache */
         int block_index = (new_block >> s->cluster_bits) &
             ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-        s->refcount_block_cache[block_index] = cpu_to_be16(1);
+        s->refcount_block[block_index] = cpu_to_be16(1);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -263,13 +249,16 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 
         /* Initialize the new refcount block only after updating its refcount,
          * update_refcount uses the refcount cache itself */
-        memset(s->refcount_block_cache, 0, s->cluster_size);
-        s->refcount_block_cache_offset = new_block;
+        ret = load_refcount_block(bs, new_block, 0);
+        if (ret < 0) {
+            goto fail_block;
+        }
+        memset(s->refcount_block, 0, s->cluster_size);
     }
 
     /* Now the new refcount block needs to be written to disk */
     BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_ALLOC_WRITE);
-    ret = bdrv_pwrite_sync(bs->file, new_block, s->refcount_block_cache,
+    ret = bdrv_pwrite_sync(bs->file, new_block, s->refcount_block,
         s->cluster_size);
     if (ret < 0) {
         goto fail_block;
@@ -407,7 +396,7 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t));
     s->free_cluster_index = old_free_cluster_index;
 
-    ret = load_refcount_block(bs, new_block);
+    ret = load_refcount_block(bs, new_block, 1);
     if (ret < 0) {
         goto fail_block;
     }
@@ -417,7 +406,11 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 fail_table:
     qemu_free(new_table);
 fail_block:
-    s->refcount_block_cache_offset = 0;
+    /* the cached copy of the new block never made it to the image */
+    if (s->refcount_block_offset == new_block) {
+        qcow2_cache_discard(s->refcount_block_cache, s->refcount_block);
+    }
+    s->refcount_block_offset = 0;
     return ret;
 }
 
@@ -430,6 +423,8 @@ static int write_refcount_block_entries(BlockDriverState *bs,
     int ret;
 
     if (cache_refcount_updates) {
+        qcow2_cache_entry_mark_dirty(s->refcount_block_cache,
+                                     s->refcount_block);
         return 0;
     }
 
@@ -446,7 +441,7 @@ static int write_refcount_block_entries(BlockDriverState *bs,
     BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
     ret = bdrv_pwrite_sync(bs->file,
         refcount_block_offset + (first_index << REFCOUNT_SHIFT),
-        &s->refcount_block_cache[first_index], size);
+        &s->refcount_block[first_index], size);
     if (ret < 0) {
         return ret;
     }
@@ -454,7 +449,6 @@ static int write_refcount_block_entries(BlockDriverState *bs,
     return 0;
 }
 
-/* XXX: cache several refcount block clusters ? */
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
     int64_t offset, int64_t length, int addend)
 {
@@ -517,7 +511,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             last_index = block_index;
         }
 
-        refcount = be16_to_cpu(s->refcount_block_cache[block_index]);
+        refcount = be16_to_cpu(s->refcount_block[block_index]);
         refcount += addend;
         if (refcount < 0 || refcount > 0xffff) {
             ret = -EINVAL;
@@ -526,7 +520,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
-        s->refcount_block_cache[block_index] = cpu_to_be16(refcount);
+        s->refcount_block[block_index] = cpu_to_be16(refcount);
     }
 
     ret = 0;
@@ -752,6 +746,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     qcow2_l2_cache_reset(bs);
     cache_refcount_updates = 1;
+    qcow2_cache_set_writeback(bs, s->refcount_block_cache, 1);
 
     l2_table = NULL;
     l1_table = NULL;
@@ -860,14 +855,15 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
         qemu_free(l1_table);
     qemu_free(l2_table);
     cache_refcount_updates = 0;
-    write_refcount_block(bs);
+    if (qcow2_cache_set_writeback(bs, s->refcount_block_cache, 0) < 0)
+        return -EIO;
     return 0;
  fail:
     if (l1_allocated)
         qemu_free(l1_table);
     qemu_free(l2_table);
     cache_refcount_updates = 0;
-    write_refcount_block(bs);
+    qcow2_cache_set_writeback(bs, s->refcount_block_cache, 0);
     return -EIO;
 }
 
@@ -52,6 +52,9 @@ typedef struct {
 #define  QCOW_EXT_MAGIC_END 0
 #define  QCOW_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 
+/* number of L2 tables cached per image, 0 selects L2_CACHE_SIZE */
+int qcow2_l2_cache_size;
+
 static int qcow_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     const QCowHeader *cow_header = (const void *)buf;
@@ -139,7 +142,7 @@ static int qcow_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 static int qcow_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    int len, i;
+    int len, i, l2_cache_size;
     QCowHeader header;
     uint64_t ext_end;
 
@@ -204,7 +207,13 @@ static int qcow_open(BlockDriverState *bs, int flags)
         }
     }
     /* alloc L2 cache */
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
+    l2_cache_size = qcow2_l2_cache_size;
+    if (l2_cache_size <= 0) {
+        l2_cache_size = L2_CACHE_SIZE;
+    } else if (l2_cache_size > L2_CACHE_SIZE_MAX) {
+        l2_cache_size = L2_CACHE_SIZE_MAX;
+    }
+    s->l2_table_cache = qcow2_cache_create(l2_cache_size, s->cluster_bits);
     s->cluster_cache = qemu_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
     s->cluster_data = qemu_malloc(QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
@@ -245,7 +254,7 @@ static int qcow_open(BlockDriverState *bs, int flags)
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    qcow2_cache_destroy(s->l2_table_cache);
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     return -1;
@@ -662,7 +671,7 @@ static void qcow_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    qcow2_cache_destroy(s->l2_table_cache);
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     qcow2_refcount_close(bs);
@@ -1295,6 +1304,34 @@ static int qcow_load_vmstate(BlockDriverState *bs, uint8_t *buf,
     return ret;
 }
 
+static uint8_t *qcow_map_vmstate(BlockDriverState *bs, int64_t pos, int *size,
+                                 int keep)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset = qcow_vm_state_offset(s) + pos;
+    int index_in_sector = offset & 511;
+    uint64_t cluster_offset;
+    int n;
+
+    if (s->crypt_method)
+        return NULL;
+
+    n = (*size + index_in_sector + 511) >> 9;
+    if (qcow2_get_cluster_offset(bs, offset, &n, &cluster_offset) < 0)
+        return NULL;
+    if (!cluster_offset || (cluster_offset & QCOW_OFLAG_COMPRESSED))
+        return NULL;
+
+    n = n * 512 - index_in_sector;
+    if (n <= 0)
+        return NULL;
+    if (*size > n)
+        *size = n;
+    return bdrv_map(bs->file,
+                    cluster_offset + (offset & (s->cluster_size - 1)), size,
+                    keep);
+}
+
 static QEMUOptionParameter qcow_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -1356,6 +1393,7 @@ static BlockDriver bdrv_qcow2 = {
 
     .bdrv_save_vmstate    = qcow_save_vmstate,
     .bdrv_load_vmstate    = qcow_load_vmstate,
+    .bdrv_map_vmstate     = qcow_map_vmstate,
 
     .bdrv_change_backing_file   = qcow2_change_backing_file,
 
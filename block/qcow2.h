@@ -49,7 +49,12 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* default number of L2 tables kept in memory, see qcow2_l2_cache_size */
 #define L2_CACHE_SIZE 16
+#define L2_CACHE_SIZE_MAX 1024
+#define REFCOUNT_CACHE_SIZE 4
+
+typedef struct Qcow2Cache Qcow2Cache;
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -92,9 +97,7 @@ typedef struct BDRVQcowState {
     uint64_t cluster_offset_mask;
     uint64_t l1_table_offset;
     uint64_t *l1_table;
-    uint64_t *l2_cache;
-    uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    Qcow2Cache *l2_table_cache;
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
@@ -103,8 +106,10 @@ typedef struct BDRVQcowState {
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
-    uint64_t refcount_block_cache_offset;
-    uint16_t *refcount_block_cache;
+    Qcow2Cache *refcount_block_cache;
+    /* most recently loaded refcount block, points into the cache */
+    uint64_t refcount_block_offset;
+    uint16_t *refcount_block;
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
@@ -206,6 +211,18 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 
+/* qcow2-cache.c functions */
+Qcow2Cache *qcow2_cache_create(int num_tables, int table_bits);
+void qcow2_cache_destroy(Qcow2Cache *c);
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table, int read);
+void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
+void qcow2_cache_discard(Qcow2Cache *c, void *table);
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
+int qcow2_cache_set_writeback(BlockDriverState *bs, Qcow2Cache *c,
+    int writeback);
+void qcow2_cache_reset(Qcow2Cache *c);
+
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
 int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id);
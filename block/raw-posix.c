@@ -28,6 +28,7 @@
 #include "block_int.h"
 #include "module.h"
 #include "block/raw-posix-aio.h"
+#include <sys/mman.h>
 
 #ifdef CONFIG_COCOA
 #include <paths.h>
@@ -98,10 +99,19 @@
 
 #define ALIGNED_BUFFER_SIZE (32 * 512)
 
+/* size and alignment of the windows mapped by raw_map() */
+#define MAP_WINDOW_SIZE (64 * 1024 * 1024)
+
 /* if the FD is not accessed during that time (in ms), we try to
    reopen it to see if the disk has been changed */
 #define FD_OPEN_TIMEOUT 1000
 
+typedef struct RawMapWindow {
+    uint8_t *base;
+    int64_t offset;
+    int64_t len;
+} RawMapWindow;
+
 typedef struct BDRVRawState {
     int fd;
     int type;
@@ -118,6 +128,8 @@ typedef struct BDRVRawState {
     void *aio_ctx;
 #endif
     uint8_t* aligned_buf;
+    RawMapWindow *maps;
+    int nb_maps;
 } BDRVRawState;
 
 static int fd_open(BlockDriverState *bs);
@@ -555,9 +567,76 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
+static void raw_unmap(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_maps; i++)
+        munmap(s->maps[i].base, s->maps[i].len);
+    qemu_free(s->maps);
+    s->maps = NULL;
+    s->nb_maps = 0;
+}
+
+/* With keep set, windows stay mapped until raw_unmap(), so that callers may
+ * keep pointers into data they have already consumed.  Otherwise mapping a
+ * new window releases the ones mapped before. */
+static uint8_t *raw_map(BlockDriverState *bs, int64_t offset, int *size,
+                        int keep)
+{
+    BDRVRawState *s = bs->opaque;
+    RawMapWindow *w = NULL;
+    int64_t start, len;
+    void *p;
+    int i;
+
+    if (s->type != FTYPE_FILE || fd_open(bs) < 0)
+        return NULL;
+
+    for (i = s->nb_maps - 1; i >= 0; i--) {
+        if (offset >= s->maps[i].offset &&
+            offset < s->maps[i].offset + s->maps[i].len) {
+            w = &s->maps[i];
+            break;
+        }
+    }
+
+    if (!w) {
+        len = raw_getlength(bs);
+        if (offset < 0 || offset >= len)
+            return NULL;
+        start = offset & ~((int64_t)MAP_WINDOW_SIZE - 1);
+        len = MIN(len - start, MAP_WINDOW_SIZE);
+        p = mmap(NULL, len, PROT_READ, MAP_SHARED, s->fd, start);
+        if (p == MAP_FAILED)
+            return NULL;
+        if (!keep)
+            raw_unmap(bs);
+        /* callers stream through the file, so start reading this window
+         * and the next one while the current one is being consumed */
+        madvise(p, len, MADV_WILLNEED);
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(s->fd, start + len, MAP_WINDOW_SIZE,
+                      POSIX_FADV_WILLNEED);
+#endif
+        s->maps = qemu_realloc(s->maps, (s->nb_maps + 1) * sizeof(*s->maps));
+        w = &s->maps[s->nb_maps++];
+        w->base = p;
+        w->offset = start;
+        w->len = len;
+    }
+
+    len = w->offset + w->len - offset;
+    if (*size > len)
+        *size = len;
+    return w->base + (offset - w->offset);
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+    raw_unmap(bs);
     if (s->fd >= 0) {
         close(s->fd);
         s->fd = -1;
@@ -755,6 +834,9 @@ static BlockDriver bdrv_file = {
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
 
+    .bdrv_map = raw_map,
+    .bdrv_unmap = raw_unmap,
+
     .create_options = raw_create_options,
 };
 
@@ -99,6 +99,15 @@ struct BlockDriver {
                              int64_t pos, int size);
     int (*bdrv_load_vmstate)(BlockDriverState *bs, uint8_t *buf,
                              int64_t pos, int size);
+    uint8_t *(*bdrv_map_vmstate)(BlockDriverState *bs, int64_t pos,
+                                 int *size, int keep);
+
+    /* read-only mapping of the host file at offset, valid until bdrv_unmap
+     * if keep is set and otherwise until the next bdrv_map; *size is
+     * clamped to the contiguous length */
+    uint8_t *(*bdrv_map)(BlockDriverState *bs, int64_t offset, int *size,
+                         int keep);
+    void (*bdrv_unmap)(BlockDriverState *bs);
 
     int (*bdrv_change_backing_file)(BlockDriverState *bs,
         const char *backing_file, const char *backing_fmt);
@@ -178,6 +187,10 @@ struct BlockDriverState {
     uint64_t rd_ops;
     uint64_t wr_ops;
     uint64_t wr_highest_sector;
+    /* requests queued in the AIO backend, and how many were merged */
+    int64_t aio_queue_depth;
+    int64_t aio_max_queue_depth;
+    uint64_t aio_merged_reqs;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -32,46 +32,160 @@
  *
  */
 
-#define  BIP_BUFFER_SIZE  512
+/* each direction buffers its pending data in a queue of circular buffers.
+ * a queue starts with a small buffer, and each time the last one fills up
+ * the next one is allocated twice as large, up to BIP_BUFFER_MAX_SHIFT, so
+ * that bursts (e.g. SMS floods or sensor streams) only need a few buffers.
+ * the size is halved again every time the queue drains completely.
+ */
+#define  BIP_BUFFER_MIN_SHIFT  9    /* 512 bytes */
+#define  BIP_BUFFER_MAX_SHIFT  16   /* 64 KB */
+#define  BIP_BUFFER_ORDERS     (BIP_BUFFER_MAX_SHIFT - BIP_BUFFER_MIN_SHIFT + 1)
+
+/* max number of free buffers kept around for each size */
+#define  BIP_BUFFER_FREE_MAX   4
 
 typedef struct BipBuffer {
     struct BipBuffer*  next;
     CBuffer            cb[1];
-    char               buff[ BIP_BUFFER_SIZE ];
+    int                order;
 } BipBuffer;
 
-static BipBuffer*  _free_bip_buffers;
+static BipBuffer*  _free_bip_buffers[ BIP_BUFFER_ORDERS ];
+static int         _free_bip_count[ BIP_BUFFER_ORDERS ];
 
 static BipBuffer*
-bip_buffer_alloc( void )
+bip_buffer_alloc( int  order )
 {
-    BipBuffer*  bip = _free_bip_buffers;
+    BipBuffer*  bip  = _free_bip_buffers[order];
+    int         size = 1 << (BIP_BUFFER_MIN_SHIFT + order);
+
     if (bip != NULL) {
-        _free_bip_buffers = bip->next;
+        _free_bip_buffers[order] = bip->next;
+        _free_bip_count[order]  -= 1;
     } else {
-        bip = malloc( sizeof(*bip) );
+        bip = malloc( sizeof(*bip) + size );
         if (bip == NULL) {
             derror( "%s: not enough memory", __FUNCTION__ );
             exit(1);
         }
+        bip->order = order;
     }
     bip->next = NULL;
-    cbuffer_reset( bip->cb, bip->buff, sizeof(bip->buff) );
+    cbuffer_reset( bip->cb, bip+1, size );
     return bip;
 }
 
 static void
 bip_buffer_free( BipBuffer*  bip )
 {
-    bip->next         = _free_bip_buffers;
-    _free_bip_buffers = bip;
+    int  order = bip->order;
+
+    if (_free_bip_count[order] >= BIP_BUFFER_FREE_MAX) {
+        free(bip);
+        return;
+    }
+    bip->next                = _free_bip_buffers[order];
+    _free_bip_buffers[order] = bip;
+    _free_bip_count[order]  += 1;
+}
+
+/* a queue of BipBuffers, used to hold the data written to one side of
+ * a charpipe, or to a charbuffer, until its reader can accept it.
+ */
+typedef struct BipQueue {
+    BipBuffer*  first;
+    BipBuffer*  last;
+    int         order;   /* size order of the next buffer to allocate */
+} BipQueue;
+
+static void
+bip_queue_init( BipQueue*  q )
+{
+    q->first = NULL;
+    q->last  = NULL;
+    q->order = 0;
+}
+
+static void
+bip_queue_clear( BipQueue*  q )
+{
+    while (q->first) {
+        BipBuffer*  bip = q->first;
+        q->first = bip->next;
+        bip_buffer_free(bip);
+    }
+    q->last  = NULL;
+    q->order = 0;
+}
+
+/* append 'len' bytes to the queue, this always succeeds */
+static void
+bip_queue_write( BipQueue*  q, const uint8_t*  buf, int  len )
+{
+    BipBuffer*  bip = q->last;
+
+    if (bip == NULL) {
+        bip = bip_buffer_alloc(q->order);
+        q->first = q->last = bip;
+    }
+
+    while (len > 0) {
+        int  len2 = cbuffer_write( bip->cb, buf, len );
+
+        buf += len2;
+        len -= len2;
+        if (len == 0)
+            break;
+
+        /* ok, we need another, larger, buffer */
+        if (q->order < BIP_BUFFER_ORDERS-1)
+            q->order += 1;
+
+        bip->next = bip_buffer_alloc(q->order);
+        bip       = bip->next;
+        q->last   = bip;
+    }
+}
+
+/* return the address and size of the first contiguous block of data
+ * in the queue, without consuming it. returns 0 if the queue is empty.
+ */
+static int
+bip_queue_peek( BipQueue*  q, uint8_t*  *pbase )
+{
+    while (q->first != NULL) {
+        BipBuffer*  bip   = q->first;
+        int         avail = cbuffer_read_peek( bip->cb, pbase );
+
+        if (avail > 0)
+            return avail;
+
+        q->first = bip->next;
+        if (q->first == NULL) {
+            q->last = NULL;
+            /* drained, shrink the next buffer back */
+            if (q->order > 0)
+                q->order -= 1;
+        }
+        bip_buffer_free(bip);
+    }
+    *pbase = NULL;
+    return 0;
+}
+
+/* consume 'len' bytes returned by a previous bip_queue_peek() */
+static void
+bip_queue_step( BipQueue*  q, int  len )
+{
+    if (q->first != NULL)
+        cbuffer_read_step( q->first->cb, len );
 }
 
 /* this models each half of the charpipe */
 typedef struct CharPipeHalf {
     CharDriverState       cs[1];
-    BipBuffer*            bip_first;
-    BipBuffer*            bip_last;
+    BipQueue              queue[1];
     struct CharPipeHalf*  peer;         /* NULL if closed */
 } CharPipeHalf;
 
@@ -82,12 +196,7 @@ charpipehalf_close( CharDriverState*  cs )
 {
     CharPipeHalf*  ph = cs->opaque;
 
-    while (ph->bip_first) {
-        BipBuffer*  bip = ph->bip_first;
-        ph->bip_first = bip->next;
-        bip_buffer_free(bip);
-    }
-    ph->bip_last    = NULL;
+    bip_queue_clear(ph->queue);
     ph->peer        = NULL;
 }
 
@@ -97,13 +206,12 @@ charpipehalf_write( CharDriverState*  cs, const uint8_t*  buf, int  len )
 {
     CharPipeHalf*  ph   = cs->opaque;
     CharPipeHalf*  peer = ph->peer;
-    BipBuffer*     bip  = ph->bip_last;
-    int            ret  = 0;
+    int            ret  = len;
 
     D("%s: writing %d bytes to %p: '%s'", __FUNCTION__,
       len, ph, quote_bytes( buf, len ));
 
-    if (bip == NULL && peer != NULL && peer->cs->chr_read != NULL) {
+    if (ph->queue->first == NULL && peer != NULL && peer->cs->chr_read != NULL) {
         /* no buffered data, try to write directly to the peer */
         while (len > 0) {
             int  size;
@@ -121,82 +229,55 @@ charpipehalf_write( CharDriverState*  cs, const uint8_t*  buf, int  len )
             qemu_chr_read( peer->cs, (uint8_t*)buf, size );
             buf += size;
             len -= size;
-            ret += size;
         }
     }
 
-    if (len == 0)
-        return ret;
-
     /* buffer the remaining data */
-    if (bip == NULL) {
-        bip = bip_buffer_alloc();
-        ph->bip_first = ph->bip_last = bip;
-    }
-
-    while (len > 0) {
-        int  len2 = cbuffer_write( bip->cb, buf, len );
+    if (len > 0)
+        bip_queue_write( ph->queue, buf, len );
 
-        buf += len2;
-        ret += len2;
-        len -= len2;
-        if (len == 0)
-            break;
-
-        /* ok, we need another buffer */
-        ph->bip_last = bip_buffer_alloc();
-        bip->next = ph->bip_last;
-        bip       = ph->bip_last;
-    }
     return  ret;
 }
 
 
-static void
+/* send as much buffered data as possible to the peer, in place.
+ * returns the number of bytes that were sent.
+ */
+static int
 charpipehalf_poll( CharPipeHalf*  ph )
 {
     CharPipeHalf*   peer = ph->peer;
-    int             size;
+    int             total = 0;
 
     if (peer == NULL || peer->cs->chr_read == NULL)
-        return;
+        return 0;
 
     while (1) {
-        BipBuffer*  bip = ph->bip_first;
         uint8_t*    base;
         int         avail;
 
-        if (bip == NULL)
+        avail = bip_queue_peek( ph->queue, &base );
+        if (avail == 0)
             break;
 
-        size = cbuffer_read_avail(bip->cb);
-        if (size == 0) {
-            ph->bip_first = bip->next;
-            if (ph->bip_first == NULL)
-                ph->bip_last = NULL;
-            bip_buffer_free(bip);
-            continue;
-        }
-
-        if (ph->cs->chr_can_read) {
+        if (peer->cs->chr_can_read) {
             int  size2 = qemu_chr_can_read(peer->cs);
 
             if (size2 == 0)
                 break;
 
-            if (size > size2)
-                size = size2;
+            if (avail > size2)
+                avail = size2;
         }
 
-        avail = cbuffer_read_peek( bip->cb, &base );
-        if (avail > size)
-            avail = size;
         D("%s: sending %d bytes from %p: '%s'", __FUNCTION__,
             avail, ph, quote_bytes( base, avail ));
 
         qemu_chr_read( peer->cs, base, avail );
-        cbuffer_read_step( bip->cb, avail );
+        bip_queue_step( ph->queue, avail );
+        total += avail;
     }
+    return total;
 }
 
 
@@ -205,8 +286,7 @@ charpipehalf_init( CharPipeHalf*  ph, CharPipeHalf*  peer )
 {
     CharDriverState*  cs = ph->cs;
 
-    ph->bip_first   = NULL;
-    ph->bip_last    = NULL;
+    bip_queue_init(ph->queue);
     ph->peer        = peer;
 
     cs->chr_write            = charpipehalf_write;
@@ -264,8 +344,7 @@ qemu_chr_open_charpipe( CharDriverState*  *pfirst, CharDriverState*  *psecond )
 
 typedef struct CharBuffer {
     CharDriverState  cs[1];
-    BipBuffer*       bip_first;
-    BipBuffer*       bip_last;
+    BipQueue         queue[1];
     CharDriverState* endpoint;  /* NULL if closed */
     char             closing;
 } CharBuffer;
@@ -276,12 +355,7 @@ charbuffer_close( CharDriverState*  cs )
 {
     CharBuffer*  cbuf = cs->opaque;
 
-    while (cbuf->bip_first) {
-        BipBuffer*  bip = cbuf->bip_first;
-        cbuf->bip_first = bip->next;
-        bip_buffer_free(bip);
-    }
-    cbuf->bip_last = NULL;
+    bip_queue_clear(cbuf->queue);
     cbuf->endpoint = NULL;
 
     if (cbuf->endpoint != NULL) {
@@ -295,13 +369,12 @@ charbuffer_write( CharDriverState*  cs, const uint8_t*  buf, int  len )
 {
     CharBuffer*       cbuf = cs->opaque;
     CharDriverState*  peer = cbuf->endpoint;
-    BipBuffer*        bip  = cbuf->bip_last;
-    int               ret  = 0;
+    int               ret  = len;
 
     D("%s: writing %d bytes to %p: '%s'", __FUNCTION__,
       len, cbuf, quote_bytes( buf, len ));
 
-    if (bip == NULL && peer != NULL) {
+    if (cbuf->queue->first == NULL && peer != NULL) {
         /* no buffered data, try to write directly to the peer */
         int  size = qemu_chr_write(peer, buf, len);
 
@@ -311,63 +384,36 @@ charbuffer_write( CharDriverState*  cs, const uint8_t*  buf, int  len )
             size = len;
 
         buf += size;
-        ret += size;
         len -= size;
     }
 
-    if (len == 0)
-        return ret;
-
     /* buffer the remaining data */
-    if (bip == NULL) {
-        bip = bip_buffer_alloc();
-        cbuf->bip_first = cbuf->bip_last = bip;
-    }
-
-    while (len > 0) {
-        int  len2 = cbuffer_write( bip->cb, buf, len );
-
-        buf += len2;
-        ret += len2;
-        len -= len2;
-        if (len == 0)
-            break;
+    if (len > 0)
+        bip_queue_write( cbuf->queue, buf, len );
 
-        /* ok, we need another buffer */
-        cbuf->bip_last = bip_buffer_alloc();
-        bip->next = cbuf->bip_last;
-        bip       = cbuf->bip_last;
-    }
     return  ret;
 }
 
 
-static void
+/* returns the number of bytes sent to the endpoint */
+static int
 charbuffer_poll( CharBuffer*  cbuf )
 {
     CharDriverState*  peer = cbuf->endpoint;
+    int               total = 0;
 
     if (peer == NULL)
-        return;
+        return 0;
 
     while (1) {
-        BipBuffer*  bip = cbuf->bip_first;
         uint8_t*    base;
         int         avail;
         int         size;
 
-        if (bip == NULL)
+        avail = bip_queue_peek( cbuf->queue, &base );
+        if (avail == 0)
             break;
 
-        avail = cbuffer_read_peek( bip->cb, &base );
-        if (avail == 0) {
-            cbuf->bip_first = bip->next;
-            if (cbuf->bip_first == NULL)
-                cbuf->bip_last = NULL;
-            bip_buffer_free(bip);
-            continue;
-        }
-
         size = qemu_chr_write( peer, base, avail );
 
         if (size < 0)  /* just to be safe */
@@ -375,11 +421,13 @@ charbuffer_poll( CharBuffer*  cbuf )
         else if (size > avail)
             size = avail;
 
-        cbuffer_read_step( bip->cb, size );
+        bip_queue_step( cbuf->queue, size );
+        total += size;
 
         if (size < avail)
             break;
     }
+    return total;
 }
 
 
@@ -401,8 +449,7 @@ charbuffer_init( CharBuffer*  cbuf, CharDriverState*  endpoint )
 {
     CharDriverState*  cs = cbuf->cs;
 
-    cbuf->bip_first   = NULL;
-    cbuf->bip_last    = NULL;
+    bip_queue_init(cbuf->queue);
     cbuf->endpoint    = endpoint;
 
     cs->chr_write               = charbuffer_write;
@@ -439,31 +486,46 @@ qemu_chr_open_buffer( CharDriverState*  endpoint )
 }
 
 
+/* a reader that receives data from a charpipe may write an answer to
+ * another one (e.g. qemud serial -> service -> serial), so keep moving
+ * data until nothing changes, but don't starve the rest of the main loop.
+ */
+#define  CHARPIPE_POLL_MAX_ROUNDS  16
+
 void
 charpipe_poll( void )
 {
-    CharPipeState*  cp     = _s_charpipes;
-    CharPipeState*  cp_end = cp + MAX_CHAR_PIPES;
+    int  round;
 
-    CharBuffer*     cb     = _s_charbuffers;
-    CharBuffer*     cb_end = cb + MAX_CHAR_BUFFERS;
+    for (round = 0; round < CHARPIPE_POLL_MAX_ROUNDS; round++) {
+        CharPipeState*  cp     = _s_charpipes;
+        CharPipeState*  cp_end = cp + MAX_CHAR_PIPES;
 
-    /* poll the charpipes */
-    for ( ; cp < cp_end; cp++ ) {
-        CharPipeHalf*  half;
+        CharBuffer*     cb     = _s_charbuffers;
+        CharBuffer*     cb_end = cb + MAX_CHAR_BUFFERS;
 
-        half = cp->a;
-        if (half->peer != NULL)
-            charpipehalf_poll(half);
+        int             moved  = 0;
 
-        half = cp->b;
-        if (half->peer != NULL)
-            charpipehalf_poll(half);
-    }
+        /* poll the charpipes */
+        for ( ; cp < cp_end; cp++ ) {
+            CharPipeHalf*  half;
 
-    /* poll the charbuffers */
-    for ( ; cb < cb_end; cb++ ) {
-        if (cb->endpoint != NULL)
-            charbuffer_poll(cb);
+            half = cp->a;
+            if (half->peer != NULL)
+                moved += charpipehalf_poll(half);
+
+            half = cp->b;
+            if (half->peer != NULL)
+                moved += charpipehalf_poll(half);
+        }
+
+        /* poll the charbuffers */
+        for ( ; cb < cb_end; cb++ ) {
+            if (cb->endpoint != NULL)
+                moved += charbuffer_poll(cb);
+        }
+
+        if (moved == 0)
+            break;
     }
 }
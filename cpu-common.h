@@ -61,6 +61,10 @@ void *qemu_get_ram_ptr(ram_addr_t addr);
 /* Same but slower, to use for migration, where the order of
  * RAMBlocks must not change. */
 void *qemu_safe_ram_ptr(ram_addr_t addr);
+/* Set while RAM is being restored lazily from a snapshot; host pointers
+ * must go through ram_lazy_fault() before being handed to the kernel. */
+extern int ram_lazy_active;
+void ram_lazy_fault(void *host);
 /* This should not be used by devices.  */
 int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr);
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr);
@@ -110,6 +114,7 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
 #define IO_MEM_ROM         (1 << IO_MEM_SHIFT) /* hardcoded offset */
 #define IO_MEM_UNASSIGNED  (2 << IO_MEM_SHIFT)
 #define IO_MEM_NOTDIRTY    (3 << IO_MEM_SHIFT)
+#define IO_MEM_WATCH       (4 << IO_MEM_SHIFT) /* debug watchpoints */
 
 /* Acts like a ROM when read and like a device when written.  */
 #define IO_MEM_ROMD        (1)
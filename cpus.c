@@ -31,6 +31,7 @@
 #include "hax.h"
 
 #include "cpus.h"
+#include "exec-all.h"
 
 static CPUState *cur_cpu;
 static CPUState *next_cpu;
@@ -102,7 +103,7 @@ int tcg_has_work(void)
 #ifndef _WIN32
 static int io_thread_fd = -1;
 
-#if 0
+#ifdef CONFIG_IOTHREAD
 static void qemu_event_increment(void)
 {
     static const char byte = 0;
@@ -172,7 +173,7 @@ static int qemu_event_init(void)
     return 0;
 }
 
-#if 0
+#ifdef CONFIG_IOTHREAD
 static void qemu_event_increment(void)
 {
     SetEvent(qemu_event_handle);
@@ -258,6 +259,30 @@ void qemu_mutex_unlock_iothread(void)
 {
 }
 
+void qemu_main_loop_start(void)
+{
+}
+
+void qemu_main_loop_release(void)
+{
+}
+
+void qemu_main_loop_acquire(void)
+{
+}
+
+void qemu_cpu_io_begin(void)
+{
+}
+
+void qemu_cpu_io_end(void)
+{
+}
+
+void qemu_cpu_exclusive_access(void)
+{
+}
+
 void vm_stop(int reason)
 {
     do_vm_stop(reason);
@@ -266,9 +291,23 @@ void vm_stop(int reason)
 #else /* CONFIG_IOTHREAD */
 
 #include "qemu-thread.h"
+#include "iolooper.h"
 
+/* SIGUSR1 and SIGUSR2 are taken by log rotation and tracing */
+#define SIG_IPI (SIGRTMIN + 4)
+
+/*
+ * The TCG thread only holds qemu_global_mutex while it is outside of
+ * generated code, or while a device emulates a guest MMIO access, see
+ * qemu_cpu_io_begin().  cpu_running_unlocked is only changed by that
+ * thread with the lock held, so other holders of the lock can trust it.
+ */
 QemuMutex qemu_global_mutex;
 static QemuMutex qemu_fair_mutex;
+static volatile int cpu_running_unlocked;
+
+/* the I/O thread is blocked in its looper with the lock released */
+static int io_thread_waiting;
 
 static QemuThread io_thread;
 
@@ -284,7 +323,6 @@ static QemuCond qemu_pause_cond;
 
 static void block_io_signals(void);
 static void unblock_io_signals(void);
-static int tcg_has_work(void);
 
 int qemu_init_main_loop(void)
 {
@@ -330,6 +368,7 @@ static void qemu_wait_io_event(CPUState *env)
 
 static int qemu_cpu_exec(CPUState *env);
 
+#if 0  /* only started by kvm_start_vcpu(), which is disabled too */
 static void *kvm_cpu_thread_fn(void *arg)
 {
     CPUState *env = arg;
@@ -354,8 +393,7 @@ static void *kvm_cpu_thread_fn(void *arg)
 
     return NULL;
 }
-
-static void tcg_cpu_exec(void);
+#endif
 
 static void *tcg_cpu_thread_fn(void *arg)
 {
@@ -386,13 +424,91 @@ void qemu_cpu_kick(void *_env)
 {
     CPUState *env = _env;
     qemu_cond_broadcast(env->halt_cond);
-    if (kvm_enabled() || hax_enabled())
-        qemu_thread_signal(env->thread, SIGUSR1);
+    if (kvm_enabled() || hax_enabled() || cpu_running_unlocked)
+        qemu_thread_signal(env->thread, SIG_IPI);
+    else
+        /* blocked on qemu_global_mutex, it will see the request next */
+        cpu_exit(env);
 }
 
-int qemu_cpu_self(void *env)
+int qemu_cpu_self(void *_env)
+{
+    CPUState *env = _env;
+    QemuThread this;
+
+    /* not started yet, the caller has it to itself */
+    if (env->thread == NULL)
+        return 1;
+
+    qemu_thread_self(&this);
+    return qemu_thread_equal(&this, env->thread);
+}
+
+/*
+ * Called with the lock held by everything that changes translated code or
+ * TLBs behind the back of the TCG thread: returns once that thread has
+ * left generated code.  It then waits for the lock, so it stays out until
+ * the caller releases it.
+ */
+void qemu_cpu_exclusive_access(void)
+{
+    QemuThread this;
+    int n;
+
+    if (tcg_cpu_thread == NULL || !cpu_running_unlocked)
+        return;
+
+    qemu_thread_self(&this);
+    if (qemu_thread_equal(&this, tcg_cpu_thread))
+        return;
+
+    for (n = 0; cpu_running_unlocked; n++) {
+        if ((n & 1023) == 0)
+            qemu_thread_signal(tcg_cpu_thread, SIG_IPI);
+        sched_yield();
+    }
+}
+
+/*
+ * Device emulation is entered from generated code without the lock;
+ * these take it for the duration of the MMIO access.
+ */
+void qemu_cpu_io_begin(void)
+{
+    cpu_running_unlocked = 0;
+    qemu_mutex_lock(&qemu_fair_mutex);
+    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_mutex_unlock(&qemu_fair_mutex);
+}
+
+void qemu_cpu_io_end(void)
+{
+    /* the device may have changed what the I/O thread is waiting for */
+    if (io_thread_waiting &&
+        iolooper_has_changes(qemu_iohandler_get_looper())) {
+        io_thread_waiting = 0;
+        qemu_event_increment();
+    }
+    cpu_running_unlocked = 1;
+    qemu_mutex_unlock(&qemu_global_mutex);
+}
+
+void qemu_main_loop_start(void)
+{
+    qemu_system_ready = 1;
+    qemu_cond_broadcast(&qemu_system_cond);
+}
+
+void qemu_main_loop_release(void)
+{
+    io_thread_waiting = 1;
+    qemu_mutex_unlock(&qemu_global_mutex);
+}
+
+void qemu_main_loop_acquire(void)
 {
-    return (cpu_single_env != NULL);
+    qemu_mutex_lock_iothread();
+    io_thread_waiting = 0;
 }
 
 static void cpu_signal(int sig)
@@ -407,18 +523,21 @@ static void block_io_signals(void)
     struct sigaction sigact;
 
     sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
     sigaddset(&set, SIGUSR2);
     sigaddset(&set, SIGIO);
     sigaddset(&set, SIGALRM);
     pthread_sigmask(SIG_BLOCK, &set, NULL);
 
+    /* faults on lazily restored RAM are handled with SIGSEGV */
     sigemptyset(&set);
-    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIG_IPI);
+    sigaddset(&set, SIGSEGV);
     pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 
     memset(&sigact, 0, sizeof(sigact));
     sigact.sa_handler = cpu_signal;
-    sigaction(SIGUSR1, &sigact, NULL);
+    sigaction(SIG_IPI, &sigact, NULL);
 }
 
 static void unblock_io_signals(void)
@@ -426,38 +545,26 @@ static void unblock_io_signals(void)
     sigset_t set;
 
     sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
     sigaddset(&set, SIGUSR2);
     sigaddset(&set, SIGIO);
     sigaddset(&set, SIGALRM);
     pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 
     sigemptyset(&set);
-    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIG_IPI);
     pthread_sigmask(SIG_BLOCK, &set, NULL);
 }
 
-static void qemu_signal_lock(unsigned int msecs)
+/* the TCG thread releases the lock while it runs guest code, so there is
+   no need to signal it out of cpu_exec() any more */
+void qemu_mutex_lock_iothread(void)
 {
     qemu_mutex_lock(&qemu_fair_mutex);
-
-    while (qemu_mutex_trylock(&qemu_global_mutex)) {
-        qemu_thread_signal(tcg_cpu_thread, SIGUSR1);
-        if (!qemu_mutex_timedlock(&qemu_global_mutex, msecs))
-            break;
-    }
+    qemu_mutex_lock(&qemu_global_mutex);
     qemu_mutex_unlock(&qemu_fair_mutex);
 }
 
-void qemu_mutex_lock_iothread(void)
-{
-    if (kvm_enabled() || hax_enabled()) {
-        qemu_mutex_lock(&qemu_fair_mutex);
-        qemu_mutex_lock(&qemu_global_mutex);
-        qemu_mutex_unlock(&qemu_fair_mutex);
-    } else
-        qemu_signal_lock(100);
-}
-
 void qemu_mutex_unlock_iothread(void)
 {
     qemu_mutex_unlock(&qemu_global_mutex);
@@ -482,7 +589,7 @@ void pause_all_vcpus(void)
 
     while (penv) {
         penv->stop = 1;
-        qemu_thread_signal(penv->thread, SIGUSR1);
+        qemu_thread_signal(penv->thread, SIG_IPI);
         qemu_cpu_kick(penv);
         penv = (CPUState *)penv->next_cpu;
     }
@@ -491,7 +598,7 @@ void pause_all_vcpus(void)
         qemu_cond_timedwait(&qemu_pause_cond, &qemu_global_mutex, 100);
         penv = first_cpu;
         while (penv) {
-            qemu_thread_signal(penv->thread, SIGUSR1);
+            qemu_thread_signal(penv->thread, SIG_IPI);
             penv = (CPUState *)penv->next_cpu;
         }
     }
@@ -504,7 +611,7 @@ void resume_all_vcpus(void)
     while (penv) {
         penv->stop = 0;
         penv->stopped = 0;
-        qemu_thread_signal(penv->thread, SIGUSR1);
+        qemu_thread_signal(penv->thread, SIG_IPI);
         qemu_cpu_kick(penv);
         penv = (CPUState *)penv->next_cpu;
     }
@@ -613,7 +720,15 @@ static int qemu_cpu_exec(CPUState *env)
 #endif
 
 
+#ifdef CONFIG_IOTHREAD
+    cpu_running_unlocked = 1;
+    qemu_mutex_unlock(&qemu_global_mutex);
+#endif
     ret = cpu_exec(env);
+#ifdef CONFIG_IOTHREAD
+    cpu_running_unlocked = 0;
+    qemu_mutex_lock(&qemu_global_mutex);
+#endif
 #ifdef CONFIG_PROFILER
     qemu_time += profile_getclock() - ti;
 #endif
@@ -639,9 +754,11 @@ void tcg_cpu_exec(void)
 
         if (!vm_running)
             break;
+#ifndef CONFIG_IOTHREAD
         if (qemu_timer_alarm_pending()) {
             break;
         }
+#endif
         if (cpu_can_run(env))
             ret = qemu_cpu_exec(env);
         if (ret == EXCP_DEBUG) {
@@ -650,5 +767,13 @@ void tcg_cpu_exec(void)
             break;
         }
     }
+
+    /* Every CPU is halted: use the time to translate code it is likely
+       to run next.  Keep the batch small so device events are not
+       delayed.  */
+    if (tb_prefetch_enabled && vm_running && !tcg_has_work() &&
+        !qemu_timer_alarm_pending()) {
+        tb_prefetch_run(first_cpu, 64);
+    }
 }
 
@@ -348,6 +348,16 @@ extern spinlock_t tb_lock;
 
 extern int tb_invalidated_flag;
 
+/* Indirect branches resolved by translated code through the virtual PC
+   cache without returning to cpu_exec, and those that fell back.  */
+extern uint64_t tb_lookup_hit_count;
+extern uint64_t tb_lookup_miss_count;
+
+/* Speculative translation of static successors while the CPUs idle.  */
+extern int tb_prefetch_enabled;
+void tb_prefetch_add(target_ulong pc, target_ulong cs_base, int flags);
+void tb_prefetch_run(CPUState *env, int max_tbs);
+
 #if !defined(CONFIG_USER_ONLY)
 
 void tlb_fill(target_ulong addr, int is_write, int mmu_idx,
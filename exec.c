@@ -47,6 +47,9 @@
 #ifdef CONFIG_MEMCHECK
 #include "memcheck/memcheck_api.h"
 #endif  // CONFIG_MEMCHECK
+#ifdef CONFIG_TRACE
+#include "android-trace.h"
+#endif
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -199,6 +202,9 @@ static int log_append = 0;
 static int tlb_flush_count;
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+uint64_t tb_lookup_hit_count;
+uint64_t tb_lookup_miss_count;
+static int tb_prefetch_count;
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
@@ -939,6 +945,141 @@ TranslationBlock *tb_gen_code(CPUState *env,
     return tb;
 }
 
+/* Speculative translation: the translator reports the static successors
+   of each block it generates, and they are translated while the CPUs are
+   idle so that their first execution does not stall in the translator.
+   TCG is not reentrant, so this runs on the CPU thread between calls to
+   cpu_exec() rather than in a thread of its own.  */
+#define TB_PREFETCH_QUEUE_SIZE 256
+#define TB_PREFETCH_MAX_DEPTH  4
+
+/* Targets whose blocks never run past the end of their first page can
+   say so, which lets blocks next to unmapped pages be translated.  */
+#ifndef TB_MAY_CROSS_PAGE
+#define TB_MAY_CROSS_PAGE(flags) 1
+#endif
+
+typedef struct TBPrefetchEntry {
+    target_ulong pc;
+    target_ulong cs_base;
+    int flags;
+    int depth;
+} TBPrefetchEntry;
+
+static TBPrefetchEntry tb_prefetch_queue[TB_PREFETCH_QUEUE_SIZE];
+static int tb_prefetch_head, tb_prefetch_tail;
+/* lookahead depth of the block being translated, 0 for real misses */
+static int tb_prefetch_depth;
+
+void tb_prefetch_add(target_ulong pc, target_ulong cs_base, int flags)
+{
+    TBPrefetchEntry *e;
+    int next;
+
+    if (!tb_prefetch_enabled || tb_prefetch_depth >= TB_PREFETCH_MAX_DEPTH)
+        return;
+#ifdef CONFIG_TRACE
+    /* the translator records every block it generates in the trace */
+    if (tracing)
+        return;
+#endif
+    next = (tb_prefetch_tail + 1) % TB_PREFETCH_QUEUE_SIZE;
+    if (next == tb_prefetch_head) {
+        /* full: drop the oldest request, recent code matters more */
+        tb_prefetch_head = (tb_prefetch_head + 1) % TB_PREFETCH_QUEUE_SIZE;
+    }
+    e = &tb_prefetch_queue[tb_prefetch_tail];
+    e->pc = pc;
+    e->cs_base = cs_base;
+    e->flags = flags;
+    e->depth = tb_prefetch_depth + 1;
+    tb_prefetch_tail = next;
+}
+
+#if !defined(CONFIG_USER_ONLY)
+/* Only code reachable without a TLB fill may be translated here: a fault
+   would longjmp out of cpu_exec() context we are not in.  */
+static int tb_prefetch_code_mapped(CPUState *env, target_ulong addr)
+{
+    int mmu_idx, page_index;
+
+    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    mmu_idx = cpu_mmu_index(env);
+    return env->tlb_table[mmu_idx][page_index].addr_code ==
+           (addr & TARGET_PAGE_MASK);
+}
+#else
+static int tb_prefetch_code_mapped(CPUState *env, target_ulong addr)
+{
+    return 1;
+}
+#endif
+
+static TranslationBlock *tb_prefetch_find(target_ulong pc,
+                                          target_ulong cs_base, int flags,
+                                          target_ulong phys_pc)
+{
+    TranslationBlock *tb;
+
+    tb = tb_phys_hash[tb_phys_hash_func(phys_pc)];
+    for (; tb != NULL; tb = tb->phys_hash_next) {
+        if (tb->pc == pc &&
+            tb->page_addr[0] == (phys_pc & TARGET_PAGE_MASK) &&
+            tb->cs_base == cs_base &&
+            tb->flags == flags)
+            return tb;
+    }
+    return NULL;
+}
+
+/* Translate up to 'max_tbs' queued blocks.  Must only be called while
+   no CPU is executing translated code.  */
+void tb_prefetch_run(CPUState *env, int max_tbs)
+{
+    TBPrefetchEntry e;
+    target_ulong phys_pc;
+    CPUState *saved_env;
+
+#ifdef CONFIG_TRACE
+    /* a speculative block would appear in the trace as if it had been
+       reached, and the queue may predate the flush that started tracing */
+    if (tracing) {
+        tb_prefetch_head = tb_prefetch_tail;
+        return;
+    }
+#endif
+    while (max_tbs > 0 && tb_prefetch_head != tb_prefetch_tail) {
+        e = tb_prefetch_queue[tb_prefetch_head];
+        tb_prefetch_head = (tb_prefetch_head + 1) % TB_PREFETCH_QUEUE_SIZE;
+
+        /* never let speculation be the reason for a cache flush */
+        if (nb_tbs >= code_gen_max_blocks - 1 ||
+            (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size) {
+            tb_prefetch_head = tb_prefetch_tail;
+            break;
+        }
+        if (!tb_prefetch_code_mapped(env, e.pc))
+            continue;
+        if (TB_MAY_CROSS_PAGE(e.flags) &&
+            !tb_prefetch_code_mapped(env, (e.pc & TARGET_PAGE_MASK) +
+                                          TARGET_PAGE_SIZE))
+            continue;
+        phys_pc = get_phys_addr_code(env, e.pc);
+        if (tb_prefetch_find(e.pc, e.cs_base, e.flags, phys_pc))
+            continue;
+
+        /* code fetches in the translator go through cpu_single_env */
+        saved_env = cpu_single_env;
+        cpu_single_env = env;
+        tb_prefetch_depth = e.depth;
+        tb_gen_code(env, e.pc, e.cs_base, e.flags, 0);
+        tb_prefetch_depth = 0;
+        cpu_single_env = saved_env;
+        tb_prefetch_count++;
+        max_tbs--;
+    }
+}
+
 /* invalidate all TBs which intersect with the target physical page
    starting in range [start;end[. NOTE: start and end must refer to
    the same physical page. 'is_cpu_write_access' should be true if called
@@ -1582,8 +1723,8 @@ void cpu_interrupt(CPUState *env, int mask)
 {
     int old_mask;
 
-    old_mask = env->interrupt_request;
-    env->interrupt_request |= mask;
+    /* the TCG thread may clear other bits at the same time */
+    old_mask = __sync_fetch_and_or(&env->interrupt_request, mask);
 
 #ifndef CONFIG_USER_ONLY
     /*
@@ -1611,7 +1752,7 @@ void cpu_interrupt(CPUState *env, int mask)
 
 void cpu_reset_interrupt(CPUState *env, int mask)
 {
-    env->interrupt_request &= ~mask;
+    __sync_fetch_and_and(&env->interrupt_request, ~mask);
 }
 
 void cpu_exit(CPUState *env)
@@ -1904,6 +2045,7 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
         abort();
     }
 
+    qemu_cpu_exclusive_access();
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         int mmu_idx;
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -2451,6 +2593,7 @@ void cpu_register_physical_memory_log(target_phys_addr_t start_addr,
     /* since each CPU stores ram addresses in its TLB cache, we must
        reset the modified entries */
     /* XXX: slow ! */
+    qemu_cpu_exclusive_access();
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         tlb_flush(env, 1);
     }
@@ -2730,6 +2873,9 @@ void *qemu_get_ram_ptr(ram_addr_t addr)
                 QLIST_REMOVE(block, next);
                 QLIST_INSERT_HEAD(&ram_list.blocks, block, next);
     }
+            if (unlikely(ram_lazy_active)) {
+                ram_lazy_fault(block->host + (addr - block->offset));
+            }
             return block->host + (addr - block->offset);
         }
     }
@@ -3258,11 +3404,10 @@ static void io_mem_init(void)
     cpu_register_io_memory_fixed(IO_MEM_ROM, error_mem_read, unassigned_mem_write, NULL);
     cpu_register_io_memory_fixed(IO_MEM_UNASSIGNED, unassigned_mem_read, unassigned_mem_write, NULL);
     cpu_register_io_memory_fixed(IO_MEM_NOTDIRTY, error_mem_read, notdirty_mem_write, NULL);
+    io_mem_watch = cpu_register_io_memory_fixed(IO_MEM_WATCH, watch_mem_read,
+                                                watch_mem_write, NULL);
     for (i=0; i<5; i++)
         io_mem_used[i] = 1;
-
-    io_mem_watch = cpu_register_io_memory(watch_mem_read,
-                                          watch_mem_write, NULL);
 }
 
 #endif /* !defined(CONFIG_USER_ONLY) */
@@ -3316,6 +3461,7 @@ static void invalidate_and_set_dirty(target_phys_addr_t addr,
 {
     if (!cpu_physical_memory_is_dirty(addr)) {
         /* invalidate code */
+        qemu_cpu_exclusive_access();
         tb_invalidate_phys_page_range(addr, addr + length, 0);
         /* set dirty bit */
         cpu_physical_memory_set_dirty_flags(addr, (0xff & ~CODE_DIRTY_FLAG));
@@ -3707,6 +3853,7 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
         if (unlikely(in_migration)) {
             if (!cpu_physical_memory_is_dirty(addr1)) {
                 /* invalidate code */
+                qemu_cpu_exclusive_access();
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
                 cpu_physical_memory_set_dirty_flags(
@@ -3942,6 +4089,13 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "indirect jump hits  %" PRIu64 " (%d%%) misses %" PRIu64 "\n",
+                tb_lookup_hit_count,
+                tb_lookup_hit_count + tb_lookup_miss_count ?
+                (int)(tb_lookup_hit_count * 100 /
+                      (tb_lookup_hit_count + tb_lookup_miss_count)) : 0,
+                tb_lookup_miss_count);
+    cpu_fprintf(f, "TB prefetch count   %d\n", tb_prefetch_count);
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -233,6 +233,10 @@ INLINE int get_float_exception_flags(float_status *status)
 {
     return STATUS(float_exception_flags);
 }
+INLINE int get_float_rounding_mode(float_status *status)
+{
+    return STATUS(float_rounding_mode);
+}
 #ifdef FLOATX80
 void set_floatx80_rounding_precision(int val STATUS_PARAM);
 #endif
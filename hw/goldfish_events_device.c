@@ -26,11 +26,27 @@ enum {
     REG_LEN         = 0x04,
     REG_DATA        = 0x08,
 
+    /* Batched reads: the guest gives the address and the size in bytes
+     * of a buffer for events, each a (type, code, value) triple of 32-bit
+     * words. Reading REG_BATCH_READ copies as many whole pending events
+     * as fit into it and returns their count. These registers are past
+     * the end of any page, so older devices read them as 0. */
+    REG_FEATURES        = 0x800,
+    REG_BATCH_ADDR_LOW  = 0x804,
+    REG_BATCH_ADDR_HIGH = 0x808,
+    REG_BATCH_SIZE      = 0x80c,
+    REG_BATCH_READ      = 0x810,
+
     PAGE_NAME       = 0x00000,
     PAGE_EVBITS     = 0x10000,
     PAGE_ABSDATA    = 0x20000 | EV_ABS,
 };
 
+/* bits of REG_FEATURES */
+enum {
+    EVENTS_FEATURE_BATCH = 0x00000001,
+};
+
 /* These corresponds to the state of the driver.
  * Unfortunately, we have to buffer events coming
  * from the UI, since the kernel driver is not
@@ -58,6 +74,10 @@ typedef struct
     unsigned last;
     unsigned state;
 
+    uint32_t batch_addr_low;
+    uint32_t batch_addr_high;
+    uint32_t batch_size;
+
     const char *name;
 
     struct {
@@ -83,8 +103,9 @@ typedef struct ABSEntry {
 
 /* modify this each time you change the events_device structure. you
  * will also need to upadte events_state_load and events_state_save
+ * 3: batched reads
  */
-#define  EVENTS_STATE_SAVE_VERSION  2
+#define  EVENTS_STATE_SAVE_VERSION  3
 
 #undef  QFIELD_STRUCT
 #define QFIELD_STRUCT  events_state
@@ -98,21 +119,40 @@ QFIELD_BEGIN(events_state_fields)
     QFIELD_INT32(state),
 QFIELD_END
 
+QFIELD_BEGIN(events_batch_fields)
+    QFIELD_INT32(batch_addr_low),
+    QFIELD_INT32(batch_addr_high),
+    QFIELD_INT32(batch_size),
+QFIELD_END
+
 static void  events_state_save(QEMUFile*  f, void*  opaque)
 {
     events_state*  s = opaque;
 
     qemu_put_struct(f, events_state_fields, s);
+    qemu_put_struct(f, events_batch_fields, s);
 }
 
 static int  events_state_load(QEMUFile*  f, void* opaque, int  version_id)
 {
     events_state*  s = opaque;
+    int  ret;
 
-    if (version_id != EVENTS_STATE_SAVE_VERSION)
+    if (version_id < 2 || version_id > EVENTS_STATE_SAVE_VERSION)
         return -1;
 
-    return qemu_get_struct(f, events_state_fields, s);
+    ret = qemu_get_struct(f, events_state_fields, s);
+    if (ret)
+        return ret;
+
+    /* the driver of an older snapshot reads events one word at a time */
+    if (version_id < 3) {
+        s->batch_addr_low = 0;
+        s->batch_addr_high = 0;
+        s->batch_size = 0;
+        return 0;
+    }
+    return qemu_get_struct(f, events_batch_fields, s);
 }
 
 static void enqueue_event(events_state *s, unsigned int type, unsigned int code, int value)
@@ -180,6 +220,42 @@ static unsigned dequeue_event(events_state *s)
     return n;
 }
 
+/* Copy as many whole events as fit into the guest's batch buffer, and
+ * return how many were copied.
+ */
+static unsigned dequeue_event_batch(events_state *s)
+{
+    uint32_t  buf[MAX_EVENTS];
+    uint64_t  addr = ((uint64_t)s->batch_addr_high << 32) | s->batch_addr_low;
+    unsigned  room = s->batch_size / (3 * sizeof(buf[0]));
+    unsigned  count, n, i;
+
+    count = ((s->last - s->first) & (MAX_EVENTS - 1)) / 3;
+    if (count > room)
+        count = room;
+    if (count == 0)
+        return 0;
+
+    n = count * 3;
+    for (i = 0; i < n; i++) {
+        buf[i] = s->events[s->first];
+        s->first = (s->first + 1) & (MAX_EVENTS - 1);
+    }
+    cpu_physical_memory_write(addr, (void*)buf, n * sizeof(buf[0]));
+
+    if (s->first == s->last) {
+        qemu_irq_lower(s->irq);
+    }
+#ifdef TARGET_I386
+    /* See dequeue_event() */
+    else {
+        qemu_irq_lower(s->irq);
+        qemu_irq_raise(s->irq);
+    }
+#endif
+    return count;
+}
+
 static int get_page_len(events_state *s)
 {
     int page = s->page;
@@ -231,6 +307,16 @@ static uint32_t events_read(void *x, target_phys_addr_t off)
         return dequeue_event(s);
     else if (offset == REG_LEN)
         return get_page_len(s);
+    else if (offset == REG_FEATURES)
+        return EVENTS_FEATURE_BATCH;
+    else if (offset == REG_BATCH_READ)
+        return dequeue_event_batch(s);
+    else if (offset == REG_BATCH_ADDR_LOW)
+        return s->batch_addr_low;
+    else if (offset == REG_BATCH_ADDR_HIGH)
+        return s->batch_addr_high;
+    else if (offset == REG_BATCH_SIZE)
+        return s->batch_size;
     else if (offset >= REG_DATA)
         return get_page_data(s, offset - REG_DATA);
     return 0; // this shouldn't happen, if the driver does the right thing
@@ -242,6 +328,12 @@ static void events_write(void *x, target_phys_addr_t off, uint32_t val)
     int offset = off; // - s->base;
     if (offset == REG_SET_PAGE)
         s->page = val;
+    else if (offset == REG_BATCH_ADDR_LOW)
+        s->batch_addr_low = val;
+    else if (offset == REG_BATCH_ADDR_HIGH)
+        s->batch_addr_high = val;
+    else if (offset == REG_BATCH_SIZE)
+        s->batch_size = val;
 }
 
 static CPUReadMemoryFunc *events_readfn[] = {
@@ -14,6 +14,7 @@
 #include "mmc.h"
 #include "sd.h"
 #include "block.h"
+#include "dma.h"
 
 enum {
     /* status register */
@@ -79,7 +80,9 @@ struct goldfish_mmc_state {
     uint32_t block_count;
     int is_SDHC;
 
-    uint8_t* buf;
+    // in-flight read or write, completion raises the interrupt
+    BlockDriverAIOCB *aiocb;
+    QEMUSGList sg;
 };
 
 #define  GOLDFISH_MMC_SAVE_VERSION  2
@@ -170,43 +173,48 @@ static const char* get_command_name(int command)
 }
 #endif
 
-static int  goldfish_mmc_bdrv_read(struct goldfish_mmc_state *s,
-                                   int64_t                    sector_number,
-                                   target_phys_addr_t         dst_address,
-                                   int                        num_sectors)
+static void goldfish_mmc_set_status(struct goldfish_mmc_state *s, int new_status)
 {
-    int  ret;
-
-    while (num_sectors > 0) {
-        ret = bdrv_read(s->bs, sector_number, s->buf, 1);
-        if (ret < 0)
-            return ret;
+    s->int_status |= new_status;
 
-        cpu_physical_memory_write(dst_address, s->buf, 512);
-        dst_address   += 512;
-        num_sectors   -= 1;
-        sector_number += 1;
+    if ((s->int_status & s->int_enable)) {
+        goldfish_device_set_irq(&s->dev, 0, (s->int_status & s->int_enable));
     }
-    return 0;
 }
 
-static int  goldfish_mmc_bdrv_write(struct goldfish_mmc_state *s,
-                                    int64_t                    sector_number,
-                                    target_phys_addr_t         dst_address,
-                                    int                        num_sectors)
+static void goldfish_mmc_bdrv_done(void *opaque, int ret)
 {
-    int  ret;
-
-    while (num_sectors > 0) {
-        cpu_physical_memory_read(dst_address, s->buf, 512);
+    struct goldfish_mmc_state *s = opaque;
 
-        ret = bdrv_write(s->bs, sector_number, s->buf, 1);
-        if (ret < 0)
-            return ret;
+    s->aiocb = NULL;
+    qemu_sglist_destroy(&s->sg);
+    goldfish_mmc_set_status(s, MMC_STAT_END_OF_CMD | MMC_STAT_END_OF_DATA);
+}
 
-        dst_address   += 512;
-        num_sectors   -= 1;
-        sector_number += 1;
+/* Transfers all blocks of a command directly between the image and guest
+ * memory in a single request. Returns 0 once the request is queued, in
+ * which case goldfish_mmc_bdrv_done() raises the command and data
+ * interrupts when it completes.
+ */
+static int  goldfish_mmc_bdrv_start(struct goldfish_mmc_state *s,
+                                    int64_t                    sector_number,
+                                    target_phys_addr_t         address,
+                                    int                        num_sectors,
+                                    int                        is_write)
+{
+    qemu_sglist_init(&s->sg, 1);
+    qemu_sglist_add(&s->sg, address, (target_phys_addr_t)num_sectors * 512);
+
+    if (is_write) {
+        s->aiocb = dma_bdrv_write(s->bs, &s->sg, sector_number,
+                                  goldfish_mmc_bdrv_done, s);
+    } else {
+        s->aiocb = dma_bdrv_read(s->bs, &s->sg, sector_number,
+                                 goldfish_mmc_bdrv_done, s);
+    }
+    if (s->aiocb == NULL) {
+        qemu_sglist_destroy(&s->sg);
+        return -EIO;
     }
     return 0;
 }
@@ -214,12 +222,17 @@ static int  goldfish_mmc_bdrv_write(struct goldfish_mmc_state *s,
 
 static void goldfish_mmc_do_command(struct goldfish_mmc_state *s, uint32_t cmd, uint32_t arg)
 {
-    int result;
     int new_status = MMC_STAT_END_OF_CMD;
     int opcode = cmd & 63;
 
 // fprintf(stderr, "goldfish_mmc_do_command opcode: %s (0x%04X), arg: %d\n", get_command_name(opcode), cmd, arg);
 
+    /* the driver waits for each transfer, but don't let a stray command
+     * overtake one that is still in flight */
+    if (s->aiocb) {
+        qemu_aio_flush();
+    }
+
     s->resp[0] = 0;
     s->resp[1] = 0;
     s->resp[2] = 0;
@@ -371,9 +384,10 @@ static void goldfish_mmc_do_command(struct goldfish_mmc_state *s, uint32_t cmd,
                 if (arg & 511) fprintf(stderr, "offset %d is not multiple of 512 when reading\n", arg);
                 arg /= s->block_length;
             }
-            result = goldfish_mmc_bdrv_read(s, arg, s->buffer_address, s->block_count);
-            new_status |= MMC_STAT_END_OF_DATA;
             s->resp[0] = SET_R1_CURRENT_STATE(4) | R1_READY_FOR_DATA; // 2304
+            if (goldfish_mmc_bdrv_start(s, arg, s->buffer_address, s->block_count, 0) == 0)
+                return;
+            new_status |= MMC_STAT_END_OF_DATA;
             break;
         }
 
@@ -388,11 +402,10 @@ static void goldfish_mmc_do_command(struct goldfish_mmc_state *s, uint32_t cmd,
                 if (arg & 511) fprintf(stderr, "offset %d is not multiple of 512 when writing\n", arg);
                 arg /= s->block_length;
             }
-            // arg is byte offset
-            result = goldfish_mmc_bdrv_write(s, arg, s->buffer_address, s->block_count);
-//            bdrv_flush(s->bs);
-            new_status |= MMC_STAT_END_OF_DATA;
             s->resp[0] = SET_R1_CURRENT_STATE(4) | R1_READY_FOR_DATA; // 2304
+            if (goldfish_mmc_bdrv_start(s, arg, s->buffer_address, s->block_count, 1) == 0)
+                return;
+            new_status |= MMC_STAT_END_OF_DATA;
             break;
         }
 
@@ -405,11 +418,7 @@ static void goldfish_mmc_do_command(struct goldfish_mmc_state *s, uint32_t cmd,
             break;
      }
 
-    s->int_status |= new_status;
-
-    if ((s->int_status & s->int_enable)) {
-        goldfish_device_set_irq(&s->dev, 0, (s->int_status & s->int_enable));
-    }
+    goldfish_mmc_set_status(s, new_status);
 }
 
 static uint32_t goldfish_mmc_read(void *opaque, target_phys_addr_t offset)
@@ -510,7 +519,6 @@ void goldfish_mmc_init(uint32_t base, int id, BlockDriverState* bs)
     s->dev.size = 0x1000;
     s->dev.irq_count = 1;
     s->bs = bs;
-    s->buf = qemu_memalign(512,512);
 
     goldfish_device_add(&s->dev, goldfish_mmc_readfn, goldfish_mmc_writefn, s);
 
@@ -269,6 +269,10 @@ static void trace_dev_write(void *opaque, target_phys_addr_t offset, uint32_t va
         cpu_single_env->exception_index = EXCP_HLT;
         cpu_single_env->halted = 1;
         qemu_system_shutdown_request();
+#ifdef CONFIG_IOTHREAD
+        /* does not return to io_write(), drop the lock it took */
+        qemu_cpu_io_end();
+#endif
         cpu_loop_exit();
         break;
 
@@ -71,6 +71,12 @@ void qemu_put_be64(QEMUFile *f, uint64_t v);
 void qemu_put_float(QEMUFile *f, float v);
 #endif
 int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size);
+int qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, int size);
+uint8_t *qemu_get_mapped_buffer(QEMUFile *f, int size);
+
+typedef struct QEMUFileMapping QEMUFileMapping;
+QEMUFileMapping *qemu_file_hold_mapping(QEMUFile *f);
+void qemu_file_release_mapping(QEMUFileMapping *m);
 int qemu_get_byte(QEMUFile *f);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
@@ -26,6 +26,7 @@
 #include "qemu-common.h"
 #include "qemu-char.h"
 #include "qemu-queue.h"
+#include "iolooper.h"
 
 #ifndef _WIN32
 #include <sys/wait.h>
@@ -37,13 +38,90 @@ typedef struct IOHandlerRecord {
     IOHandler *fd_read;
     IOHandler *fd_write;
     int deleted;
+    int events;     /* IOLOOPER_XXX flags watched in io_looper */
+    int polled;     /* linked in io_poll_handlers */
     void *opaque;
     QLIST_ENTRY(IOHandlerRecord) next;
+    QLIST_ENTRY(IOHandlerRecord) poll_next;
 } IOHandlerRecord;
 
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+/* the handlers that have a fd_read_poll callback */
+static QLIST_HEAD(, IOHandlerRecord) io_poll_handlers =
+    QLIST_HEAD_INITIALIZER(io_poll_handlers);
+
+/*
+ * The main loop waits on io_looper. A handler updates the events it is
+ * watched for when it is set, so that a wakeup only costs the number of
+ * ready descriptors; only the fd_read_poll callbacks, kept in
+ * io_poll_handlers, are evaluated on every iteration. io_handlers_fd maps a ready descriptor back to its
+ * handler, descriptors that are not found there belong to slirp.
+ */
+static IoLooper *io_looper;
+static IOHandlerRecord **io_handlers_fd;
+static int io_handlers_fd_size;
+static int io_handlers_deleted;
+
+IoLooper *qemu_iohandler_get_looper(void)
+{
+    if (!io_looper) {
+        io_looper = iolooper_new();
+    }
+    return io_looper;
+}
+
+static void qemu_iohandler_watch(IOHandlerRecord *ioh, int events)
+{
+    if (ioh->events != events) {
+        iolooper_modify(qemu_iohandler_get_looper(), ioh->fd,
+                        ioh->events, events);
+        ioh->events = events;
+    }
+}
+
+static void qemu_iohandler_map(IOHandlerRecord *ioh)
+{
+    int fd = ioh->fd;
+
+    if (fd >= io_handlers_fd_size) {
+        int size = io_handlers_fd_size * 2 + 64;
+
+        if (size <= fd) {
+            size = fd + 1;
+        }
+        io_handlers_fd = qemu_realloc(io_handlers_fd,
+                                      size * sizeof(*io_handlers_fd));
+        memset(io_handlers_fd + io_handlers_fd_size, 0,
+               (size - io_handlers_fd_size) * sizeof(*io_handlers_fd));
+        io_handlers_fd_size = size;
+    }
+    io_handlers_fd[fd] = ioh;
+}
+
+static void qemu_iohandler_set_polled(IOHandlerRecord *ioh, int polled)
+{
+    if (ioh->polled != polled) {
+        if (polled) {
+            QLIST_INSERT_HEAD(&io_poll_handlers, ioh, poll_next);
+        } else {
+            QLIST_REMOVE(ioh, poll_next);
+        }
+        ioh->polled = polled;
+    }
+}
+
+static void qemu_iohandler_free(IOHandlerRecord *ioh)
+{
+    if (ioh->fd < io_handlers_fd_size && io_handlers_fd[ioh->fd] == ioh) {
+        io_handlers_fd[ioh->fd] = NULL;
+    }
+    qemu_iohandler_set_polled(ioh, 0);
+    QLIST_REMOVE(ioh, next);
+    qemu_free(ioh);
+}
+
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -58,11 +136,19 @@ int qemu_set_fd_handler2(int fd,
     if (!fd_read && !fd_write) {
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
-                ioh->deleted = 1;
+                /* the descriptor is usually closed right after this */
+                qemu_iohandler_watch(ioh, 0);
+                qemu_iohandler_set_polled(ioh, 0);
+                if (!ioh->deleted) {
+                    ioh->deleted = 1;
+                    io_handlers_deleted++;
+                }
                 break;
             }
         }
     } else {
+        int events = 0;
+
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd)
                 goto found;
@@ -70,12 +156,27 @@ int qemu_set_fd_handler2(int fd,
         ioh = qemu_mallocz(sizeof(IOHandlerRecord));
         QLIST_INSERT_HEAD(&io_handlers, ioh, next);
     found:
+        if (ioh->deleted) {
+            io_handlers_deleted--;
+        }
         ioh->fd = fd;
         ioh->fd_read_poll = fd_read_poll;
         ioh->fd_read = fd_read;
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
         ioh->deleted = 0;
+        qemu_iohandler_map(ioh);
+        qemu_iohandler_set_polled(ioh, fd_read && fd_read_poll);
+
+        /* fd_read_poll is only evaluated before waiting, in
+           qemu_iohandler_prepare() */
+        if (fd_read && (!fd_read_poll || (ioh->events & IOLOOPER_READ))) {
+            events |= IOLOOPER_READ;
+        }
+        if (fd_write) {
+            events |= IOLOOPER_WRITE;
+        }
+        qemu_iohandler_watch(ioh, events);
     }
     return 0;
 }
@@ -125,10 +226,59 @@ void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int re
 
             /* Do this last in case read/write handlers marked it for deletion */
             if (ioh->deleted) {
-                QLIST_REMOVE(ioh, next);
-                qemu_free(ioh);
+                io_handlers_deleted--;
+                qemu_iohandler_free(ioh);
+            }
+        }
+    }
+}
+
+/* Updates the read interest of the handlers that have a fd_read_poll
+   callback, this must be called before waiting on the looper. */
+void qemu_iohandler_prepare(void)
+{
+    IOHandlerRecord *ioh;
+
+    QLIST_FOREACH(ioh, &io_poll_handlers, poll_next) {
+        int events = ioh->events & ~IOLOOPER_READ;
+
+        if (ioh->fd_read_poll(ioh->opaque) != 0) {
+            events |= IOLOOPER_READ;
+        }
+        qemu_iohandler_watch(ioh, events);
+    }
+}
+
+/* Runs the handlers of the descriptors reported by the last wait. */
+void qemu_iohandler_dispatch(int ret)
+{
+    IOHandlerRecord *ioh, *pioh;
+    int cursor = 0, fd, events;
+
+    if (ret > 0) {
+        while ((events = iolooper_next_ready(io_looper, &cursor, &fd)) != 0) {
+            if (fd >= io_handlers_fd_size ||
+                (ioh = io_handlers_fd[fd]) == NULL) {
+                continue;
+            }
+            if (!ioh->deleted && ioh->fd_read && (events & IOLOOPER_READ)) {
+                ioh->fd_read(ioh->opaque);
+            }
+            /* the read handler may have stopped watching for writes */
+            if (!ioh->deleted && ioh->fd_write &&
+                iolooper_is_write(io_looper, fd)) {
+                ioh->fd_write(ioh->opaque);
+            }
+        }
+    }
+
+    if (io_handlers_deleted > 0) {
+        QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
+            if (ioh->deleted) {
+                qemu_iohandler_free(ioh);
             }
         }
+        io_handlers_deleted = 0;
     }
 }
 
@@ -0,0 +1,529 @@
+#include "iolooper.h"
+#include "qemu-common.h"
+
+/* An implementation of iolooper.h based on Linux epoll()
+ *
+ * The epoll set is level-triggered so that a descriptor is reported after
+ * every wait for as long as it stays readable or writable, exactly like
+ * with the select() implementation. Unlike select(), the cost of a wait
+ * only depends on the number of descriptors that are ready, and there is
+ * no FD_SETSIZE limit.
+ *
+ * Changes of interest are only recorded in a per-descriptor table, and
+ * handed to the kernel at the start of the next wait, so that a descriptor
+ * whose interest is toggled several times between two waits only costs a
+ * single epoll_ctl() call, or none at all.
+ *
+ * A descriptor that was deleted (or dropped by iolooper_reset()) is always
+ * registered again from scratch, since it may have been closed and its
+ * number reused in the meantime.
+ *
+ * Descriptors that epoll does not support (regular files) are always
+ * ready for the operations they are watched for, as with select().
+ */
+#include <sys/epoll.h>
+#include "android/utils/system.h"
+#include "sockets.h"
+
+typedef struct {
+    unsigned  wanted;   /* IOLOOPER_XXX flags requested by the user */
+    unsigned  kernel;   /* flags currently registered with epoll */
+    unsigned  ready;    /* flags reported by the wait numbered 'serial' */
+    unsigned  serial;
+    int       cleared;  /* must be registered again from scratch */
+    int       forced;   /* not supported by epoll, always ready */
+    int       dirty;    /* listed in 'dirty_fds' */
+    int       index;    /* position in 'fds', or -1 */
+} IoLooperFd;
+
+struct IoLooper {
+    int                  epoll_fd;
+
+    IoLooperFd*          entries;      /* indexed by descriptor */
+    int                  max_entries;
+
+    int*                 fds;          /* descriptors known to this looper */
+    int                  num_fds;
+    int                  max_fds;
+
+    int*                 dirty_fds;    /* descriptors to sync with the kernel */
+    int                  num_dirty;
+    int                  max_dirty;
+
+    int                  num_active;   /* descriptors with wanted != 0 */
+    int                  num_forced;
+
+    struct epoll_event*  events;
+    int                  max_events;
+
+    int*                 ready_fds;    /* result of the last wait */
+    int                  num_ready;
+    int                  max_ready;
+    unsigned             serial;
+};
+
+static void
+iolooper_grow( int** parray, int* pmax, int count )
+{
+    if (count > *pmax) {
+        int  max = *pmax + (*pmax >> 1) + 16;
+        if (max < count)
+            max = count;
+        AARRAY_RENEW(*parray, max);
+        *pmax = max;
+    }
+}
+
+static IoLooperFd*
+iolooper_entry( IoLooper*  iol, int  fd )
+{
+    if (fd >= iol->max_entries) {
+        int  old = iol->max_entries;
+        int  max = old + (old >> 1) + 64;
+        if (max <= fd)
+            max = fd + 1;
+        AARRAY_RENEW(iol->entries, max);
+        for ( ; old < max; old++ ) {
+            IoLooperFd*  e = &iol->entries[old];
+            AZERO(e);
+            e->index = -1;
+        }
+        iol->max_entries = max;
+    }
+    return &iol->entries[fd];
+}
+
+IoLooper*
+iolooper_new(void)
+{
+    IoLooper*  iol;
+
+    ANEW0(iol);
+    iol->epoll_fd = epoll_create(64);
+    if (iol->epoll_fd >= 0)
+        fcntl(iol->epoll_fd, F_SETFD, FD_CLOEXEC);
+    return iol;
+}
+
+void
+iolooper_free( IoLooper*  iol )
+{
+    if (iol->epoll_fd >= 0)
+        close(iol->epoll_fd);
+    AFREE(iol->entries);
+    AFREE(iol->fds);
+    AFREE(iol->dirty_fds);
+    AFREE(iol->events);
+    AFREE(iol->ready_fds);
+    AFREE(iol);
+}
+
+static void
+iolooper_set_wanted( IoLooper*  iol, int  fd, unsigned  wanted )
+{
+    IoLooperFd*  e = iolooper_entry(iol, fd);
+
+    if (e->wanted == wanted)
+        return;
+
+    if (e->wanted == 0)
+        iol->num_active += 1;
+    else if (wanted == 0) {
+        iol->num_active -= 1;
+        e->cleared = 1;
+    }
+
+    e->wanted = wanted;
+
+    if (e->index < 0) {
+        iolooper_grow(&iol->fds, &iol->max_fds, iol->num_fds + 1);
+        e->index = iol->num_fds;
+        iol->fds[iol->num_fds++] = fd;
+    }
+    if (!e->dirty) {
+        iolooper_grow(&iol->dirty_fds, &iol->max_dirty, iol->num_dirty + 1);
+        iol->dirty_fds[iol->num_dirty++] = fd;
+        e->dirty = 1;
+    }
+}
+
+void
+iolooper_reset( IoLooper*  iol )
+{
+    int  nn;
+
+    for (nn = 0; nn < iol->num_fds; nn++)
+        iolooper_set_wanted(iol, iol->fds[nn], 0);
+}
+
+void
+iolooper_modify( IoLooper* iol, int fd, int oldflags, int newflags )
+{
+    if (fd < 0)
+        return;
+
+    int changed = oldflags ^ newflags;
+
+    if ((changed & IOLOOPER_READ) != 0) {
+        if ((newflags & IOLOOPER_READ) != 0)
+            iolooper_add_read(iol, fd);
+        else
+            iolooper_del_read(iol, fd);
+    }
+    if ((changed & IOLOOPER_WRITE) != 0) {
+        if ((newflags & IOLOOPER_WRITE) != 0)
+            iolooper_add_write(iol, fd);
+        else
+            iolooper_del_write(iol, fd);
+    }
+    if ((changed & IOLOOPER_EXCEPT) != 0) {
+        if ((newflags & IOLOOPER_EXCEPT) != 0)
+            iolooper_add_except(iol, fd);
+        else
+            iolooper_del_except(iol, fd);
+    }
+}
+
+void
+iolooper_add_read( IoLooper*  iol, int  fd )
+{
+    if (fd >= 0)
+        iolooper_set_wanted(iol, fd, iolooper_entry(iol, fd)->wanted | IOLOOPER_READ);
+}
+
+void
+iolooper_add_write( IoLooper*  iol, int  fd )
+{
+    if (fd >= 0)
+        iolooper_set_wanted(iol, fd, iolooper_entry(iol, fd)->wanted | IOLOOPER_WRITE);
+}
+
+void
+iolooper_add_except( IoLooper*  iol, int  fd )
+{
+    if (fd >= 0)
+        iolooper_set_wanted(iol, fd, iolooper_entry(iol, fd)->wanted | IOLOOPER_EXCEPT);
+}
+
+void
+iolooper_del_read( IoLooper*  iol, int  fd )
+{
+    if (fd >= 0 && fd < iol->max_entries)
+        iolooper_set_wanted(iol, fd, iol->entries[fd].wanted & ~IOLOOPER_READ);
+}
+
+void
+iolooper_del_write( IoLooper*  iol, int  fd )
+{
+    if (fd >= 0 && fd < iol->max_entries)
+        iolooper_set_wanted(iol, fd, iol->entries[fd].wanted & ~IOLOOPER_WRITE);
+}
+
+void
+iolooper_del_except( IoLooper*  iol, int  fd )
+{
+    if (fd >= 0 && fd < iol->max_entries)
+        iolooper_set_wanted(iol, fd, iol->entries[fd].wanted & ~IOLOOPER_EXCEPT);
+}
+
+static void
+iolooper_forget( IoLooper*  iol, int  fd )
+{
+    IoLooperFd*  e    = &iol->entries[fd];
+    int          last = iol->fds[--iol->num_fds];
+
+    iol->fds[e->index] = last;
+    iol->entries[last].index = e->index;
+    e->index   = -1;
+    e->cleared = 0;
+}
+
+static int
+iolooper_ctl( IoLooper*  iol, int  op, int  fd, unsigned  flags )
+{
+    struct epoll_event  ev;
+
+    ev.events   = 0;
+    ev.data.u64 = 0;
+    ev.data.fd  = fd;
+    if (flags & IOLOOPER_READ)
+        ev.events |= EPOLLIN;
+    if (flags & IOLOOPER_WRITE)
+        ev.events |= EPOLLOUT;
+    if (flags & IOLOOPER_EXCEPT)
+        ev.events |= EPOLLPRI;
+
+    return epoll_ctl(iol->epoll_fd, op, fd, &ev);
+}
+
+/* Hands the recorded changes of interest to the kernel */
+static int
+iolooper_sync( IoLooper*  iol )
+{
+    while (iol->num_dirty > 0) {
+        int          fd = iol->dirty_fds[iol->num_dirty-1];
+        IoLooperFd*  e  = &iol->entries[fd];
+        int          ret = 0;
+
+        if (e->forced && (e->wanted == 0 || e->cleared)) {
+            e->forced = 0;
+            e->kernel = 0;
+            iol->num_forced -= 1;
+        }
+
+        if (e->wanted == 0) {
+            if (e->kernel != 0)
+                iolooper_ctl(iol, EPOLL_CTL_DEL, fd, 0);
+            e->kernel = 0;
+            iolooper_forget(iol, fd);
+        } else if (e->forced) {
+            e->kernel = e->wanted;
+        } else if (e->kernel == 0 || e->cleared) {
+            ret = iolooper_ctl(iol, EPOLL_CTL_ADD, fd, e->wanted);
+            if (ret < 0 && errno == EEXIST)
+                ret = iolooper_ctl(iol, EPOLL_CTL_MOD, fd, e->wanted);
+        } else if (e->kernel != e->wanted) {
+            ret = iolooper_ctl(iol, EPOLL_CTL_MOD, fd, e->wanted);
+            if (ret < 0 && errno == ENOENT)
+                ret = iolooper_ctl(iol, EPOLL_CTL_ADD, fd, e->wanted);
+        }
+
+        if (ret < 0) {
+            if (errno != EPERM) {
+                /* e.g. EBADF, select() would fail in the same way.
+                 * Keep the entry dirty so that the next wait retries. */
+                return -1;
+            }
+            e->forced = 1;
+            iol->num_forced += 1;
+        }
+        if (e->wanted != 0) {
+            e->kernel  = e->wanted;
+            e->cleared = 0;
+        }
+        e->dirty = 0;
+        iol->num_dirty -= 1;
+    }
+    return 0;
+}
+
+static int
+iolooper_epoll( IoLooper*  iol, int  timeout_ms, int  restart,
+                void (*unlock)(void), void (*lock)(void) )
+{
+    int  count, nn, ret, err;
+
+    iol->serial += 1;
+    iol->num_ready = 0;
+
+    if (iol->epoll_fd < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (iolooper_sync(iol) < 0)
+        return -1;
+
+    if (iol->num_forced > 0)
+        timeout_ms = 0;
+
+    count = iol->num_fds;
+    if (count > iol->max_events) {
+        iol->max_events = count + (count >> 1);
+        AARRAY_RENEW(iol->events, iol->max_events);
+    }
+    iolooper_grow(&iol->ready_fds, &iol->max_ready, count);
+
+    /* only 'events' is used while the lock is released */
+    if (unlock)
+        unlock();
+    do {
+        ret = epoll_wait(iol->epoll_fd, iol->events, count, timeout_ms);
+    } while (ret < 0 && errno == EINTR && restart);
+    err = errno;
+    if (lock)
+        lock();
+
+    if (ret < 0) {
+        errno = err;
+        return ret;
+    }
+    iolooper_grow(&iol->ready_fds, &iol->max_ready, ret + iol->num_forced);
+
+    for (nn = 0; nn < ret; nn++) {
+        int          fd     = iol->events[nn].data.fd;
+        unsigned     events = iol->events[nn].events;
+        IoLooperFd*  e      = &iol->entries[fd];
+        unsigned     ready  = 0;
+
+        if (events & EPOLLIN)
+            ready |= IOLOOPER_READ;
+        if (events & EPOLLOUT)
+            ready |= IOLOOPER_WRITE;
+        if (events & EPOLLPRI)
+            ready |= IOLOOPER_EXCEPT;
+        /* select() reports errors and hang-ups as readable and writable */
+        if (events & (EPOLLERR|EPOLLHUP))
+            ready |= IOLOOPER_READ|IOLOOPER_WRITE;
+
+        ready &= e->wanted;
+        if (ready == 0)
+            continue;
+
+        e->ready  = ready;
+        e->serial = iol->serial;
+        iol->ready_fds[iol->num_ready++] = fd;
+    }
+
+    if (iol->num_forced > 0) {
+        for (nn = 0; nn < iol->num_fds; nn++) {
+            int          fd = iol->fds[nn];
+            IoLooperFd*  e  = &iol->entries[fd];
+
+            if (!e->forced || (e->wanted & (IOLOOPER_READ|IOLOOPER_WRITE)) == 0)
+                continue;
+
+            e->ready  = e->wanted & (IOLOOPER_READ|IOLOOPER_WRITE);
+            e->serial = iol->serial;
+            iol->ready_fds[iol->num_ready++] = fd;
+        }
+    }
+
+    return iol->num_ready;
+}
+
+int
+iolooper_poll( IoLooper*  iol )
+{
+    if (iol->num_active == 0)
+        return 0;
+
+    return iolooper_epoll(iol, 0, 1, NULL, NULL);
+}
+
+static int
+iolooper_wait_internal( IoLooper*  iol, int64_t  duration, int  restart,
+                        void (*unlock)(void), void (*lock)(void) )
+{
+    int  timeout, ret;
+
+    if (iol->num_active == 0)
+        return 0;
+
+    if (duration < 0)
+        timeout = -1;
+    else if (duration > INT_MAX)
+        timeout = INT_MAX;
+    else
+        timeout = (int)duration;
+
+    ret = iolooper_epoll(iol, timeout, restart, unlock, lock);
+    if (ret == 0) {
+        // Indicates timeout
+        errno = ETIMEDOUT;
+    }
+    return ret;
+}
+
+int
+iolooper_wait( IoLooper*  iol, int64_t  duration )
+{
+    return iolooper_wait_internal(iol, duration, 1, NULL, NULL);
+}
+
+int
+iolooper_wait_interruptible( IoLooper*  iol, int64_t  duration )
+{
+    return iolooper_wait_internal(iol, duration, 0, NULL, NULL);
+}
+
+int
+iolooper_wait_unlocked( IoLooper*  iol, int64_t  duration,
+                        void (*unlock)(void), void (*lock)(void) )
+{
+    return iolooper_wait_internal(iol, duration, 0, unlock, lock);
+}
+
+int
+iolooper_has_changes( IoLooper*  iol )
+{
+    return iol->num_dirty > 0;
+}
+
+
+static unsigned
+iolooper_ready( IoLooper*  iol, int  fd )
+{
+    IoLooperFd*  e;
+
+    if (fd < 0 || fd >= iol->max_entries)
+        return 0;
+
+    e = &iol->entries[fd];
+    if (e->serial != iol->serial)
+        return 0;
+
+    /* operations deleted since the wait are not reported anymore */
+    return e->ready & e->wanted;
+}
+
+int
+iolooper_is_read( IoLooper*  iol, int  fd )
+{
+    return (iolooper_ready(iol, fd) & IOLOOPER_READ) != 0;
+}
+
+int
+iolooper_is_write( IoLooper*  iol, int  fd )
+{
+    return (iolooper_ready(iol, fd) & IOLOOPER_WRITE) != 0;
+}
+
+int
+iolooper_is_except( IoLooper*  iol, int  fd )
+{
+    return (iolooper_ready(iol, fd) & IOLOOPER_EXCEPT) != 0;
+}
+
+int
+iolooper_next_ready( IoLooper*  iol, int*  pcursor, int*  pfd )
+{
+    int  nn;
+
+    for (nn = *pcursor; nn < iol->num_ready; nn++) {
+        unsigned  ready = iolooper_ready(iol, iol->ready_fds[nn]);
+        if (ready != 0) {
+            *pcursor = nn + 1;
+            *pfd     = iol->ready_fds[nn];
+            return ready;
+        }
+    }
+    *pcursor = nn;
+    return 0;
+}
+
+int
+iolooper_has_operations( IoLooper* iol )
+{
+    return iol->num_active > 0;
+}
+
+int64_t
+iolooper_now(void)
+{
+    struct timeval time_now;
+    return gettimeofday(&time_now, NULL) ? -1 : (int64_t)time_now.tv_sec * 1000LL +
+                                                time_now.tv_usec / 1000;
+}
+
+int
+iolooper_wait_absolute(IoLooper* iol, int64_t deadline)
+{
+    int64_t timeout = deadline - iolooper_now();
+
+    /* If the deadline has passed, set the timeout to 0, this allows us
+     * to poll the file descriptor nonetheless */
+    if (timeout < 0)
+        timeout = 0;
+
+    return iolooper_wait(iol, timeout);
+}
@@ -13,12 +13,25 @@
 struct IoLooper {
     fd_set   reads[1];
     fd_set   writes[1];
+    fd_set   excepts[1];
     fd_set   reads_result[1];
     fd_set   writes_result[1];
+    fd_set   excepts_result[1];
     int      max_fd;
     int      max_fd_valid;
+    int      result_count;
+    int      changed;
 };
 
+/* the sets are undefined after a failed select() */
+static void
+iolooper_clear_results( IoLooper*  iol )
+{
+    FD_ZERO(iol->reads_result);
+    FD_ZERO(iol->writes_result);
+    FD_ZERO(iol->excepts_result);
+}
+
 IoLooper*
 iolooper_new(void)
 {
@@ -38,13 +51,18 @@ iolooper_reset( IoLooper*  iol )
 {
     FD_ZERO(iol->reads);
     FD_ZERO(iol->writes);
+    FD_ZERO(iol->excepts);
+    iolooper_clear_results(iol);
+    iol->result_count = 0;
     iol->max_fd = -1;
     iol->max_fd_valid = 1;
+    iol->changed = 1;
 }
 
 static void
 iolooper_add_fd( IoLooper*  iol, int fd )
 {
+    iol->changed = 1;
     if (iol->max_fd_valid && fd > iol->max_fd) {
         iol->max_fd = fd;
     }
@@ -53,6 +71,7 @@ iolooper_add_fd( IoLooper*  iol, int fd )
 static void
 iolooper_del_fd( IoLooper*  iol, int fd )
 {
+    iol->changed = 1;
     if (iol->max_fd_valid && fd == iol->max_fd)
         iol->max_fd_valid = 0;
 }
@@ -77,6 +96,12 @@ iolooper_modify( IoLooper* iol, int fd, int oldflags, int newflags )
         else
             iolooper_del_write(iol, fd);
     }
+    if ((changed & IOLOOPER_EXCEPT) != 0) {
+        if ((newflags & IOLOOPER_EXCEPT) != 0)
+            iolooper_add_except(iol, fd);
+        else
+            iolooper_del_except(iol, fd);
+    }
 }
 
 
@@ -91,7 +116,8 @@ iolooper_fd_count( IoLooper*  iol )
 
     /* recompute max fd */
     for (fd = 0; fd < FD_SETSIZE; fd++) {
-        if (!FD_ISSET(fd, iol->reads) && !FD_ISSET(fd, iol->writes))
+        if (!FD_ISSET(fd, iol->reads) && !FD_ISSET(fd, iol->writes) &&
+            !FD_ISSET(fd, iol->excepts))
             continue;
 
         max_fd = fd;
@@ -120,12 +146,22 @@ iolooper_add_write( IoLooper*  iol, int  fd )
     }
 }
 
+void
+iolooper_add_except( IoLooper*  iol, int  fd )
+{
+    if (fd >= 0) {
+        iolooper_add_fd(iol, fd);
+        FD_SET(fd, iol->excepts);
+    }
+}
+
 void
 iolooper_del_read( IoLooper*  iol, int  fd )
 {
     if (fd >= 0) {
         iolooper_del_fd(iol, fd);
         FD_CLR(fd, iol->reads);
+        FD_CLR(fd, iol->reads_result);
     }
 }
 
@@ -135,6 +171,17 @@ iolooper_del_write( IoLooper*  iol, int  fd )
     if (fd >= 0) {
         iolooper_del_fd(iol, fd);
         FD_CLR(fd, iol->writes);
+        FD_CLR(fd, iol->writes_result);
+    }
+}
+
+void
+iolooper_del_except( IoLooper*  iol, int  fd )
+{
+    if (fd >= 0) {
+        iolooper_del_fd(iol, fd);
+        FD_CLR(fd, iol->excepts);
+        FD_CLR(fd, iol->excepts_result);
     }
 }
 
@@ -143,33 +190,36 @@ iolooper_poll( IoLooper*  iol )
 {
     int     count = iolooper_fd_count(iol);
     int     ret;
-    fd_set  errs;
 
     if (count == 0)
         return 0;
 
-    FD_ZERO(&errs);
-
     do {
         struct timeval  tv;
 
         tv.tv_sec = tv.tv_usec = 0;
 
-        iol->reads_result[0]  = iol->reads[0];
-        iol->writes_result[0] = iol->writes[0];
+        iol->reads_result[0]   = iol->reads[0];
+        iol->writes_result[0]  = iol->writes[0];
+        iol->excepts_result[0] = iol->excepts[0];
 
-        ret = select( count, iol->reads_result, iol->writes_result, &errs, &tv);
+        ret = select( count, iol->reads_result, iol->writes_result,
+                      iol->excepts_result, &tv);
     } while (ret < 0 && errno == EINTR);
 
+    if (ret < 0)
+        iolooper_clear_results(iol);
+
+    iol->result_count = (ret > 0) ? count : 0;
+
     return ret;
 }
 
-int
-iolooper_wait( IoLooper*  iol, int64_t  duration )
+static int
+iolooper_wait_internal( IoLooper*  iol, int64_t  duration, int  restart )
 {
     int     count = iolooper_fd_count(iol);
     int     ret;
-    fd_set  errs;
     struct timeval tm0, *tm = NULL;
 
     if (count == 0)
@@ -185,22 +235,101 @@ iolooper_wait( IoLooper*  iol, int64_t  duration )
         tm->tv_usec = (duration - 1000*tm->tv_sec) * 1000;
     }
 
-    FD_ZERO(&errs);
-
+    iol->changed = 0;
     do {
-        iol->reads_result[0]  = iol->reads[0];
-        iol->writes_result[0] = iol->writes[0];
+        iol->reads_result[0]   = iol->reads[0];
+        iol->writes_result[0]  = iol->writes[0];
+        iol->excepts_result[0] = iol->excepts[0];
 
-        ret = select( count, iol->reads_result, iol->writes_result, &errs, tm);
+        ret = select( count, iol->reads_result, iol->writes_result,
+                      iol->excepts_result, tm);
         if (ret == 0) {
             // Indicates timeout
             errno = ETIMEDOUT;
         }
-    } while (ret < 0 && errno == EINTR);
+    } while (ret < 0 && errno == EINTR && restart);
+
+    if (ret < 0)
+        iolooper_clear_results(iol);
+
+    iol->result_count = (ret > 0) ? count : 0;
 
     return ret;
 }
 
+int
+iolooper_wait( IoLooper*  iol, int64_t  duration )
+{
+    return iolooper_wait_internal(iol, duration, 1);
+}
+
+int
+iolooper_wait_interruptible( IoLooper*  iol, int64_t  duration )
+{
+    return iolooper_wait_internal(iol, duration, 0);
+}
+
+int
+iolooper_wait_unlocked( IoLooper*  iol, int64_t  duration,
+                        void (*unlock)(void), void (*lock)(void) )
+{
+    /* select() works on private copies, since the interest sets may be
+     * modified by other threads while the lock is released */
+    fd_set  reads[1], writes[1], excepts[1];
+    int     count = iolooper_fd_count(iol);
+    int     ret, err, fd;
+    struct timeval tm0, *tm = NULL;
+
+    if (count == 0)
+        return 0;
+
+    CLAMP_MAC_TIMEOUT(duration);
+
+    if (duration >= 0) {
+        tm = &tm0;
+        tm->tv_sec  = duration / 1000;
+        tm->tv_usec = (duration - 1000*tm->tv_sec) * 1000;
+    }
+
+    reads[0]   = iol->reads[0];
+    writes[0]  = iol->writes[0];
+    excepts[0] = iol->excepts[0];
+    iol->changed = 0;
+
+    unlock();
+    ret = select(count, reads, writes, excepts, tm);
+    err = errno;
+    lock();
+
+    if (ret <= 0) {
+        iolooper_clear_results(iol);
+        iol->result_count = 0;
+        errno = (ret == 0) ? ETIMEDOUT : err;
+        return ret;
+    }
+
+    for (fd = 0; fd < count; fd++) {
+        if (!FD_ISSET(fd, iol->reads))
+            FD_CLR(fd, reads);
+        if (!FD_ISSET(fd, iol->writes))
+            FD_CLR(fd, writes);
+        if (!FD_ISSET(fd, iol->excepts))
+            FD_CLR(fd, excepts);
+    }
+    iol->reads_result[0]   = reads[0];
+    iol->writes_result[0]  = writes[0];
+    iol->excepts_result[0] = excepts[0];
+    iol->result_count = count;
+
+    return ret;
+}
+
+int
+iolooper_has_changes( IoLooper*  iol )
+{
+    return iol->changed;
+}
+
 
 int
 iolooper_is_read( IoLooper*  iol, int  fd )
@@ -214,6 +343,37 @@ iolooper_is_write( IoLooper*  iol, int  fd )
     return FD_ISSET(fd, iol->writes_result);
 }
 
+int
+iolooper_is_except( IoLooper*  iol, int  fd )
+{
+    return FD_ISSET(fd, iol->excepts_result);
+}
+
+int
+iolooper_next_ready( IoLooper*  iol, int*  pcursor, int*  pfd )
+{
+    int  fd;
+
+    for (fd = *pcursor; fd < iol->result_count; fd++) {
+        int  flags = 0;
+
+        if (FD_ISSET(fd, iol->reads_result))
+            flags |= IOLOOPER_READ;
+        if (FD_ISSET(fd, iol->writes_result))
+            flags |= IOLOOPER_WRITE;
+        if (FD_ISSET(fd, iol->excepts_result))
+            flags |= IOLOOPER_EXCEPT;
+
+        if (flags != 0) {
+            *pcursor = fd + 1;
+            *pfd     = fd;
+            return flags;
+        }
+    }
+    *pcursor = fd;
+    return 0;
+}
+
 int
 iolooper_has_operations( IoLooper* iol )
 {
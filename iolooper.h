@@ -3,7 +3,12 @@
 
 #include <stdint.h>
 
-/* An IOLooper is an abstraction for select() */
+/* An IOLooper is an abstraction for select()
+ *
+ * iolooper-select.c implements it with select(), iolooper-epoll.c with
+ * the Linux epoll() interface. Both report a descriptor as long as it
+ * is ready (level-triggered), for the operations it is watched for.
+ */
 
 typedef struct IoLooper  IoLooper;
 
@@ -15,10 +20,14 @@ void       iolooper_add_read( IoLooper*  iol, int  fd );
 void       iolooper_add_write( IoLooper*  iol, int  fd );
 void       iolooper_del_read( IoLooper*  iol, int  fd );
 void       iolooper_del_write( IoLooper*  iol, int  fd );
+/* Exceptional conditions, i.e. urgent (out-of-band) data on TCP sockets */
+void       iolooper_add_except( IoLooper*  iol, int  fd );
+void       iolooper_del_except( IoLooper*  iol, int  fd );
 
 enum {
     IOLOOPER_READ = (1<<0),
     IOLOOPER_WRITE = (1<<1),
+    IOLOOPER_EXCEPT = (1<<2),
 };
 void       iolooper_modify( IoLooper*  iol, int fd, int oldflags, int newflags);
 
@@ -29,9 +38,38 @@ int        iolooper_poll( IoLooper*  iol );
  *  errno set to ETIMEDOUT.
  */
 int        iolooper_wait( IoLooper*  iol, int64_t  duration );
+/* Same as iolooper_wait(), but returns -1 with errno set to EINTR when a
+ * signal is caught, instead of waiting again. Used by the main loop, which
+ * must run the timers as soon as the alarm signal is delivered. */
+int        iolooper_wait_interruptible( IoLooper*  iol, int64_t  duration );
+/* Same as iolooper_wait_interruptible(), but calls unlock() just before
+ * blocking in the kernel and lock() right after, so that other threads
+ * holding the same lock may change the interest of the looper while it
+ * waits. Operations deleted in the meantime are not reported. */
+int        iolooper_wait_unlocked( IoLooper*  iol, int64_t  duration,
+                                   void (*unlock)(void), void (*lock)(void) );
+/* Returns 1 if the interest of the looper was changed since the current or
+ * last wait started, i.e. if a thread blocked in iolooper_wait_unlocked()
+ * must be woken up to take the change into account. */
+int        iolooper_has_changes( IoLooper*  iol );
 
 int        iolooper_is_read( IoLooper*  iol, int  fd );
 int        iolooper_is_write( IoLooper*  iol, int  fd );
+int        iolooper_is_except( IoLooper*  iol, int  fd );
+/* Note that the iolooper_is_XXX() functions do not report an operation that
+ * was deleted after the last wait, so that a handler can stop the processing
+ * of pending events for a descriptor it is about to shut down. */
+/* Enumerates the descriptors reported by the last iolooper_poll() or
+ * iolooper_wait(), without probing every watched descriptor.
+ * Param:
+ *  iol IoLooper instance.
+ *  pcursor Iteration state, must be set to 0 before the first call.
+ *  pfd Receives the next ready descriptor.
+ * Return:
+ *  The IOLOOPER_XXX flags of *pfd, or 0 when there are no more ready
+ *  descriptors.
+ */
+int        iolooper_next_ready( IoLooper*  iol, int*  pcursor, int*  pfd );
 /* Returns 1 if this IoLooper has one or more file descriptor to interact with */
 int        iolooper_has_operations( IoLooper*  iol );
 /* Gets current time in milliseconds.
@@ -0,0 +1,346 @@
+/*
+ * Linux native AIO support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "qemu-aio.h"
+#include "block_int.h"
+#include "block/raw-posix-aio.h"
+
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/aio_abi.h>
+
+/*
+ * The kernel interface is used directly through syscall() rather than
+ * through libaio, which is not part of the host toolchains we build with.
+ *
+ * New requests are queued and handed to the kernel together, in one
+ * io_submit() call, from a bottom half or from the AIO flush handler when
+ * a synchronous request is waiting in a nested async context. Completions
+ * are signalled through an eventfd registered with the AIO handlers.
+ */
+
+#define MAX_EVENTS 128
+
+struct qemu_laiocb {
+    BlockDriverAIOCB common;
+    struct qemu_laio_state *ctx;
+    struct iocb iocb;
+    ssize_t ret;
+    size_t nbytes;
+    int cancelled;
+    int async_context_id;
+    QSIMPLEQ_ENTRY(qemu_laiocb) pending;
+    QLIST_ENTRY(qemu_laiocb) node;
+};
+
+struct qemu_laio_state {
+    aio_context_t ctx;
+    int efd;
+    /* requests queued, in flight or waiting for their callback */
+    int count;
+    /* requests owned by the kernel */
+    int in_flight;
+    QEMUBH *submit_bh;
+    QSIMPLEQ_HEAD(, qemu_laiocb) pending_reqs;
+    QLIST_HEAD(, qemu_laiocb) completed_reqs;
+};
+
+static int laio_setup(unsigned nr_events, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr_events, ctx);
+}
+
+static int laio_io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int laio_io_getevents(aio_context_t ctx, long min_nr, long nr,
+                             struct io_event *events, struct timespec *ts)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, ts);
+}
+
+static int laio_io_cancel(aio_context_t ctx, struct iocb *iocb,
+                          struct io_event *result)
+{
+    return syscall(__NR_io_cancel, ctx, iocb, result);
+}
+
+static void qemu_laio_process_completion(struct qemu_laio_state *s,
+    struct qemu_laiocb *laiocb)
+{
+    int ret;
+
+    s->count--;
+    laiocb->common.bs->aio_queue_depth--;
+
+    ret = laiocb->ret;
+    if (ret == laiocb->nbytes) {
+        ret = 0;
+    } else if (ret >= 0) {
+        ret = -EINVAL;
+    }
+    if (!laiocb->cancelled) {
+        laiocb->common.cb(laiocb->common.opaque, ret);
+    }
+
+    qemu_aio_release(laiocb);
+}
+
+/*
+ * All requests are completed in the async context that submitted them,
+ * like posix-aio-compat does; others are deferred to the process_queue
+ * handler.
+ */
+static void qemu_laio_enqueue_completed(struct qemu_laio_state *s,
+    struct qemu_laiocb *laiocb)
+{
+    if (laiocb->async_context_id == get_async_context_id()) {
+        qemu_laio_process_completion(s, laiocb);
+    } else {
+        QLIST_INSERT_HEAD(&s->completed_reqs, laiocb, node);
+    }
+}
+
+/* Hands as many queued requests to the kernel as it has room for. */
+static void qemu_laio_submit_pending(struct qemu_laio_state *s)
+{
+    struct iocb *iocbs[MAX_EVENTS];
+    struct qemu_laiocb *laiocb;
+    int i, n, ret;
+
+    while (!QSIMPLEQ_EMPTY(&s->pending_reqs) && s->in_flight < MAX_EVENTS) {
+        n = 0;
+        QSIMPLEQ_FOREACH(laiocb, &s->pending_reqs, pending) {
+            if (s->in_flight + n == MAX_EVENTS) {
+                break;
+            }
+            iocbs[n++] = &laiocb->iocb;
+        }
+
+        ret = laio_io_submit(s->ctx, n, iocbs);
+        if (ret < 0 && errno == EAGAIN) {
+            /* retried once in-flight requests complete */
+            break;
+        }
+        if (ret < 0) {
+            /* the first request is bad, fail it and go on with the rest */
+            laiocb = QSIMPLEQ_FIRST(&s->pending_reqs);
+            QSIMPLEQ_REMOVE_HEAD(&s->pending_reqs, pending);
+            laiocb->ret = -errno;
+            qemu_laio_enqueue_completed(s, laiocb);
+            continue;
+        }
+
+        for (i = 0; i < ret; i++) {
+            QSIMPLEQ_REMOVE_HEAD(&s->pending_reqs, pending);
+        }
+        s->in_flight += ret;
+    }
+}
+
+static void qemu_laio_submit_bh(void *opaque)
+{
+    qemu_laio_submit_pending(opaque);
+}
+
+static void qemu_laio_completion_cb(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+
+    while (1) {
+        struct io_event events[MAX_EVENTS];
+        uint64_t val;
+        ssize_t ret;
+        struct timespec ts = { 0 };
+        int nevents, i;
+
+        do {
+            ret = read(s->efd, &val, sizeof(val));
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == -1 && errno == EAGAIN) {
+            break;
+        }
+
+        if (ret != 8) {
+            break;
+        }
+
+        do {
+            nevents = laio_io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
+        } while (nevents == -1 && errno == EINTR);
+
+        for (i = 0; i < nevents; i++) {
+            struct iocb *iocb = (struct iocb *)(uintptr_t)events[i].obj;
+            struct qemu_laiocb *laiocb =
+                    container_of(iocb, struct qemu_laiocb, iocb);
+
+            s->in_flight--;
+            laiocb->ret = events[i].res;
+            qemu_laio_enqueue_completed(s, laiocb);
+        }
+    }
+
+    /* room was freed up for requests that did not fit before */
+    qemu_laio_submit_pending(s);
+}
+
+static int qemu_laio_flush_cb(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+
+    /* the submit bottom half may belong to an outer async context */
+    qemu_laio_submit_pending(s);
+
+    return (s->count > 0) ? 1 : 0;
+}
+
+static int qemu_laio_process_requests(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    struct qemu_laiocb *laiocb, *next;
+    int res = 0;
+
+    QLIST_FOREACH_SAFE (laiocb, &s->completed_reqs, node, next) {
+        if (laiocb->async_context_id == get_async_context_id()) {
+            QLIST_REMOVE(laiocb, node);
+            qemu_laio_process_completion(s, laiocb);
+            res = 1;
+        }
+    }
+
+    return res;
+}
+
+static void laio_cancel(BlockDriverAIOCB *blockacb)
+{
+    struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
+    struct qemu_laiocb *p;
+    struct io_event event;
+
+    /* still queued: the kernel has never seen it */
+    QSIMPLEQ_FOREACH(p, &s->pending_reqs, pending) {
+        if (p == laiocb) {
+            QSIMPLEQ_REMOVE(&s->pending_reqs, laiocb, qemu_laiocb, pending);
+            s->count--;
+            laiocb->common.bs->aio_queue_depth--;
+            qemu_aio_release(laiocb);
+            return;
+        }
+    }
+
+    laiocb->cancelled = 1;
+    if (laiocb->ret != -EINPROGRESS) {
+        /* completed, waiting in completed_reqs for its context */
+        return;
+    }
+
+    if (laio_io_cancel(s->ctx, &laiocb->iocb, &event) == 0) {
+        /* no completion event will be posted for it */
+        s->in_flight--;
+        s->count--;
+        laiocb->common.bs->aio_queue_depth--;
+        qemu_aio_release(laiocb);
+        return;
+    }
+
+    /*
+     * The kernel could not cancel the request, so we have to wait for it;
+     * the callback has been suppressed above.
+     */
+    while (laiocb->ret == -EINPROGRESS) {
+        qemu_laio_completion_cb(s);
+    }
+}
+
+static AIOPool laio_pool = {
+    .aiocb_size         = sizeof(struct qemu_laiocb),
+    .cancel             = laio_cancel,
+};
+
+BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    struct qemu_laio_state *s = aio_ctx;
+    struct qemu_laiocb *laiocb;
+    struct iocb *iocb;
+    off_t offset = sector_num * 512;
+
+    laiocb = qemu_aio_get(&laio_pool, bs, cb, opaque);
+    if (!laiocb)
+        return NULL;
+    laiocb->nbytes = nb_sectors * 512;
+    laiocb->ctx = s;
+    laiocb->ret = -EINPROGRESS;
+    laiocb->cancelled = 0;
+    laiocb->async_context_id = get_async_context_id();
+
+    iocb = &laiocb->iocb;
+    memset(iocb, 0, sizeof(*iocb));
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        iocb->aio_lio_opcode = IOCB_CMD_PWRITEV;
+        break;
+    case QEMU_AIO_READ:
+        iocb->aio_lio_opcode = IOCB_CMD_PREADV;
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        qemu_aio_release(laiocb);
+        return NULL;
+    }
+    iocb->aio_fildes = fd;
+    iocb->aio_buf = (uintptr_t)qiov->iov;
+    iocb->aio_nbytes = qiov->niov;
+    iocb->aio_offset = offset;
+    iocb->aio_data = (uintptr_t)laiocb;
+    iocb->aio_flags = IOCB_FLAG_RESFD;
+    iocb->aio_resfd = s->efd;
+
+    s->count++;
+    if (++bs->aio_queue_depth > bs->aio_max_queue_depth) {
+        bs->aio_max_queue_depth = bs->aio_queue_depth;
+    }
+    QSIMPLEQ_INSERT_TAIL(&s->pending_reqs, laiocb, pending);
+    qemu_bh_schedule(s->submit_bh);
+
+    return &laiocb->common;
+}
+
+void *laio_init(void)
+{
+    struct qemu_laio_state *s;
+
+    s = qemu_mallocz(sizeof(*s));
+    QLIST_INIT(&s->completed_reqs);
+    QSIMPLEQ_INIT(&s->pending_reqs);
+    s->efd = eventfd(0, 0);
+    if (s->efd == -1)
+        goto out_free_state;
+    fcntl(s->efd, F_SETFL, O_NONBLOCK);
+
+    if (laio_setup(MAX_EVENTS, &s->ctx) != 0)
+        goto out_close_efd;
+
+    s->submit_bh = qemu_bh_new(qemu_laio_submit_bh, s);
+
+    qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
+        qemu_laio_flush_cb, qemu_laio_process_requests, s);
+
+    return s;
+
+out_close_efd:
+    close(s->efd);
+out_free_state:
+    qemu_free(s);
+    return NULL;
+}
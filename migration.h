@@ -108,5 +108,7 @@ uint64_t ram_bytes_total(void);
 
 int ram_save_live(QEMUFile *f, int stage, void *opaque);
 int ram_load(QEMUFile *f, void *opaque, int version_id);
+void ram_lazy_start(void);
+void ram_lazy_flush(void);
 
 #endif
@@ -336,6 +336,24 @@ static void do_info_name(Monitor *mon)
         monitor_printf(mon, "%s\n", qemu_name);
 }
 
+static void do_info_block(Monitor *mon)
+{
+    QObject *data;
+
+    bdrv_info(mon, &data);
+    bdrv_info_print(mon, data);
+    qobject_decref(data);
+}
+
+static void do_info_blockstats(Monitor *mon)
+{
+    QObject *data;
+
+    bdrv_info_stats(mon, &data);
+    bdrv_stats_print(mon, data);
+    qobject_decref(data);
+}
+
 #if defined(TARGET_I386)
 static void do_info_hpet(Monitor *mon)
 {
@@ -1673,9 +1691,9 @@ static const mon_cmd_t info_cmds[] = {
       "", "show the network state" },
     { "chardev", "", qemu_chr_info,
       "", "show the character devices" },
-    { "block", "", bdrv_info,
+    { "block", "", do_info_block,
       "", "show the block devices" },
-    { "blockstats", "", bdrv_info_stats,
+    { "blockstats", "", do_info_blockstats,
       "", "show block device statistics" },
     { "registers", "", do_info_registers,
       "", "show the cpu registers" },
@@ -1717,6 +1735,8 @@ static const mon_cmd_t info_cmds[] = {
       "", "show capture information" },
     { "snapshots", "", do_info_snapshots,
       "", "show the currently saved VM snapshots" },
+    { "savevm", "", do_info_savevm,
+      "", "show where the time went in the last VM state save" },
     { "status", "", do_info_status,
       "", "show the current VM status (running|paused)" },
     { "pcmcia", "", pcmcia_info,
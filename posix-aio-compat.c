@@ -58,6 +58,19 @@ typedef struct PosixAioState {
     struct qemu_paiocb *first_aio;
 } PosixAioState;
 
+/* per worker thread state, reused across requests */
+typedef struct PosixAioThread {
+    char *bounce;
+    size_t bounce_size;
+    struct iovec *iov;
+} PosixAioThread;
+
+/* the most requests handled by a single system call */
+#define MAX_MERGE_REQS      32
+
+/* bounce buffers bigger than this are not kept around between requests */
+#define MAX_BOUNCE_KEEP     (1024 * 1024)
+
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
@@ -231,7 +244,29 @@ static ssize_t handle_aiocb_rw_linear(struct qemu_paiocb *aiocb, char *buf)
     return offset;
 }
 
-static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
+static char *paio_bounce_get(PosixAioThread *t, BlockDriverState *bs,
+                             size_t size)
+{
+    size_t align = (bs && bs->buffer_alignment) ? bs->buffer_alignment : 512;
+
+    if (t->bounce_size < size || ((uintptr_t)t->bounce & (align - 1))) {
+        qemu_vfree(t->bounce);
+        t->bounce = qemu_blockalign(bs, size);
+        t->bounce_size = size;
+    }
+    return t->bounce;
+}
+
+static void paio_bounce_put(PosixAioThread *t)
+{
+    if (t->bounce_size > MAX_BOUNCE_KEEP) {
+        qemu_vfree(t->bounce);
+        t->bounce = NULL;
+        t->bounce_size = 0;
+    }
+}
+
+static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb, PosixAioThread *t)
 {
     ssize_t nbytes;
     char *buf;
@@ -270,7 +305,7 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
      * Ok, we have to do it the hard way, copy all segments into
      * a single aligned buffer.
      */
-    buf = qemu_blockalign(aiocb->common.bs, aiocb->aio_nbytes);
+    buf = paio_bounce_get(t, aiocb->common.bs, aiocb->aio_nbytes);
     if (aiocb->aio_type & QEMU_AIO_WRITE) {
         char *p = buf;
         int i;
@@ -296,13 +331,100 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
             count -= copy;
         }
     }
-    qemu_vfree(buf);
+    paio_bounce_put(t);
 
     return nbytes;
 }
 
+/*
+ * Moves queued requests that continue 'aiocb' on disk into 'batch', so
+ * that they can be handled with a single system call. Requests are only
+ * merged with others of the same type and alignment, and never across a
+ * queued flush. Called with the lock held.
+ */
+static int paio_merge(struct qemu_paiocb *aiocb, struct qemu_paiocb **batch)
+{
+    struct qemu_paiocb *next;
+    off_t end = aiocb->aio_offset + aiocb->aio_nbytes;
+    int niov = aiocb->aio_niov;
+    int n = 1, found;
+
+    batch[0] = aiocb;
+    if (!(aiocb->aio_type & (QEMU_AIO_READ | QEMU_AIO_WRITE))) {
+        return 1;
+    }
+
+    do {
+        found = 0;
+        QTAILQ_FOREACH(next, &request_list, node) {
+            if (next->aio_type & QEMU_AIO_FLUSH) {
+                break;
+            }
+            if (next->aio_fildes == aiocb->aio_fildes &&
+                next->aio_type == aiocb->aio_type &&
+                next->aio_offset == end &&
+                niov + next->aio_niov <= IOV_MAX) {
+                QTAILQ_REMOVE(&request_list, next, node);
+                next->active = 1;
+                batch[n++] = next;
+                end += next->aio_nbytes;
+                niov += next->aio_niov;
+                found = 1;
+                break;
+            }
+        }
+    } while (found && n < MAX_MERGE_REQS);
+
+    if (n > 1) {
+        aiocb->common.bs->aio_merged_reqs += n - 1;
+    }
+    return n;
+}
+
+/*
+ * Handles the requests in 'batch' as one, and splits the result between
+ * them in order: a short transfer completes the leading requests.
+ */
+static void handle_aiocb_rw_batch(struct qemu_paiocb **batch, int n,
+                                  PosixAioThread *t)
+{
+    struct qemu_paiocb merged = *batch[0];
+    ssize_t ret, len;
+    int i;
+
+    if (!t->iov) {
+        t->iov = qemu_malloc(IOV_MAX * sizeof(struct iovec));
+    }
+
+    merged.aio_iov = t->iov;
+    merged.aio_niov = 0;
+    merged.aio_nbytes = 0;
+    for (i = 0; i < n; i++) {
+        memcpy(t->iov + merged.aio_niov, batch[i]->aio_iov,
+               batch[i]->aio_niov * sizeof(struct iovec));
+        merged.aio_niov += batch[i]->aio_niov;
+        merged.aio_nbytes += batch[i]->aio_nbytes;
+    }
+
+    ret = handle_aiocb_rw(&merged, t);
+
+    mutex_lock(&lock);
+    for (i = 0; i < n; i++) {
+        if (ret < 0) {
+            batch[i]->ret = ret;
+            continue;
+        }
+        len = MIN(ret, batch[i]->aio_nbytes);
+        batch[i]->ret = len;
+        ret -= len;
+    }
+    mutex_unlock(&lock);
+}
+
 static void *aio_thread(void *unused)
 {
+    PosixAioThread t = { NULL, 0, NULL };
+    struct qemu_paiocb *batch[MAX_MERGE_REQS];
     pid_t pid;
 
     pid = getpid();
@@ -310,6 +432,7 @@ static void *aio_thread(void *unused)
     while (1) {
         struct qemu_paiocb *aiocb;
         ssize_t ret = 0;
+        int n;
         qemu_timeval tv;
         struct timespec ts;
 
@@ -330,13 +453,25 @@ static void *aio_thread(void *unused)
         aiocb = QTAILQ_FIRST(&request_list);
         QTAILQ_REMOVE(&request_list, aiocb, node);
         aiocb->active = 1;
+        n = paio_merge(aiocb, batch);
         idle_threads--;
         mutex_unlock(&lock);
 
+        if (n > 1) {
+            handle_aiocb_rw_batch(batch, n, &t);
+
+            mutex_lock(&lock);
+            idle_threads++;
+            mutex_unlock(&lock);
+
+            if (kill(pid, aiocb->ev_signo)) die("kill failed");
+            continue;
+        }
+
         switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
         case QEMU_AIO_READ:
         case QEMU_AIO_WRITE:
-            ret = handle_aiocb_rw(aiocb);
+            ret = handle_aiocb_rw(aiocb, &t);
             break;
         case QEMU_AIO_FLUSH:
             ret = handle_aiocb_flush(aiocb);
@@ -362,6 +497,8 @@ static void *aio_thread(void *unused)
     cur_threads--;
     mutex_unlock(&lock);
 
+    qemu_vfree(t.bounce);
+    qemu_free(t.iov);
     return NULL;
 }
 
@@ -383,6 +520,12 @@ static void spawn_thread(void)
 
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
+    BlockDriverState *bs = aiocb->common.bs;
+
+    if (++bs->aio_queue_depth > bs->aio_max_queue_depth) {
+        bs->aio_max_queue_depth = bs->aio_queue_depth;
+    }
+
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
     mutex_lock(&lock);
@@ -441,6 +584,7 @@ static int posix_aio_process_queue(void *opaque)
             if (ret == ECANCELED) {
                 /* remove the request */
                 *pacb = acb->next;
+                acb->common.bs->aio_queue_depth--;
                 qemu_aio_release(acb);
                 result = 1;
             } else if (ret != EINPROGRESS) {
@@ -459,6 +603,7 @@ static int posix_aio_process_queue(void *opaque)
 
                 /* remove the request */
                 *pacb = acb->next;
+                acb->common.bs->aio_queue_depth--;
                 /* call the callback */
                 acb->common.cb(acb->common.opaque, ret);
                 qemu_aio_release(acb);
@@ -527,6 +672,7 @@ static void paio_remove(struct qemu_paiocb *acb)
             break;
         } else if (*pacb == acb) {
             *pacb = acb->next;
+            acb->common.bs->aio_queue_depth--;
             qemu_aio_release(acb);
             break;
         }
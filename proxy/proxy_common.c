@@ -43,6 +43,23 @@ proxy_set_verbose(int  mode)
 
 static ProxyConnection  s_connections[1];
 
+/** Descriptors watched in the main loop's looper
+ **
+ ** The connections tell which events they want on each pass, but the
+ ** looper is only told about changes.
+ **/
+
+typedef struct {
+    int       fd;
+    unsigned  events;   /* IOLOOPER_XXX flags registered with s_looper */
+    unsigned  wanted;   /* IOLOOPER_XXX flags requested by this pass */
+} ProxyWatch;
+
+static IoLooper*    s_looper;
+static ProxyWatch*  s_watches;
+static int          s_num_watches;
+static int          s_max_watches;
+
 #define  MAX_HEX_DUMP  512
 
 static void
@@ -97,6 +114,7 @@ proxy_connection_done( ProxyConnection*  conn )
 {
     stralloc_reset( conn->str );
     if (conn->socket >= 0) {
+        proxy_select_forget(conn->socket);
         socket_close(conn->socket);
         conn->socket = -1;
     }
@@ -313,6 +331,7 @@ proxy_connection_free( ProxyConnection*  conn,
         int  fd = conn->socket;
 
         proxy_connection_remove(conn);
+        proxy_select_forget(fd);
 
         if (event != PROXY_EVENT_NONE)
             conn->ev_func( conn->ev_opaque, fd, event );
@@ -370,31 +389,63 @@ proxy_manager_del( void*  ev_opaque )
     }
 }
 
+static ProxyWatch*
+proxy_watch_find( int  fd )
+{
+    int  nn;
+
+    for (nn = 0; nn < s_num_watches; nn++) {
+        if (s_watches[nn].fd == fd)
+            return &s_watches[nn];
+    }
+    return NULL;
+}
+
+static void
+proxy_watch_remove( ProxyWatch*  watch )
+{
+    watch[0] = s_watches[--s_num_watches];
+}
+
 void
 proxy_select_set( ProxySelect*  sel,
                   int           fd,
                   unsigned      flags )
 {
+    ProxyWatch*  watch;
+    unsigned     wanted = 0;
+
     if (fd < 0 || !flags)
         return;
 
-    if (*sel->pcount < fd+1)
-        *sel->pcount = fd+1;
-
-    if (flags & PROXY_SELECT_READ) {
-        FD_SET( fd, sel->reads );
-    } else {
-        FD_CLR( fd, sel->reads );
-    }
-    if (flags & PROXY_SELECT_WRITE) {
-        FD_SET( fd, sel->writes );
-    } else {
-        FD_CLR( fd, sel->writes );
+    if (flags & PROXY_SELECT_READ)
+        wanted |= IOLOOPER_READ;
+    if (flags & PROXY_SELECT_WRITE)
+        wanted |= IOLOOPER_WRITE;
+    if (flags & PROXY_SELECT_ERROR)
+        wanted |= IOLOOPER_EXCEPT;
+
+    watch = proxy_watch_find(fd);
+    if (watch == NULL) {
+        if (s_num_watches == s_max_watches) {
+            s_max_watches += 8;
+            AARRAY_RENEW(s_watches, s_max_watches);
+        }
+        watch = &s_watches[s_num_watches++];
+        watch->fd     = fd;
+        watch->events = 0;
     }
-    if (flags & PROXY_SELECT_ERROR) {
-        FD_SET( fd, sel->errors );
-    } else {
-        FD_CLR( fd, sel->errors );
+    watch->wanted = wanted;
+}
+
+void
+proxy_select_forget( int  fd )
+{
+    ProxyWatch*  watch = proxy_watch_find(fd);
+
+    if (watch != NULL) {
+        iolooper_modify(s_looper, fd, watch->events, 0);
+        proxy_watch_remove(watch);
     }
 }
 
@@ -404,31 +455,33 @@ proxy_select_poll( ProxySelect*  sel, int  fd )
     unsigned  flags = 0;
 
     if (fd >= 0) {
-        if ( FD_ISSET(fd, sel->reads) )
+        if ( iolooper_is_read(sel->looper, fd) )
             flags |= PROXY_SELECT_READ;
-        if ( FD_ISSET(fd, sel->writes) )
+        if ( iolooper_is_write(sel->looper, fd) )
             flags |= PROXY_SELECT_WRITE;
-        if ( FD_ISSET(fd, sel->errors) )
+        if ( iolooper_is_except(sel->looper, fd) )
             flags |= PROXY_SELECT_ERROR;
     }
     return flags;
 }
 
-/* this function is called to update the select file descriptor sets
- * with those of the proxified connection sockets that are currently managed */
+/* this function is called to update the events the proxified connection
+ * sockets that are currently managed are watched for */
 void
-proxy_manager_select_fill( int  *pcount, fd_set*  read_fds, fd_set*  write_fds, fd_set*  err_fds)
+proxy_manager_select_fill( IoLooper*  looper )
 {
     ProxyConnection*  conn;
     ProxySelect       sel[1];
+    int               nn;
 
     if (!s_init)
         proxy_manager_init();
 
-    sel->pcount = pcount;
-    sel->reads  = read_fds;
-    sel->writes = write_fds;
-    sel->errors = err_fds;
+    s_looper    = looper;
+    sel->looper = looper;
+
+    for (nn = 0; nn < s_num_watches; nn++)
+        s_watches[nn].wanted = 0;
 
     conn = s_connections->next;
     while (conn != s_connections) {
@@ -436,19 +489,28 @@ proxy_manager_select_fill( int  *pcount, fd_set*  read_fds, fd_set*  write_fds,
         conn->conn_select(conn, sel);
         conn = next;
     }
+
+    /* apply the changes, and drop the descriptors nobody wants anymore */
+    for (nn = s_num_watches-1; nn >= 0; nn--) {
+        ProxyWatch*  watch = &s_watches[nn];
+
+        if (watch->wanted != watch->events) {
+            iolooper_modify(looper, watch->fd, watch->events, watch->wanted);
+            watch->events = watch->wanted;
+        }
+        if (watch->events == 0)
+            proxy_watch_remove(watch);
+    }
 }
 
 /* this function is called to act on proxified connection sockets when network events arrive */
 void
-proxy_manager_poll( fd_set*  read_fds, fd_set*  write_fds, fd_set*  err_fds )
+proxy_manager_poll( IoLooper*  looper )
 {
     ProxyConnection*  conn = s_connections->next;
     ProxySelect       sel[1];
 
-    sel->pcount = NULL;
-    sel->reads  = read_fds;
-    sel->writes = write_fds;
-    sel->errors = err_fds;
+    sel->looper = looper;
 
     while (conn != s_connections) {
         ProxyConnection*  next  = conn->next;
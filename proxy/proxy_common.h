@@ -73,17 +73,14 @@ extern int   proxy_manager_add( SockAddress*         address,
  */
 extern void  proxy_manager_del( void*  ev_opaque );
 
-/* this function is called to update the select file descriptor sets
- * with those of the proxified connection sockets that are currently managed */
-extern void  proxy_manager_select_fill( int     *pcount, 
-                                        fd_set*  read_fds, 
-                                        fd_set*  write_fds, 
-                                        fd_set*  err_fds);
+struct IoLooper;
+
+/* this function is called to update the events the proxified connection
+ * sockets that are currently managed are watched for in the main loop's looper */
+extern void  proxy_manager_select_fill( struct IoLooper*  looper );
 
 /* this function is called to act on proxified connection sockets when network events arrive */
-extern void  proxy_manager_poll( fd_set*  read_fds, 
-                                 fd_set*  write_fds, 
-                                 fd_set*  err_fds );
+extern void  proxy_manager_poll( struct IoLooper*  looper );
 
 /* this function checks that one can connect to a given proxy. It will simply try to connect()
  * to it, for a specified timeout, in milliseconds, then close the connection.
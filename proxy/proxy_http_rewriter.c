@@ -370,6 +370,7 @@ rewrite_connection_free( ProxyConnection*  root )
     RewriteConnection*  conn = (RewriteConnection*)root;
 
     if (conn->slirp_fd >= 0) {
+        proxy_select_forget(conn->slirp_fd);
         socket_close(conn->slirp_fd);
         conn->slirp_fd = -1;
     }
@@ -34,10 +34,7 @@ enum {
 };
 
 typedef struct {
-    int*     pcount;
-    fd_set*  reads;
-    fd_set*  writes;
-    fd_set*  errors;
+    struct IoLooper*  looper;
 } ProxySelect;
 
 extern void     proxy_select_set( ProxySelect*  sel,
@@ -46,6 +43,10 @@ extern void     proxy_select_set( ProxySelect*  sel,
 
 extern unsigned  proxy_select_poll( ProxySelect*  sel, int  fd );
 
+/* stop watching 'fd', this must be called before it is closed or handed
+ * over to the slirp stack */
+extern void     proxy_select_forget( int  fd );
+
 
 /* sockets proxy manager internals */
 
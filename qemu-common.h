@@ -215,6 +215,11 @@ char *qemu_strndup(const char *str, size_t size);
 
 void qemu_mutex_lock_iothread(void);
 void qemu_mutex_unlock_iothread(void);
+void qemu_main_loop_release(void);
+void qemu_main_loop_acquire(void);
+void qemu_cpu_io_begin(void);
+void qemu_cpu_io_end(void);
+void qemu_cpu_exclusive_access(void);
 
 int qemu_open(const char *name, int flags, ...);
 ssize_t qemu_write_full(int fd, const void *buf, size_t count)
@@ -242,6 +247,11 @@ typedef void IOHandler(void *opaque);
 void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds);
 void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int rc);
 
+/* The main loop waits on this looper, see iolooper.h */
+struct IoLooper *qemu_iohandler_get_looper(void);
+void qemu_iohandler_prepare(void);
+void qemu_iohandler_dispatch(int rc);
+
 struct ParallelIOArg {
     void *buffer;
     int count;
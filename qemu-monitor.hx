@@ -71,6 +71,8 @@ show profiling information
 show information about active capturing
 @item info snapshots
 show list of VM snapshots
+@item info savevm
+show the time and size of each section in the last VM state save
 @item info status
 show the current VM status (running|paused)
 @item info pcmcia
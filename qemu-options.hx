@@ -1644,6 +1644,33 @@ DEF("tb-size", HAS_ARG, QEMU_OPTION_tb_size, \
 STEXI
 ETEXI
 
+DEF("qcow2-l2-cache", HAS_ARG, QEMU_OPTION_qcow2_l2_cache, \
+    "-qcow2-l2-cache n\n"
+    "                cache n L2 tables per qcow2 image (default 16)\n")
+STEXI
+@item -qcow2-l2-cache @var{n}
+Keep @var{n} L2 tables of each qcow2 image in memory. Each table costs
+one cluster of memory and maps cluster_size/8 clusters of guest data, so
+larger values help random I/O on big sparse images.
+ETEXI
+
+DEF("compressed-cache", HAS_ARG, QEMU_OPTION_compressed_cache, \
+    "-compressed-cache n[,readahead=m]\n"
+    "                keep n decompressed chunks per cloop or dmg image\n"
+    "                (default 16) and decompress m chunks ahead of\n"
+    "                sequential reads on a worker thread (default 0)\n")
+STEXI
+@item -compressed-cache @var{n}[,readahead=@var{m}]
+Keep the @var{n} most recently used chunks of each cloop or dmg image in
+decompressed form. With @var{m} greater than 0, sequential reads also
+decompress the next @var{m} chunks (at most 16) on a worker thread.
+ETEXI
+
+DEF("tb-prefetch", 0, QEMU_OPTION_tb_prefetch, \
+    "-tb-prefetch    translate branch targets ahead of time while idle\n")
+STEXI
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n")
 STEXI
@@ -1695,6 +1722,13 @@ DEF("trace", HAS_ARG, QEMU_OPTION_trace, \
     "-trace name\n" \
     "                set trace directory\n")
 
+DEF("trace-compress", 0, QEMU_OPTION_trace_compress, \
+    "-trace-compress gzip the trace files\n")
+
+DEF("trace-segment", HAS_ARG, QEMU_OPTION_trace_segment, \
+    "-trace-segment size\n" \
+    "                start a new file for a trace stream every 'size' MB\n")
+
 DEF("nand", HAS_ARG, QEMU_OPTION_nand, \
     "-nand <params>  enable NAND Flash partition\n")
 
@@ -1798,6 +1832,12 @@ DEF("audio-test-out", 0, QEMU_OPTION_audio_test_out, \
 DEF("snapshot-no-time-update", 0, QEMU_OPTION_snapshot_no_time_update, \
     "-snapshot-no-time-update Disable time update when restoring snapshots\n")
 
+DEF("snapshot-lazy-load", 0, QEMU_OPTION_snapshot_lazy_load, \
+    "-snapshot-lazy-load restore RAM from snapshots on first access\n")
+
+DEF("snapshot-direct-io", 0, QEMU_OPTION_snapshot_direct_io, \
+    "-snapshot-direct-io access the snapshot storage with O_DIRECT\n")
+
 DEF("list-webcam", 0, QEMU_OPTION_list_webcam, \
     "-list-webcam List web cameras available for emulation\n")
 
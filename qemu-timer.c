@@ -41,6 +41,7 @@
 
 #ifdef __linux__
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <linux/rtc.h>
 /* For the benefit of older linux systems which don't supply it,
    we use a local copy of hpet.h. */
@@ -184,6 +185,8 @@ void cpu_disable_ticks(void)
 #define QEMU_CLOCK_VIRTUAL  1
 #define QEMU_CLOCK_HOST     2
 
+#define QEMU_NUM_CLOCKS 3
+
 struct QEMUClock {
     int type;
     int enabled;
@@ -197,9 +200,50 @@ struct QEMUTimer {
     int scale;
     QEMUTimerCB *cb;
     void *opaque;
-    struct QEMUTimer *next;
+    int heap_index;     /* position in the active heap, -1 if not pending */
+    uint64_t order;     /* keeps timers with equal expire times in FIFO order */
 };
 
+/* The pending timers of a clock are kept in a binary min-heap ordered by
+ * expire time, so arming, deleting and firing a timer are O(log n).
+ * next_expire caches the expire time of the heap top for the alarm
+ * signal handler, which must not look at the heap itself; it is only
+ * accessed through qemu_timer_get/set_next_expire(). */
+typedef struct QEMUTimerHeap {
+    QEMUTimer **timers;
+    int count;
+    int size;
+    uint64_t order;
+    volatile int64_t next_expire;
+} QEMUTimerHeap;
+
+/* The signal handler may interrupt an update of next_expire, or run in
+   another thread.  A 64-bit access is a single instruction on 64-bit
+   hosts; elsewhere it takes two, and a torn value could postpone the
+   alarm, so use a compare-and-swap (cmpxchg8b on x86) instead.  */
+static inline int64_t qemu_timer_get_next_expire(QEMUTimerHeap *h)
+{
+#if HOST_LONG_BITS == 64
+    return h->next_expire;
+#else
+    return __sync_val_compare_and_swap(&h->next_expire, 0, 0);
+#endif
+}
+
+static inline void qemu_timer_set_next_expire(QEMUTimerHeap *h, int64_t expire)
+{
+#if HOST_LONG_BITS == 64
+    h->next_expire = expire;
+#else
+    int64_t old = h->next_expire, cur;
+
+    while ((cur = __sync_val_compare_and_swap(&h->next_expire,
+                                              old, expire)) != old) {
+        old = cur;
+    }
+#endif
+}
+
 struct qemu_alarm_timer {
     char const *name;
     int (*start)(struct qemu_alarm_timer *t);
@@ -208,6 +252,7 @@ struct qemu_alarm_timer {
 #if defined(__linux__)
     int fd;
     timer_t timer;
+    int64_t expire_ns;  /* CLOCK_MONOTONIC deadline armed in the timerfd */
 #elif defined(_WIN32)
     HANDLE timer;
 #endif
@@ -222,6 +267,84 @@ static bool qemu_timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+static QEMUTimerHeap active_timers[QEMU_NUM_CLOCKS];
+
+static inline QEMUTimer *qemu_first_timer(int type)
+{
+    QEMUTimerHeap *h = &active_timers[type];
+
+    return h->count ? h->timers[0] : NULL;
+}
+
+static inline bool qemu_timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->order < b->order);
+}
+
+static inline void qemu_timer_heap_set(QEMUTimerHeap *h, int i, QEMUTimer *ts)
+{
+    h->timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void qemu_timer_heap_up(QEMUTimerHeap *h, int i)
+{
+    QEMUTimer *ts = h->timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!qemu_timer_before(ts, h->timers[parent])) {
+            break;
+        }
+        qemu_timer_heap_set(h, i, h->timers[parent]);
+        i = parent;
+    }
+    qemu_timer_heap_set(h, i, ts);
+}
+
+static void qemu_timer_heap_down(QEMUTimerHeap *h, int i)
+{
+    QEMUTimer *ts = h->timers[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= h->count) {
+            break;
+        }
+        if (child + 1 < h->count &&
+            qemu_timer_before(h->timers[child + 1], h->timers[child])) {
+            child++;
+        }
+        if (!qemu_timer_before(h->timers[child], ts)) {
+            break;
+        }
+        qemu_timer_heap_set(h, i, h->timers[child]);
+        i = child;
+    }
+    qemu_timer_heap_set(h, i, ts);
+}
+
+static void qemu_timer_heap_changed(QEMUTimerHeap *h)
+{
+    qemu_timer_set_next_expire(h, h->count ? h->timers[0]->expire_time
+                                          : INT64_MAX);
+}
+
+static void qemu_timer_heap_remove(QEMUTimerHeap *h, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+    QEMUTimer *last = h->timers[--h->count];
+
+    ts->heap_index = -1;
+    if (last != ts) {
+        qemu_timer_heap_set(h, i, last);
+        qemu_timer_heap_down(h, i);
+        qemu_timer_heap_up(h, last->heap_index);
+    }
+    qemu_timer_heap_changed(h);
+}
+
 int qemu_alarm_pending(void)
 {
     return alarm_timer->pending;
@@ -260,6 +383,12 @@ static void unix_stop_timer(struct qemu_alarm_timer *t);
 
 #ifdef __linux__
 
+#ifdef CONFIG_IOTHREAD
+static int timerfd_start_timer(struct qemu_alarm_timer *t);
+static void timerfd_stop_timer(struct qemu_alarm_timer *t);
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t);
+#endif
+
 static int dynticks_start_timer(struct qemu_alarm_timer *t);
 static void dynticks_stop_timer(struct qemu_alarm_timer *t);
 static void dynticks_rearm_timer(struct qemu_alarm_timer *t);
@@ -332,6 +461,11 @@ int64_t qemu_icount_round(int64_t count)
 static struct qemu_alarm_timer alarm_timers[] = {
 #ifndef _WIN32
 #ifdef __linux__
+#ifdef CONFIG_IOTHREAD
+    /* a timerfd watched by the I/O thread, with absolute deadlines */
+    {"timerfd", timerfd_start_timer,
+     timerfd_stop_timer, timerfd_rearm_timer},
+#endif
     /* HPET - if available - is preferred */
     {"hpet", hpet_start_timer, hpet_stop_timer, NULL},
     /* ...otherwise try RTC */
@@ -419,20 +553,17 @@ next:
     }
 }
 
-#define QEMU_NUM_CLOCKS 3
-
 QEMUClock *rt_clock;
 QEMUClock *vm_clock;
 QEMUClock *host_clock;
 
-static QEMUTimer *active_timers[QEMU_NUM_CLOCKS];
-
 static QEMUClock *qemu_new_clock(int type)
 {
     QEMUClock *clock;
     clock = qemu_mallocz(sizeof(QEMUClock));
     clock->type = type;
     clock->enabled = 1;
+    qemu_timer_set_next_expire(&active_timers[type], INT64_MAX);
     return clock;
 }
 
@@ -464,8 +595,8 @@ static void icount_warp_rt(void *opaque)
             int64_t delta = cur_time - cur_icount;
             qemu_icount_bias += MIN(warp_delta, delta);
         }
-        if (qemu_timer_expired(active_timers[QEMU_CLOCK_VIRTUAL],
-                               qemu_get_clock_ns(vm_clock))) {
+        if (qemu_timer_expired_ns(qemu_first_timer(QEMU_CLOCK_VIRTUAL),
+                                  qemu_get_clock_ns(vm_clock))) {
             qemu_notify_event();
         }
     }
@@ -495,7 +626,8 @@ void qemu_clock_warp(QEMUClock *clock)
      * the earliest vm_clock timer.
      */
     icount_warp_rt(NULL);
-    if (qemu_cpu_has_work(cpu_single_env) || !active_timers[clock->type]) {
+    if (qemu_cpu_has_work(cpu_single_env) ||
+        !active_timers[clock->type].count) {
         qemu_del_timer(clock->warp_timer);
         return;
     }
@@ -535,31 +667,23 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
     ts->cb = cb;
     ts->opaque = opaque;
     ts->scale = scale;
+    ts->heap_index = -1;
     return ts;
 }
 
 void qemu_free_timer(QEMUTimer *ts)
 {
+    qemu_del_timer(ts);
     qemu_free(ts);
 }
 
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
-
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+    /* NOTE: the alarm signal handler only reads next_expire, which is
+       updated once the heap is consistent again. */
+    if (ts->heap_index >= 0) {
+        qemu_timer_heap_remove(&active_timers[ts->clock->type], ts);
     }
 }
 
@@ -567,27 +691,27 @@ void qemu_del_timer(QEMUTimer *ts)
    >= expire_time. The corresponding callback will be called. */
 static void qemu_mod_timer_ns(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
-
-    qemu_del_timer(ts);
+    QEMUTimerHeap *h = &active_timers[ts->clock->type];
 
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!qemu_timer_expired_ns(t, expire_time)) {
-            break;
+    ts->expire_time = expire_time;
+    ts->order = h->order++;
+    if (ts->heap_index >= 0) {
+        /* already pending, move it to its new place */
+        qemu_timer_heap_down(h, ts->heap_index);
+        qemu_timer_heap_up(h, ts->heap_index);
+    } else {
+        if (h->count == h->size) {
+            h->size = h->size ? h->size * 2 : 16;
+            h->timers = qemu_realloc(h->timers,
+                                     h->size * sizeof(h->timers[0]));
         }
-        pt = &t->next;
+        qemu_timer_heap_set(h, h->count++, ts);
+        qemu_timer_heap_up(h, ts->heap_index);
     }
-    ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    qemu_timer_heap_changed(h);
 
     /* Rearm if necessary  */
-    if (pt == &active_timers[ts->clock->type]) {
+    if (ts->heap_index == 0) {
         if (!alarm_timer->pending) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -608,12 +732,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 int qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for(t = active_timers[ts->clock->type]; t != NULL; t = t->next) {
-        if (t == ts)
-            return 1;
-    }
-    return 0;
+    return ts->heap_index >= 0;
 }
 
 int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -623,22 +742,21 @@ int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
 
 static void qemu_run_timers(QEMUClock *clock)
 {
-    QEMUTimer **ptimer_head, *ts;
+    QEMUTimerHeap *h = &active_timers[clock->type];
+    QEMUTimer *ts;
     int64_t current_time;
 
     if (!clock->enabled)
         return;
 
     current_time = qemu_get_clock_ns(clock);
-    ptimer_head = &active_timers[clock->type];
     for(;;) {
-        ts = *ptimer_head;
+        ts = qemu_first_timer(clock->type);
         if (!qemu_timer_expired_ns(ts, current_time)) {
             break;
         }
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        qemu_timer_heap_remove(h, ts);
 
         /* run the callback (the timer list can be modified) */
         ts->cb(ts->opaque);
@@ -736,7 +854,10 @@ void configure_icount(const char *option)
         return;
 
 #ifdef CONFIG_IOTHREAD
-    vm_clock->warp_timer = qemu_new_timer_ns(rt_clock, icount_warp_rt, NULL);
+    /* the instruction counter is read by device code while the TCG
+       thread runs without the global lock */
+    fprintf(stderr, "-icount is not supported with the I/O thread\n");
+    exit(1);
 #endif
 
     if (strcmp(option, "auto") != 0) {
@@ -849,8 +970,8 @@ int64_t qemu_next_icount_deadline(void)
     int64_t delta = INT32_MAX;
 
     assert(use_icount);
-    if (active_timers[QEMU_CLOCK_VIRTUAL]) {
-        delta = active_timers[QEMU_CLOCK_VIRTUAL]->expire_time -
+    if (active_timers[QEMU_CLOCK_VIRTUAL].count) {
+        delta = active_timers[QEMU_CLOCK_VIRTUAL].timers[0]->expire_time -
                      qemu_get_clock_ns(vm_clock);
     }
 
@@ -860,26 +981,29 @@ int64_t qemu_next_icount_deadline(void)
     return delta;
 }
 
+/* can be called from the alarm signal handler, so it only uses the
+   next_expire of each clock */
 static int64_t qemu_next_alarm_deadline(void)
 {
     int64_t delta;
     int64_t rtdelta;
+    int64_t expire;
 
-    if (!use_icount && active_timers[QEMU_CLOCK_VIRTUAL]) {
-        delta = active_timers[QEMU_CLOCK_VIRTUAL]->expire_time -
-                     qemu_get_clock_ns(vm_clock);
+    expire = qemu_timer_get_next_expire(&active_timers[QEMU_CLOCK_VIRTUAL]);
+    if (!use_icount && expire != INT64_MAX) {
+        delta = expire - qemu_get_clock_ns(vm_clock);
     } else {
         delta = INT32_MAX;
     }
-    if (active_timers[QEMU_CLOCK_HOST]) {
-        int64_t hdelta = active_timers[QEMU_CLOCK_HOST]->expire_time -
-                 qemu_get_clock_ns(host_clock);
+    expire = qemu_timer_get_next_expire(&active_timers[QEMU_CLOCK_HOST]);
+    if (expire != INT64_MAX) {
+        int64_t hdelta = expire - qemu_get_clock_ns(host_clock);
         if (hdelta < delta)
             delta = hdelta;
     }
-    if (active_timers[QEMU_CLOCK_REALTIME]) {
-        rtdelta = (active_timers[QEMU_CLOCK_REALTIME]->expire_time -
-                 qemu_get_clock_ns(rt_clock));
+    expire = qemu_timer_get_next_expire(&active_timers[QEMU_CLOCK_REALTIME]);
+    if (expire != INT64_MAX) {
+        rtdelta = expire - qemu_get_clock_ns(rt_clock);
         if (rtdelta < delta)
             delta = rtdelta;
     }
@@ -990,6 +1114,85 @@ static void rtc_stop_timer(struct qemu_alarm_timer *t)
     close(rtc_fd);
 }
 
+#ifdef CONFIG_IOTHREAD
+/* The timerfd is watched by the main loop, so its wait wakes up on it
+ * without a signal.  A timerfd cannot raise SIGIO, so this alarm is only
+ * usable when the vCPU runs in its own thread and does not need to be
+ * interrupted by it. */
+static void timerfd_alarm_handler(void *opaque)
+{
+    struct qemu_alarm_timer *t = opaque;
+    uint64_t expirations;
+
+    /* drain the descriptor, the timer is rearmed by qemu_run_all_timers() */
+    while (read(t->fd, &expirations, sizeof(expirations)) < 0 &&
+           errno == EINTR) {
+    }
+    t->expired = 1;
+    t->pending = 1;
+    timer_alarm_pending = 1;
+}
+
+static int timerfd_start_timer(struct qemu_alarm_timer *t)
+{
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    t->fd = fd;
+    t->expire_ns = 0;
+    qemu_set_fd_handler(fd, timerfd_alarm_handler, NULL, t);
+
+    return 0;
+}
+
+static void timerfd_stop_timer(struct qemu_alarm_timer *t)
+{
+    qemu_set_fd_handler(t->fd, NULL, NULL, NULL);
+    close(t->fd);
+}
+
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t)
+{
+    struct itimerspec timeout;
+    struct timespec ts;
+    int64_t nearest_delta_ns, now_ns, expire_ns;
+
+    assert(alarm_has_dynticks(t));
+    if (!active_timers[QEMU_CLOCK_REALTIME].count &&
+        !active_timers[QEMU_CLOCK_VIRTUAL].count &&
+        !active_timers[QEMU_CLOCK_HOST].count)
+        return;
+
+    nearest_delta_ns = qemu_next_alarm_deadline();
+    if (nearest_delta_ns < MIN_TIMER_REARM_NS)
+        nearest_delta_ns = MIN_TIMER_REARM_NS;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    expire_ns = now_ns + nearest_delta_ns;
+
+    /* the deadline armed last time is remembered, so there is no need to
+       ask the kernel whether an earlier one is still running */
+    if (t->expire_ns > now_ns && t->expire_ns <= expire_ns)
+        return;
+
+    timeout.it_interval.tv_sec = 0;
+    timeout.it_interval.tv_nsec = 0; /* 0 for one-shot timer */
+    timeout.it_value.tv_sec = expire_ns / 1000000000;
+    timeout.it_value.tv_nsec = expire_ns % 1000000000;
+    if (timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &timeout, NULL)) {
+        perror("timerfd_settime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+    t->expire_ns = expire_ns;
+}
+#endif /* CONFIG_IOTHREAD */
+
 static int dynticks_start_timer(struct qemu_alarm_timer *t)
 {
     struct sigevent ev;
@@ -1040,9 +1243,9 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
     int64_t current_ns;
 
     assert(alarm_has_dynticks(t));
-    if (!active_timers[QEMU_CLOCK_REALTIME] &&
-        !active_timers[QEMU_CLOCK_VIRTUAL] &&
-        !active_timers[QEMU_CLOCK_HOST])
+    if (!active_timers[QEMU_CLOCK_REALTIME].count &&
+        !active_timers[QEMU_CLOCK_VIRTUAL].count &&
+        !active_timers[QEMU_CLOCK_HOST].count)
         return;
 
     nearest_delta_ns = qemu_next_alarm_deadline();
@@ -1176,9 +1379,9 @@ static void mm_rearm_timer(struct qemu_alarm_timer *t)
     int nearest_delta_ms;
 
     assert(alarm_has_dynticks(t));
-    if (!active_timers[QEMU_CLOCK_REALTIME] &&
-        !active_timers[QEMU_CLOCK_VIRTUAL] &&
-        !active_timers[QEMU_CLOCK_HOST]) {
+    if (!active_timers[QEMU_CLOCK_REALTIME].count &&
+        !active_timers[QEMU_CLOCK_VIRTUAL].count &&
+        !active_timers[QEMU_CLOCK_HOST].count) {
         return;
     }
 
@@ -1246,9 +1449,9 @@ static void win32_rearm_timer(struct qemu_alarm_timer *t)
     BOOLEAN success;
 
     assert(alarm_has_dynticks(t));
-    if (!active_timers[QEMU_CLOCK_REALTIME] &&
-        !active_timers[QEMU_CLOCK_VIRTUAL] &&
-        !active_timers[QEMU_CLOCK_HOST])
+    if (!active_timers[QEMU_CLOCK_REALTIME].count &&
+        !active_timers[QEMU_CLOCK_VIRTUAL].count &&
+        !active_timers[QEMU_CLOCK_HOST].count)
         return;
 
     nearest_delta_ms = (qemu_next_alarm_deadline() + 999999) / 1000000;
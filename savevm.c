@@ -85,6 +85,9 @@
 #include "qemu-queue.h"
 #include "qemu_file.h"
 #include "android/snapshot.h"
+#ifdef __linux__
+#include "qemu-thread.h"
+#endif
 
 
 #define SELF_ANNOUNCE_ROUNDS 5
@@ -161,9 +164,33 @@ void qemu_announce_self(void)
 
 #define IO_BUF_SIZE 32768
 
+/* largest window requested from a map_buffer callback at once */
+#define IO_MAP_SIZE (16 * 1024 * 1024)
+
+/* Return a read-only pointer to the data at the given position instead of
+ * copying it, or NULL if that part of the file can't be mapped.  *size is
+ * the number of bytes wanted on entry, and the number of contiguous bytes
+ * available at the returned pointer on exit.  When keep is set, the pointer
+ * stays valid until the unmap callback is called; otherwise only until the
+ * next call, so that the backend can release what was mapped before.
+ */
+typedef uint8_t *(QEMUFileMapBufferFunc)(void *opaque, int64_t pos, int *size,
+                                         int keep);
+typedef void (QEMUFileUnmapFunc)(void *opaque);
+
+typedef struct QEMUFileWriter QEMUFileWriter;
+
+/* mappings kept alive past qemu_fclose() by qemu_file_hold_mapping() */
+struct QEMUFileMapping {
+    QEMUFileUnmapFunc *unmap;
+    void *opaque;
+};
+
 struct QEMUFile {
     QEMUFilePutBufferFunc *put_buffer;
     QEMUFileGetBufferFunc *get_buffer;
+    QEMUFileMapBufferFunc *map_buffer;
+    QEMUFileUnmapFunc *unmap;
     QEMUFileCloseFunc *close;
     QEMUFileRateLimit *rate_limit;
     QEMUFileSetRateLimit *set_rate_limit;
@@ -175,11 +202,32 @@ struct QEMUFile {
                            when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    int buf_max; /* capacity of buf when writing */
+    uint8_t *buf; /* io_buf, a mapping returned by map_buffer, or one of
+                     the writer's buffers */
+    uint8_t io_buf[IO_BUF_SIZE];
+    QEMUFileWriter *writer;
 
+    int keep_mappings; /* set by qemu_file_hold_mapping() */
     int has_error;
 };
 
+/* Open a read-only file whose data can also be mapped in place; get_buffer
+ * is used for whatever map_buffer can't map. */
+static QEMUFile *qemu_fopen_ops_map(void *opaque,
+                                    QEMUFileGetBufferFunc *get_buffer,
+                                    QEMUFileMapBufferFunc *map_buffer,
+                                    QEMUFileUnmapFunc *unmap,
+                                    QEMUFileCloseFunc *close)
+{
+    QEMUFile *f;
+
+    f = qemu_fopen_ops(opaque, NULL, get_buffer, close, NULL, NULL, NULL);
+    f->map_buffer = map_buffer;
+    f->unmap = unmap;
+    return f;
+}
+
 typedef struct QEMUFileStdio
 {
     FILE *stdio_file;
@@ -351,6 +399,77 @@ static int file_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return fread(buf, 1, size, s->stdio_file);
 }
 
+#ifndef _WIN32
+typedef struct QEMUFileMmap
+{
+    uint8_t *base;
+    int64_t size;
+} QEMUFileMmap;
+
+static int mmap_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileMmap *s = opaque;
+
+    if (pos >= s->size)
+        return 0;
+    if (size > s->size - pos)
+        size = s->size - pos;
+    memcpy(buf, s->base + pos, size);
+    return size;
+}
+
+static uint8_t *mmap_map_buffer(void *opaque, int64_t pos, int *size,
+                                int keep)
+{
+    QEMUFileMmap *s = opaque;
+
+    if (pos >= s->size)
+        return NULL;
+    if (*size > s->size - pos)
+        *size = s->size - pos;
+    return s->base + pos;
+}
+
+static void mmap_unmap(void *opaque)
+{
+    QEMUFileMmap *s = opaque;
+    munmap(s->base, s->size);
+    qemu_free(s);
+}
+
+/* Map a whole file read-only, so that loading from it costs no read()
+ * calls and no copy into the QEMUFile buffer. */
+static QEMUFile *qemu_fopen_mmap(const char *filename)
+{
+    QEMUFileMmap *s;
+    struct stat st;
+    void *base;
+    int fd;
+
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        st.st_size != (size_t)st.st_size) {
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+#ifdef MADV_SEQUENTIAL
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+    s = qemu_mallocz(sizeof(QEMUFileMmap));
+    s->base = base;
+    s->size = st.st_size;
+    return qemu_fopen_ops_map(s, mmap_get_buffer, mmap_map_buffer,
+                              mmap_unmap, NULL);
+}
+#endif
+
 QEMUFile *qemu_fopen(const char *filename, const char *mode)
 {
     QEMUFileStdio *s;
@@ -362,6 +481,14 @@ QEMUFile *qemu_fopen(const char *filename, const char *mode)
         return NULL;
     }
 
+#ifndef _WIN32
+    if (mode[0] == 'r') {
+        QEMUFile *f = qemu_fopen_mmap(filename);
+        if (f)
+            return f;
+    }
+#endif
+
     s = qemu_mallocz(sizeof(QEMUFileStdio));
 
     s->stdio_file = fopen(filename, mode);
@@ -381,11 +508,174 @@ fail:
     return NULL;
 }
 
+/* statistics of the last file written through a writer thread */
+static struct {
+    int valid;
+    int64_t busy_time;   /* spent in put_buffer */
+    int64_t stall_time;  /* caller waiting for a free buffer */
+    int64_t drain_time;  /* qemu_fclose() waiting for the queued buffers */
+} writer_stats;
+
+#ifdef __linux__
+/* Data written to a file with a writer is serialized into one of a ring of
+ * large buffers while the writer thread passes the previous ones to
+ * put_buffer.  Buffers are page aligned and, short of the last one, always
+ * full, so that they can go straight to a file opened with O_DIRECT.
+ *
+ * Only the writer thread calls put_buffer while it runs, and it may enter
+ * the block layer: this is only used for VM state, which is saved with the
+ * VM stopped and by handlers that don't do block I/O themselves.
+ */
+#define WRITER_BUFS 4
+#define WRITER_BUF_SIZE (2 * 1024 * 1024)
+
+struct QEMUFileWriter {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    uint8_t *bufs[WRITER_BUFS];
+    int64_t pos[WRITER_BUFS];
+    int len[WRITER_BUFS];
+    int fill;   /* buffer being filled by the caller */
+    int count;  /* buffers queued before it, the oldest being written */
+    int stop;
+    int error;
+    int64_t busy_time;
+    int64_t stall_time;
+};
+
+/* put_buffer runs here without qemu_global_mutex.  For VM state that is
+ * block_put_buffer, which goes through qcow2 to bdrv_write_em() and so to
+ * async_context_push() and qemu_aio_wait() off the main thread.  This is
+ * only safe because nothing else touches the block layer meanwhile: the VM
+ * is stopped, the main thread stays in do_savevm() and only waits for this
+ * thread in qemu_file_writer_queue() and qemu_file_stop_writer(), and
+ * qemu_aio_flush() left no other AIO request in flight, so the AIO context
+ * stack and the completion handlers are used by this thread alone.  A short write is an
+ * error, reported by qemu_fclose().
+ */
+static void *qemu_file_writer_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
+    QEMUFileWriter *w = f->writer;
+
+    qemu_mutex_lock(&w->lock);
+    for (;;) {
+        int64_t t0;
+        int i, len;
+
+        while (w->count == 0 && !w->stop)
+            qemu_cond_wait(&w->cond, &w->lock);
+        if (w->count == 0)
+            break;
+        i = (w->fill + WRITER_BUFS - w->count) % WRITER_BUFS;
+        qemu_mutex_unlock(&w->lock);
+
+        t0 = get_clock();
+        len = f->put_buffer(f->opaque, w->bufs[i], w->pos[i], w->len[i]);
+
+        qemu_mutex_lock(&w->lock);
+        w->busy_time += get_clock() - t0;
+        if (len != w->len[i])
+            w->error = 1;
+        w->count--;
+        qemu_cond_broadcast(&w->cond);
+    }
+    qemu_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void qemu_file_start_writer(QEMUFile *f)
+{
+    QEMUFileWriter *w;
+    int i;
+
+    w = qemu_mallocz(sizeof(*w));
+    for (i = 0; i < WRITER_BUFS; i++)
+        w->bufs[i] = qemu_memalign(getpagesize(), WRITER_BUF_SIZE);
+    qemu_mutex_init(&w->lock);
+    qemu_cond_init(&w->cond);
+
+    f->writer = w;
+    f->buf = w->bufs[0];
+    f->buf_max = WRITER_BUF_SIZE;
+    qemu_thread_create(&w->thread, qemu_file_writer_thread, f);
+}
+
+/* Queue the current buffer and switch to the next free one. */
+static void qemu_file_writer_queue(QEMUFile *f)
+{
+    QEMUFileWriter *w = f->writer;
+
+    qemu_mutex_lock(&w->lock);
+    w->pos[w->fill] = f->buf_offset;
+    w->len[w->fill] = f->buf_index;
+    w->fill = (w->fill + 1) % WRITER_BUFS;
+    w->count++;
+    qemu_cond_broadcast(&w->cond);
+    if (w->count == WRITER_BUFS) {
+        int64_t t0 = get_clock();
+        while (w->count == WRITER_BUFS)
+            qemu_cond_wait(&w->cond, &w->lock);
+        w->stall_time += get_clock() - t0;
+    }
+    if (w->error)
+        f->has_error = 1;
+    qemu_mutex_unlock(&w->lock);
+
+    f->buf_offset += f->buf_index;
+    f->buf_index = 0;
+    f->buf = w->bufs[w->fill];
+}
+
+/* Wait for the queued buffers to be written and stop the thread. */
+static void qemu_file_stop_writer(QEMUFile *f)
+{
+    QEMUFileWriter *w = f->writer;
+    int64_t t0 = get_clock();
+    int i;
+
+    qemu_mutex_lock(&w->lock);
+    w->stop = 1;
+    qemu_cond_broadcast(&w->cond);
+    qemu_mutex_unlock(&w->lock);
+    pthread_join(w->thread.thread, NULL);
+
+    if (w->error)
+        f->has_error = 1;
+    writer_stats.valid = 1;
+    writer_stats.busy_time = w->busy_time;
+    writer_stats.stall_time = w->stall_time;
+    writer_stats.drain_time = get_clock() - t0;
+
+    qemu_cond_destroy(&w->cond);
+    qemu_mutex_destroy(&w->lock);
+    for (i = 0; i < WRITER_BUFS; i++)
+        qemu_vfree(w->bufs[i]);
+    qemu_free(w);
+    f->writer = NULL;
+    f->buf = f->io_buf;
+    f->buf_max = IO_BUF_SIZE;
+}
+#else
+static void qemu_file_start_writer(QEMUFile *f)
+{
+    writer_stats.valid = 0;
+}
+
+static void qemu_file_writer_queue(QEMUFile *f)
+{
+}
+
+static void qemu_file_stop_writer(QEMUFile *f)
+{
+}
+#endif
+
 static int block_put_buffer(void *opaque, const uint8_t *buf,
                            int64_t pos, int size)
 {
-    bdrv_save_vmstate(opaque, buf, pos, size);
-    return size;
+    return bdrv_save_vmstate(opaque, buf, pos, size);
 }
 
 static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
@@ -393,6 +683,17 @@ static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return bdrv_load_vmstate(opaque, buf, pos, size);
 }
 
+static uint8_t *block_map_buffer(void *opaque, int64_t pos, int *size,
+                                 int keep)
+{
+    return bdrv_map_vmstate(opaque, pos, size, keep);
+}
+
+static void block_unmap(void *opaque)
+{
+    bdrv_unmap(opaque);
+}
+
 static int bdrv_fclose(void *opaque)
 {
     return 0;
@@ -400,10 +701,14 @@ static int bdrv_fclose(void *opaque)
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
-    if (is_writable)
-        return qemu_fopen_ops(bs, block_put_buffer, NULL, bdrv_fclose,
-			      NULL, NULL, NULL);
-    return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
+    if (is_writable) {
+        QEMUFile *f = qemu_fopen_ops(bs, block_put_buffer, NULL, bdrv_fclose,
+                                     NULL, NULL, NULL);
+        qemu_file_start_writer(f);
+        return f;
+    }
+    return qemu_fopen_ops_map(bs, block_get_buffer, block_map_buffer,
+                              block_unmap, bdrv_fclose);
 }
 
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
@@ -425,6 +730,8 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
     f->set_rate_limit = set_rate_limit;
     f->get_rate_limit = get_rate_limit;
     f->is_write = 0;
+    f->buf = f->io_buf;
+    f->buf_max = IO_BUF_SIZE;
 
     return f;
 }
@@ -444,6 +751,12 @@ void qemu_fflush(QEMUFile *f)
     if (!f->put_buffer)
         return;
 
+    if (f->writer) {
+        if (f->buf_index > 0)
+            qemu_file_writer_queue(f);
+        return;
+    }
+
     if (f->is_write && f->buf_index > 0) {
         int len;
 
@@ -466,6 +779,21 @@ static void qemu_fill_buffer(QEMUFile *f)
     if (f->is_write)
         abort();
 
+    if (f->map_buffer) {
+        uint8_t *p;
+
+        len = IO_MAP_SIZE;
+        p = f->map_buffer(f->opaque, f->buf_offset, &len, f->keep_mappings);
+        if (p && len > 0) {
+            f->buf = p;
+            f->buf_index = 0;
+            f->buf_size = len;
+            f->buf_offset += len;
+            return;
+        }
+    }
+
+    f->buf = f->io_buf;
     len = f->get_buffer(f->opaque, f->buf, f->buf_offset, IO_BUF_SIZE);
     if (len > 0) {
         f->buf_index = 0;
@@ -479,8 +807,18 @@ int qemu_fclose(QEMUFile *f)
 {
     int ret = 0;
     qemu_fflush(f);
-    if (f->close)
-        ret = f->close(f->opaque);
+    if (f->writer) {
+        qemu_file_stop_writer(f);
+        if (f->has_error)
+            ret = -EIO;
+    }
+    if (f->unmap)
+        f->unmap(f->opaque);
+    if (f->close) {
+        int close_ret = f->close(f->opaque);
+        if (close_ret < 0 || ret == 0)
+            ret = close_ret;
+    }
     qemu_free(f);
     return ret;
 }
@@ -501,7 +839,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 
     while (!f->has_error && size > 0) {
-        l = IO_BUF_SIZE - f->buf_index;
+        l = f->buf_max - f->buf_index;
         if (l > size)
             l = size;
         memcpy(f->buf + f->buf_index, buf, l);
@@ -509,7 +847,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         f->buf_index += l;
         buf += l;
         size -= l;
-        if (f->buf_index >= IO_BUF_SIZE)
+        if (f->buf_index >= f->buf_max)
             qemu_fflush(f);
     }
 }
@@ -524,7 +862,7 @@ void qemu_put_byte(QEMUFile *f, int v)
 
     f->buf[f->buf_index++] = v;
     f->is_write = 1;
-    if (f->buf_index >= IO_BUF_SIZE)
+    if (f->buf_index >= f->buf_max)
         qemu_fflush(f);
 }
 
@@ -554,6 +892,81 @@ int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size1)
     return size1 - size;
 }
 
+/* Read size bytes and point *buf at them.  When the bytes are contiguous in
+ * the file's buffer, which is nearly always the case for mapped files, *buf
+ * is pointed into that buffer and no copy is made; the data then only stays
+ * valid until the next read from f.  Otherwise they are copied into the
+ * caller's buffer that *buf points to on entry.
+ */
+int qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, int size)
+{
+    if (f->is_write)
+        abort();
+
+    if (f->buf_size - f->buf_index < size && f->map_buffer) {
+        /* remap from the current position so the request is contiguous */
+        f->buf_offset = qemu_ftell(f);
+        f->buf_index = 0;
+        f->buf_size = 0;
+        qemu_fill_buffer(f);
+    }
+    if (f->buf_size - f->buf_index >= size) {
+        *buf = f->buf + f->buf_index;
+        f->buf_index += size;
+        return size;
+    }
+    return qemu_get_buffer(f, *buf, size);
+}
+
+/* Return a pointer to the next size bytes if they can be mapped from the
+ * file, without copying them; NULL is returned and nothing is consumed
+ * otherwise.  The data stays valid until the next read from f, or until
+ * qemu_file_release_mapping() if the mapping is held.
+ */
+uint8_t *qemu_get_mapped_buffer(QEMUFile *f, int size)
+{
+    uint8_t *p;
+
+    if (f->is_write)
+        abort();
+
+    if (f->buf_size - f->buf_index < size && f->map_buffer) {
+        f->buf_offset = qemu_ftell(f);
+        f->buf_index = 0;
+        f->buf_size = 0;
+        qemu_fill_buffer(f);
+    }
+    if (f->buf == f->io_buf || f->buf_size - f->buf_index < size)
+        return NULL;
+
+    p = f->buf + f->buf_index;
+    f->buf_index += size;
+    return p;
+}
+
+/* Keep the mappings returned by qemu_get_mapped_buffer() from now on valid
+ * across reads and after f is closed.  Returns NULL if f isn't mapped. */
+QEMUFileMapping *qemu_file_hold_mapping(QEMUFile *f)
+{
+    QEMUFileMapping *m;
+
+    if (!f->unmap)
+        return NULL;
+
+    m = qemu_malloc(sizeof(*m));
+    m->unmap = f->unmap;
+    m->opaque = f->opaque;
+    f->unmap = NULL;
+    f->keep_mappings = 1;
+    return m;
+}
+
+void qemu_file_release_mapping(QEMUFileMapping *m)
+{
+    m->unmap(m->opaque);
+    qemu_free(m);
+}
+
 int qemu_get_byte(QEMUFile *f)
 {
     if (f->is_write)
@@ -897,19 +1310,124 @@ void unregister_savevm(const char *idstr, void *opaque)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 
+/* what each section cost during the last save, for "info savevm" */
+typedef struct SaveTimelineEntry {
+    SaveStateEntry *se;
+    char idstr[64];
+    int instance_id;
+    int section_type;
+    int64_t start;  /* ns since the save began */
+    int64_t time;
+    int64_t size;
+} SaveTimelineEntry;
+
+static struct {
+    SaveTimelineEntry *entries;
+    int nb_entries;
+    int max_entries;
+    int64_t start;
+    int64_t time;
+    int64_t size;
+} savevm_timeline;
+
+static void savevm_timeline_begin(void)
+{
+    savevm_timeline.nb_entries = 0;
+    savevm_timeline.start = get_clock();
+    savevm_timeline.time = 0;
+    savevm_timeline.size = 0;
+    writer_stats.valid = 0;
+}
+
+/* Account for a section written since t0, when f was at pos0.  The parts
+ * of a live section are summed up into a single entry. */
+static void savevm_timeline_add(QEMUFile *f, SaveStateEntry *se,
+                                int section_type, int64_t t0, int64_t pos0)
+{
+    SaveTimelineEntry *e = NULL;
+    int i;
+
+    if (section_type == QEMU_VM_SECTION_PART) {
+        for (i = 0; i < savevm_timeline.nb_entries; i++) {
+            if (savevm_timeline.entries[i].se == se &&
+                savevm_timeline.entries[i].section_type == section_type) {
+                e = &savevm_timeline.entries[i];
+                break;
+            }
+        }
+    }
+    if (!e) {
+        if (savevm_timeline.nb_entries == savevm_timeline.max_entries) {
+            savevm_timeline.max_entries = savevm_timeline.max_entries * 2 + 16;
+            savevm_timeline.entries =
+                qemu_realloc(savevm_timeline.entries,
+                             savevm_timeline.max_entries * sizeof(*e));
+        }
+        e = &savevm_timeline.entries[savevm_timeline.nb_entries++];
+        e->se = se;
+        pstrcpy(e->idstr, sizeof(e->idstr), se->idstr);
+        e->instance_id = se->instance_id;
+        e->section_type = section_type;
+        e->start = t0 - savevm_timeline.start;
+        e->time = 0;
+        e->size = 0;
+    }
+    e->time += get_clock() - t0;
+    e->size += qemu_ftell(f) - pos0;
+}
+
+void do_info_savevm(Monitor *mon)
+{
+    static const char *const types[] = {
+        [QEMU_VM_SECTION_START] = "start",
+        [QEMU_VM_SECTION_PART]  = "part",
+        [QEMU_VM_SECTION_END]   = "end",
+        [QEMU_VM_SECTION_FULL]  = "full",
+    };
+    int i;
+
+    if (!savevm_timeline.start) {
+        monitor_printf(mon, "No VM state saved yet\n");
+        return;
+    }
+    monitor_printf(mon, "%" PRId64 " bytes of VM state in %.1f ms\n",
+                   savevm_timeline.size, savevm_timeline.time / 1e6);
+    monitor_printf(mon, "%10s %10s %12s  section\n",
+                   "start ms", "time ms", "bytes");
+    for (i = 0; i < savevm_timeline.nb_entries; i++) {
+        SaveTimelineEntry *e = &savevm_timeline.entries[i];
+        monitor_printf(mon, "%10.1f %10.1f %12" PRId64 "  %s.%d %s\n",
+                       e->start / 1e6, e->time / 1e6, e->size,
+                       e->idstr, e->instance_id, types[e->section_type]);
+    }
+    if (writer_stats.valid) {
+        monitor_printf(mon, "writer: %.1f ms writing, %.1f ms waited for "
+                       "a free buffer, %.1f ms draining at close\n",
+                       writer_stats.busy_time / 1e6,
+                       writer_stats.stall_time / 1e6,
+                       writer_stats.drain_time / 1e6);
+    }
+}
+
 int qemu_savevm_state_begin(QEMUFile *f)
 {
     SaveStateEntry *se;
 
+    savevm_timeline_begin();
+
     qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
     qemu_put_be32(f, QEMU_VM_FILE_VERSION);
 
     for (se = first_se; se != NULL; se = se->next) {
+        int64_t t0, pos0;
         int len;
 
         if (se->save_live_state == NULL)
             continue;
 
+        t0 = get_clock();
+        pos0 = qemu_ftell(f);
+
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_START);
         qemu_put_be32(f, se->section_id);
@@ -923,6 +1441,7 @@ int qemu_savevm_state_begin(QEMUFile *f)
         qemu_put_be32(f, se->version_id);
 
         se->save_live_state(f, QEMU_VM_SECTION_START, se->opaque);
+        savevm_timeline_add(f, se, QEMU_VM_SECTION_START, t0, pos0);
     }
 
     if (qemu_file_has_error(f))
@@ -937,14 +1456,20 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     int ret = 1;
 
     for (se = first_se; se != NULL; se = se->next) {
+        int64_t t0, pos0;
+
         if (se->save_live_state == NULL)
             continue;
 
+        t0 = get_clock();
+        pos0 = qemu_ftell(f);
+
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_PART);
         qemu_put_be32(f, se->section_id);
 
         ret &= !!se->save_live_state(f, QEMU_VM_SECTION_PART, se->opaque);
+        savevm_timeline_add(f, se, QEMU_VM_SECTION_PART, t0, pos0);
     }
 
     if (ret)
@@ -961,22 +1486,32 @@ int qemu_savevm_state_complete(QEMUFile *f)
     SaveStateEntry *se;
 
     for (se = first_se; se != NULL; se = se->next) {
+        int64_t t0, pos0;
+
         if (se->save_live_state == NULL)
             continue;
 
+        t0 = get_clock();
+        pos0 = qemu_ftell(f);
+
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
         se->save_live_state(f, QEMU_VM_SECTION_END, se->opaque);
+        savevm_timeline_add(f, se, QEMU_VM_SECTION_END, t0, pos0);
     }
 
     for(se = first_se; se != NULL; se = se->next) {
+        int64_t t0, pos0;
         int len;
 
         if (se->save_state == NULL)
             continue;
 
+        t0 = get_clock();
+        pos0 = qemu_ftell(f);
+
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_FULL);
         qemu_put_be32(f, se->section_id);
@@ -990,10 +1525,14 @@ int qemu_savevm_state_complete(QEMUFile *f)
         qemu_put_be32(f, se->version_id);
 
         se->save_state(f, se->opaque);
+        savevm_timeline_add(f, se, QEMU_VM_SECTION_FULL, t0, pos0);
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
 
+    savevm_timeline.time = get_clock() - savevm_timeline.start;
+    savevm_timeline.size = qemu_ftell(f);
+
     if (qemu_file_has_error(f))
         return -EIO;
 
@@ -1192,6 +1731,9 @@ out:
         qemu_free(le);
     }
 
+    /* RAM that ram_load() only located in the file is restored from now on */
+    ram_lazy_start();
+
     if (qemu_file_has_error(f))
         ret = -EIO;
 
@@ -1265,6 +1807,9 @@ void do_savevm(Monitor *err, const char *name)
     saved_vm_running = vm_running;
     vm_stop(0);
 
+    /* the old snapshot's clusters may be reused below */
+    ram_lazy_flush();
+
     must_delete = 0;
     if (name) {
         ret = bdrv_snapshot_find(bs, old_sn, name);
@@ -1307,7 +1852,8 @@ void do_savevm(Monitor *err, const char *name)
     }
     ret = qemu_savevm_state(f);
     vm_state_size = qemu_ftell(f);
-    qemu_fclose(f);
+    if (qemu_fclose(f) < 0 && ret >= 0)
+        ret = -EIO;
     if (ret < 0) {
         monitor_printf(err, "Error %d while writing VM\n", ret);
         goto the_end;
@@ -1362,6 +1908,8 @@ void do_loadvm(Monitor *err, const char *name)
     saved_vm_running = vm_running;
     vm_stop(0);
 
+    ram_lazy_flush();
+
     bs1 = bs;
     do {
         if (bdrv_can_snapshot(bs1)) {
@@ -1430,6 +1978,8 @@ void do_delvm(Monitor *err, const char *name)
         return;
     }
 
+    ram_lazy_flush();
+
     bs1 = NULL;
     while ((bs1 = bdrv_next(bs1))) {
         if (bdrv_can_snapshot(bs1)) {
@@ -25,10 +25,11 @@ char*  inet_iptostr(uint32_t  ip);
 
 void slirp_init(int restricted, const char *special_ip);
 
-void slirp_select_fill(int *pnfds,
-                       fd_set *readfds, fd_set *writefds, fd_set *xfds);
+struct IoLooper;
 
-void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds);
+void slirp_pollfds_fill(struct IoLooper *iol);
+
+void slirp_pollfds_poll(struct IoLooper *iol);
 
 void slirp_input(const uint8_t *pkt, int pkt_len);
 
@@ -31,6 +31,7 @@
 #include "android/utils/bufprint.h"
 #include "android/android.h"
 #include "sockets.h"
+#include "iolooper.h"
 
 #include "qemu-queue.h"
 
@@ -74,8 +75,8 @@ struct timeval tt;
 FILE *lfd;
 struct ex_list *exec_list;
 
-/* XXX: suppress those select globals */
-fd_set *global_readfds, *global_writefds, *global_xfds;
+/* the looper sockets are watched in, see sowatch() */
+IoLooper *global_looper;
 
 char slirp_hostname[33];
 
@@ -271,7 +272,6 @@ void slirp_init(int restricted, const char *special_ip)
 
 #define CONN_CANFSEND(so) (((so)->so_state & (SS_FCANTSENDMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
-#define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
 
 /*
  * curtime kept to an accuracy of 1ms
@@ -298,20 +298,19 @@ static void updtime(void)
 }
 #endif
 
-void slirp_select_fill(int *pnfds,
-                       fd_set *readfds, fd_set *writefds, fd_set *xfds)
+/*
+ * Updates the events each socket is watched for in the main loop's looper.
+ * Only the sockets whose interest changed since the last call cost a
+ * system call.
+ */
+void slirp_pollfds_fill(IoLooper *iol)
 {
     struct socket *so, *so_next;
     struct timeval timeout;
-    int nfds;
+    int events;
     int tmp_time;
 
-    /* fail safe */
-    global_readfds = NULL;
-    global_writefds = NULL;
-    global_xfds = NULL;
-
-    nfds = *pnfds;
+    global_looper = iol;
 	/*
 	 * First, TCP sockets
 	 */
@@ -336,9 +335,12 @@ void slirp_select_fill(int *pnfds,
 			/*
 			 * NOFDREF can include still connecting to local-host,
 			 * newly socreated() sockets etc. Don't want to select these.
+			 * Proxified connections have no socket of their own yet.
 	 		 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
+			if (so->so_state & SS_NOFDREF || so->s == -1) {
+			   sowatch(so, 0);
 			   continue;
+			}
 
             /*
              * don't register proxified socked connections here
@@ -350,8 +352,7 @@ void slirp_select_fill(int *pnfds,
 			 * Set for reading sockets which are accepting
 			 */
 			if (so->so_state & SS_FACCEPTCONN) {
-                                FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
+				sowatch(so, IOLOOPER_READ);
 				continue;
 			}
 
@@ -359,18 +360,18 @@ void slirp_select_fill(int *pnfds,
 			 * Set for writing sockets which are connecting
 			 */
 			if (so->so_state & SS_ISFCONNECTING) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
+				sowatch(so, IOLOOPER_WRITE);
 				continue;
 			}
 
+			events = 0;
+
 			/*
 			 * Set for writing if we are connected, can send more, and
 			 * we have something to send
 			 */
 			if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
+				events |= IOLOOPER_WRITE;
 			}
 
 			/*
@@ -378,10 +379,10 @@ void slirp_select_fill(int *pnfds,
 			 * receive more, and we have room for it XXX /2 ?
 			 */
 			if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-				FD_SET(so->s, readfds);
-				FD_SET(so->s, xfds);
-				UPD_NFDS(so->s);
+				events |= IOLOOPER_READ | IOLOOPER_EXCEPT;
 			}
+
+			sowatch(so, events);
 		}
 
 		/*
@@ -415,10 +416,18 @@ void slirp_select_fill(int *pnfds,
 			 * (XXX <= 4 ?)
 			 */
 			if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-				FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
+				sowatch(so, IOLOOPER_READ);
+			} else {
+				sowatch(so, 0);
 			}
 		}
+	} else {
+		/* nothing is read from or written to the sockets while the
+		 * link is down */
+		for (so = tcb.so_next; so != &tcb; so = so->so_next)
+			sowatch(so, 0);
+		for (so = udb.so_next; so != &udb; so = so->so_next)
+			sowatch(so, 0);
 	}
 
 	/*
@@ -457,19 +466,19 @@ void slirp_select_fill(int *pnfds,
     /*
      * now, the proxified sockets
      */
-    proxy_manager_select_fill(&nfds, readfds, writefds, xfds);
-
-        *pnfds = nfds;
+    proxy_manager_select_fill(iol);
 }
 
-void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
+/*
+ * Processes the events reported by the last wait on 'iol'; nothing is
+ * reported when the wait failed.
+ */
+void slirp_pollfds_poll(IoLooper *iol)
 {
     struct socket *so, *so_next;
     int ret;
 
-    global_readfds = readfds;
-    global_writefds = writefds;
-    global_xfds = xfds;
+    global_looper = iol;
 
 	/* Update time */
 	updtime();
@@ -518,12 +527,12 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 			 * This will soread as well, so no need to
 			 * test for readfds below if this succeeds
 			 */
-			if (FD_ISSET(so->s, xfds))
+			if (iolooper_is_except(iol, so->s))
 			   sorecvoob(so);
 			/*
 			 * Check sockets for reading
 			 */
-			else if (FD_ISSET(so->s, readfds)) {
+			else if (iolooper_is_read(iol, so->s)) {
 				/*
 				 * Check for incoming connections
 				 */
@@ -541,7 +550,7 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 			/*
 			 * Check sockets for writing
 			 */
-			if (FD_ISSET(so->s, writefds)) {
+			if (iolooper_is_write(iol, so->s)) {
 			  /*
 			   * Check for non-blocking, still-connecting sockets
 			   */
@@ -623,7 +632,7 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
             if ((so->so_state & SS_PROXIFIED) != 0)
                 continue;
 
-			if (so->s != -1 && FD_ISSET(so->s, readfds)) {
+			if (so->s != -1 && iolooper_is_read(iol, so->s)) {
                             sorecvfrom(so);
                         }
 		}
@@ -632,7 +641,7 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
     /*
      * Now the proxified sockets
      */
-    proxy_manager_poll(readfds, writefds, xfds);
+    proxy_manager_poll(iol);
 
 	/*
 	 * See if we can start outputting
@@ -640,14 +649,6 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 	if (if_queued && link_up)
 	   if_start();
 
-	/* clear global file descriptor sets.
-	 * these reside on the stack in vl.c
-	 * so they're unusable if we're not in
-	 * slirp_select_fill or slirp_select_poll.
-	 */
-	 global_readfds = NULL;
-	 global_writefds = NULL;
-	 global_xfds = NULL;
 }
 
 #define ETH_ALEN 6
@@ -1166,6 +1167,7 @@ int slirp_redir_rm(int is_udp, int host_port)
  loop_again:
     for (so = head->so_next; so != head; so = so->so_next) {
         if (so->so_faddr_port == host_port) {
+            sowatch(so, 0);
             close(so->s);
             sofree(so);
             n++;
@@ -16,6 +16,7 @@
 #define  SLIRP_COMPILATION 1
 #include "sockets.h"
 #include "proxy_common.h"
+#include "iolooper.h"
 
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
@@ -73,6 +74,8 @@ socreate(void)
 void
 sofree(struct socket *so)
 {
+  sowatch(so, 0);
+
   if (so->so_state & SS_PROXIFIED)
     proxy_manager_del(so);
 
@@ -687,6 +690,7 @@ sounlisten(u_int  port)
 
     sofcantrcvmore( so );
     sofcantsendmore( so );
+    sowatch( so, 0 );
     close( so->s );
     so->s = -1;
     sofree( so );
@@ -742,14 +746,28 @@ soisfconnected(struct socket *so)
 	so->so_state |= SS_ISFCONNECTED; /* Clobber other states */
 }
 
+/*
+ * Sets the events the main loop watches so->s for; the looper is only told
+ * about changes. Must be called with 0 before so->s is closed, since its
+ * number may be reused by the next socket.
+ */
+void
+sowatch(struct socket *so, int events)
+{
+	if (so->so_events != events) {
+		if (global_looper)
+			iolooper_modify(global_looper, so->s, so->so_events, events);
+		so->so_events = events;
+	}
+}
+
 static void
 sofcantrcvmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
 		shutdown(so->s,0);
-		if(global_writefds) {
-		  FD_CLR(so->s,global_writefds);
-		}
+		/* don't process pending writes in this poll */
+		sowatch(so, so->so_events & ~IOLOOPER_WRITE);
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTSENDMORE)
@@ -763,12 +781,8 @@ sofcantsendmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
             shutdown(so->s,1);           /* send FIN to fhost */
-            if (global_readfds) {
-                FD_CLR(so->s,global_readfds);
-            }
-            if (global_xfds) {
-                FD_CLR(so->s,global_xfds);
-            }
+            /* don't process pending reads in this poll */
+            sowatch(so, so->so_events & ~(IOLOOPER_READ|IOLOOPER_EXCEPT));
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTRCVMORE)
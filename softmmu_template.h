@@ -80,6 +80,11 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(target_phys_addr_t physaddr,
     }
 
     env->mem_io_vaddr = addr;
+#ifdef CONFIG_IOTHREAD
+    /* devices are only entered with the global lock held */
+    if (index > (IO_MEM_WATCH >> IO_MEM_SHIFT))
+        qemu_cpu_io_begin();
+#endif
 #if SHIFT <= 2
     res = io_mem_read[index][SHIFT](io_mem_opaque[index], physaddr);
 #else
@@ -91,6 +96,10 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(target_phys_addr_t physaddr,
     res |= (uint64_t)io_mem_read[index][2](io_mem_opaque[index], physaddr + 4) << 32;
 #endif
 #endif /* SHIFT > 2 */
+#ifdef CONFIG_IOTHREAD
+    if (index > (IO_MEM_WATCH >> IO_MEM_SHIFT))
+        qemu_cpu_io_end();
+#endif
     return res;
 }
 
@@ -259,6 +268,10 @@ static inline void glue(io_write, SUFFIX)(target_phys_addr_t physaddr,
 
     env->mem_io_vaddr = addr;
     env->mem_io_pc = (unsigned long)retaddr;
+#ifdef CONFIG_IOTHREAD
+    if (index > (IO_MEM_WATCH >> IO_MEM_SHIFT))
+        qemu_cpu_io_begin();
+#endif
 #if SHIFT <= 2
     io_mem_write[index][SHIFT](io_mem_opaque[index], physaddr, val);
 #else
@@ -270,6 +283,10 @@ static inline void glue(io_write, SUFFIX)(target_phys_addr_t physaddr,
     io_mem_write[index][2](io_mem_opaque[index], physaddr + 4, val >> 32);
 #endif
 #endif /* SHIFT > 2 */
+#ifdef CONFIG_IOTHREAD
+    if (index > (IO_MEM_WATCH >> IO_MEM_SHIFT))
+        qemu_cpu_io_end();
+#endif
 }
 
 void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr,
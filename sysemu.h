@@ -45,6 +45,7 @@ void cpu_enable_ticks(void);
 void cpu_disable_ticks(void);
 
 void qemu_system_reset_request(void);
+void qemu_system_vmstop_request(int reason);
 void qemu_system_shutdown_request(void);
 void qemu_system_powerdown_request(void);
 int qemu_shutdown_requested(void);
@@ -65,6 +66,7 @@ void do_savevm(Monitor *mon, const char *name);
 void do_loadvm(Monitor *mon, const char *name);
 void do_delvm(Monitor *mon, const char *name);
 void do_info_snapshots(Monitor *mon, Monitor* err);
+void do_info_savevm(Monitor *mon);
 
 void qemu_announce_self(void);
 
@@ -95,6 +97,7 @@ int tap_win32_init(VLANState *vlan, const char *model,
 void do_info_slirp(Monitor *mon);
 
 extern int autostart;
+extern int lazy_ram_restore;
 extern int bios_size;
 extern int cirrus_vga_enabled;
 extern int std_vga_enabled;
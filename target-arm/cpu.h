@@ -71,6 +71,13 @@ struct arm_boot_info;
 
 #define NB_MMU_MODES 2
 
+/* Use host SIMD for whole-register NEON integer operations.  This relies
+   on D registers being laid out in host memory in element order, which
+   holds on little-endian x86 hosts.  */
+#if defined(__SSE2__) && !defined(HOST_WORDS_BIGENDIAN)
+#define NEON_HOST_SIMD 1
+#endif
+
 /* We currently assume float and double are IEEE single and double
    precision respectively.
    Doing runtime conversions is tricky because VFP registers may contain
@@ -515,6 +522,9 @@ static inline void cpu_clone_regs(CPUState *env, target_ulong newsp)
 #define ARM_TBFLAG_CONDEXEC(F) \
     (((F) & ARM_TBFLAG_CONDEXEC_MASK) >> ARM_TBFLAG_CONDEXEC_SHIFT)
 
+/* Only a 32-bit Thumb-2 instruction can straddle a page boundary.  */
+#define TB_MAY_CROSS_PAGE(flags) ((flags) & ARM_TBFLAG_THUMB_MASK)
+
 static inline void cpu_get_tb_cpu_state(CPUState *env, target_ulong *pc,
                                         target_ulong *cs_base, int *flags)
 {
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <float.h>
+#include <math.h>
 
 #include "cpu.h"
 #include "exec-all.h"
@@ -958,7 +960,7 @@ void do_interrupt(CPUARMState *env)
     }
     env->regs[14] = env->regs[15] + offset;
     env->regs[15] = addr;
-    env->interrupt_request |= CPU_INTERRUPT_EXITTB;
+    __sync_fetch_and_or(&env->interrupt_request, CPU_INTERRUPT_EXITTB);
 }
 
 /* Check section/page access permissions.
@@ -2694,6 +2696,125 @@ void vfp_set_fpscr(CPUState *env, uint32_t val)
 
 #define VFP_HELPER(name, p) HELPER(glue(glue(vfp_,name),p))
 
+/* Host FPU fast path.  When the host evaluates float and double in their
+   own precision, the guest asks for round-to-nearest, no exception traps
+   are enabled and the sticky inexact flag is already set, an operation on
+   zero or normal operands that produces a normal result raises no new
+   exception, so the host FPU gives exactly the softfloat answer.  Anything
+   else (NaNs, infinities, denormals, possible overflow or underflow, or a
+   first inexact result) goes through softfloat.  */
+#if defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ == 0
+#define VFP_HOST_FPU 1
+#endif
+
+#ifdef VFP_HOST_FPU
+/* FPSCR IOE, DZE, OFE, UFE, IXE and IDE.  */
+#define VFP_TRAP_ENABLE_MASK 0x9f00
+
+static inline int vfp_host_fpu_usable(CPUState *env)
+{
+    float_status *s = &env->vfp.fp_status;
+
+    return get_float_rounding_mode(s) == float_round_nearest_even
+           && (get_float_exception_flags(s) & float_flag_inexact)
+           && !(env->vfp.xregs[ARM_VFP_FPSCR] & VFP_TRAP_ENABLE_MASK);
+}
+
+static inline int vfp_f32_zero_or_normal(float32 a)
+{
+    uint32_t exp = (float32_val(a) >> 23) & 0xff;
+    return exp != 0xff && (exp != 0 || float32_is_zero(a));
+}
+
+static inline int vfp_f64_zero_or_normal(float64 a)
+{
+    uint64_t exp = (float64_val(a) >> 52) & 0x7ff;
+    return exp != 0x7ff && (exp != 0 || float64_is_zero(a));
+}
+
+static inline float vfp_f32_to_host(float32 a)
+{
+    union { uint32_t i; float f; } u;
+    u.i = float32_val(a);
+    return u.f;
+}
+
+static inline float32 vfp_f32_from_host(float f)
+{
+    union { uint32_t i; float f; } u;
+    u.f = f;
+    return make_float32(u.i);
+}
+
+static inline double vfp_f64_to_host(float64 a)
+{
+    union { uint64_t i; double f; } u;
+    u.i = float64_val(a);
+    return u.f;
+}
+
+static inline float64 vfp_f64_from_host(double f)
+{
+    union { uint64_t i; double f; } u;
+    u.f = f;
+    return make_float64(u.i);
+}
+
+/* Results strictly between the smallest normal and the largest finite
+   value cannot have underflowed or overflowed.  */
+static inline int vfp_f32_result_normal(float r)
+{
+    return fabsf(r) > FLT_MIN && fabsf(r) <= FLT_MAX;
+}
+
+static inline int vfp_f64_result_normal(double r)
+{
+    return fabs(r) > DBL_MIN && fabs(r) <= DBL_MAX;
+}
+
+/* An exactly zero sum of finite operands is exact.  */
+#define VFP_FAST_add(p, a, b, r) \
+    (vfp_##p##_result_normal(r) || (r) == 0)
+#define VFP_FAST_sub VFP_FAST_add
+/* A product or quotient with a zero dividend is an exact signed zero.  */
+#define VFP_FAST_mul(p, a, b, r) \
+    (vfp_##p##_result_normal(r) || (a) == 0 || (b) == 0)
+#define VFP_FAST_div(p, a, b, r) \
+    ((b) != 0 && (vfp_##p##_result_normal(r) || (a) == 0))
+
+#define VFP_BINOP(name, op) \
+float32 VFP_HELPER(name, s)(float32 a, float32 b, CPUState *env) \
+{ \
+    if (vfp_host_fpu_usable(env) && vfp_f32_zero_or_normal(a) \
+        && vfp_f32_zero_or_normal(b)) { \
+        float ha = vfp_f32_to_host(a); \
+        float hb = vfp_f32_to_host(b); \
+        float r = ha op hb; \
+        if (VFP_FAST_##name(f32, ha, hb, r)) { \
+            return vfp_f32_from_host(r); \
+        } \
+    } \
+    return float32_ ## name (a, b, &env->vfp.fp_status); \
+} \
+float64 VFP_HELPER(name, d)(float64 a, float64 b, CPUState *env) \
+{ \
+    if (vfp_host_fpu_usable(env) && vfp_f64_zero_or_normal(a) \
+        && vfp_f64_zero_or_normal(b)) { \
+        double ha = vfp_f64_to_host(a); \
+        double hb = vfp_f64_to_host(b); \
+        double r = ha op hb; \
+        if (VFP_FAST_##name(f64, ha, hb, r)) { \
+            return vfp_f64_from_host(r); \
+        } \
+    } \
+    return float64_ ## name (a, b, &env->vfp.fp_status); \
+}
+VFP_BINOP(add, +)
+VFP_BINOP(sub, -)
+VFP_BINOP(mul, *)
+VFP_BINOP(div, /)
+#undef VFP_BINOP
+#else
 #define VFP_BINOP(name) \
 float32 VFP_HELPER(name, s)(float32 a, float32 b, CPUState *env) \
 { \
@@ -2708,6 +2829,7 @@ VFP_BINOP(sub)
 VFP_BINOP(mul)
 VFP_BINOP(div)
 #undef VFP_BINOP
+#endif /* VFP_HOST_FPU */
 
 float32 VFP_HELPER(neg, s)(float32 a)
 {
@@ -2731,11 +2853,24 @@ float64 VFP_HELPER(abs, d)(float64 a)
 
 float32 VFP_HELPER(sqrt, s)(float32 a, CPUState *env)
 {
+#ifdef VFP_HOST_FPU
+    /* The square root of a non-negative normal is always normal.  */
+    if (vfp_host_fpu_usable(env) && vfp_f32_zero_or_normal(a)
+        && (!float32_is_neg(a) || float32_is_zero(a))) {
+        return vfp_f32_from_host(sqrtf(vfp_f32_to_host(a)));
+    }
+#endif
     return float32_sqrt(a, &env->vfp.fp_status);
 }
 
 float64 VFP_HELPER(sqrt, d)(float64 a, CPUState *env)
 {
+#ifdef VFP_HOST_FPU
+    if (vfp_host_fpu_usable(env) && vfp_f64_zero_or_normal(a)
+        && (!float64_is_neg(a) || float64_is_zero(a))) {
+        return vfp_f64_from_host(sqrt(vfp_f64_to_host(a)));
+    }
+#endif
     return float64_sqrt(a, &env->vfp.fp_status);
 }
 
@@ -52,6 +52,7 @@ DEF_HELPER_1(logicq_cc, i32, i64)
 DEF_HELPER_3(sel_flags, i32, i32, i32, i32)
 DEF_HELPER_1(exception, void, i32)
 DEF_HELPER_0(wfi, void)
+DEF_HELPER_0(lookup_tb_ptr, ptr)
 
 DEF_HELPER_2(cpsr_write, void, i32, i32)
 DEF_HELPER_0(cpsr_read, i32)
@@ -473,5 +474,29 @@ DEF_HELPER_2(neon_qzip16, void, i32, i32)
 DEF_HELPER_2(neon_qzip32, void, i32, i32)
 DEF_HELPER_1(neon_vldst_all, void, i32)
 
+#ifdef NEON_HOST_SIMD
+DEF_HELPER_4(neon_vec_add, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_sub, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_qadd, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_qsub, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_hadd, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_rhadd, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_hsub, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_cgt, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_cge, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_max, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_min, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_abd, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_aba, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_mul, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_mla, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_mls, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_tst, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_ceq, void, i32, i32, i32, i32)
+DEF_HELPER_4(neon_vec_logic, void, i32, i32, i32, i32)
+DEF_HELPER_3(neon_vec_abs, void, i32, i32, i32)
+DEF_HELPER_3(neon_vec_neg, void, i32, i32, i32)
+#endif
+
 #include "helper-android.h"
 #include "def-helper.h"
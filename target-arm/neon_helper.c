@@ -10,6 +10,12 @@
 #include <stdio.h>
 
 #include "cpu.h"
+#ifdef NEON_HOST_SIMD
+#include <emmintrin.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#endif
 #include "exec.h"
 #include "helper.h"
 
@@ -2020,3 +2026,451 @@ void HELPER(neon_zip16)(uint32_t rd, uint32_t rm)
     env->vfp.regs[rm] = make_float64(m0);
     env->vfp.regs[rd] = make_float64(d0);
 }
+
+#ifdef NEON_HOST_SIMD
+/* Whole-register NEON operations using host SSE2 (and SSSE3 where
+   available).  Each helper processes a complete D or Q register in one
+   call rather than one 32-bit chunk at a time.  DESC packs the Q bit,
+   element size and U bit as (q << 3) | (size << 1) | u, and the results
+   must match the per-chunk helpers above bit for bit, including QC.  */
+
+#define NEON_VEC_Q(desc)    (((desc) >> 3) & 1)
+#define NEON_VEC_SIZE(desc) (((desc) >> 1) & 3)
+#define NEON_VEC_U(desc)    ((desc) & 1)
+
+static inline __m128i neon_vec_load(uint32_t reg, int q)
+{
+    if (q) {
+        return _mm_loadu_si128((const __m128i *)&env->vfp.regs[reg]);
+    }
+    return _mm_loadl_epi64((const __m128i *)&env->vfp.regs[reg]);
+}
+
+static inline void neon_vec_store(uint32_t reg, __m128i val, int q)
+{
+    if (q) {
+        _mm_storeu_si128((__m128i *)&env->vfp.regs[reg], val);
+    } else {
+        _mm_storel_epi64((__m128i *)&env->vfp.regs[reg], val);
+    }
+}
+
+/* The most significant bit of every element.  */
+static inline __m128i neon_vec_signbits(int size)
+{
+    switch (size) {
+    case 0: return _mm_set1_epi8((char)0x80);
+    case 1: return _mm_set1_epi16((short)0x8000);
+    default: return _mm_set1_epi32((int)0x80000000);
+    }
+}
+
+static inline __m128i neon_vec_ones(void)
+{
+    __m128i zero = _mm_setzero_si128();
+    return _mm_cmpeq_epi32(zero, zero);
+}
+
+static inline __m128i neon_vec_add_n(__m128i a, __m128i b, int size)
+{
+    switch (size) {
+    case 0: return _mm_add_epi8(a, b);
+    case 1: return _mm_add_epi16(a, b);
+    default: return _mm_add_epi32(a, b);
+    }
+}
+
+static inline __m128i neon_vec_sub_n(__m128i a, __m128i b, int size)
+{
+    switch (size) {
+    case 0: return _mm_sub_epi8(a, b);
+    case 1: return _mm_sub_epi16(a, b);
+    default: return _mm_sub_epi32(a, b);
+    }
+}
+
+static inline __m128i neon_vec_cmpeq_n(__m128i a, __m128i b, int size)
+{
+    switch (size) {
+    case 0: return _mm_cmpeq_epi8(a, b);
+    case 1: return _mm_cmpeq_epi16(a, b);
+    default: return _mm_cmpeq_epi32(a, b);
+    }
+}
+
+/* Element-wise a > b, all ones where true.  Unsigned compares are done
+   by flipping the sign bits and using the signed compare.  */
+static inline __m128i neon_vec_cmpgt_n(__m128i a, __m128i b, int size, int u)
+{
+    if (u) {
+        __m128i sign = neon_vec_signbits(size);
+        a = _mm_xor_si128(a, sign);
+        b = _mm_xor_si128(b, sign);
+    }
+    switch (size) {
+    case 0: return _mm_cmpgt_epi8(a, b);
+    case 1: return _mm_cmpgt_epi16(a, b);
+    default: return _mm_cmpgt_epi32(a, b);
+    }
+}
+
+/* Select elements of A where MASK is set and of B elsewhere.  */
+static inline __m128i neon_vec_select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline __m128i neon_vec_mul_n(__m128i a, __m128i b, int size)
+{
+    __m128i even, odd;
+
+    switch (size) {
+    case 0:
+        /* No byte multiply: do the even and odd bytes as halfwords.  */
+        even = _mm_and_si128(_mm_mullo_epi16(a, b), _mm_set1_epi16(0xff));
+        odd = _mm_slli_epi16(_mm_mullo_epi16(_mm_srli_epi16(a, 8),
+                                             _mm_srli_epi16(b, 8)), 8);
+        return _mm_or_si128(even, odd);
+    case 1:
+        return _mm_mullo_epi16(a, b);
+    default:
+        even = _mm_mul_epu32(a, b);
+        odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+}
+
+static inline __m128i neon_vec_abd_n(__m128i a, __m128i b, int size, int u)
+{
+    return neon_vec_select(neon_vec_cmpgt_n(a, b, size, u),
+                           neon_vec_sub_n(a, b, size),
+                           neon_vec_sub_n(b, a, size));
+}
+
+/* Shift right by one with the shift kind matching the signedness.  Only
+   used for 32-bit elements; bytes and halfwords go through pavg.  */
+static inline __m128i neon_vec_sr1_32(__m128i a, int u)
+{
+    return u ? _mm_srli_epi32(a, 1) : _mm_srai_epi32(a, 1);
+}
+
+/* Apply a per-chunk helper to every 32-bit chunk of a register, for the
+   few element types SSE2 has no saturating arithmetic for.  */
+static void neon_vec_scalar(uint32_t rd, uint32_t rn, uint32_t rm, int q,
+                            uint32_t (*fn)(uint32_t, uint32_t))
+{
+    uint32_t *d = (uint32_t *)&env->vfp.regs[rd];
+    uint32_t *n = (uint32_t *)&env->vfp.regs[rn];
+    uint32_t *m = (uint32_t *)&env->vfp.regs[rm];
+    uint32_t res[4];
+    int pass;
+
+    for (pass = 0; pass < (q ? 4 : 2); pass++) {
+        res[pass] = fn(n[pass], m[pass]);
+    }
+    memcpy(d, res, (q ? 4 : 2) * sizeof(uint32_t));
+}
+
+#define NEON_VEC_BEGIN(desc, rn, rm) \
+    int q = NEON_VEC_Q(desc); \
+    int size = NEON_VEC_SIZE(desc); \
+    int u = NEON_VEC_U(desc); \
+    __m128i a = neon_vec_load(rn, q); \
+    __m128i b = neon_vec_load(rm, q)
+
+void HELPER(neon_vec_add)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    (void)u;
+    neon_vec_store(rd, neon_vec_add_n(a, b, size), q);
+}
+
+void HELPER(neon_vec_sub)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    (void)u;
+    neon_vec_store(rd, neon_vec_sub_n(a, b, size), q);
+}
+
+void HELPER(neon_vec_qadd)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    __m128i res;
+
+    switch ((size << 1) | u) {
+    case 0: res = _mm_adds_epi8(a, b); break;
+    case 1: res = _mm_adds_epu8(a, b); break;
+    case 2: res = _mm_adds_epi16(a, b); break;
+    case 3: res = _mm_adds_epu16(a, b); break;
+    default:
+        neon_vec_scalar(rd, rn, rm, q, u ? helper_neon_qadd_u32
+                                         : helper_neon_qadd_s32);
+        return;
+    }
+    /* Saturation happened wherever the result differs from the
+       wrapping sum.  */
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(res, neon_vec_add_n(a, b, size)))
+        != 0xffff) {
+        SET_QC();
+    }
+    neon_vec_store(rd, res, q);
+}
+
+void HELPER(neon_vec_qsub)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    __m128i res;
+
+    switch ((size << 1) | u) {
+    case 0: res = _mm_subs_epi8(a, b); break;
+    case 1: res = _mm_subs_epu8(a, b); break;
+    case 2: res = _mm_subs_epi16(a, b); break;
+    case 3: res = _mm_subs_epu16(a, b); break;
+    default:
+        neon_vec_scalar(rd, rn, rm, q, u ? helper_neon_qsub_u32
+                                         : helper_neon_qsub_s32);
+        return;
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(res, neon_vec_sub_n(a, b, size)))
+        != 0xffff) {
+        SET_QC();
+    }
+    neon_vec_store(rd, res, q);
+}
+
+/* Bytes and halfwords use the unsigned rounding average; signed elements
+   are biased into unsigned range first.  (a + b + 1) >> 1 is pavg, and
+   the truncating forms subtract the carry that pavg rounded in.  */
+static inline __m128i neon_vec_avg_n(__m128i a, __m128i b, int size)
+{
+    return size ? _mm_avg_epu16(a, b) : _mm_avg_epu8(a, b);
+}
+
+static inline __m128i neon_vec_lsb(int size)
+{
+    return size ? _mm_set1_epi16(1) : _mm_set1_epi8(1);
+}
+
+void HELPER(neon_vec_hadd)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    __m128i res;
+
+    if (size == 2) {
+        res = _mm_add_epi32(_mm_add_epi32(neon_vec_sr1_32(a, u),
+                                          neon_vec_sr1_32(b, u)),
+                            _mm_and_si128(_mm_and_si128(a, b),
+                                          _mm_set1_epi32(1)));
+    } else {
+        __m128i sign = neon_vec_signbits(size);
+        if (!u) {
+            a = _mm_xor_si128(a, sign);
+            b = _mm_xor_si128(b, sign);
+        }
+        res = neon_vec_sub_n(neon_vec_avg_n(a, b, size),
+                             _mm_and_si128(_mm_xor_si128(a, b),
+                                           neon_vec_lsb(size)), size);
+        if (!u) {
+            res = _mm_xor_si128(res, sign);
+        }
+    }
+    neon_vec_store(rd, res, q);
+}
+
+void HELPER(neon_vec_rhadd)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    __m128i res;
+
+    if (size == 2) {
+        res = _mm_add_epi32(_mm_add_epi32(neon_vec_sr1_32(a, u),
+                                          neon_vec_sr1_32(b, u)),
+                            _mm_and_si128(_mm_or_si128(a, b),
+                                          _mm_set1_epi32(1)));
+    } else {
+        __m128i sign = neon_vec_signbits(size);
+        if (!u) {
+            a = _mm_xor_si128(a, sign);
+            b = _mm_xor_si128(b, sign);
+        }
+        res = neon_vec_avg_n(a, b, size);
+        if (!u) {
+            res = _mm_xor_si128(res, sign);
+        }
+    }
+    neon_vec_store(rd, res, q);
+}
+
+void HELPER(neon_vec_hsub)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    __m128i res;
+
+    if (size == 2) {
+        res = _mm_sub_epi32(_mm_sub_epi32(neon_vec_sr1_32(a, u),
+                                          neon_vec_sr1_32(b, u)),
+                            _mm_and_si128(_mm_andnot_si128(a, b),
+                                          _mm_set1_epi32(1)));
+    } else {
+        /* pavg(a, ~b) is (a - b) / 2 rounded down, offset by half the
+           element range.  */
+        __m128i sign = neon_vec_signbits(size);
+        if (!u) {
+            a = _mm_xor_si128(a, sign);
+            b = _mm_xor_si128(b, sign);
+        }
+        res = _mm_xor_si128(neon_vec_avg_n(a, _mm_xor_si128(b, neon_vec_ones()),
+                                           size), sign);
+    }
+    neon_vec_store(rd, res, q);
+}
+
+void HELPER(neon_vec_cgt)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    neon_vec_store(rd, neon_vec_cmpgt_n(a, b, size, u), q);
+}
+
+void HELPER(neon_vec_cge)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    neon_vec_store(rd, _mm_xor_si128(neon_vec_cmpgt_n(b, a, size, u),
+                                     neon_vec_ones()), q);
+}
+
+void HELPER(neon_vec_max)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    __m128i res;
+
+    switch ((size << 1) | u) {
+    case 1: res = _mm_max_epu8(a, b); break;
+    case 2: res = _mm_max_epi16(a, b); break;
+    default:
+        res = neon_vec_select(neon_vec_cmpgt_n(a, b, size, u), a, b);
+        break;
+    }
+    neon_vec_store(rd, res, q);
+}
+
+void HELPER(neon_vec_min)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    __m128i res;
+
+    switch ((size << 1) | u) {
+    case 1: res = _mm_min_epu8(a, b); break;
+    case 2: res = _mm_min_epi16(a, b); break;
+    default:
+        res = neon_vec_select(neon_vec_cmpgt_n(a, b, size, u), b, a);
+        break;
+    }
+    neon_vec_store(rd, res, q);
+}
+
+void HELPER(neon_vec_abd)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    neon_vec_store(rd, neon_vec_abd_n(a, b, size, u), q);
+}
+
+void HELPER(neon_vec_aba)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    neon_vec_store(rd, neon_vec_add_n(neon_vec_load(rd, q),
+                                      neon_vec_abd_n(a, b, size, u), size), q);
+}
+
+void HELPER(neon_vec_mul)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    (void)u;
+    neon_vec_store(rd, neon_vec_mul_n(a, b, size), q);
+}
+
+void HELPER(neon_vec_mla)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    (void)u;
+    neon_vec_store(rd, neon_vec_add_n(neon_vec_mul_n(a, b, size),
+                                      neon_vec_load(rd, q), size), q);
+}
+
+void HELPER(neon_vec_mls)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    (void)u;
+    neon_vec_store(rd, neon_vec_sub_n(neon_vec_load(rd, q),
+                                      neon_vec_mul_n(a, b, size), size), q);
+}
+
+void HELPER(neon_vec_tst)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    (void)u;
+    neon_vec_store(rd, _mm_xor_si128(neon_vec_cmpeq_n(_mm_and_si128(a, b),
+                                                      _mm_setzero_si128(),
+                                                      size),
+                                     neon_vec_ones()), q);
+}
+
+void HELPER(neon_vec_ceq)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    (void)u;
+    neon_vec_store(rd, neon_vec_cmpeq_n(a, b, size), q);
+}
+
+/* VAND, VBIC, VORR, VORN, VEOR, VBSL, VBIT, VBIF selected by
+   (u << 2) | size as in the instruction encoding.  */
+void HELPER(neon_vec_logic)(uint32_t rd, uint32_t rn, uint32_t rm, uint32_t desc)
+{
+    NEON_VEC_BEGIN(desc, rn, rm);
+    __m128i res;
+
+    switch ((u << 2) | size) {
+    case 0: res = _mm_and_si128(a, b); break;
+    case 1: res = _mm_andnot_si128(b, a); break;
+    case 2: res = _mm_or_si128(a, b); break;
+    case 3: res = _mm_or_si128(a, _mm_xor_si128(b, neon_vec_ones())); break;
+    case 4: res = _mm_xor_si128(a, b); break;
+    case 5: res = neon_vec_select(neon_vec_load(rd, q), a, b); break;
+    case 6: res = neon_vec_select(b, a, neon_vec_load(rd, q)); break;
+    default: res = neon_vec_select(b, neon_vec_load(rd, q), a); break;
+    }
+    neon_vec_store(rd, res, q);
+}
+
+void HELPER(neon_vec_abs)(uint32_t rd, uint32_t rm, uint32_t desc)
+{
+    int q = NEON_VEC_Q(desc);
+    int size = NEON_VEC_SIZE(desc);
+    __m128i a = neon_vec_load(rm, q);
+    __m128i res;
+
+#ifdef __SSSE3__
+    switch (size) {
+    case 0: res = _mm_abs_epi8(a); break;
+    case 1: res = _mm_abs_epi16(a); break;
+    default: res = _mm_abs_epi32(a); break;
+    }
+#else
+    {
+        /* (a ^ m) - m where m is all ones for negative elements.  */
+        __m128i m = neon_vec_cmpgt_n(_mm_setzero_si128(), a, size, 0);
+        res = neon_vec_sub_n(_mm_xor_si128(a, m), m, size);
+    }
+#endif
+    neon_vec_store(rd, res, q);
+}
+
+void HELPER(neon_vec_neg)(uint32_t rd, uint32_t rm, uint32_t desc)
+{
+    int q = NEON_VEC_Q(desc);
+    int size = NEON_VEC_SIZE(desc);
+
+    neon_vec_store(rd, neon_vec_sub_n(_mm_setzero_si128(),
+                                      neon_vec_load(rm, q), size), q);
+}
+#endif /* NEON_HOST_SIMD */
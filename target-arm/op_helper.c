@@ -18,6 +18,7 @@
  */
 #include "exec.h"
 #include "helper.h"
+#include "qemu-barrier.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -279,6 +280,36 @@ void HELPER(wfi)(void)
     cpu_loop_exit();
 }
 
+/* Find the TB for the current CPU state in the virtual PC cache, so that
+   translated code ending in an indirect branch can jump straight to it.
+   Returns NULL when cpu_exec must take over instead: on a cache miss, or
+   when an interrupt or exit request is pending.  */
+void *HELPER(lookup_tb_ptr)(void)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        tb_lookup_miss_count++;
+        return NULL;
+    }
+    /* cpu_interrupt and cpu_exit unlink the chain of env->current_tb, so
+       publish the new TB before looking for pending requests: one that
+       arrives after the check will unlink the TB we are jumping to.  */
+    env->current_tb = tb;
+    barrier();
+    if (unlikely(env->interrupt_request || env->exit_request)) {
+        tb_lookup_miss_count++;
+        return NULL;
+    }
+    tb_lookup_hit_count++;
+    return tb->tc_ptr;
+}
+
 void HELPER(exception)(uint32_t excp)
 {
     env->exception_index = excp;
@@ -741,7 +741,9 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    /* The Thumb bit is part of the TB flags, so an indirect jump lookup
+       of the next TB picks up the new state.  */
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -842,6 +844,22 @@ static inline void gen_set_pc_im(uint32_t val)
     tcg_gen_movi_i32(cpu_R[15], val);
 }
 
+/* End the TB with a jump to the TB for the current PC and CPU state,
+   looked up from translated code.  Falls back to returning to cpu_exec
+   when the lookup misses or an interrupt is pending.  */
+static void gen_goto_ptr(void)
+{
+    TCGv_ptr ptr = tcg_temp_local_new_ptr();
+    int exit_label = gen_new_label();
+
+    gen_helper_lookup_tb_ptr(ptr);
+    tcg_gen_brcondi_ptr(TCG_COND_EQ, ptr, 0, exit_label);
+    tcg_gen_goto_ptr(ptr);
+    gen_set_label(exit_label);
+    tcg_temp_free_ptr(ptr);
+    tcg_gen_exit_tb(0);
+}
+
 /* Force a TB lookup after an instruction that changes the CPU state.  */
 static inline void gen_lookup_tb(DisasContext *s)
 {
@@ -3450,6 +3468,9 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
     TranslationBlock *tb;
 
     tb = s->tb;
+    /* Queue the successor for speculative translation.  It normally
+       starts outside any IT block.  */
+    tb_prefetch_add(dest, 0, tb->flags & ~ARM_TBFLAG_CONDEXEC_MASK);
     if ((tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK)) {
         tcg_gen_goto_tb(n);
         gen_set_pc_im(dest);
@@ -4408,6 +4429,83 @@ static const uint8_t neon_2rm_sizes[] = {
     [NEON_2RM_VCVT_UF] = 0x4,
 };
 
+#ifdef NEON_HOST_SIMD
+/* Emit a single whole-register helper call for a "three registers of the
+   same length" integer operation.  Returns nonzero if the operation was
+   handled, zero to fall back to the 32-bit chunk loop.  */
+static int gen_neon_vec_3same(int op, int q, int u, int size,
+                              int rd, int rn, int rm)
+{
+    void (*gen)(TCGv, TCGv, TCGv, TCGv);
+    TCGv td, tn, tm, desc;
+
+    switch (op) {
+    case NEON_3R_VHADD: gen = gen_helper_neon_vec_hadd; break;
+    case NEON_3R_VQADD: gen = gen_helper_neon_vec_qadd; break;
+    case NEON_3R_VRHADD: gen = gen_helper_neon_vec_rhadd; break;
+    case NEON_3R_LOGIC: gen = gen_helper_neon_vec_logic; break;
+    case NEON_3R_VHSUB: gen = gen_helper_neon_vec_hsub; break;
+    case NEON_3R_VQSUB: gen = gen_helper_neon_vec_qsub; break;
+    case NEON_3R_VCGT: gen = gen_helper_neon_vec_cgt; break;
+    case NEON_3R_VCGE: gen = gen_helper_neon_vec_cge; break;
+    case NEON_3R_VMAX: gen = gen_helper_neon_vec_max; break;
+    case NEON_3R_VMIN: gen = gen_helper_neon_vec_min; break;
+    case NEON_3R_VABD: gen = gen_helper_neon_vec_abd; break;
+    case NEON_3R_VABA: gen = gen_helper_neon_vec_aba; break;
+    case NEON_3R_VADD_VSUB:
+        gen = u ? gen_helper_neon_vec_sub : gen_helper_neon_vec_add;
+        break;
+    case NEON_3R_VTST_VCEQ:
+        gen = u ? gen_helper_neon_vec_ceq : gen_helper_neon_vec_tst;
+        break;
+    case NEON_3R_VML:
+        gen = u ? gen_helper_neon_vec_mls : gen_helper_neon_vec_mla;
+        break;
+    case NEON_3R_VMUL:
+        if (u) {
+            /* Polynomial multiply stays on the chunk helpers.  */
+            return 0;
+        }
+        gen = gen_helper_neon_vec_mul;
+        break;
+    default:
+        return 0;
+    }
+    td = tcg_const_i32(rd);
+    tn = tcg_const_i32(rn);
+    tm = tcg_const_i32(rm);
+    desc = tcg_const_i32((q << 3) | (size << 1) | u);
+    gen(td, tn, tm, desc);
+    tcg_temp_free_i32(td);
+    tcg_temp_free_i32(tn);
+    tcg_temp_free_i32(tm);
+    tcg_temp_free_i32(desc);
+    return 1;
+}
+
+/* Likewise for the integer "two registers, miscellaneous" operations.  */
+static int gen_neon_vec_2misc(int op, int q, int size, int rd, int rm)
+{
+    void (*gen)(TCGv, TCGv, TCGv);
+    TCGv td, tm, desc;
+
+    switch (op) {
+    case NEON_2RM_VABS: gen = gen_helper_neon_vec_abs; break;
+    case NEON_2RM_VNEG: gen = gen_helper_neon_vec_neg; break;
+    default:
+        return 0;
+    }
+    td = tcg_const_i32(rd);
+    tm = tcg_const_i32(rm);
+    desc = tcg_const_i32((q << 3) | (size << 1));
+    gen(td, tm, desc);
+    tcg_temp_free_i32(td);
+    tcg_temp_free_i32(tm);
+    tcg_temp_free_i32(desc);
+    return 1;
+}
+#endif
+
 /* Translate a NEON data processing instruction.  Return nonzero if the
    instruction is invalid.
    We process data in a mixture of 32-bit and 64-bit chunks.
@@ -4571,6 +4669,12 @@ static int disas_neon_data_insn(CPUState * env, DisasContext *s, uint32_t insn)
             return 1;
         }
 
+#ifdef NEON_HOST_SIMD
+        if (!pairwise && gen_neon_vec_3same(op, q, u, size, rd, rn, rm)) {
+            return 0;
+        }
+#endif
+
         for (pass = 0; pass < (q ? 4 : 2); pass++) {
 
         if (pairwise) {
@@ -5818,6 +5922,12 @@ static int disas_neon_data_insn(CPUState * env, DisasContext *s, uint32_t insn)
                     tcg_temp_free_i32(tmp2);
                     tcg_temp_free_i32(tmp3);
                     break;
+#ifdef NEON_HOST_SIMD
+                case NEON_2RM_VABS:
+                case NEON_2RM_VNEG:
+                    gen_neon_vec_2misc(op, q, size, rd, rm);
+                    break;
+#endif
                 default:
                 elementwise:
                     for (pass = 0; pass < (q ? 4 : 2); pass++) {
@@ -9774,8 +9884,12 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* only the PC (and Thumb bit) changed: look up the next TB
+               without leaving translated code */
+            gen_goto_ptr();
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
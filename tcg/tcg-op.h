@@ -2526,8 +2526,22 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #define tcg_gen_add_ptr tcg_gen_add_i32
 #define tcg_gen_addi_ptr tcg_gen_addi_i32
 #define tcg_gen_ext_i32_ptr tcg_gen_mov_i32
+#define tcg_gen_brcondi_ptr tcg_gen_brcondi_i32
 #else /* TCG_TARGET_REG_BITS == 32 */
 #define tcg_gen_add_ptr tcg_gen_add_i64
 #define tcg_gen_addi_ptr tcg_gen_addi_i64
 #define tcg_gen_ext_i32_ptr tcg_gen_ext_i32_i64
+#define tcg_gen_brcondi_ptr tcg_gen_brcondi_i64
 #endif /* TCG_TARGET_REG_BITS != 32 */
+
+/* Jump to the host code at PTR, typically the start of another TB.  Like
+   goto_tb this ends the TB; PTR must be a local temp if it was computed
+   before a branch.  */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+#if TCG_TARGET_REG_BITS == 32
+    tcg_gen_op1_i32(INDEX_op_jmp, ptr);
+#else
+    tcg_gen_op1_i64(INDEX_op_jmp, ptr);
+#endif
+}
@@ -0,0 +1,150 @@
+/*
+ * Random O_DIRECT read benchmark for the raw-posix AIO backends: the
+ * posix-aio-compat thread pool and, with CONFIG_LINUX_AIO, the Linux
+ * native AIO of linux-aio.c (aio=native).
+ *
+ *     bench-aio [reads [depth...]]
+ *
+ * Creates a 256 MB raw image in $TMPDIR, which must support O_DIRECT (a
+ * tmpfs does not), with the sector number at the start of every 4 KB
+ * block.  For each depth (1, 32 and 300 by default), issues 'reads'
+ * (20000) random 4 KB reads in batches of 'depth' requests with both
+ * backends, checks every block that was read and prints the time taken.
+ *
+ * Built by tests/Makefile ('make -C tests bench-aio'), which links it
+ * against the objects of a built emulator.
+ */
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block.h"
+#include "qemu-aio.h"
+#include <time.h>
+
+#define IMAGE_SECTORS   (256LL * 1024 * 1024 / 512)
+
+typedef struct BenchRequest {
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t sector;
+} BenchRequest;
+
+static int completed, errors;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void read_done(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    uint64_t tag;
+
+    memcpy(&tag, req->iov.iov_base, sizeof(tag));
+    if (ret < 0 || tag != (uint64_t)req->sector) {
+        errors++;
+    }
+    completed++;
+}
+
+static int create_image(const char *filename)
+{
+    uint64_t block[4096 / 8];
+    int64_t sector;
+    int fd;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(block, 0, sizeof(block));
+    for (sector = 0; sector < IMAGE_SECTORS; sector += 8) {
+        block[0] = sector;
+        if (write(fd, block, sizeof(block)) != sizeof(block)) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static int run(const char *filename, int native, int reads, int depth)
+{
+    BlockDriverState *bs;
+    BenchRequest *reqs;
+    int flags = BDRV_O_RDWR | BDRV_O_NOCACHE;
+    int i, issued;
+    double start;
+
+    if (native) {
+        flags |= BDRV_O_NATIVE_AIO;
+    }
+    bs = bdrv_new("");
+    if (bdrv_open(bs, filename, flags, bdrv_find_format("raw")) < 0) {
+        fprintf(stderr, "cannot open %s\n", filename);
+        return -1;
+    }
+    reqs = qemu_mallocz(depth * sizeof(reqs[0]));
+    for (i = 0; i < depth; i++) {
+        reqs[i].iov.iov_base = qemu_blockalign(bs, 4096);
+        reqs[i].iov.iov_len = 4096;
+    }
+
+    srand(1);
+    completed = errors = issued = 0;
+    start = now();
+    while (issued < reads) {
+        for (i = 0; i < depth && issued < reads; i++, issued++) {
+            BenchRequest *req = &reqs[i];
+
+            req->sector = (rand() % (IMAGE_SECTORS / 8)) * 8;
+            qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+            if (!bdrv_aio_readv(bs, req->sector, &req->qiov, 8,
+                                read_done, req)) {
+                errors++;
+                completed++;
+            }
+        }
+        qemu_aio_flush();
+    }
+    printf("%-7s depth %3d: %d reads in %.3f s, %d errors\n",
+           native ? "native" : "threads", depth, reads, now() - start,
+           errors);
+
+    for (i = 0; i < depth; i++) {
+        qemu_vfree(reqs[i].iov.iov_base);
+    }
+    qemu_free(reqs);
+    bdrv_delete(bs);
+    return completed == reads && errors == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    static const int default_depths[] = { 1, 32, 300 };
+    const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    int reads = argc > 1 ? atoi(argv[1]) : 20000;
+    char filename[1024];
+    int i, depth, failed = 0;
+
+    snprintf(filename, sizeof(filename), "%s/bench-aio-%d.raw",
+             tmpdir, (int)getpid());
+    if (create_image(filename) < 0) {
+        fprintf(stderr, "cannot create %s\n", filename);
+        return 1;
+    }
+    bdrv_init();
+    for (i = 0; argc > 2 ? i < argc - 2 : i < 3; i++) {
+        depth = argc > 2 ? atoi(argv[i + 2]) : default_depths[i];
+        failed |= run(filename, 0, reads, depth);
+#ifdef CONFIG_LINUX_AIO
+        failed |= run(filename, 1, reads, depth);
+#endif
+    }
+    unlink(filename);
+    return failed ? 1 : 0;
+}
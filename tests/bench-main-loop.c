@@ -0,0 +1,163 @@
+/*
+ * Main loop wakeup benchmark: time per main_loop_wait() pass with one
+ * active pipe and many idle fd handlers.
+ *
+ *     bench-main-loop [wakeups [idle...]]
+ *
+ * For each count of idle handlers (16, 128, 480, 2000 and 8000 by
+ * default), registers that many pipes with qemu_set_fd_handler() that
+ * never become readable, plus one that is written before each pass, and
+ * times 'wakeups' (20000) passes of main_loop_wait().  While the
+ * descriptors fit in an fd_set, the same passes are also timed the way
+ * main_loop_wait() used to do them: qemu_iohandler_fill(), select() and
+ * qemu_iohandler_poll() over every handler.
+ *
+ * Built by tests/Makefile ('make -C tests bench-main-loop'), which links
+ * it against the objects of a built emulator.
+ */
+#include "qemu-common.h"
+#include "qemu-char.h"
+#include "qemu-timer.h"
+#include "sysemu.h"
+#include "cpus.h"
+#include "charpipe.h"
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <time.h>
+
+void main_loop_wait(int timeout);
+
+static int active_calls, idle_calls;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void active_read(void *opaque)
+{
+    char buf[64];
+
+    active_calls++;
+    if (read((long)opaque, buf, sizeof(buf)) < 0) {
+        perror("read");
+    }
+}
+
+static void idle_read(void *opaque)
+{
+    idle_calls++;
+}
+
+/* the body of main_loop_wait() before the handlers were kept in the
+   IoLooper */
+static void select_loop_wait(int timeout)
+{
+    fd_set rfds, wfds, xfds;
+    struct timeval tv;
+    int nfds = -1, ret;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&xfds);
+    qemu_iohandler_fill(&nfds, &rfds, &wfds, &xfds);
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+    qemu_iohandler_poll(&rfds, &wfds, &xfds, ret);
+    charpipe_poll();
+    qemu_run_all_timers();
+    qemu_bh_poll();
+}
+
+static double run(int wakeups, int active[2], int use_select)
+{
+    double start = now();
+    int i;
+
+    active_calls = 0;
+    for (i = 0; i < wakeups; i++) {
+        if (write(active[1], "x", 1) != 1) {
+            perror("write");
+            exit(1);
+        }
+        do {
+            if (use_select) {
+                select_loop_wait(1000);
+            } else {
+                main_loop_wait(1000);
+            }
+        } while (active_calls == i);
+    }
+    return (now() - start) / wakeups * 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    static const int default_idle[] = { 16, 128, 480, 2000, 8000 };
+    int wakeups = argc > 1 ? atoi(argv[1]) : 20000;
+    int nruns = argc > 2 ? argc - 2 : 5;
+    struct rlimit rl;
+    int active[2], i, k;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    init_clocks();
+    if (qemu_init_main_loop() < 0) {
+        fprintf(stderr, "could not initialize the main loop\n");
+        return 1;
+    }
+    if (init_timer_alarm() < 0) {
+        fprintf(stderr, "could not initialize alarm timer\n");
+        return 1;
+    }
+
+    for (k = 0; k < nruns; k++) {
+        int idle = argc > 2 ? atoi(argv[k + 2]) : default_idle[k];
+        int (*pipes)[2] = qemu_mallocz(idle * sizeof(pipes[0]));
+
+        for (i = 0; i < idle; i++) {
+            if (pipe(pipes[i]) < 0) {
+                perror("pipe");
+                return 1;
+            }
+            qemu_set_fd_handler(pipes[i][0], idle_read, NULL, NULL);
+        }
+        if (pipe(active) < 0) {
+            perror("pipe");
+            return 1;
+        }
+        qemu_set_fd_handler(active[0], active_read, NULL,
+                            (void *)(long)active[0]);
+
+        idle_calls = 0;
+        printf("%5d idle handlers: looper %6.2f us/wakeup", idle,
+               run(wakeups, active, 0));
+        if (active[0] < FD_SETSIZE) {
+            printf(", select %6.2f us/wakeup", run(wakeups, active, 1));
+        }
+        printf("\n");
+        if (idle_calls) {
+            fprintf(stderr, "%d calls of idle handlers\n", idle_calls);
+            return 1;
+        }
+
+        for (i = 0; i < idle; i++) {
+            qemu_set_fd_handler(pipes[i][0], NULL, NULL, NULL);
+            close(pipes[i][0]);
+            close(pipes[i][1]);
+        }
+        qemu_set_fd_handler(active[0], NULL, NULL, NULL);
+        close(active[0]);
+        close(active[1]);
+        qemu_free(pipes);
+        /* let the loop release the deleted handlers */
+        main_loop_wait(0);
+    }
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * qcow2 random I/O benchmark, run through the block layer of the ARM
+ * emulator.
+ *
+ *     bench-qcow2 [writes [reads [l2-cache-tables [cluster-size]]]]
+ *
+ * Creates a 4 GB qcow2 image in $TMPDIR and writes 'writes' random runs
+ * of 1 to 16 sectors over its first 512 MB, creating a snapshot every
+ * 5000 writes and deleting the one before last.  That leaves a sparse
+ * image with shared clusters and many L2 tables, like a long-lived
+ * userdata image.  The image is then reopened, read back in full and
+ * checked, and 'reads' random 4 KB reads are timed.
+ *
+ * 'l2-cache-tables' sets qcow2_l2_cache_size (-qcow2-l2-cache) for the
+ * reopened image, 0 keeps the default.  With the default 4 KB clusters
+ * one L2 table covers 2 MB, so the 512 MB range needs 256 tables to stay
+ * cached:
+ *
+ *     bench-qcow2 60000 1000000 16
+ *     bench-qcow2 60000 1000000 512
+ *
+ * Built by tests/Makefile ('make -C tests bench-qcow2'), which links it
+ * against the objects of a built emulator.
+ */
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block.h"
+#include <time.h>
+
+#define RANGE_SECTORS   (512LL * 1024 * 1024 / 512)
+
+/* number of times each sector of the range has been written */
+static uint16_t *versions;
+
+static void fill_sector(uint8_t *buf, int64_t sector, int version)
+{
+    int i;
+
+    for (i = 0; i < 512; i += 8) {
+        uint64_t x = (sector * 2654435761ULL) ^ ((uint64_t)version << 40) ^ i;
+        memcpy(buf + i, &x, 8);
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int64_t random_sector(int64_t limit)
+{
+    return ((int64_t)rand() * 7919 + rand()) % limit;
+}
+
+static int verify(BlockDriverState *bs, int64_t first, int count)
+{
+    uint8_t buf[128 * 512], expect[512];
+    int i;
+
+    if (bdrv_read(bs, first, buf, count) < 0) {
+        fprintf(stderr, "read error at sector %lld\n", (long long)first);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        int version = versions[first + i];
+
+        if (version == 0) {
+            memset(expect, 0, sizeof(expect));
+        } else {
+            fill_sector(expect, first + i, version);
+        }
+        if (memcmp(expect, buf + i * 512, 512) != 0) {
+            fprintf(stderr, "sector %lld does not hold version %d\n",
+                    (long long)(first + i), version);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long writes = argc > 1 ? atol(argv[1]) : 60000;
+    long reads = argc > 2 ? atol(argv[2]) : 1000000;
+    int l2_cache = argc > 3 ? atoi(argv[3]) : 0;
+    int cluster_size = argc > 4 ? atoi(argv[4]) : 4096;
+    const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char filename[1024], name[32];
+    BlockDriver *drv;
+    BlockDriverState *bs;
+    QEMUOptionParameter *options;
+    BdrvCheckResult check;
+    uint8_t buf[16 * 512];
+    double start;
+    long i;
+
+    snprintf(filename, sizeof(filename), "%s/bench-qcow2-%d.qcow2",
+             tmpdir, (int)getpid());
+    bdrv_init();
+    versions = qemu_mallocz(RANGE_SECTORS * sizeof(versions[0]));
+
+    drv = bdrv_find_format("qcow2");
+    options = parse_option_parameters("", drv->create_options, NULL);
+    set_option_parameter_int(options, BLOCK_OPT_SIZE, 4LL << 30);
+    set_option_parameter_int(options, BLOCK_OPT_CLUSTER_SIZE, cluster_size);
+    if (bdrv_create(drv, filename, options) < 0) {
+        fprintf(stderr, "cannot create %s\n", filename);
+        return 1;
+    }
+    bs = bdrv_new("");
+    if (bdrv_open(bs, filename, BDRV_O_RDWR, drv) < 0) {
+        fprintf(stderr, "cannot open %s\n", filename);
+        goto fail;
+    }
+
+    srand(1);
+    start = now();
+    for (i = 0; i < writes; i++) {
+        int count = 1 + rand() % 16, k;
+        int64_t first = random_sector(RANGE_SECTORS - count);
+
+        for (k = 0; k < count; k++) {
+            versions[first + k]++;
+            fill_sector(buf + k * 512, first + k, versions[first + k]);
+        }
+        if (bdrv_write(bs, first, buf, count) < 0) {
+            fprintf(stderr, "write error at sector %lld\n", (long long)first);
+            goto fail;
+        }
+        if (i % 5000 == 2500) {
+            QEMUSnapshotInfo sn;
+
+            memset(&sn, 0, sizeof(sn));
+            snprintf(sn.name, sizeof(sn.name), "s%ld", i);
+            if (bdrv_snapshot_create(bs, &sn) < 0) {
+                fprintf(stderr, "cannot create snapshot %s\n", sn.name);
+                goto fail;
+            }
+            snprintf(name, sizeof(name), "s%ld", i - 10000);
+            if (i > 10000 && bdrv_snapshot_delete(bs, name) < 0) {
+                fprintf(stderr, "cannot delete snapshot %s\n", name);
+                goto fail;
+            }
+        }
+    }
+    printf("%ld random writes: %.3f s\n", writes, now() - start);
+    bdrv_close(bs);
+
+    if (l2_cache > 0) {
+        qcow2_l2_cache_size = l2_cache;
+    }
+    if (bdrv_open(bs, filename, BDRV_O_RDWR, drv) < 0) {
+        fprintf(stderr, "cannot reopen %s\n", filename);
+        goto fail;
+    }
+    for (i = 0; i < RANGE_SECTORS; i += 128) {
+        if (verify(bs, i, 128) < 0) {
+            goto fail;
+        }
+    }
+    memset(&check, 0, sizeof(check));
+    bdrv_check(bs, &check);
+    if (check.corruptions || check.leaks || check.check_errors) {
+        fprintf(stderr, "check: %d corruptions, %d leaks, %d errors\n",
+                check.corruptions, check.leaks, check.check_errors);
+        goto fail;
+    }
+
+    srand(2);
+    start = now();
+    for (i = 0; i < reads; i++) {
+        bdrv_read(bs, random_sector(RANGE_SECTORS - 8) & ~7, buf, 8);
+    }
+    printf("%ld random reads, L2 cache %d: %.3f s\n", reads, l2_cache,
+           now() - start);
+    bdrv_close(bs);
+    unlink(filename);
+    return 0;
+
+fail:
+    unlink(filename);
+    return 1;
+}
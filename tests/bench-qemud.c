@@ -0,0 +1,289 @@
+/*
+ * qemud serial loopback throughput, with the hex and the bulk protocol.
+ *
+ *     bench-qemud [messages [size...]]
+ *
+ * Plays the guest's qemud daemon on the serial charpipe of the emulator:
+ * connects channel 1 to a framed "bench" service, and for each message
+ * size (100, 4000 and 60000 bytes by default) sends 'messages' (20000)
+ * messages in both directions, first with the hex packet headers, then
+ * after negotiating bulk mode with "bulk:ffff".  Every message is checked
+ * on arrival, and the time taken and the number of serial packets used
+ * are printed for each direction.
+ *
+ * No guest and no tty device are involved: this measures the qemud code
+ * of the emulator alone, on data that stays in the CPU caches.  Towards
+ * the guest the charpipe hands the packets over without copying them, so
+ * large messages reach rates that only say the path adds little to a
+ * memcmp(); the packet counts are the figure that carries over to a real
+ * serial port, where every packet costs a device interrupt.
+ *
+ * Built by tests/Makefile ('make -C tests bench-qemud'), which links it
+ * against the objects of a built emulator.
+ */
+#include "qemu-common.h"
+#include "qemu-char.h"
+#include "android/hw-qemud.h"
+#include <time.h>
+
+#define MAX_SIZE        65535
+#define HEX_PAYLOAD     4000
+
+static CharDriverState *serial;
+
+/* guest side: packet parser */
+static int bulk, max_payload = HEX_PAYLOAD;
+static uint8_t packet[6 + MAX_SIZE];
+static int packet_used, packet_len = -1, packet_channel;
+static char control[64];
+
+/* guest side: frames received on channel 1 */
+static const uint8_t *expect;
+static int expect_size;
+static uint8_t frame_header[4];
+static int frame_used, frame_len = -1;
+static long guest_messages, guest_packets, errors;
+
+/* emulator side */
+static QemudClient *client;
+static long service_messages;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned hex(const uint8_t *p, int len)
+{
+    char tmp[8];
+
+    memcpy(tmp, p, len);
+    tmp[len] = 0;
+    return strtoul(tmp, NULL, 16);
+}
+
+static void guest_frame_data(const uint8_t *p, int len)
+{
+    while (len > 0) {
+        int n;
+
+        if (frame_len < 0) {
+            n = MIN(len, 4 - frame_used);
+            memcpy(frame_header + frame_used, p, n);
+            frame_used += n;
+            p += n;
+            len -= n;
+            if (frame_used < 4) {
+                break;
+            }
+            frame_len = hex(frame_header, 4);
+            frame_used = 0;
+            if (frame_len != expect_size) {
+                errors++;
+            }
+        }
+        n = MIN(len, frame_len - frame_used);
+        if (frame_used + n <= expect_size &&
+            memcmp(p, expect + frame_used, n) != 0) {
+            errors++;
+        }
+        frame_used += n;
+        p += n;
+        len -= n;
+        if (frame_used == frame_len) {
+            guest_messages++;
+            frame_len = -1;
+            frame_used = 0;
+        }
+    }
+}
+
+static int guest_can_read(void *opaque)
+{
+    return sizeof(packet);
+}
+
+static void guest_read(void *opaque, const uint8_t *buf, int len)
+{
+    while (len > 0) {
+        int n;
+
+        if (packet_len < 0) {
+            n = MIN(len, 6 - packet_used);
+            memcpy(packet + packet_used, buf, n);
+            packet_used += n;
+            buf += n;
+            len -= n;
+            if (packet_used < 6) {
+                break;
+            }
+            if (bulk) {
+                packet_channel = packet[0] | (packet[1] << 8);
+                packet_len = packet[2] | (packet[3] << 8) |
+                             (packet[4] << 16) | (packet[5] << 24);
+            } else {
+                packet_channel = hex(packet, 2);
+                packet_len = hex(packet + 2, 4);
+            }
+            packet_used = 0;
+            if (packet_len > max_payload) {
+                fprintf(stderr, "packet of %d bytes\n", packet_len);
+                exit(1);
+            }
+        }
+        n = MIN(len, packet_len - packet_used);
+        if (packet_channel == 0) {
+            memcpy(packet + packet_used, buf, n);
+        } else {
+            guest_frame_data(buf, n);
+        }
+        packet_used += n;
+        buf += n;
+        len -= n;
+        if (packet_used == packet_len) {
+            if (packet_channel == 0) {
+                snprintf(control, sizeof(control), "%.*s", packet_len, packet);
+            } else {
+                guest_packets++;
+            }
+            packet_len = -1;
+            packet_used = 0;
+        }
+    }
+}
+
+static void guest_send_packet(int channel, const uint8_t *data, int len)
+{
+    char header[8];
+
+    if (bulk) {
+        header[0] = channel;
+        header[1] = channel >> 8;
+        header[2] = len;
+        header[3] = len >> 8;
+        header[4] = len >> 16;
+        header[5] = len >> 24;
+    } else {
+        snprintf(header, sizeof(header), "%02x%04x", channel, len);
+    }
+    qemu_chr_write(serial, (uint8_t *)header, 6);
+    qemu_chr_write(serial, data, len);
+}
+
+static void guest_send_control(const char *msg)
+{
+    control[0] = 0;
+    guest_send_packet(0, (const uint8_t *)msg, strlen(msg));
+}
+
+/* send a framed message on channel 1, split into serial packets */
+static int guest_send_message(const uint8_t *msg, int size)
+{
+    uint8_t *frame = qemu_malloc(4 + size);
+    char header[5];
+    int off, packets = 0;
+
+    snprintf(header, sizeof(header), "%04x", size);
+    memcpy(frame, header, 4);
+    memcpy(frame + 4, msg, size);
+    for (off = 0; off < 4 + size; off += max_payload, packets++) {
+        guest_send_packet(1, frame + off, MIN(max_payload, 4 + size - off));
+    }
+    qemu_free(frame);
+    return packets;
+}
+
+static void service_recv(void *opaque, uint8_t *msg, int msglen,
+                         QemudClient *c)
+{
+    if (msglen != expect_size || memcmp(msg, expect, msglen) != 0) {
+        errors++;
+    }
+    service_messages++;
+}
+
+static QemudClient *service_connect(void *opaque, QemudService *sv,
+                                    int channel, const char *param)
+{
+    client = qemud_client_new(sv, channel, param, NULL, service_recv,
+                              NULL, NULL, NULL);
+    qemud_client_set_framing(client, 1);
+    return client;
+}
+
+static int run(long messages, int size)
+{
+    uint8_t *msg = qemu_malloc(size);
+    long packets = 0, i;
+    double start, to_guest;
+
+    for (i = 0; i < size; i++) {
+        msg[i] = i * 7 + size;
+    }
+    expect = msg;
+    expect_size = size;
+    errors = guest_messages = guest_packets = service_messages = 0;
+
+    start = now();
+    for (i = 0; i < messages; i++) {
+        qemud_client_send(client, msg, size);
+    }
+    to_guest = now() - start;
+
+    start = now();
+    for (i = 0; i < messages; i++) {
+        packets += guest_send_message(msg, size);
+    }
+    printf("%-4s %5d bytes: to guest %7.1f MB/s %7ld packets, "
+           "from guest %7.1f MB/s %7ld packets\n",
+           bulk ? "bulk" : "hex", size,
+           size * messages / to_guest / 1e6, guest_packets,
+           size * messages / (now() - start) / 1e6, packets);
+    qemu_free(msg);
+
+    if (errors || guest_messages != messages || service_messages != messages) {
+        fprintf(stderr, "%ld errors, %ld/%ld messages received\n",
+                errors, guest_messages, service_messages);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const int default_sizes[] = { 100, 4000, 60000 };
+    long messages = argc > 1 ? atol(argv[1]) : 20000;
+    int nsizes = argc > 2 ? argc - 2 : 3;
+    int i, failed = 0;
+
+    serial = android_qemud_get_cs();
+    qemu_chr_add_handlers(serial, guest_can_read, guest_read, NULL, NULL);
+    qemud_service_register("bench", 0, NULL, service_connect, NULL, NULL);
+    guest_send_control("connect:bench:01");
+    if (strcmp(control, "ok:connect:01") != 0) {
+        fprintf(stderr, "connect: '%s'\n", control);
+        return 1;
+    }
+
+    for (i = 0; i < nsizes; i++) {
+        failed |= run(messages, argc > 2 ? atoi(argv[i + 2]) : default_sizes[i]);
+    }
+
+    /* the answer still uses the hex header, the daemon switches as soon
+       as it has sent the request */
+    guest_send_control("bulk:ffff");
+    bulk = 1;
+    if (strncmp(control, "ok:bulk:", 8) != 0) {
+        fprintf(stderr, "bulk: '%s'\n", control);
+        return 1;
+    }
+    max_payload = hex((const uint8_t *)control + 8, 4);
+
+    for (i = 0; i < nsizes; i++) {
+        failed |= run(messages, argc > 2 ? atoi(argv[i + 2]) : default_sizes[i]);
+    }
+    return failed ? 1 : 0;
+}
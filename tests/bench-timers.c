@@ -0,0 +1,113 @@
+/*
+ * Timer queue benchmark: cost of arming, re-arming and firing QEMUTimers
+ * when many of them are pending on the same clock.
+ *
+ *     bench-timers [timers [alarm]]
+ *
+ * Creates 'timers' (100000) rt_clock timers and measures, in ns per
+ * operation:
+ *
+ *   arm    arming each of them at a random time an hour from now,
+ *   rearm  moving random pending timers to another random time,
+ *   head   arming them so that each one becomes the earliest, which
+ *          also re-arms the host alarm every time,
+ *   fire   running all of them once their deadline has passed.
+ *
+ * 'alarm' selects the host alarm as -clock does (the default one when
+ * omitted).  Every timer must fire exactly once.
+ *
+ * Built by tests/Makefile ('make -C tests bench-timers'), which links it
+ * against the objects of a built emulator.
+ */
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "cpus.h"
+
+#define HOUR_NS     (3600LL * 1000000000)
+#define SPREAD_NS   1000000000
+
+static long fired;
+
+static void timer_cb(void *opaque)
+{
+    fired++;
+}
+
+static double elapsed_ns(int64_t start, int n)
+{
+    return (double)(get_clock() - start) / n;
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    QEMUTimer **timers;
+    double arm, rearm, head, fire;
+    int64_t base, start;
+    int i;
+
+    init_clocks();
+    if (argc > 2) {
+        configure_alarms(argv[2]);
+    }
+    if (qemu_init_main_loop() < 0 || init_timer_alarm() < 0) {
+        fprintf(stderr, "could not initialize alarm timer\n");
+        return 1;
+    }
+    /* clears the alarm that init_timer_alarm() leaves pending */
+    qemu_run_all_timers();
+
+    srand(1);
+    timers = qemu_malloc(n * sizeof(timers[0]));
+    for (i = 0; i < n; i++) {
+        timers[i] = qemu_new_timer_ns(rt_clock, timer_cb, NULL);
+    }
+
+    base = qemu_get_clock_ns(rt_clock) + HOUR_NS;
+    start = get_clock();
+    for (i = 0; i < n; i++) {
+        qemu_mod_timer(timers[i], base + rand() % SPREAD_NS);
+    }
+    arm = elapsed_ns(start, n);
+
+    start = get_clock();
+    for (i = 0; i < n; i++) {
+        qemu_mod_timer(timers[rand() % n], base + rand() % SPREAD_NS);
+    }
+    rearm = elapsed_ns(start, n);
+
+    for (i = 0; i < n; i++) {
+        qemu_del_timer(timers[i]);
+    }
+    base = qemu_get_clock_ns(rt_clock) + HOUR_NS;
+    start = get_clock();
+    for (i = 0; i < n; i++) {
+        qemu_mod_timer(timers[i], base - i * 1000LL);
+    }
+    head = elapsed_ns(start, n);
+
+    base = qemu_get_clock_ns(rt_clock) - 2 * SPREAD_NS;
+    for (i = 0; i < n; i++) {
+        qemu_mod_timer(timers[i], base + rand() % SPREAD_NS);
+    }
+    start = get_clock();
+    qemu_run_all_timers();
+    fire = elapsed_ns(start, n);
+
+    printf("%d timers: arm %.0f, rearm %.0f, head %.0f, fire %.0f ns/op\n",
+           n, arm, rearm, head, fire);
+    if (fired != n) {
+        fprintf(stderr, "%ld of %d timers fired\n", fired, n);
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        if (qemu_timer_pending(timers[i])) {
+            fprintf(stderr, "timer %d still pending\n", i);
+            return 1;
+        }
+        qemu_free_timer(timers[i]);
+    }
+    qemu_free(timers);
+    quit_timers();
+    return 0;
+}
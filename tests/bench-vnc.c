@@ -0,0 +1,220 @@
+/*
+ * VNC server refresh benchmark: main thread CPU time per frame with
+ * several clients connected.
+ *
+ *     bench-vnc [clients [frames]]
+ *
+ * Opens the VNC server of the emulator on display :7 (port 5907) with a
+ * 640x480 surface and forks 'clients' (4) processes that connect with
+ * Tight encoding and request incremental updates at 30 fps.  Each of the
+ * 'frames' (300) frames then changes a 64x64 area and reports the whole
+ * screen as damaged, as the goldfish framebuffer does, and the CPU time
+ * the main loop spends until the next frame is measured.
+ *
+ * Built by tests/Makefile ('make -C tests bench-vnc'), which links it
+ * against the objects of a built emulator.
+ */
+#include "qemu-common.h"
+#include "console.h"
+#include "qemu-timer.h"
+#include "sysemu.h"
+#include "cpus.h"
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <time.h>
+
+#define VNC_DISPLAY     "127.0.0.1:7"
+#define VNC_PORT        5907
+#define FRAME_MS        33
+
+void main_loop_wait(int timeout);
+
+static uint32_t random_state = 12345;
+
+static uint32_t random32(void)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return random_state >> 8;
+}
+
+static int recv_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* An RFB 3.8 client that keeps asking for incremental updates and throws
+   the data away.  Runs in a child process until it is killed.  */
+static void run_client(void)
+{
+    static const uint8_t set_encodings[] = { 2, 0, 0, 1, 0, 0, 0, 7 };
+    uint8_t buf[65536], request[10];
+    struct sockaddr_in addr;
+    uint32_t name_len;
+    uint16_t width, height;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(VNC_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        _exit(1);
+    }
+    /* version, security type None, shared ClientInit */
+    if (recv_all(fd, buf, 12) < 0 ||
+        send(fd, "RFB 003.008\n", 12, 0) != 12 ||
+        recv_all(fd, buf, 1) < 0 || recv_all(fd, buf + 1, buf[0]) < 0 ||
+        send(fd, "\1", 1, 0) != 1 ||
+        recv_all(fd, buf, 4) < 0 ||
+        send(fd, "\1", 1, 0) != 1 ||
+        recv_all(fd, buf, 24) < 0) {
+        _exit(1);
+    }
+    width = (buf[0] << 8) | buf[1];
+    height = (buf[2] << 8) | buf[3];
+    name_len = (buf[20] << 24) | (buf[21] << 16) | (buf[22] << 8) | buf[23];
+    if (name_len > sizeof(buf) || recv_all(fd, buf, name_len) < 0 ||
+        send(fd, set_encodings, sizeof(set_encodings), 0) < 0) {
+        _exit(1);
+    }
+
+    /* FramebufferUpdateRequest, incremental, whole screen */
+    memset(request, 0, sizeof(request));
+    request[0] = 3;
+    request[1] = 1;
+    request[6] = width >> 8;
+    request[7] = width;
+    request[8] = height >> 8;
+    request[9] = height;
+    for (;;) {
+        struct timespec next;
+
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        next.tv_nsec += FRAME_MS * 1000000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        if (send(fd, request, sizeof(request), 0) < 0) {
+            _exit(0);
+        }
+        for (;;) {
+            struct timespec now;
+            fd_set fds;
+            struct timeval tv = { 0, 2000 };
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > next.tv_sec ||
+                (now.tv_sec == next.tv_sec && now.tv_nsec >= next.tv_nsec)) {
+                break;
+            }
+            FD_ZERO(&fds);
+            FD_SET(fd, &fds);
+            if (select(fd + 1, &fds, NULL, NULL, &tv) > 0 &&
+                recv(fd, buf, sizeof(buf), 0) <= 0) {
+                _exit(0);
+            }
+        }
+    }
+}
+
+/* The keymaps are read from the source tree.  */
+char *qemu_find_file(int type, const char *name)
+{
+    char path[1024];
+
+    snprintf(path, sizeof(path), "%s/%s%s", DATA_DIR,
+             type == QEMU_FILE_TYPE_KEYMAP ? "keymaps/" : "", name);
+    return access(path, R_OK) == 0 ? qemu_strdup(path) : NULL;
+}
+
+static double thread_cpu_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+    int clients = argc > 1 ? atoi(argv[1]) : 4;
+    int frames = argc > 2 ? atoi(argv[2]) : 300;
+    DisplayState *ds;
+    pid_t *pids;
+    int64_t end;
+    double cpu = 0;
+    int i, x, y;
+
+    init_clocks();
+    if (qemu_init_main_loop() < 0) {
+        fprintf(stderr, "could not initialize the main loop\n");
+        return 1;
+    }
+    if (init_timer_alarm() < 0) {
+        fprintf(stderr, "could not initialize alarm timer\n");
+        return 1;
+    }
+    ds = get_displaystate();
+    vnc_display_init(ds);
+    if (vnc_display_open(ds, VNC_DISPLAY) < 0) {
+        fprintf(stderr, "cannot open VNC display %s\n", VNC_DISPLAY);
+        return 1;
+    }
+    dpy_resize(ds);
+
+    pids = qemu_mallocz(clients * sizeof(pids[0]));
+    for (i = 0; i < clients; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            run_client();
+        }
+    }
+    /* let the clients connect and receive the first full update */
+    end = qemu_get_clock_ms(rt_clock) + 2500;
+    while (qemu_get_clock_ms(rt_clock) < end) {
+        main_loop_wait(5);
+    }
+
+    for (i = 0; i < frames; i++) {
+        int64_t next = qemu_get_clock_ms(rt_clock) + FRAME_MS;
+        uint32_t *p = (uint32_t *)ds_get_data(ds);
+        int stride = ds_get_linesize(ds) / 4;
+        int x0 = (i * 37) % (ds_get_width(ds) - 64);
+        int y0 = (i * 53) % (ds_get_height(ds) - 64);
+
+        for (y = y0; y < y0 + 64; y++) {
+            for (x = x0; x < x0 + 64; x++) {
+                p[y * stride + x] = random32() & 0xffffff;
+            }
+        }
+        dpy_update(ds, 0, 0, ds_get_width(ds), ds_get_height(ds));
+        while (qemu_get_clock_ms(rt_clock) < next) {
+            double start = thread_cpu_us();
+            main_loop_wait(5);
+            cpu += thread_cpu_us() - start;
+        }
+    }
+    printf("%d clients: main thread CPU per frame %.0f us\n", clients,
+           cpu / frames);
+
+    for (i = 0; i < clients; i++) {
+        kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+#
+# Replay a recorded gesture into an events guest through the emulator
+# console, and report how long the emulator took to deliver it.
+#
+# usage: tests/guest/replay-events.py <guest.bin> [repeats [gesture]]
+#
+# Starts the guest with run-guest.sh (EMULATOR and TIMEOUT apply), waits
+# for it to print "ready", then sends the 'event send' lines of 'gesture'
+# (pinch-gesture.txt) 'repeats' (100) times, LINES_IN_FLIGHT lines at a
+# time so that the device queue never overflows, and ends with an EV_KEY
+# event that stops the guest.  The events, interrupts and value sum the
+# guest reports are checked against what was sent.
+#
+# The wall time is mostly console round trips; the CPU time the emulator
+# used, boot included, is the figure to compare between guests.
+
+import os
+import re
+import resource
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+CONSOLE_PORT = 5554
+LINES_IN_FLIGHT = 4
+STOP_EVENT = "event send 1:116:1"       # EV_KEY KEY_POWER down
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write("usage: %s <guest.bin> [repeats [gesture]]\n"
+                         % sys.argv[0])
+        return 1
+    here = os.path.dirname(os.path.abspath(__file__))
+    guest = sys.argv[1]
+    repeats = int(sys.argv[2]) if len(sys.argv) > 2 else 100
+    gesture = sys.argv[3] if len(sys.argv) > 3 else \
+        os.path.join(here, "pinch-gesture.txt")
+
+    lines = [l.strip() for l in open(gesture)
+             if l.strip() and not l.startswith("#")]
+    events = 0
+    value_sum = 0
+    for l in lines:
+        for ev in l.split()[2:]:
+            events += 1
+            value_sum += int(ev.split(":")[2])
+    events = events * repeats + 1
+    value_sum = (value_sum * repeats + 1) & 0xffffffff
+
+    p = subprocess.Popen([os.path.join(here, "run-guest.sh"), guest,
+                          "-android-ports",
+                          "%d,%d" % (CONSOLE_PORT, CONSOLE_PORT + 1)],
+                         stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                         universal_newlines=True)
+    output = []
+    ready = threading.Event()
+
+    def read_stderr():
+        for l in p.stderr:
+            output.append(l)
+            if l.strip() == "ready":
+                ready.set()
+        ready.set()
+    threading.Thread(target=read_stderr, daemon=True).start()
+
+    if not ready.wait(60) or p.poll() is not None:
+        sys.stderr.write("the guest did not start:\n" + "".join(output))
+        return 1
+    console = socket.create_connection(("127.0.0.1", CONSOLE_PORT))
+    reply = b""
+    while b"OK" not in reply:
+        reply += console.recv(4096)
+
+    start = time.time()
+    sent = acked = 0
+    for r in range(repeats):
+        for i in range(0, len(lines), LINES_IN_FLIGHT):
+            chunk = lines[i:i + LINES_IN_FLIGHT]
+            console.sendall(("\n".join(chunk) + "\n").encode())
+            sent += len(chunk)
+            while acked < sent:
+                acked += console.recv(65536).count(b"OK")
+    console.sendall((STOP_EVENT + "\n").encode())
+    p.wait()
+    elapsed = time.time() - start
+    console.close()
+
+    text = "".join(output)
+    m = re.search(r"events (\d+) interrupts (\d+) value sum (\d+)", text)
+    if p.returncode != 0 or not m:
+        sys.stderr.write(text)
+        return 1
+    got_events, irqs, got_sum = [int(x) for x in m.groups()]
+    lost = text.count("lose event")
+    usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+    print("%s: %d events in %.2f s, emulator CPU %.2f s, %d interrupts, "
+          "%d lost" % (os.path.basename(guest), got_events, elapsed,
+                       usage.ru_utime + usage.ru_stime, irqs, lost))
+    if got_events != events or got_sum != value_sum or lost:
+        sys.stderr.write("expected %d events with value sum %d\n"
+                         % (events, value_sum))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
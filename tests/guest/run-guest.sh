@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Boot a bare-metal test guest (see guest.inc) in the ARM system emulator
+# and report how long the emulator ran, in milliseconds.
+#
+# usage: tests/guest/run-guest.sh <guest.bin> [emulator options...]
+#
+# EMULATOR selects the emulator binary, objs/qemu-android-arm by default.
+# TIMEOUT (seconds, default 300) bounds the run; a guest that fails spins
+# until then and the script exits with an error.
+
+EMULATOR=${EMULATOR:-objs/qemu-android-arm}
+TIMEOUT=${TIMEOUT:-300}
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <guest.bin> [emulator options...]" >&2
+    exit 1
+fi
+guest=$1
+shift
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+: > "$dir/system.img"
+: > "$dir/data.img"
+dd if=/dev/zero of="$dir/initrd" bs=4096 count=1 2>/dev/null
+cat > "$dir/hw.ini" <<EOF2
+hw.ramSize=64
+hw.cpu.arch=arm
+kernel.path=$guest
+disk.systemPartition.size=1m
+disk.dataPartition.size=1m
+disk.systemPartition.path=$dir/system.img
+disk.dataPartition.path=$dir/data.img
+disk.systemPartition.initPath=$dir/system.img
+disk.dataPartition.initPath=$dir/data.img
+disk.cachePartition=no
+disk.ramdisk.path=$dir/initrd
+EOF2
+
+start=$(date +%s%N)
+timeout "$TIMEOUT" "$EMULATOR" -android-hw "$dir/hw.ini" -kernel "$guest" \
+    -initrd "$dir/initrd" -nographic -semihosting -serial stdio "$@"
+status=$?
+end=$(date +%s%N)
+
+echo "$(basename "$guest"): $(( (end - start) / 1000000 )) ms" >&2
+exit $status
@@ -0,0 +1,161 @@
+/*
+ * Equivalence test of the table-driven instruction tick decoder of
+ * trace.c with the decoder it replaced, kept in insn-ticks-old.inc.
+ *
+ *     test-insn-ticks [shard shards]
+ *
+ * Runs both decoders on every Thumb opcode from each of NUM_STATES
+ * interlock states, and on every one of the 2^32 ARM opcodes from one of
+ * these states picked by a hash of the opcode.  Every call must return the
+ * same ticks and leave the same interlocks[] and interlock_base.
+ *
+ * The ARM space is split into as many shards as there are CPUs, each run
+ * by a child process.  With arguments, only ARM shard 'shard' of 'shards'
+ * is run, and the Thumb space if 'shard' is 0, to spread the test over
+ * several machines.
+ *
+ * Built by tests/Makefile.
+ */
+#include "trace.c"
+#include "insn-ticks-old.inc"
+#include <sys/wait.h>
+
+#define NUM_STATES  16
+#define MAX_ERRORS  10
+
+static int states[NUM_STATES][16];
+static int state_bases[NUM_STATES];
+static long errors;
+
+/* State 0 is the one trace_bb_start() leaves; in the others every
+ * register becomes free between 3 cycles ago and 5 cycles from now. */
+static void init_states(void)
+{
+    int s, r;
+
+    for (s = 1; s < NUM_STATES; s++) {
+        state_bases[s] = s * 7;
+        for (r = 0; r < 16; r++) {
+            states[s][r] = state_bases[s] + (r * 5 + s * 3) % 9 - 3;
+        }
+    }
+}
+
+static void set_state(int s)
+{
+    memcpy(interlocks, states[s], sizeof(interlocks));
+    interlock_base = state_bases[s];
+}
+
+static void check(uint32_t insn, int thumb, int s)
+{
+    int old_ticks, old_base, old_interlocks[16];
+    int ticks;
+
+    set_state(s);
+    old_ticks = thumb ? old_get_insn_ticks_thumb(insn)
+                      : old_get_insn_ticks_arm(insn);
+    old_base = interlock_base;
+    memcpy(old_interlocks, interlocks, sizeof(interlocks));
+
+    set_state(s);
+    ticks = thumb ? get_insn_ticks_thumb(insn) : get_insn_ticks_arm(insn);
+
+    if (ticks != old_ticks || interlock_base != old_base ||
+        memcmp(interlocks, old_interlocks, sizeof(interlocks)) != 0) {
+        if (errors++ < MAX_ERRORS) {
+            fprintf(stderr, "%s %08x, interlock state %d: %d ticks, "
+                    "expected %d%s\n", thumb ? "thumb" : "arm", insn, s,
+                    ticks, old_ticks, ticks == old_ticks ?
+                    ", different interlocks" : "");
+        }
+    }
+}
+
+static void test_thumb(void)
+{
+    uint32_t insn;
+    int s;
+
+    for (s = 0; s < NUM_STATES; s++) {
+        for (insn = 0; insn < 0x10000; insn++) {
+            check(insn, 1, s);
+        }
+    }
+}
+
+static void test_arm(uint32_t shard, uint32_t shards)
+{
+    uint64_t insn, end = (shard + 1) * (0x100000000ULL / shards);
+
+    for (insn = shard * (0x100000000ULL / shards); insn < end; insn++) {
+        check(insn, 0, ((uint32_t)insn * 0x9e3779b9) >> 28);
+    }
+}
+
+/* Run the given shard, or all of them in child processes. */
+static int run(int shard, int shards, int fork_shards)
+{
+    int failed = 0, status, k;
+
+    if (!fork_shards) {
+        if (shard == 0) {
+            test_thumb();
+        }
+        test_arm(shard, shards);
+        return errors != 0;
+    }
+    for (k = 0; k < shards; k++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            exit(run(k, shards, 0));
+        }
+    }
+    for (k = 0; k < shards; k++) {
+        if (wait(&status) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    int shard = 0, shards, failed;
+
+    init_states();
+    if (argc > 2) {
+        shard = atoi(argv[1]);
+        shards = atoi(argv[2]);
+        if (shards < 1 || shard < 0 || shard >= shards ||
+            (shards & (shards - 1)) != 0) {
+            fprintf(stderr, "usage: %s [shard shards], shards a power "
+                    "of 2\n", argv[0]);
+            return 1;
+        }
+        failed = run(shard, shards, 0);
+    } else {
+        shards = sysconf(_SC_NPROCESSORS_ONLN);
+        while (shards & (shards - 1)) {
+            shards &= shards - 1;
+        }
+        if (shards < 1) {
+            shards = 1;
+        }
+        failed = run(0, shards, 1);
+    }
+    if (failed) {
+        fprintf(stderr, "the decoders differ\n");
+        return 1;
+    }
+    printf("ticks of %d Thumb and %llu ARM opcodes match\n",
+           shard == 0 ? 0x10000 : 0,
+           0x100000000ULL / shards * (argc > 2 ? 1 : shards));
+    return 0;
+}
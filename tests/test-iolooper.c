@@ -0,0 +1,214 @@
+/*
+ * Test of an IoLooper backend and of the generic Looper built on it.
+ *
+ *     test-iolooper-epoll [idle]
+ *     test-iolooper-select [idle]
+ *
+ * Registers 'idle' (480) socketpairs, of which only a few ever become
+ * ready, and checks level triggering, interest toggles between two waits,
+ * the reuse of a closed descriptor number, regular files, hang-ups,
+ * iolooper_next_ready() and iolooper_reset().  It then runs the generic
+ * Looper with one waiter per socketpair, two of them active, checks that
+ * only those are called back and prints the time per pass.
+ *
+ * The select() backend cannot watch descriptors above FD_SETSIZE, so
+ * 'idle' must stay below FD_SETSIZE / 2 for test-iolooper-select.
+ *
+ * Built by tests/Makefile, once per backend.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "iolooper.h"
+#include "android/looper.h"
+
+unsigned long android_verbose;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define ITERATIONS  20000
+
+static int (*pairs)[2];
+static int idle_count = 480;
+
+/* calls of the generic looper's callbacks: active, idle */
+static int calls[2];
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int count_ready(IoLooper *iol)
+{
+    int cursor = 0, fd, n = 0;
+
+    while (iolooper_next_ready(iol, &cursor, &fd)) {
+        n++;
+    }
+    return n;
+}
+
+static void test_iolooper(void)
+{
+    IoLooper *iol = iolooper_new();
+    int active[5] = { 1, 17, idle_count / 2, idle_count - 2, idle_count - 1 };
+    int i, pass, old, rd, wr, p[2];
+    FILE *file;
+    char c;
+
+    for (i = 0; i < idle_count; i++) {
+        iolooper_add_read(iol, pairs[i][0]);
+    }
+    CHECK(iolooper_has_operations(iol));
+    CHECK(iolooper_wait(iol, 10) == 0 && errno == ETIMEDOUT);
+
+    /* level-triggered: the same descriptors are reported again until
+       they are read */
+    for (i = 0; i < 5; i++) {
+        CHECK(write(pairs[active[i]][1], "x", 1) == 1);
+    }
+    for (pass = 0; pass < 2; pass++) {
+        CHECK(iolooper_wait(iol, 1000) == 5);
+        for (i = 0; i < 5; i++) {
+            CHECK(iolooper_is_read(iol, pairs[active[i]][0]));
+        }
+        CHECK(!iolooper_is_read(iol, pairs[0][0]));
+        CHECK(!iolooper_is_write(iol, pairs[1][0]));
+        CHECK(count_ready(iol) == 5);
+    }
+    for (i = 0; i < 5; i++) {
+        CHECK(read(pairs[active[i]][0], &c, 1) == 1);
+    }
+    CHECK(iolooper_poll(iol) == 0);
+
+    /* write interest toggled between two waits */
+    iolooper_add_write(iol, pairs[3][0]);
+    iolooper_del_write(iol, pairs[3][0]);
+    iolooper_add_write(iol, pairs[3][0]);
+    CHECK(iolooper_poll(iol) == 1);
+    CHECK(iolooper_is_write(iol, pairs[3][0]));
+    CHECK(!iolooper_is_read(iol, pairs[3][0]));
+    iolooper_del_write(iol, pairs[3][0]);
+    CHECK(iolooper_poll(iol) == 0);
+
+    /* a descriptor number closed and reused between two waits */
+    old = pairs[5][0];
+    iolooper_del_read(iol, old);
+    close(pairs[5][0]);
+    close(pairs[5][1]);
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, p) == 0);
+    CHECK(p[0] == old || p[1] == old);
+    rd = p[0] == old ? p[0] : p[1];
+    wr = p[0] == old ? p[1] : p[0];
+    iolooper_add_read(iol, rd);
+    CHECK(write(wr, "y", 1) == 1);
+    CHECK(iolooper_wait(iol, 1000) == 1 && iolooper_is_read(iol, rd));
+    CHECK(read(rd, &c, 1) == 1);
+    iolooper_del_read(iol, rd);
+    pairs[5][0] = rd;
+    pairs[5][1] = wr;
+
+    /* regular files are always ready, as with select() */
+    file = tmpfile();
+    CHECK(file != NULL);
+    iolooper_add_read(iol, fileno(file));
+    CHECK(iolooper_wait(iol, 1000) == 1 && iolooper_is_read(iol, fileno(file)));
+    iolooper_del_read(iol, fileno(file));
+    fclose(file);
+    CHECK(iolooper_poll(iol) == 0);
+
+    /* a hang-up is reported as readable */
+    close(pairs[7][1]);
+    CHECK(iolooper_poll(iol) == 1 && iolooper_is_read(iol, pairs[7][0]));
+    iolooper_del_read(iol, pairs[7][0]);
+    CHECK(iolooper_poll(iol) == 0);
+
+    iolooper_reset(iol);
+    CHECK(!iolooper_has_operations(iol));
+    CHECK(iolooper_wait(iol, -1) == 0);
+    iolooper_free(iol);
+}
+
+static void io_callback(void *opaque, int fd, unsigned events)
+{
+    char buf[16];
+
+    calls[opaque != NULL]++;
+    CHECK(read(fd, buf, sizeof(buf)) > 0);
+}
+
+static void test_looper(void)
+{
+    Looper *looper = looper_newGeneric();
+    LoopIo *ios = calloc(idle_count, sizeof(LoopIo));
+    int first = 1, last = idle_count - 1;
+    double start;
+    int i;
+
+    for (i = 0; i < idle_count; i++) {
+        if (i == 7) {
+            continue;       /* hung up above */
+        }
+        loopIo_init(&ios[i], looper, pairs[i][0], io_callback,
+                    i == first || i == last ? NULL : &ios[i]);
+        loopIo_wantRead(&ios[i]);
+    }
+
+    start = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        CHECK(write(pairs[first][1], "a", 1) == 1);
+        if (i & 1) {
+            CHECK(write(pairs[last][1], "b", 1) == 1);
+        }
+        looper_runWithDeadline(looper, 0);
+    }
+    printf("looper pass with %d idle fds: %.2f us\n", idle_count,
+           (now() - start) / ITERATIONS * 1e6);
+    CHECK(calls[0] == ITERATIONS + ITERATIONS / 2);
+    CHECK(calls[1] == 0);
+
+    for (i = 0; i < idle_count; i++) {
+        if (i != 7) {
+            loopIo_done(&ios[i]);
+        }
+    }
+    looper_free(looper);
+    free(ios);
+}
+
+int main(int argc, char **argv)
+{
+    struct rlimit rl;
+    int i;
+
+    if (argc > 1) {
+        idle_count = atoi(argv[1]);
+    }
+    CHECK(idle_count >= 20);
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    pairs = calloc(idle_count, sizeof(pairs[0]));
+    for (i = 0; i < idle_count; i++) {
+        CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) == 0);
+    }
+    test_iolooper();
+    test_looper();
+    return 0;
+}
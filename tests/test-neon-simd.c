@@ -0,0 +1,265 @@
+/*
+ * Compare the whole-register NEON helpers (NEON_HOST_SIMD) with the
+ * per-chunk helpers that translate.c uses on other hosts.
+ *
+ * Every op/size/U/Q combination is run on random registers whose bytes
+ * are biased towards the edge values 0x00, 0x7f, 0x80 and 0xff, with
+ * source and destination registers sometimes aliased.  The destination,
+ * the other registers and FPSCR.QC must match bit for bit.
+ *
+ * Built by tests/Makefile, with and without SSSE3.
+ */
+#include "target-arm/neon_helper.c"
+
+#ifndef NEON_HOST_SIMD
+#error "NEON_HOST_SIMD is not enabled for this host"
+#endif
+
+static CPUARMState test_env;
+
+typedef uint32_t (*chunk_fn)(uint32_t, uint32_t);
+
+static uint32_t add_u32(uint32_t a, uint32_t b) { return a + b; }
+static uint32_t sub_u32(uint32_t a, uint32_t b) { return a - b; }
+static uint32_t mul_u32(uint32_t a, uint32_t b) { return a * b; }
+
+/* The 32-bit halving ops are inline TCG code in translate.c, the helpers
+   compute the same thing.  */
+static uint32_t hadd_s32(uint32_t a, uint32_t b)
+{
+    return helper_neon_hadd_s32(a, b);
+}
+static uint32_t rhadd_s32(uint32_t a, uint32_t b)
+{
+    return helper_neon_rhadd_s32(a, b);
+}
+static uint32_t hsub_s32(uint32_t a, uint32_t b)
+{
+    return helper_neon_hsub_s32(a, b);
+}
+
+/* Indexed by size, or by size * 2 + u.  */
+static const chunk_fn add_fn[3] = {
+    helper_neon_add_u8, helper_neon_add_u16, add_u32
+};
+static const chunk_fn sub_fn[3] = {
+    helper_neon_sub_u8, helper_neon_sub_u16, sub_u32
+};
+static const chunk_fn mul_fn[3] = {
+    helper_neon_mul_u8, helper_neon_mul_u16, mul_u32
+};
+static const chunk_fn tst_fn[3] = {
+    helper_neon_tst_u8, helper_neon_tst_u16, helper_neon_tst_u32
+};
+static const chunk_fn ceq_fn[3] = {
+    helper_neon_ceq_u8, helper_neon_ceq_u16, helper_neon_ceq_u32
+};
+
+#define SIGNED_UNSIGNED(name) { \
+    helper_neon_##name##_s8, helper_neon_##name##_u8, \
+    helper_neon_##name##_s16, helper_neon_##name##_u16, \
+    helper_neon_##name##_s32, helper_neon_##name##_u32 }
+
+static const chunk_fn qadd_fn[6] = SIGNED_UNSIGNED(qadd);
+static const chunk_fn qsub_fn[6] = SIGNED_UNSIGNED(qsub);
+static const chunk_fn cgt_fn[6] = SIGNED_UNSIGNED(cgt);
+static const chunk_fn cge_fn[6] = SIGNED_UNSIGNED(cge);
+static const chunk_fn max_fn[6] = SIGNED_UNSIGNED(max);
+static const chunk_fn min_fn[6] = SIGNED_UNSIGNED(min);
+static const chunk_fn abd_fn[6] = SIGNED_UNSIGNED(abd);
+static const chunk_fn hadd_fn[6] = {
+    helper_neon_hadd_s8, helper_neon_hadd_u8,
+    helper_neon_hadd_s16, helper_neon_hadd_u16,
+    hadd_s32, helper_neon_hadd_u32
+};
+static const chunk_fn rhadd_fn[6] = {
+    helper_neon_rhadd_s8, helper_neon_rhadd_u8,
+    helper_neon_rhadd_s16, helper_neon_rhadd_u16,
+    rhadd_s32, helper_neon_rhadd_u32
+};
+static const chunk_fn hsub_fn[6] = {
+    helper_neon_hsub_s8, helper_neon_hsub_u8,
+    helper_neon_hsub_s16, helper_neon_hsub_u16,
+    hsub_s32, helper_neon_hsub_u32
+};
+
+enum {
+    OP_ADD, OP_SUB, OP_QADD, OP_QSUB, OP_HADD, OP_RHADD, OP_HSUB,
+    OP_CGT, OP_CGE, OP_MAX, OP_MIN, OP_ABD, OP_ABA, OP_MUL, OP_MLA,
+    OP_MLS, OP_TST, OP_CEQ, OP_LOGIC, OP_ABS, OP_NEG, NUM_OPS
+};
+
+static const char *op_names[NUM_OPS] = {
+    "add", "sub", "qadd", "qsub", "hadd", "rhadd", "hsub",
+    "cgt", "cge", "max", "min", "abd", "aba", "mul", "mla",
+    "mls", "tst", "ceq", "logic", "abs", "neg"
+};
+
+typedef void (*vec_fn)(uint32_t, uint32_t, uint32_t, uint32_t);
+
+static const vec_fn vec_ops[OP_LOGIC + 1] = {
+    helper_neon_vec_add, helper_neon_vec_sub, helper_neon_vec_qadd,
+    helper_neon_vec_qsub, helper_neon_vec_hadd, helper_neon_vec_rhadd,
+    helper_neon_vec_hsub, helper_neon_vec_cgt, helper_neon_vec_cge,
+    helper_neon_vec_max, helper_neon_vec_min, helper_neon_vec_abd,
+    helper_neon_vec_aba, helper_neon_vec_mul, helper_neon_vec_mla,
+    helper_neon_vec_mls, helper_neon_vec_tst, helper_neon_vec_ceq,
+    helper_neon_vec_logic
+};
+
+/* One 32-bit chunk of the result, the way translate.c computes it
+   without NEON_HOST_SIMD.  */
+static uint32_t chunk_ref(int op, int size, int u,
+                          uint32_t n, uint32_t m, uint32_t d)
+{
+    int i = size * 2 + u;
+
+    switch (op) {
+    case OP_ADD:   return add_fn[size](n, m);
+    case OP_SUB:   return sub_fn[size](n, m);
+    case OP_QADD:  return qadd_fn[i](n, m);
+    case OP_QSUB:  return qsub_fn[i](n, m);
+    case OP_HADD:  return hadd_fn[i](n, m);
+    case OP_RHADD: return rhadd_fn[i](n, m);
+    case OP_HSUB:  return hsub_fn[i](n, m);
+    case OP_CGT:   return cgt_fn[i](n, m);
+    case OP_CGE:   return cge_fn[i](n, m);
+    case OP_MAX:   return max_fn[i](n, m);
+    case OP_MIN:   return min_fn[i](n, m);
+    case OP_ABD:   return abd_fn[i](n, m);
+    case OP_ABA:   return add_fn[size](abd_fn[i](n, m), d);
+    case OP_MUL:   return mul_fn[size](n, m);
+    case OP_MLA:   return add_fn[size](mul_fn[size](n, m), d);
+    case OP_MLS:   return sub_fn[size](d, mul_fn[size](n, m));
+    case OP_TST:   return tst_fn[size](n, m);
+    case OP_CEQ:   return ceq_fn[size](n, m);
+    case OP_LOGIC:
+        switch ((u << 2) | size) {
+        case 0: return n & m;                   /* VAND */
+        case 1: return n & ~m;                  /* VBIC */
+        case 2: return n | m;                   /* VORR */
+        case 3: return n | ~m;                  /* VORN */
+        case 4: return n ^ m;                   /* VEOR */
+        case 5: return (n & d) | (m & ~d);      /* VBSL */
+        case 6: return (n & m) | (d & ~m);      /* VBIT */
+        default: return (d & m) | (n & ~m);     /* VBIF */
+        }
+    case OP_ABS:
+        if (size == 0) {
+            return helper_neon_abs_s8(m);
+        }
+        if (size == 1) {
+            return helper_neon_abs_s16(m);
+        }
+        return (int32_t)m < 0 ? -m : m;
+    case OP_NEG:
+        return sub_fn[size](0, m);
+    }
+    abort();
+}
+
+static uint64_t random_reg(void)
+{
+    uint64_t val = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        static const uint8_t edges[4] = { 0x00, 0x7f, 0x80, 0xff };
+        int k = rand() % 6;
+
+        val = (val << 8) | (k < 4 ? edges[k] : (uint8_t)rand());
+    }
+    return val;
+}
+
+static int run_case(int op, int size, int u, int q)
+{
+    uint64_t saved[32];
+    uint32_t expect[4], got[4], expect_fpscr;
+    uint32_t desc = (q << 3) | (size << 1) | u;
+    int rd, rn, rm, pass, reg;
+    int failed = 0;
+
+    for (reg = 0; reg < 32; reg++) {
+        env->vfp.regs[reg] = make_float64(random_reg());
+    }
+    /* Q registers are even pairs of D registers.  */
+    rd = (rand() % 16) & ~q;
+    rn = (rand() % 16) & ~q;
+    rm = (rand() % 16) & ~q;
+    if (rand() % 4 == 0) {
+        rn = rd;
+    }
+    if (rand() % 4 == 0) {
+        rm = rn;
+    }
+    memcpy(saved, env->vfp.regs, sizeof(saved));
+
+    env->vfp.xregs[ARM_VFP_FPSCR] = 0;
+    for (pass = 0; pass < (q ? 4 : 2); pass++) {
+        uint32_t *n = (uint32_t *)&env->vfp.regs[rn];
+        uint32_t *m = (uint32_t *)&env->vfp.regs[rm];
+        uint32_t *d = (uint32_t *)&env->vfp.regs[rd];
+
+        expect[pass] = chunk_ref(op, size, u, n[pass], m[pass], d[pass]);
+    }
+    expect_fpscr = env->vfp.xregs[ARM_VFP_FPSCR];
+
+    memcpy(env->vfp.regs, saved, sizeof(saved));
+    env->vfp.xregs[ARM_VFP_FPSCR] = 0;
+    if (op == OP_ABS) {
+        helper_neon_vec_abs(rd, rm, desc);
+    } else if (op == OP_NEG) {
+        helper_neon_vec_neg(rd, rm, desc);
+    } else {
+        vec_ops[op](rd, rn, rm, desc);
+    }
+    memcpy(got, &env->vfp.regs[rd], q ? 16 : 8);
+
+    if (memcmp(got, expect, q ? 16 : 8) != 0 ||
+        expect_fpscr != env->vfp.xregs[ARM_VFP_FPSCR]) {
+        printf("FAIL %s size %d u %d q %d: expected %08x %08x qc %x, "
+               "got %08x %08x qc %x\n", op_names[op], size, u, q,
+               expect[0], expect[1], expect_fpscr,
+               got[0], got[1], env->vfp.xregs[ARM_VFP_FPSCR]);
+        failed = 1;
+    }
+    for (reg = 0; reg < 32; reg++) {
+        if (reg == rd || (q && reg == rd + 1)) {
+            continue;
+        }
+        if (float64_val(env->vfp.regs[reg]) != saved[reg]) {
+            printf("FAIL %s size %d u %d q %d: clobbered d%d\n",
+                   op_names[op], size, u, q, reg);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 5000;
+    int op, size, u, q, it;
+    long cases = 0, failures = 0;
+
+    env = &test_env;
+    srand(1);
+    for (it = 0; it < iterations; it++) {
+        for (op = 0; op < NUM_OPS; op++) {
+            for (size = 0; size < (op == OP_LOGIC ? 4 : 3); size++) {
+                for (u = 0; u < 2; u++) {
+                    if ((op == OP_ABS || op == OP_NEG) && u) {
+                        continue;
+                    }
+                    for (q = 0; q < 2; q++) {
+                        failures += run_case(op, size, u, q);
+                        cases++;
+                    }
+                }
+            }
+        }
+    }
+    printf("test-neon-simd: %ld cases, %ld failures\n", cases, failures);
+    return failures != 0;
+}
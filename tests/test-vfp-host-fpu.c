@@ -0,0 +1,198 @@
+/*
+ * Compare the VFP arithmetic helpers, which use the host FPU when
+ * VFP_HOST_FPU is enabled, with the softfloat functions they replace.
+ *
+ * Operands are random, biased towards zeros, denormals, values near the
+ * overflow threshold, infinities and NaNs.  FPSCR is set through
+ * vfp_set_fpscr with a random rounding mode, flush-to-zero and default
+ * NaN setting and sticky flags, so the fast path is both taken and
+ * refused.  The result and the float_status after the operation must
+ * match softfloat exactly.
+ *
+ * Built by tests/Makefile.
+ */
+#include "target-arm/helper.c"
+
+#ifndef VFP_HOST_FPU
+#error "VFP_HOST_FPU is not enabled for this host"
+#endif
+
+enum { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_SQRT, NUM_OPS };
+
+static const char *op_names[NUM_OPS] = { "add", "sub", "mul", "div", "sqrt" };
+
+static uint64_t random_u64(void)
+{
+    return ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ rand();
+}
+
+/* Pick an exponent class: zero/denormal, tiny normal, near overflow,
+   infinity/NaN, or an ordinary value.  */
+static uint32_t random_f32(void)
+{
+    uint32_t sign = (uint32_t)(rand() & 1) << 31;
+    uint32_t mant = rand() & 0x7fffff;
+    uint32_t exp;
+    int k = rand() % 10;
+
+    switch (k) {
+    case 0:  exp = 0; break;
+    case 1:  exp = 1 + rand() % 4; break;
+    case 2:  exp = 250 + rand() % 4; break;
+    case 3:  exp = 0xff; break;
+    default: exp = 100 + rand() % 56; break;
+    }
+    if (k == 4) {
+        mant = 0;
+    }
+    return sign | (exp << 23) | mant;
+}
+
+static uint64_t random_f64(void)
+{
+    uint64_t sign = (uint64_t)(rand() & 1) << 63;
+    uint64_t mant = random_u64() & 0xfffffffffffffULL;
+    uint64_t exp;
+    int k = rand() % 10;
+
+    switch (k) {
+    case 0:  exp = 0; break;
+    case 1:  exp = 1 + rand() % 4; break;
+    case 2:  exp = 2040 + rand() % 6; break;
+    case 3:  exp = 0x7ff; break;
+    default: exp = 900 + rand() % 250; break;
+    }
+    if (k == 4) {
+        mant = 0;
+    }
+    return sign | (exp << 52) | mant;
+}
+
+/* Mostly round-to-nearest with IXC set, which is what the fast path
+   needs; the rest covers every way of refusing it.  */
+static uint32_t random_fpscr(void)
+{
+    uint32_t val = 0;
+
+    if (rand() % 4 == 0) {
+        val |= (rand() & 3) << 22;              /* RMode */
+    }
+    if (rand() % 2) {
+        val |= 1 << 24;                         /* FZ */
+    }
+    if (rand() % 4 == 0) {
+        val |= 1 << 25;                         /* DN */
+    }
+    if (rand() % 8 != 0) {
+        val |= 1 << 4;                          /* IXC */
+    }
+    val |= rand() & 0x8f;                       /* other sticky flags */
+    if (rand() % 8 == 0) {
+        val |= (rand() & 0x1f) << 8;            /* trap enables */
+    }
+    return val;
+}
+
+static int run_case(CPUState *env, int op, int dp)
+{
+    float_status ref;
+    uint64_t got, expect;
+    uint64_t a = dp ? random_f64() : random_f32();
+    uint64_t b = dp ? random_f64() : random_f32();
+    uint32_t fpscr = random_fpscr();
+
+    vfp_set_fpscr(env, fpscr);
+    ref = env->vfp.fp_status;
+
+    if (dp) {
+        float64 fa = make_float64(a), fb = make_float64(b);
+        float64 x, y;
+
+        switch (op) {
+        case OP_ADD:
+            x = helper_vfp_addd(fa, fb, env);
+            y = float64_add(fa, fb, &ref);
+            break;
+        case OP_SUB:
+            x = helper_vfp_subd(fa, fb, env);
+            y = float64_sub(fa, fb, &ref);
+            break;
+        case OP_MUL:
+            x = helper_vfp_muld(fa, fb, env);
+            y = float64_mul(fa, fb, &ref);
+            break;
+        case OP_DIV:
+            x = helper_vfp_divd(fa, fb, env);
+            y = float64_div(fa, fb, &ref);
+            break;
+        default:
+            x = helper_vfp_sqrtd(fa, env);
+            y = float64_sqrt(fa, &ref);
+            break;
+        }
+        got = float64_val(x);
+        expect = float64_val(y);
+    } else {
+        float32 fa = make_float32(a), fb = make_float32(b);
+        float32 x, y;
+
+        switch (op) {
+        case OP_ADD:
+            x = helper_vfp_adds(fa, fb, env);
+            y = float32_add(fa, fb, &ref);
+            break;
+        case OP_SUB:
+            x = helper_vfp_subs(fa, fb, env);
+            y = float32_sub(fa, fb, &ref);
+            break;
+        case OP_MUL:
+            x = helper_vfp_muls(fa, fb, env);
+            y = float32_mul(fa, fb, &ref);
+            break;
+        case OP_DIV:
+            x = helper_vfp_divs(fa, fb, env);
+            y = float32_div(fa, fb, &ref);
+            break;
+        default:
+            x = helper_vfp_sqrts(fa, env);
+            y = float32_sqrt(fa, &ref);
+            break;
+        }
+        got = float32_val(x);
+        expect = float32_val(y);
+    }
+
+    if (got != expect || memcmp(&ref, &env->vfp.fp_status, sizeof(ref))) {
+        printf("FAIL %s%c %llx %llx fpscr %08x: expected %llx flags %x, "
+               "got %llx flags %x\n", op_names[op], dp ? 'd' : 's',
+               (unsigned long long)a, (unsigned long long)b, fpscr,
+               (unsigned long long)expect,
+               get_float_exception_flags(&ref),
+               (unsigned long long)got,
+               get_float_exception_flags(&env->vfp.fp_status));
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 500000;
+    static CPUState test_env;
+    long it, cases = 0, failures = 0;
+    int op, dp;
+
+    set_float_detect_tininess(float_tininess_before_rounding,
+                              &test_env.vfp.fp_status);
+    srand(1);
+    for (it = 0; it < iterations; it++) {
+        for (op = 0; op < NUM_OPS; op++) {
+            for (dp = 0; dp < 2; dp++) {
+                failures += run_case(&test_env, op, dp);
+                cases++;
+            }
+        }
+    }
+    printf("test-vfp-host-fpu: %ld cases, %ld failures\n", cases, failures);
+    return failures != 0;
+}
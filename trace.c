@@ -10,6 +10,7 @@
 ** GNU General Public License for more details.
 */
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,14 +23,330 @@
 #include <time.h>
 #include "cpu.h"
 #include "exec-all.h"
+#include "host-utils.h"
 #include "android-trace.h"
 #include "varint.h"
 #include "android/utils/path.h"
+#include <zlib.h>
+#ifdef __linux__
+#include <sched.h>
+#include "qemu-thread.h"
+#endif
+
+// The compressed records of each trace stream are copied into large
+// blocks, and full blocks are written to the file by a writer thread, so
+// that the thread running the guest never waits in fwrite().  Blocks go
+// to the writer, and come back empty, through two single-producer,
+// single-consumer rings that need no lock.  The writer can also gzip the
+// stream, and start a new file ("qtrace.bb.001", ...) every
+// trace_segment_size bytes.  Segments always end on a record boundary;
+// concatenating them gives back the whole stream.
+#define kTraceBlockSize (256 * 1024)
+#define kTraceNumBlocks 32              // shared by all the streams
+#define kTraceRingSize  64              // a power of 2 > kTraceNumBlocks
+
+// Where the blocks of a trace stream go.
+typedef struct TraceSink {
+    char        *filename;      // name of the first segment
+    FILE        *fstream;       // current segment
+    gzFile      gzstream;       // same, when compressing
+    int         segment;
+    uint64_t    segment_bytes;
+    char        *block;         // block being filled, owned by the producer
+    uint32_t    block_size;
+} TraceSink;
+
+typedef struct TraceRingEntry {
+    TraceSink   *sink;
+    char        *block;
+    uint32_t    size;
+} TraceRingEntry;
+
+typedef struct TraceRing {
+    TraceRingEntry entries[kTraceRingSize];
+    volatile unsigned head;     // written by the producer only
+    volatile unsigned tail;     // written by the consumer only
+} TraceRing;
+
+int trace_compress;
+uint64_t trace_segment_size;
+
+static struct {
+    int         started;
+    TraceRing   full;           // from the guest thread to the writer
+    TraceRing   empty;          // and back
+#ifdef __linux__
+    QemuThread  thread;
+    QemuMutex   lock;
+    QemuCond    cond;
+    volatile int writer_idle;
+    volatile int producer_idle;
+    volatile int stop;
+#endif
+    uint64_t    stall_usecs;    // time the guest waited for an empty block
+    uint64_t    bytes;
+} trace_writer;
+
+static void trace_ring_push(TraceRing *ring, TraceSink *sink, char *block,
+                            uint32_t size)
+{
+    TraceRingEntry *entry = &ring->entries[ring->head % kTraceRingSize];
+
+    entry->sink = sink;
+    entry->block = block;
+    entry->size = size;
+    // make the entry visible before the new head
+    __sync_synchronize();
+    ring->head += 1;
+}
+
+static int trace_ring_pop(TraceRing *ring, TraceRingEntry *entry)
+{
+    if (ring->tail == ring->head)
+        return 0;
+    __sync_synchronize();
+    *entry = ring->entries[ring->tail % kTraceRingSize];
+    __sync_synchronize();
+    ring->tail += 1;
+    return 1;
+}
+
+static void trace_sink_open_segment(TraceSink *sink)
+{
+    char *fname = sink->filename;
+    const char *ext = trace_compress ? ".gz" : "";
+    char *name;
+
+    name = malloc(strlen(fname) + 16);
+    if (sink->segment == 0)
+        sprintf(name, "%s%s", fname, ext);
+    else
+        sprintf(name, "%s.%03d%s", fname, sink->segment, ext);
+
+    sink->fstream = fopen(name, "wb");
+    if (sink->fstream == NULL) {
+        perror(name);
+        exit(1);
+    }
+    if (trace_compress) {
+        // speed matters more than size here
+        sink->gzstream = gzdopen(dup(fileno(sink->fstream)), "wb1");
+        if (sink->gzstream == NULL) {
+            fprintf(stderr, "%s: cannot compress\n", name);
+            exit(1);
+        }
+    }
+    sink->segment_bytes = 0;
+    free(name);
+}
+
+static void trace_sink_close_segment(TraceSink *sink)
+{
+    if (sink->gzstream) {
+        gzclose(sink->gzstream);
+        sink->gzstream = NULL;
+    }
+    fclose(sink->fstream);
+}
+
+// Writes a block to the current segment of a sink, starting a new segment
+// first if the block does not fit.  Called by the writer thread, or by the
+// guest thread when there is none.
+static void trace_sink_write(TraceSink *sink, const char *data, uint32_t size)
+{
+    if (trace_segment_size && sink->segment_bytes > 0 &&
+        sink->segment_bytes + size > trace_segment_size) {
+        trace_sink_close_segment(sink);
+        sink->segment += 1;
+        trace_sink_open_segment(sink);
+    }
+
+    if (sink->gzstream) {
+        if (gzwrite(sink->gzstream, data, size) != (int)size) {
+            fprintf(stderr, "gzwrite() failed\n");
+            perror(sink->filename);
+            exit(1);
+        }
+    } else if (fwrite(data, sizeof(char), size, sink->fstream) != size) {
+        fprintf(stderr, "fwrite() failed\n");
+        perror(sink->filename);
+        exit(1);
+    }
+    sink->segment_bytes += size;
+    trace_writer.bytes += size;
+}
+
+#ifdef __linux__
+static void *trace_writer_thread(void *opaque)
+{
+    TraceRingEntry entry;
+
+    for (;;) {
+        if (!trace_ring_pop(&trace_writer.full, &entry)) {
+            // announce that we are going to sleep, then look at the ring
+            // again, so that the producer either sees the flag or we see
+            // its block.
+            qemu_mutex_lock(&trace_writer.lock);
+            trace_writer.writer_idle = 1;
+            __sync_synchronize();
+            while (trace_writer.full.tail == trace_writer.full.head &&
+                   !trace_writer.stop)
+                qemu_cond_wait(&trace_writer.cond, &trace_writer.lock);
+            trace_writer.writer_idle = 0;
+            qemu_mutex_unlock(&trace_writer.lock);
+            if (trace_writer.full.tail == trace_writer.full.head)
+                break;
+            continue;
+        }
+
+        trace_sink_write(entry.sink, entry.block, entry.size);
+
+        trace_ring_push(&trace_writer.empty, NULL, entry.block, 0);
+        __sync_synchronize();
+        if (trace_writer.producer_idle) {
+            qemu_mutex_lock(&trace_writer.lock);
+            qemu_cond_broadcast(&trace_writer.cond);
+            qemu_mutex_unlock(&trace_writer.lock);
+        }
+    }
+    return NULL;
+}
+
+static void trace_writer_wake(void)
+{
+    __sync_synchronize();
+    if (trace_writer.writer_idle) {
+        qemu_mutex_lock(&trace_writer.lock);
+        qemu_cond_broadcast(&trace_writer.cond);
+        qemu_mutex_unlock(&trace_writer.lock);
+    }
+}
+
+static void trace_writer_start(void)
+{
+    int ii;
+
+    for (ii = 0; ii < kTraceNumBlocks; ++ii)
+        trace_ring_push(&trace_writer.empty, NULL, malloc(kTraceBlockSize), 0);
+
+    qemu_mutex_init(&trace_writer.lock);
+    qemu_cond_init(&trace_writer.cond);
+    qemu_thread_create(&trace_writer.thread, trace_writer_thread, NULL);
+    trace_writer.started = 1;
+}
+
+// Returns an empty block, waiting for the writer to hand one back if
+// they are all queued.
+static char *trace_writer_get_block(void)
+{
+    TraceRingEntry entry;
+    uint64_t start;
+
+    if (trace_ring_pop(&trace_writer.empty, &entry))
+        return entry.block;
+
+    start = Now();
+    qemu_mutex_lock(&trace_writer.lock);
+    trace_writer.producer_idle = 1;
+    __sync_synchronize();
+    while (!trace_ring_pop(&trace_writer.empty, &entry))
+        qemu_cond_wait(&trace_writer.cond, &trace_writer.lock);
+    trace_writer.producer_idle = 0;
+    qemu_mutex_unlock(&trace_writer.lock);
+    trace_writer.stall_usecs += Now() - start;
+    return entry.block;
+}
+
+// Hands the block of a sink over to the writer.
+static void trace_sink_queue(TraceSink *sink)
+{
+    trace_ring_push(&trace_writer.full, sink, sink->block, sink->block_size);
+    trace_writer_wake();
+    sink->block = trace_writer_get_block();
+    sink->block_size = 0;
+}
+
+// Waits for the writer to write all the queued blocks, and stops it.
+static void trace_writer_stop(void)
+{
+    TraceRingEntry entry;
+
+    if (!trace_writer.started)
+        return;
+    qemu_mutex_lock(&trace_writer.lock);
+    trace_writer.stop = 1;
+    qemu_cond_broadcast(&trace_writer.cond);
+    qemu_mutex_unlock(&trace_writer.lock);
+    pthread_join(trace_writer.thread.thread, NULL);
+    trace_writer.started = 0;
+
+    while (trace_ring_pop(&trace_writer.empty, &entry))
+        free(entry.block);
+    qemu_cond_destroy(&trace_writer.cond);
+    qemu_mutex_destroy(&trace_writer.lock);
+}
+#else
+static void trace_writer_start(void)
+{
+}
+
+static void trace_sink_queue(TraceSink *sink)
+{
+    trace_sink_write(sink, sink->block, sink->block_size);
+    sink->block_size = 0;
+}
+
+static void trace_writer_stop(void)
+{
+}
+#endif
+
+// Opens the first segment of a trace stream, and returns it.
+static FILE *trace_sink_open(TraceSink *sink, char *fname)
+{
+    sink->filename = fname;
+    sink->segment = 0;
+    sink->gzstream = NULL;
+    trace_sink_open_segment(sink);
+
+    sink->block_size = 0;
+#ifdef __linux__
+    if (!trace_writer.started)
+        trace_writer_start();
+    sink->block = trace_writer_get_block();
+#else
+    sink->block = malloc(kTraceBlockSize);
+#endif
+    return sink->fstream;
+}
+
+// Appends compressed records to a trace stream.  This replaces fwrite()
+// on the hot paths: it only copies, unless the block is full.
+static void trace_sink_put(TraceSink *sink, const void *data, uint32_t size)
+{
+    // callers pass at most kCompressedSize bytes at a time
+    if (sink->block_size + size > kTraceBlockSize)
+        trace_sink_queue(sink);
+    memcpy(sink->block + sink->block_size, data, size);
+    sink->block_size += size;
+}
+
+// Writes what is left in the block of a trace stream and closes it.  The
+// writer must have been stopped.
+static void trace_sink_close(TraceSink *sink)
+{
+    if (sink->block_size)
+        trace_sink_write(sink, sink->block, sink->block_size);
+    free(sink->block);
+    sink->block = NULL;
+    trace_sink_close_segment(sink);
+}
 
 // For tracing dynamic execution of basic blocks
 typedef struct TraceBB {
     char        *filename;
     FILE        *fstream;
+    TraceSink   sink;
     BBRec       buffer[kMaxNumBasicBlocks];
     BBRec       *next;          // points to next record in buffer
     uint64_t    flush_time;     // time of last buffer flush
@@ -49,6 +366,7 @@ typedef struct TraceBB {
 typedef struct TraceInsn {
     char        *filename;
     FILE        *fstream;
+    TraceSink   sink;
     InsnRec     dummy;          // this is here so we can use buffer[-1]
     InsnRec     buffer[kInsnBufferSize];
     InsnRec     *current;
@@ -73,6 +391,7 @@ typedef struct TraceStatic {
 typedef struct TraceAddr {
     char        *filename;
     FILE        *fstream;
+    TraceSink   sink;
     AddrRec     buffer[kMaxNumAddrs];
     AddrRec     *next;
     char        compressed[kCompressedSize];
@@ -86,6 +405,7 @@ typedef struct TraceAddr {
 typedef struct TraceExc {
     char        *filename;
     FILE        *fstream;
+    TraceSink   sink;
     char        compressed[kCompressedSize];
     char        *compressed_ptr;
     char        *high_water_ptr;
@@ -97,6 +417,7 @@ typedef struct TraceExc {
 typedef struct TracePid {
     char        *filename;
     FILE        *fstream;
+    TraceSink   sink;
     char        compressed[kCompressedSize];
     char        *compressed_ptr;
     uint64_t    prev_time;
@@ -106,6 +427,7 @@ typedef struct TracePid {
 typedef struct TraceMethod {
     char        *filename;
     FILE        *fstream;
+    TraceSink   sink;
     char        compressed[kCompressedSize];
     char        *compressed_ptr;
     uint64_t    prev_time;
@@ -340,11 +662,7 @@ void create_trace_bb(const char *filename)
     char *fname = create_trace_path(filename, ".bb");
     trace_bb.filename = fname;
 
-    FILE *fstream = fopen(fname, "wb");
-    if (fstream == NULL) {
-        perror(fname);
-        exit(1);
-    }
+    FILE *fstream = trace_sink_open(&trace_bb.sink, fname);
     trace_bb.fstream = fstream;
     trace_bb.next = &trace_bb.buffer[0];
     trace_bb.flush_time = 0;
@@ -362,11 +680,7 @@ void create_trace_insn(const char *filename)
     char *fname = create_trace_path(filename, ".insn");
     trace_insn.filename = fname;
 
-    FILE *fstream = fopen(fname, "wb");
-    if (fstream == NULL) {
-        perror(fname);
-        exit(1);
-    }
+    FILE *fstream = trace_sink_open(&trace_insn.sink, fname);
     trace_insn.fstream = fstream;
     trace_insn.current = &trace_insn.dummy;
     trace_insn.dummy.time_diff = 0;
@@ -427,11 +741,7 @@ void create_trace_addr(const char *filename)
         char *fname = create_trace_path(filename, ".load");
         trace_load.filename = fname;
 
-        FILE *fstream = fopen(fname, "wb");
-        if (fstream == NULL) {
-            perror(fname);
-            exit(1);
-        }
+        FILE *fstream = trace_sink_open(&trace_load.sink, fname);
         trace_load.fstream = fstream;
         trace_load.next = &trace_load.buffer[0];
         trace_load.compressed_ptr = trace_load.compressed;
@@ -443,11 +753,7 @@ void create_trace_addr(const char *filename)
         fname = create_trace_path(filename, ".store");
         trace_store.filename = fname;
 
-        fstream = fopen(fname, "wb");
-        if (fstream == NULL) {
-            perror(fname);
-            exit(1);
-        }
+        fstream = trace_sink_open(&trace_store.sink, fname);
         trace_store.fstream = fstream;
         trace_store.next = &trace_store.buffer[0];
         trace_store.compressed_ptr = trace_store.compressed;
@@ -463,11 +769,7 @@ void create_trace_exc(const char *filename)
     char *fname = create_trace_path(filename, ".exc");
     trace_exc.filename = fname;
 
-    FILE *fstream = fopen(fname, "wb");
-    if (fstream == NULL) {
-        perror(fname);
-        exit(1);
-    }
+    FILE *fstream = trace_sink_open(&trace_exc.sink, fname);
     trace_exc.fstream = fstream;
     trace_exc.compressed_ptr = trace_exc.compressed;
     trace_exc.high_water_ptr = &trace_exc.compressed[kCompressedSize] - kMaxExcCompressed;
@@ -481,11 +783,7 @@ void create_trace_pid(const char *filename)
     char *fname = create_trace_path(filename, ".pid");
     trace_pid.filename = fname;
 
-    FILE *fstream = fopen(fname, "wb");
-    if (fstream == NULL) {
-        perror(fname);
-        exit(1);
-    }
+    FILE *fstream = trace_sink_open(&trace_pid.sink, fname);
     trace_pid.fstream = fstream;
     trace_pid.compressed_ptr = trace_pid.compressed;
     trace_pid.prev_time = 0;
@@ -497,11 +795,7 @@ void create_trace_method(const char *filename)
     char *fname = create_trace_path(filename, ".method");
     trace_method.filename = fname;
 
-    FILE *fstream = fopen(fname, "wb");
-    if (fstream == NULL) {
-        perror(fname);
-        exit(1);
-    }
+    FILE *fstream = trace_sink_open(&trace_method.sink, fname);
     trace_method.fstream = fstream;
     trace_method.compressed_ptr = trace_method.compressed;
     trace_method.prev_time = 0;
@@ -648,8 +942,7 @@ void trace_cleanup()
         for (ptr = trace_bb.buffer; ptr != next; ++ptr) {
             if (comp_ptr >= trace_bb.high_water_ptr) {
                 uint32_t size = comp_ptr - trace_bb.compressed;
-                fwrite(trace_bb.compressed, sizeof(char), size,
-                       trace_bb.fstream);
+                trace_sink_put(&trace_bb.sink, trace_bb.compressed, size);
                 comp_ptr = trace_bb.compressed;
             }
             int64_t bb_diff = ptr->bb_num - prev_bb_num;
@@ -675,13 +968,12 @@ void trace_cleanup()
 
         uint32_t size = comp_ptr - trace_bb.compressed;
         if (size)
-            fwrite(trace_bb.compressed, sizeof(char), size, trace_bb.fstream);
+            trace_sink_put(&trace_bb.sink, trace_bb.compressed, size);
 
         // Terminate the file with three zeros so that we can detect
         // the end of file quickly.
         uint32_t zeros = 0;
-        fwrite(&zeros, 3, 1, trace_bb.fstream);
-        fclose(trace_bb.fstream);
+        trace_sink_put(&trace_bb.sink, &zeros, 3);
     }
 
     if (trace_insn.fstream) {
@@ -691,13 +983,7 @@ void trace_cleanup()
         for (ptr = trace_insn.buffer; ptr != current; ++ptr) {
             if (comp_ptr >= trace_insn.high_water_ptr) {
                 uint32_t size = comp_ptr - trace_insn.compressed;
-                uint32_t rval = fwrite(trace_insn.compressed, sizeof(char),
-                                       size, trace_insn.fstream);
-                if (rval != size) {
-                    fprintf(stderr, "fwrite() failed\n");
-                    perror(trace_insn.filename);
-                    exit(1);
-                }
+                trace_sink_put(&trace_insn.sink, trace_insn.compressed, size);
                 comp_ptr = trace_insn.compressed;
             }
             comp_ptr = varint_encode(ptr->time_diff, comp_ptr);
@@ -705,16 +991,8 @@ void trace_cleanup()
         }
 
         uint32_t size = comp_ptr - trace_insn.compressed;
-        if (size) {
-            uint32_t rval = fwrite(trace_insn.compressed, sizeof(char), size,
-                                   trace_insn.fstream);
-            if (rval != size) {
-                fprintf(stderr, "fwrite() failed\n");
-                perror(trace_insn.filename);
-                exit(1);
-            }
-        }
-        fclose(trace_insn.fstream);
+        if (size)
+            trace_sink_put(&trace_insn.sink, trace_insn.compressed, size);
     }
 
     if (trace_static.fstream) {
@@ -732,8 +1010,7 @@ void trace_cleanup()
         for (ptr = trace_load.buffer; ptr != next; ++ptr) {
             if (comp_ptr >= trace_load.high_water_ptr) {
                 uint32_t size = comp_ptr - trace_load.compressed;
-                fwrite(trace_load.compressed, sizeof(char), size,
-                       trace_load.fstream);
+                trace_sink_put(&trace_load.sink, trace_load.compressed, size);
                 comp_ptr = trace_load.compressed;
             }
 
@@ -748,15 +1025,13 @@ void trace_cleanup()
 
         uint32_t size = comp_ptr - trace_load.compressed;
         if (size) {
-            fwrite(trace_load.compressed, sizeof(char), size,
-                   trace_load.fstream);
+            trace_sink_put(&trace_load.sink, trace_load.compressed, size);
         }
 
         // Terminate the file with two zeros so that we can detect
         // the end of file quickly.
         uint32_t zeros = 0;
-        fwrite(&zeros, 2, 1, trace_load.fstream);
-        fclose(trace_load.fstream);
+        trace_sink_put(&trace_load.sink, &zeros, 2);
     }
 
     if (trace_store.fstream) {
@@ -768,8 +1043,7 @@ void trace_cleanup()
         for (ptr = trace_store.buffer; ptr != next; ++ptr) {
             if (comp_ptr >= trace_store.high_water_ptr) {
                 uint32_t size = comp_ptr - trace_store.compressed;
-                fwrite(trace_store.compressed, sizeof(char), size,
-                       trace_store.fstream);
+                trace_sink_put(&trace_store.sink, trace_store.compressed, size);
                 comp_ptr = trace_store.compressed;
             }
 
@@ -784,235 +1058,393 @@ void trace_cleanup()
 
         uint32_t size = comp_ptr - trace_store.compressed;
         if (size) {
-            fwrite(trace_store.compressed, sizeof(char), size,
-                   trace_store.fstream);
+            trace_sink_put(&trace_store.sink, trace_store.compressed, size);
         }
 
         // Terminate the file with two zeros so that we can detect
         // the end of file quickly.
         uint32_t zeros = 0;
-        fwrite(&zeros, 2, 1, trace_store.fstream);
-        fclose(trace_store.fstream);
+        trace_sink_put(&trace_store.sink, &zeros, 2);
     }
 
     if (trace_exc.fstream) {
         uint32_t size = trace_exc.compressed_ptr - trace_exc.compressed;
         if (size) {
-            fwrite(trace_exc.compressed, sizeof(char), size,
-                   trace_exc.fstream);
+            trace_sink_put(&trace_exc.sink, trace_exc.compressed, size);
         }
 
         // Terminate the file with 7 zeros so that we can detect
         // the end of file quickly.
         uint64_t zeros = 0;
-        fwrite(&zeros, 7, 1, trace_exc.fstream);
-        fclose(trace_exc.fstream);
+        trace_sink_put(&trace_exc.sink, &zeros, 7);
     }
     if (trace_pid.fstream) {
         uint32_t size = trace_pid.compressed_ptr - trace_pid.compressed;
         if (size) {
-            fwrite(trace_pid.compressed, sizeof(char), size,
-                   trace_pid.fstream);
+            trace_sink_put(&trace_pid.sink, trace_pid.compressed, size);
         }
 
         // Terminate the file with 2 zeros so that we can detect
         // the end of file quickly.
         uint64_t zeros = 0;
-        fwrite(&zeros, 2, 1, trace_pid.fstream);
-        fclose(trace_pid.fstream);
+        trace_sink_put(&trace_pid.sink, &zeros, 2);
     }
     if (trace_method.fstream) {
         uint32_t size = trace_method.compressed_ptr - trace_method.compressed;
         if (size) {
-            fwrite(trace_method.compressed, sizeof(char), size,
-                   trace_method.fstream);
+            trace_sink_put(&trace_method.sink, trace_method.compressed, size);
         }
 
         // Terminate the file with 2 zeros so that we can detect
         // the end of file quickly.
         uint64_t zeros = 0;
-        fwrite(&zeros, 2, 1, trace_method.fstream);
-        fclose(trace_method.fstream);
+        trace_sink_put(&trace_method.sink, &zeros, 2);
     }
+
+    // Let the writer catch up, then write the last blocks ourselves.
+    trace_writer_stop();
+    if (trace_bb.fstream)
+        trace_sink_close(&trace_bb.sink);
+    if (trace_insn.fstream)
+        trace_sink_close(&trace_insn.sink);
+    if (trace_load.fstream)
+        trace_sink_close(&trace_load.sink);
+    if (trace_store.fstream)
+        trace_sink_close(&trace_store.sink);
+    if (trace_exc.fstream)
+        trace_sink_close(&trace_exc.sink);
+    if (trace_pid.fstream)
+        trace_sink_close(&trace_pid.sink);
+    if (trace_method.fstream)
+        trace_sink_close(&trace_method.sink);
+    printf("Trace bytes written: %" PRIu64 ", waited %.3f seconds for the writer\n",
+           trace_writer.bytes, trace_writer.stall_usecs / 1000000.0);
+
     if (ftrace_debug)
         fclose(ftrace_debug);
 }
 
-// Define the number of clock ticks for some instructions.  Add one to these
-// (in some cases) if there is an interlock.  We currently do not check for
-// interlocks.
-#define TICKS_OTHER	1
-#define TICKS_SMULxy	1
-#define TICKS_SMLAWy	1
-#define TICKS_SMLALxy	2
-#define TICKS_MUL	2
-#define TICKS_MLA	2
-#define TICKS_MULS	4	// no interlock penalty
-#define TICKS_MLAS	4	// no interlock penalty
-#define TICKS_UMULL	3
-#define TICKS_UMLAL	3
-#define TICKS_SMULL	3
-#define TICKS_SMLAL	3
-#define TICKS_UMULLS	5	// no interlock penalty
-#define TICKS_UMLALS	5	// no interlock penalty
-#define TICKS_SMULLS	5	// no interlock penalty
-#define TICKS_SMLALS	5	// no interlock penalty
-
-// Compute the number of cycles that this instruction will take,
-// not including any I-cache or D-cache misses.  This function
-// is called for each instruction in a basic block when that
-// block is being translated.
+// Compute the number of cycles that an instruction will take, not
+// including any I-cache or D-cache misses.  These functions are called for
+// each instruction in a basic block when that block is being translated.
+// See Chapter 12 of the ARM920T Reference Manual for details about clock
+// cycles.
+//
+// The instruction sets are described by ordered lists of encodings; the
+// first encoding that matches an instruction gives its kind, and the ticks
+// of each kind are computed by get_insn_ticks_arm() or
+// get_insn_ticks_thumb().  The first call sorts the encodings into buckets
+// keyed by the opcode bits that tell most of them apart (bits 27-20 and
+// 7-4 for ARM, bits 15-6 for Thumb).  A bucket lists, in order, the
+// encodings that can match an instruction with these bits, and ends with
+// the first one that always does.  Most buckets hold a single encoding,
+// so most instructions are decoded with one table lookup.
+
+enum {
+    kTicksOne,                  // one cycle, no interlock
+    kTicksBranch,               // three cycles, no interlock
+
+    kTicksArmMul,               // multiply (accumulate)
+    kTicksArmMull,              // multiply (accumulate) long
+    kTicksArmSwap,              // swap/swap byte
+    kTicksArmHalfReg,           // load/store half/byte, register offset
+    kTicksArmHalfImm,           // load/store half/byte, immediate offset
+    kTicksArmUseRm,             // MSR register, BX, BLX register, CLZ
+    kTicksArmDataReg,           // data processing
+    kTicksArmDataImm,           // data processing immediate
+    kTicksArmLoadImm,           // load/store immediate offset
+    kTicksArmLoadReg,           // load/store register offset
+    kTicksArmLoadMultiple,      // load/store multiple
+    kTicksArmCopLoad,           // coprocessor load/store
+
+    kTicksThumbShift,           // shift by immediate
+    kTicksThumbAddSub,          // add/subtract
+    kTicksThumbImm,             // add/subtract/compare immediate
+    kTicksThumbDataReg,         // data processing register
+    kTicksThumbSpecial,         // special data processing
+    kTicksThumbBx,              // branch/exchange
+    kTicksThumbLoadPool,        // load from literal pool
+    kTicksThumbLoadReg,         // load/store register offset
+    kTicksThumbStoreImm,        // store word/byte/halfword immediate offset
+    kTicksThumbLoadImm,         // load word immediate offset
+    kTicksThumbLoadHalfImm,     // load byte/halfword immediate offset
+    kTicksThumbUseSp,           // store to stack, add to PC/SP
+    kTicksThumbLoadSp,          // load from stack
+    kTicksThumbAdjustSp,        // adjust stack pointer
+    kTicksThumbPushPop,         // push/pop register list
+    kTicksThumbStoreMultiple,   // store multiple
+    kTicksThumbLoadMultiple,    // load multiple
+};
+
+typedef struct TickEncoding {
+    uint32_t    mask;
+    uint32_t    value;
+    int         kind;
+} TickEncoding;
+
+// ARM instructions whose condition is not 0xf.
+static const TickEncoding arm_tick_encodings[] = {
+    { 0x0fc000f0, 0x00000090, kTicksArmMul },
+    { 0x0f8000f0, 0x00800090, kTicksArmMull },
+    { 0x0fd00ff0, 0x01000090, kTicksArmSwap },
+    { 0x0e400ff0, 0x00000090, kTicksArmHalfReg },
+    { 0x0e400ff0, 0x00400090, kTicksArmHalfImm },
+    { 0x0e500fd0, 0x000000d0, kTicksOne },              // XXX: load/store two words
+    { 0x0e500fd0, 0x001000d0, kTicksArmHalfReg },
+    { 0x0e5000d0, 0x004000d0, kTicksOne },              // XXX: load/store two words
+    { 0x0e5000d0, 0x005000d0, kTicksArmHalfImm },
+    { 0x0e000090, 0x00000090, kTicksOne },              // UNDEFINED
+    { 0x0fb0fff0, 0x0120f000, kTicksArmUseRm },         // move register to status register
+    { 0x0ffffff0, 0x01200010, kTicksArmUseRm },         // branch/exchange
+    { 0x0fff0ff0, 0x01600010, kTicksArmUseRm },         // count leading zeroes
+    { 0x0ffffff0, 0x01200030, kTicksArmUseRm },         // link/exchange
+    { 0x0f900000, 0x01000000, kTicksOne },              // TODO: Enhanced DSP instructions
+    { 0x0e000000, 0x00000000, kTicksArmDataReg },
+    { 0x0f900000, 0x03900000, kTicksOne },              // UNDEFINED or move immediate to CPSR
+    { 0x0e000000, 0x02000000, kTicksArmDataImm },
+    { 0x0e000000, 0x04000000, kTicksArmLoadImm },
+    { 0x0e000010, 0x06000000, kTicksArmLoadReg },
+    { 0x0e000000, 0x06000000, kTicksOne },              // UNDEFINED
+    { 0x0e000000, 0x08000000, kTicksArmLoadMultiple },
+    { 0x0e000000, 0x0a000000, kTicksOne },              // branch and branch+link
+    { 0x0e000000, 0x0c000000, kTicksArmCopLoad },
+    { 0x0e000000, 0x0e000000, kTicksOne },              // XXX: co-processor related things
+};
+
+// Thumb instructions.
+static const TickEncoding thumb_tick_encodings[] = {
+    { 0xf000, 0x0000, kTicksThumbShift },
+    { 0xf800, 0x1000, kTicksThumbShift },
+    { 0xf800, 0x1800, kTicksThumbAddSub },
+    { 0xf800, 0x2000, kTicksOne },                      // move immediate
+    { 0xe000, 0x2000, kTicksThumbImm },
+    { 0xfc00, 0x4000, kTicksThumbDataReg },
+    { 0xff07, 0x4700, kTicksThumbBx },
+    { 0xff00, 0x4700, kTicksOne },                      // UNDEFINED
+    { 0xfc00, 0x4400, kTicksThumbSpecial },
+    { 0xf800, 0x4800, kTicksThumbLoadPool },
+    { 0xf000, 0x5000, kTicksThumbLoadReg },
+    { 0xf800, 0x6000, kTicksThumbStoreImm },
+    { 0xf800, 0x6800, kTicksThumbLoadImm },
+    { 0xf800, 0x7000, kTicksThumbStoreImm },
+    { 0xf800, 0x7800, kTicksThumbLoadHalfImm },
+    { 0xf800, 0x8000, kTicksThumbStoreImm },
+    { 0xf800, 0x8800, kTicksThumbLoadHalfImm },
+    { 0xf800, 0x9000, kTicksThumbUseSp },
+    { 0xf800, 0x9800, kTicksThumbLoadSp },
+    { 0xf000, 0xa000, kTicksThumbUseSp },
+    { 0xff00, 0xb000, kTicksThumbAdjustSp },
+    { 0xf600, 0xb400, kTicksThumbPushPop },
+    { 0xf000, 0xb000, kTicksOne },                      // software breakpoint
+    { 0xf800, 0xc000, kTicksThumbStoreMultiple },
+    { 0xf800, 0xc800, kTicksThumbLoadMultiple },
+    { 0xfe00, 0xde00, kTicksOne },                      // UNDEFINED, SWI
+    { 0xf000, 0xd000, kTicksBranch },                   // conditional branch
+    { 0xf800, 0xe000, kTicksBranch },                   // unconditional branch
+    { 0xf801, 0xe800, kTicksBranch },                   // BLX suffix
+    { 0xf800, 0xe800, kTicksOne },                      // UNDEFINED
+    { 0xf800, 0xf000, kTicksOne },                      // BLX/BL prefix
+    { 0xf800, 0xf800, kTicksBranch },                   // BL suffix
+};
+
+// A bucket that holds a single encoding is stored as its kind; the others
+// as kTicksBucket plus the start of their list.
+#define kTicksBucket 0x100
+
+typedef struct TickDecoder {
+    const TickEncoding  *encodings;
+    int                 num_encodings;
+    uint32_t            key_mask;   // opcode bits of the key
+    uint16_t            *buckets;
+    uint8_t             *list;      // indexes into encodings[]
+} TickDecoder;
+
+static TickDecoder arm_ticks = {
+    arm_tick_encodings, ARRAY_SIZE(arm_tick_encodings), 0x0ff000f0
+};
+static TickDecoder thumb_ticks = {
+    thumb_tick_encodings, ARRAY_SIZE(thumb_tick_encodings), 0x0000ffc0
+};
+
+// Returns the opcode bits of the instructions whose key is 'key'; the low
+// bits of the key go to the low bits of the key mask.
+static uint32_t tick_key_bits(uint32_t key_mask, uint32_t key)
+{
+    uint32_t bits = 0;
+    uint32_t bit;
+
+    for (bit = 1; key_mask; bit <<= 1) {
+        if (key_mask & bit) {
+            if (key & 1)
+                bits |= bit;
+            key >>= 1;
+            key_mask &= ~bit;
+        }
+    }
+    return bits;
+}
+
+// Fills the buckets of a decoder and returns the size of their lists.
+// Called twice: first to size the lists, then to fill them.
+static int tick_decoder_fill(TickDecoder *d)
+{
+    uint32_t num_keys = 1U << ctpop32(d->key_mask);
+    uint32_t key;
+    uint8_t bucket[64];
+    int size = 0;
+    int count, nn;
+
+    for (key = 0; key < num_keys; key++) {
+        uint32_t bits = tick_key_bits(d->key_mask, key);
+
+        count = 0;
+        for (nn = 0; nn < d->num_encodings; nn++) {
+            const TickEncoding *e = &d->encodings[nn];
+            uint32_t mask = e->mask & d->key_mask;
+
+            if ((bits & mask) != (e->value & mask))
+                continue;
+            assert(count < (int)ARRAY_SIZE(bucket));
+            bucket[count++] = nn;
+            if ((e->mask & ~d->key_mask) == 0)
+                break;
+        }
+        if (count == 1) {
+            if (d->buckets)
+                d->buckets[key] = d->encodings[bucket[0]].kind;
+        } else {
+            assert(kTicksBucket + size <= UINT16_MAX);
+            if (d->buckets) {
+                d->buckets[key] = kTicksBucket + size;
+                memcpy(d->list + size, bucket, count);
+            }
+            size += count;
+        }
+    }
+    return size;
+}
+
+static void tick_decoder_init(TickDecoder *d)
+{
+    int size = tick_decoder_fill(d);
+
+    d->list = malloc(size);
+    d->buckets = malloc((1U << ctpop32(d->key_mask)) * sizeof(d->buckets[0]));
+    tick_decoder_fill(d);
+}
+
+static inline int tick_kind(const TickDecoder *d, uint32_t insn, uint32_t key)
+{
+    const uint8_t *index;
+    const TickEncoding *e;
+    int bucket = d->buckets[key];
+
+    if (bucket < kTicksBucket)
+        return bucket;
+    index = d->list + bucket - kTicksBucket;
+    do {
+        e = &d->encodings[*index++];
+    } while ((insn & e->mask) != e->value);
+    return e->kind;
+}
+
 int get_insn_ticks_arm(uint32_t insn)
 {
-#if 1
     int   result   =  1;   /* by default, use 1 cycle */
 
-    /* See Chapter 12 of the ARM920T Reference Manual for details about clock cycles */
-
     /* first check for invalid condition codes */
     if ((insn >> 28) == 0xf)
     {
         if ((insn >> 25) == 0x7d) {  /* BLX */
             result = 3;
-            goto Exit;
         }
         /* XXX: if we get there, we're either in an UNDEFINED instruction     */
         /*      or in co-processor related ones. For now, only return 1 cycle */
         goto Exit;
     }
 
-    /* other cases */
-    switch ((insn >> 25) & 7)
+    if (arm_ticks.buckets == NULL)
+        tick_decoder_init(&arm_ticks);
+
+    /* XXX: TODO: Add support for multiplier operand content penalties in the translator */
+    switch (tick_kind(&arm_ticks, insn,
+                      ((insn >> 16) & 0xff0) | ((insn >> 4) & 0xf)))
     {
-        case 0:
-            if ((insn & 0x00000090) == 0x00000090)  /* Multiplies, extra load/store, Table 3-2 */
+        case kTicksArmMul:
             {
-                /* XXX: TODO: Add support for multiplier operand content penalties in the translator */
-
-                if ((insn & 0x0fc000f0) == 0x00000090)   /* 3-2: Multiply (accumulate) */
-                {
-                    int  Rm = (insn & 15);
-                    int  Rs = (insn >> 8) & 15;
-                    int  Rn = (insn >> 12) & 15;
+                int  Rm = (insn & 15);
+                int  Rs = (insn >> 8) & 15;
+                int  Rn = (insn >> 12) & 15;
 
-                    if ((insn & 0x00200000) != 0) {  /* MLA */
-                        result += _interlock_use(Rn);
-                    } else {   /* MLU */
-                        if (Rn != 0)      /* UNDEFINED */
-                            goto Exit;
-                    }
-                    /* cycles=2+m, assume m=1, this should be adjusted at interpretation time */
-                    result += 2 + _interlock_use(Rm) + _interlock_use(Rs);
+                if ((insn & 0x00200000) != 0) {  /* MLA */
+                    result += _interlock_use(Rn);
+                } else {   /* MLU */
+                    if (Rn != 0)      /* UNDEFINED */
+                        goto Exit;
                 }
-                else if ((insn & 0x0f8000f0) == 0x00800090)  /* 3-2: Multiply (accumulate) long */
-                {
-                    int  Rm   = (insn & 15);
-                    int  Rs   = (insn >> 8) & 15;
-                    int  RdLo = (insn >> 12) & 15;
-                    int  RdHi = (insn >> 16) & 15;
+                /* cycles=2+m, assume m=1, this should be adjusted at interpretation time */
+                result += 2 + _interlock_use(Rm) + _interlock_use(Rs);
+            }
+            break;
 
-                    if ((insn & 0x00200000) != 0) { /* SMLAL & UMLAL */
-                        result += _interlock_use(RdLo) + _interlock_use(RdHi);
-                    }
-                    /* else SMLL and UMLL */
+        case kTicksArmMull:
+            {
+                int  Rm   = (insn & 15);
+                int  Rs   = (insn >> 8) & 15;
+                int  RdLo = (insn >> 12) & 15;
+                int  RdHi = (insn >> 16) & 15;
 
-                    /* cucles=3+m, assume m=1, this should be adjusted at interpretation time */
-                    result += 3 + _interlock_use(Rm) + _interlock_use(Rs);
+                if ((insn & 0x00200000) != 0) { /* SMLAL & UMLAL */
+                    result += _interlock_use(RdLo) + _interlock_use(RdHi);
                 }
-                else if ((insn & 0x0fd00ff0) == 0x01000090)  /* 3-2: Swap/swap byte */
-                {
-                    int  Rm = (insn & 15);
-                    int  Rd = (insn >> 8) & 15;
+                /* else SMLL and UMLL */
 
-                    result = 2 + _interlock_use(Rm);
-                    _interlock_def(Rd, result+1);
-                }
-                else if ((insn & 0x0e400ff0) == 0x00000090)  /* 3-2: load/store halfword, reg offset */
-                {
-                    int  Rm = (insn & 15);
-                    int  Rd = (insn >> 12) & 15;
-                    int  Rn = (insn >> 16) & 15;
+                /* cycles=3+m, assume m=1, this should be adjusted at interpretation time */
+                result += 3 + _interlock_use(Rm) + _interlock_use(Rs);
+            }
+            break;
 
-                    result += _interlock_use(Rn) + _interlock_use(Rm);
-                    if ((insn & 0x00100000) != 0)  /* it's a load, there's a 2-cycle interlock */
-                        _interlock_def(Rd, result+2);
-                }
-                else if ((insn & 0x0e400ff0) == 0x00400090)  /* 3-2: load/store halfword, imm offset */
-                {
-                    int  Rd = (insn >> 12) & 15;
-                    int  Rn = (insn >> 16) & 15;
+        case kTicksArmSwap:
+            {
+                int  Rm = (insn & 15);
+                int  Rd = (insn >> 8) & 15;
 
-                    result += _interlock_use(Rn);
-                    if ((insn & 0x00100000) != 0)  /* it's a load, there's a 2-cycle interlock */
-                        _interlock_def(Rd, result+2);
-                }
-                else if ((insn & 0x0e500fd0) == 0x000000d0) /* 3-2: load/store two words, reg offset */
-                {
-                    /* XXX: TODO: Enhanced DSP instructions */
-                }
-                else if ((insn & 0x0e500fd0) == 0x001000d0) /* 3-2: load/store half/byte, reg offset */
-                {
-                    int  Rm = (insn & 15);
-                    int  Rd = (insn >> 12) & 15;
-                    int  Rn = (insn >> 16) & 15;
+                result = 2 + _interlock_use(Rm);
+                _interlock_def(Rd, result+1);
+            }
+            break;
 
-                    result += _interlock_use(Rn) + _interlock_use(Rm);
-                    if ((insn & 0x00100000) != 0)  /* load, 2-cycle interlock */
-                        _interlock_def(Rd, result+2);
-                }
-                else if ((insn & 0x0e5000d0) == 0x004000d0) /* 3-2: load/store two words, imm offset */
-                {
-                    /* XXX: TODO: Enhanced DSP instructions */
-                }
-                else if ((insn & 0x0e5000d0) == 0x005000d0) /* 3-2: load/store half/byte, imm offset */
-                {
-                    int  Rd = (insn >> 12) & 15;
-                    int  Rn = (insn >> 16) & 15;
+        case kTicksArmHalfReg:
+            {
+                int  Rm = (insn & 15);
+                int  Rd = (insn >> 12) & 15;
+                int  Rn = (insn >> 16) & 15;
 
-                    result += _interlock_use(Rn);
-                    if ((insn & 0x00100000) != 0)  /* load, 2-cycle interlock */
-                        _interlock_def(Rd, result+2);
-                }
-                else
-                {
-                    /* UNDEFINED */
-                }
+                result += _interlock_use(Rn) + _interlock_use(Rm);
+                if ((insn & 0x00100000) != 0)  /* it's a load, there's a 2-cycle interlock */
+                    _interlock_def(Rd, result+2);
             }
-            else if ((insn & 0x0f900000) == 0x01000000)  /* Misc. instructions, table 3-3 */
-            {
-                switch ((insn >> 4) & 15)
-                {
-                    case 0:
-                        if ((insn & 0x0fb0fff0) == 0x0120f000) /* move register to status register */
-                        {
-                            int  Rm = (insn & 15);
-                            result += _interlock_use(Rm);
-                        }
-                        break;
+            break;
 
-                    case 1:
-                        if ( ((insn & 0x0ffffff0) == 0x01200010) ||  /* branch/exchange */
-                             ((insn & 0x0fff0ff0) == 0x01600010) )   /* count leading zeroes */
-                        {
-                            int  Rm = (insn & 15);
-                            result += _interlock_use(Rm);
-                        }
-                        break;
+        case kTicksArmHalfImm:
+            {
+                int  Rd = (insn >> 12) & 15;
+                int  Rn = (insn >> 16) & 15;
 
-                    case 3:
-                        if ((insn & 0x0ffffff0) == 0x01200030)   /* link/exchange */
-                        {
-                            int  Rm = (insn & 15);
-                            result += _interlock_use(Rm);
-                        }
-                        break;
+                result += _interlock_use(Rn);
+                if ((insn & 0x00100000) != 0)  /* it's a load, there's a 2-cycle interlock */
+                    _interlock_def(Rd, result+2);
+            }
+            break;
 
-                    default:
-                        /* TODO: Enhanced DSP instructions */
-                        ;
-                }
+        case kTicksArmUseRm:
+            {
+                int  Rm = (insn & 15);
+                result += _interlock_use(Rm);
             }
-            else  /* Data processing */
+            break;
+
+        case kTicksArmDataReg:
             {
                 int  Rm = (insn & 15);
                 int  Rn = (insn >> 16) & 15;
@@ -1025,19 +1457,14 @@ int get_insn_ticks_arm(uint32_t insn)
             }
             break;
 
-        case 1:
-            if ((insn & 0x01900000) == 0x01900000)
-            {
-                /* either UNDEFINED or move immediate to CPSR */
-            }
-            else  /* Data processing immediate */
+        case kTicksArmDataImm:
             {
                 int  Rn = (insn >> 12) & 15;
                 result += _interlock_use(Rn);
             }
             break;
 
-        case 2:  /* load/store immediate */
+        case kTicksArmLoadImm:
             {
                 int  Rn = (insn >> 16) & 15;
 
@@ -1053,8 +1480,7 @@ int get_insn_ticks_arm(uint32_t insn)
             }
             break;
 
-        case 3:
-            if ((insn & 0x10) == 0)  /* load/store register offset */
+        case kTicksArmLoadReg:
             {
                 int  Rm = (insn & 15);
                 int  Rn = (insn >> 16) & 15;
@@ -1069,23 +1495,18 @@ int get_insn_ticks_arm(uint32_t insn)
                         _interlock_def(Rd,result+1);
                 }
             }
-            /* else UNDEFINED */
             break;
 
-        case 4:  /* load/store multiple */
+        case kTicksArmLoadMultiple:
             {
-                int       Rn   = (insn >> 16) & 15;
-                uint32_t  mask = (insn & 0xffff);
-                int       count;
-
-                for (count = 0; mask; count++)
-                    mask &= (mask-1);
+                int       Rn    = (insn >> 16) & 15;
+                int       count = ctpop16(insn & 0xffff);
 
                 result += _interlock_use(Rn);
 
                 if (insn & 0x00100000)  /* LDM */
                 {
-                    int  nn;
+                    uint32_t  mask;
 
                     if (insn & 0x8000) {  /* loading PC */
                         result = count+4;
@@ -1093,19 +1514,15 @@ int get_insn_ticks_arm(uint32_t insn)
                         result = (count < 2) ? 2 : count;
                     }
                     /* create defs, all registers locked until the end of the load */
-                    for (nn = 0; nn < 15; nn++)
-                        if ((insn & (1U << nn)) != 0)
-                            _interlock_def(nn,result);
+                    for (mask = insn & 0x7fff; mask; mask &= mask - 1)
+                        _interlock_def(ctz32(mask),result);
                 }
                 else  /* STM */
                     result = (count < 2) ? 2 : count;
             }
             break;
 
-        case 5:  /* branch and branch+link */
-            break;
-
-        case 6:  /* coprocessor load/store */
+        case kTicksArmCopLoad:
             {
                 int  Rn = (insn >> 16) & 15;
 
@@ -1115,86 +1532,33 @@ int get_insn_ticks_arm(uint32_t insn)
                 /* XXX: other things to do ? */
             }
             break;
-
-        default: /* i.e. 7 */
-            /* XXX: TODO: co-processor related things */
-            ;
     }
 Exit:
     interlock_base += result;
     return result;
-#else /* old code - this seems to be completely buggy ?? */
-    if ((insn & 0x0ff0f090) == 0x01600080) {
-        return TICKS_SMULxy;
-    } else if ((insn & 0x0ff00090) == 0x01200080) {
-        return TICKS_SMLAWy;
-    } else if ((insn & 0x0ff00090) == 0x01400080) {
-        return TICKS_SMLALxy;
-    } else if ((insn & 0x0f0000f0) == 0x00000090) {
-        // multiply
-        uint8_t bit23 = (insn >> 23) & 0x1;
-        uint8_t bit22_U = (insn >> 22) & 0x1;
-        uint8_t bit21_A = (insn >> 21) & 0x1;
-        uint8_t bit20_S = (insn >> 20) & 0x1;
-
-        if (bit23 == 0) {
-            // 32-bit multiply
-            if (bit22_U != 0) {
-                // This is an unexpected bit pattern.
-                return TICKS_OTHER;
-            }
-            if (bit21_A == 0) {
-                if (bit20_S)
-                    return TICKS_MULS;
-                return TICKS_MUL;
-            }
-            if (bit20_S)
-                return TICKS_MLAS;
-            return TICKS_MLA;
-        }
-        // 64-bit multiply
-        if (bit22_U == 0) {
-            // Unsigned multiply long
-            if (bit21_A == 0) {
-                if (bit20_S)
-                    return TICKS_UMULLS;
-                return TICKS_UMULL;
-            }
-            if (bit20_S)
-                return TICKS_UMLALS;
-            return TICKS_UMLAL;
-        }
-        // Signed multiply long
-        if (bit21_A == 0) {
-            if (bit20_S)
-                return TICKS_SMULLS;
-            return TICKS_SMULL;
-        }
-        if (bit20_S)
-            return TICKS_SMLALS;
-        return TICKS_SMLAL;
-    }
-    return TICKS_OTHER;
-#endif
 }
 
 int  get_insn_ticks_thumb(uint32_t  insn)
 {
-#if 1
     int  result = 1;
 
-    switch ((insn >> 11) & 31)
+    if (thumb_ticks.buckets == NULL)
+        tick_decoder_init(&thumb_ticks);
+
+    switch (tick_kind(&thumb_ticks, insn, (insn >> 6) & 0x3ff))
     {
-        case 0:
-        case 1:
-        case 2:   /* Shift by immediate */
+        case kTicksBranch:
+            result = 3;
+            break;
+
+        case kTicksThumbShift:
             {
                 int  Rm = (insn >> 3) & 7;
                 result += _interlock_use(Rm);
             }
             break;
 
-        case 3:  /* Add/Substract */
+        case kTicksThumbAddSub:
             {
                 int  Rn = (insn >> 3) & 7;
                 result += _interlock_use(Rn);
@@ -1206,65 +1570,50 @@ int  get_insn_ticks_thumb(uint32_t  insn)
             }
             break;
 
-        case 4:  /* move immediate */
-            break;
-
-        case 5:
-        case 6:
-        case 7:  /* add/substract/compare immediate */
+        case kTicksThumbImm:
             {
                 int  Rd = (insn >> 8) & 7;
                 result += _interlock_use(Rd);
             }
             break;
 
-        case 8:
+        case kTicksThumbDataReg:
             {
-                if ((insn & 0x0400) == 0)  /* data processing register */
-                {
-                    /* the registers can also be Rs and Rn in some cases */
-                    /* but they're always read anyway and located at the */
-                    /* same place, so we don't check the opcode          */
-                    int  Rm = (insn >> 3) & 7;
-                    int  Rd = (insn >> 3) & 7;
+                /* the registers can also be Rs and Rn in some cases */
+                /* but they're always read anyway and located at the */
+                /* same place, so we don't check the opcode          */
+                int  Rm = (insn >> 3) & 7;
+                int  Rd = (insn >> 3) & 7;
 
-                    result += _interlock_use(Rm) + _interlock_use(Rd);
-                }
-                else switch ((insn >> 8) & 3)
-                {
-                    case 0:
-                    case 1:
-                    case 2:  /* special data processing */
-                        {
-                            int  Rn = (insn & 7) | ((insn >> 4) & 0x8);
-                            int  Rm = ((insn >> 3) & 15);
-
-                            result += _interlock_use(Rn) + _interlock_use(Rm);
-                        }
-                        break;
+                result += _interlock_use(Rm) + _interlock_use(Rd);
+            }
+            break;
 
-                    case 3:
-                        if ((insn & 0xff07) == 0x4700)  /* branch/exchange */
-                        {
-                            int  Rm = (insn >> 3) & 15;
+        case kTicksThumbSpecial:
+            {
+                int  Rn = (insn & 7) | ((insn >> 4) & 0x8);
+                int  Rm = ((insn >> 3) & 15);
 
-                            result = 3 + _interlock_use(Rm);
-                        }
-                        /* else UNDEFINED */
-                        break;
-                }
+                result += _interlock_use(Rn) + _interlock_use(Rm);
+            }
+            break;
+
+        case kTicksThumbBx:
+            {
+                int  Rm = (insn >> 3) & 15;
+
+                result = 3 + _interlock_use(Rm);
             }
             break;
 
-        case 9:  /* load from literal pool */
+        case kTicksThumbLoadPool:
             {
                 int  Rd = (insn >> 8) & 7;
                 _interlock_def(Rd,result+1);
             }
             break;
 
-        case 10:
-        case 11:  /* load/store register offset */
+        case kTicksThumbLoadReg:
             {
                 int  Rd = (insn & 7);
                 int  Rn = (insn >> 3) & 7;
@@ -1293,8 +1642,7 @@ int  get_insn_ticks_thumb(uint32_t  insn)
             }
             break;
 
-        case 12:  /* store word immediate offset */
-        case 14:  /* store byte immediate offset */
+        case kTicksThumbStoreImm:
             {
                 int  Rd = (insn & 7);
                 int  Rn = (insn >> 3) & 7;
@@ -1303,7 +1651,7 @@ int  get_insn_ticks_thumb(uint32_t  insn)
             }
             break;
 
-        case 13:  /* load word immediate offset */
+        case kTicksThumbLoadImm:
             {
                 int  Rd = (insn & 7);
                 int  Rn = (insn >> 3) & 7;
@@ -1313,26 +1661,7 @@ int  get_insn_ticks_thumb(uint32_t  insn)
             }
             break;
 
-        case 15:  /* load byte immediate offset */
-            {
-                int  Rd = (insn & 7);
-                int  Rn = (insn >> 3) & 7;
-
-                result += _interlock_use(Rn);
-                _interlock_def(Rd,result+2);
-            }
-            break;
-
-        case 16:  /* store halfword immediate offset */
-            {
-                int  Rd = (insn & 7);
-                int  Rn = (insn >> 3) & 7;
-
-                result += _interlock_use(Rn) + _interlock_use(Rd);
-            }
-            break;
-
-        case 17:  /* load halfword immediate offset */
+        case kTicksThumbLoadHalfImm:
             {
                 int  Rd = (insn & 7);
                 int  Rn = (insn >> 3) & 7;
@@ -1342,135 +1671,74 @@ int  get_insn_ticks_thumb(uint32_t  insn)
             }
             break;
 
-        case 18:  /* store to stack */
+        case kTicksThumbUseSp:
             {
                 int  Rd = (insn >> 8) & 3;
                 result += _interlock_use(Rd);
             }
             break;
 
-        case 19:  /* load from stack */
+        case kTicksThumbLoadSp:
             {
                 int  Rd = (insn >> 8) & 3;
                 _interlock_def(Rd,result+1);
             }
             break;
 
-        case 20:  /* add to PC */
-        case 21:  /* add to SP */
-            {
-                int  Rd = (insn >> 8) & 3;
-                result += _interlock_use(Rd);
-            }
+        case kTicksThumbAdjustSp:
+            result += _interlock_use(14);
             break;
 
-        case 22:
-        case 23:  /* misc. instructions, table 6-2 */
+        case kTicksThumbPushPop:
             {
-                if ((insn & 0xff00) == 0xb000)  /* adjust stack pointer */
+                int  count = ctpop16(insn & 0x01ff);
+                uint32_t  mask;
+
+                result = (count < 2) ? 2 : count;
+
+                if (insn & 0x0800)  /* pop register list */
                 {
-                    result += _interlock_use(14);
+                    for (mask = insn & 0x01ff; mask; mask &= mask - 1)
+                        _interlock_def(ctz32(mask), result);
                 }
-                else if ((insn & 0x0600) == 0x0400)  /* push pop register list */
+                else  /* push register list */
                 {
-                    uint32_t  mask = insn & 0x01ff;
-                    int       count, nn;
-
-                    for (count = 0; mask; count++)
-                        mask &= (mask-1);
-
-                    result = (count < 2) ? 2 : count;
-
-                    if (insn & 0x0800)  /* pop register list */
-                    {
-                        for (nn = 0; nn < 9; nn++)
-                            if (insn & (1 << nn))
-                                _interlock_def(nn, result);
-                    }
-                    else  /* push register list */
-                    {
-                        for (nn = 0; nn < 9; nn++)
-                            if (insn & (1 << nn))
-                                result += _interlock_use(nn);
-                    }
+                    for (mask = insn & 0x01ff; mask; mask &= mask - 1)
+                        result += _interlock_use(ctz32(mask));
                 }
-                /* else  software breakpoint */
             }
             break;
 
-        case 24:  /* store multiple */
+        case kTicksThumbStoreMultiple:
             {
-                int  Rd = (insn >> 8) & 7;
-                uint32_t  mask = insn & 255;
-                int       count, nn;
-
-                for (count = 0; mask; count++)
-                    mask &= (mask-1);
+                int  Rd    = (insn >> 8) & 7;
+                int  count = ctpop8(insn & 255);
+                uint32_t  mask;
 
                 result = (count < 2) ? 2 : count;
                 result += _interlock_use(Rd);
 
-                for (nn = 0; nn < 8; nn++)
-                    if (insn & (1 << nn))
-                        result += _interlock_use(nn);
+                for (mask = insn & 255; mask; mask &= mask - 1)
+                    result += _interlock_use(ctz32(mask));
             }
             break;
 
-        case 25:  /* load multiple */
+        case kTicksThumbLoadMultiple:
             {
-                int  Rd = (insn >> 8) & 7;
-                uint32_t  mask = insn & 255;
-                int       count, nn;
-
-                for (count = 0; mask; count++)
-                    mask &= (mask-1);
+                int  Rd    = (insn >> 8) & 7;
+                int  count = ctpop8(insn & 255);
+                uint32_t  mask;
 
                 result  = (count < 2) ? 2 : count;
                 result += _interlock_use(Rd);
 
-                for (nn = 0; nn < 8; nn++)
-                    if (insn & (1 << nn))
-                        _interlock_def(nn, result);
+                for (mask = insn & 255; mask; mask &= mask - 1)
+                    _interlock_def(ctz32(mask), result);
             }
             break;
-
-        case 26:
-        case 27:  /* conditional branch / undefined / software interrupt */
-            switch ((insn >> 8) & 15)
-            {
-                case 14: /* UNDEFINED */
-                case 15: /* SWI */
-                    break;
-
-                default:  /* conditional branch */
-                    result = 3;
-            }
-            break;
-
-        case 28:  /* unconditional branch */
-            result = 3;
-            break;
-
-        case 29:  /* BLX suffix or undefined */
-            if ((insn & 1) == 0)
-                result = 3;
-            break;
-
-        case 30:  /* BLX/BLX prefix */
-            break;
-
-        case 31:  /* BL suffix */
-            result = 3;
-            break;
     }
     interlock_base += result;
     return result;
-#else /* old code */
-    if ((insn & 0xfc00) == 0x4340) /* MUL */
-        return TICKS_SMULxy;
-
-    return TICKS_OTHER;
-#endif
 }
 
 // Adds an exception trace record.
@@ -1496,7 +1764,7 @@ void trace_exception(uint32 target_pc)
     char *comp_ptr = trace_exc.compressed_ptr;
     if (comp_ptr >= trace_exc.high_water_ptr) {
         uint32_t size = comp_ptr - trace_exc.compressed;
-        fwrite(trace_exc.compressed, sizeof(char), size, trace_exc.fstream);
+        trace_sink_put(&trace_exc.sink, trace_exc.compressed, size);
         comp_ptr = trace_exc.compressed;
     }
     uint64_t time_diff = sim_time - trace_exc.prev_time;
@@ -1521,7 +1789,7 @@ void trace_pid_1arg(int pid, int rec_type)
     char *max_end_ptr = comp_ptr + kMaxPidCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
         uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
+        trace_sink_put(&trace_pid.sink, trace_pid.compressed, size);
         comp_ptr = trace_pid.compressed;
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
@@ -1540,7 +1808,7 @@ void trace_pid_2arg(int tgid, int pid, int rec_type)
     char *max_end_ptr = comp_ptr + kMaxPid2Compressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
         uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
+        trace_sink_put(&trace_pid.sink, trace_pid.compressed, size);
         comp_ptr = trace_pid.compressed;
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
@@ -1604,7 +1872,7 @@ void trace_name(char *name)
     char *max_end_ptr = comp_ptr + len + kMaxNameCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
         uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
+        trace_sink_put(&trace_pid.sink, trace_pid.compressed, size);
         comp_ptr = trace_pid.compressed;
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
@@ -1654,7 +1922,7 @@ void trace_execve(const char *argv, int len)
     char *max_end_ptr = comp_ptr + len + 5 * argc + kMaxExecArgsCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
         uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
+        trace_sink_put(&trace_pid.sink, trace_pid.compressed, size);
         comp_ptr = trace_pid.compressed;
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
@@ -1690,7 +1958,7 @@ void trace_mmap(unsigned long vstart, unsigned long vend,
     char *max_end_ptr = comp_ptr + len + kMaxMmapCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
         uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
+        trace_sink_put(&trace_pid.sink, trace_pid.compressed, size);
         comp_ptr = trace_pid.compressed;
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
@@ -1719,7 +1987,7 @@ void trace_munmap(unsigned long vstart, unsigned long vend)
     char *max_end_ptr = comp_ptr + kMaxMunmapCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
         uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
+        trace_sink_put(&trace_pid.sink, trace_pid.compressed, size);
         comp_ptr = trace_pid.compressed;
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
@@ -1745,7 +2013,7 @@ void trace_dynamic_symbol_add(unsigned long vaddr, const char *name)
     char *max_end_ptr = comp_ptr + len + kMaxSymbolCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
         uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
+        trace_sink_put(&trace_pid.sink, trace_pid.compressed, size);
         comp_ptr = trace_pid.compressed;
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
@@ -1771,7 +2039,7 @@ void trace_dynamic_symbol_remove(unsigned long vaddr)
     char *max_end_ptr = comp_ptr + kMaxSymbolCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
         uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
+        trace_sink_put(&trace_pid.sink, trace_pid.compressed, size);
         comp_ptr = trace_pid.compressed;
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
@@ -1796,7 +2064,7 @@ void trace_init_name(int tgid, int pid, const char *name)
     char *max_end_ptr = comp_ptr + len + kMaxKthreadNameCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
         uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
+        trace_sink_put(&trace_pid.sink, trace_pid.compressed, size);
         comp_ptr = trace_pid.compressed;
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
@@ -1855,7 +2123,7 @@ void trace_bb_helper(uint64_t bb_num, TranslationBlock *tb)
         for (ptr = trace_bb.buffer; ptr != next; ++ptr) {
             if (comp_ptr >= trace_bb.high_water_ptr) {
                 uint32_t size = comp_ptr - trace_bb.compressed;
-                fwrite(trace_bb.compressed, sizeof(char), size, trace_bb.fstream);
+                trace_sink_put(&trace_bb.sink, trace_bb.compressed, size);
                 comp_ptr = trace_bb.compressed;
             }
             int64_t bb_diff = ptr->bb_num - prev_bb_num;
@@ -1920,13 +2188,7 @@ void trace_insn_helper()
         for (ptr = trace_insn.buffer; ptr != current; ++ptr) {
             if (comp_ptr >= trace_insn.high_water_ptr) {
                 uint32_t size = comp_ptr - trace_insn.compressed;
-                uint32_t rval = fwrite(trace_insn.compressed, sizeof(char),
-                                       size, trace_insn.fstream);
-                if (rval != size) {
-                    fprintf(stderr, "fwrite() failed\n");
-                    perror(trace_insn.filename);
-                    exit(1);
-                }
+                trace_sink_put(&trace_insn.sink, trace_insn.compressed, size);
                 comp_ptr = trace_insn.compressed;
             }
             comp_ptr = varint_encode(ptr->time_diff, comp_ptr);
@@ -1956,7 +2218,7 @@ void trace_interpreted_method(uint32_t addr, int call_type)
     char *max_end_ptr = comp_ptr + kMaxMethodCompressed;
     if (max_end_ptr >= &trace_method.compressed[kCompressedSize]) {
         uint32_t size = comp_ptr - trace_method.compressed;
-        fwrite(trace_method.compressed, sizeof(char), size, trace_method.fstream);
+        trace_sink_put(&trace_method.sink, trace_method.compressed, size);
         comp_ptr = trace_method.compressed;
     }
     uint64_t time_diff = sim_time - trace_method.prev_time;
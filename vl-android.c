@@ -49,6 +49,7 @@
 #include "qemu_file.h"
 #include "android/android.h"
 #include "charpipe.h"
+#include "iolooper.h"
 #include "modem_driver.h"
 #include "android/gps.h"
 #include "android/hw-kmsg.h"
@@ -297,6 +298,7 @@ int rtc_td_hack = 0;
 #endif
 int usb_enabled = 0;
 int singlestep = 0;
+int tb_prefetch_enabled = 0;
 int smp_cpus = 1;
 const char *vnc_display;
 int acpi_enabled = 1;
@@ -410,6 +412,8 @@ const char* drop_log_filename = NULL;
 static int rotate_logs_requested = 0;
 
 const char* savevm_on_exit = NULL;
+int lazy_ram_restore = 0;
+static int snapshot_direct_io = 0;
 
 #define TFR(expr) do { if ((expr) != -1) break; } while (errno == EINTR)
 
@@ -1917,51 +1921,40 @@ void qemu_system_powerdown_request(void)
     qemu_notify_event();
 }
 
-#ifdef CONFIG_IOTHREAD
-static void qemu_system_vmstop_request(int reason)
+void qemu_system_vmstop_request(int reason)
 {
     vmstop_requested = reason;
     qemu_notify_event();
 }
-#endif
 
 void main_loop_wait(int timeout)
 {
-    fd_set rfds, wfds, xfds;
-    int ret, nfds;
-    struct timeval tv;
+    IoLooper *iol = qemu_iohandler_get_looper();
+    int ret;
 
     qemu_bh_update_timeout(&timeout);
 
     os_host_main_loop_wait(&timeout);
 
-
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout % 1000) * 1000;
-
     /* poll any events */
 
+    /* The handlers and the slirp sockets keep their descriptors registered
+     * in the looper; only the interest that changed since the last pass is
+     * updated here. */
     /* XXX: separate device handlers from system ones */
-    nfds = -1;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&xfds);
-    qemu_iohandler_fill(&nfds, &rfds, &wfds, &xfds);
+    qemu_iohandler_prepare();
     if (slirp_is_inited()) {
-        slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+        slirp_pollfds_fill(iol);
     }
 
-    qemu_mutex_unlock_iothread();
-    ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
-    qemu_mutex_lock_iothread();
-    qemu_iohandler_poll(&rfds, &wfds, &xfds, ret);
+    /* with CONFIG_IOTHREAD the default alarm is a timerfd watched by the
+       looper, otherwise the alarm signal interrupts the wait; the lock is
+       only released while blocked in the kernel */
+    ret = iolooper_wait_unlocked(iol, timeout, qemu_main_loop_release,
+                                 qemu_main_loop_acquire);
+    qemu_iohandler_dispatch(ret);
     if (slirp_is_inited()) {
-        if (ret < 0) {
-            FD_ZERO(&rfds);
-            FD_ZERO(&wfds);
-            FD_ZERO(&xfds);
-        }
-        slirp_select_poll(&rfds, &wfds, &xfds);
+        slirp_pollfds_poll(iol);
     }
     charpipe_poll();
 
@@ -1990,10 +1983,7 @@ static void main_loop(void)
 {
     int r;
 
-#ifdef CONFIG_IOTHREAD
-    qemu_system_ready = 1;
-    qemu_cond_broadcast(&qemu_system_cond);
-#endif
+    qemu_main_loop_start();
 
 #ifdef CONFIG_HAX
     if (hax_enabled())
@@ -3310,6 +3300,24 @@ int main(int argc, char **argv, char **envp)
                 if (tb_size < 0)
                     tb_size = 0;
                 break;
+            case QEMU_OPTION_tb_prefetch:
+                tb_prefetch_enabled = 1;
+                break;
+            case QEMU_OPTION_qcow2_l2_cache:
+                qcow2_l2_cache_size = strtol(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_compressed_cache:
+                {
+                    char *end;
+                    const char *p;
+                    bdrv_compressed_cache_size = strtol(optarg, &end, 0);
+                    if (strstart(end, ",readahead=", &p)) {
+                        bdrv_compressed_readahead = strtol(p, NULL, 0);
+                    } else if (*end != '\0') {
+                        PANIC("Invalid -compressed-cache option: %s", optarg);
+                    }
+                }
+                break;
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
@@ -3337,6 +3345,12 @@ int main(int argc, char **argv, char **envp)
                 trace_filename = optarg;
                 tracing = 1;
                 break;
+            case QEMU_OPTION_trace_compress:
+                trace_compress = 1;
+                break;
+            case QEMU_OPTION_trace_segment:
+                trace_segment_size = strtoull(optarg, NULL, 0) << 20;
+                break;
 #if 0
             case QEMU_OPTION_trace_miss:
                 trace_cache_miss = 1;
@@ -3487,6 +3501,14 @@ int main(int argc, char **argv, char **envp)
                 android_snapshot_update_time = 0;
                 break;
 
+            case QEMU_OPTION_snapshot_lazy_load:
+                lazy_ram_restore = 1;
+                break;
+
+            case QEMU_OPTION_snapshot_direct_io:
+                snapshot_direct_io = 1;
+                break;
+
             case QEMU_OPTION_list_webcam:
                 android_list_web_cameras();
                 exit(0);
@@ -3685,8 +3707,14 @@ int main(int argc, char **argv, char **envp)
                 PANIC("Snapshot storage already in use: %s", spath);
             }
             hdb_opts = drive_add(spath, HD_ALIAS, 1);
-            /* See comment above to understand why this is needed. */
-            qemu_opt_set(hdb_opts, "cache", "unsafe");
+            if (snapshot_direct_io) {
+                /* Snapshots are written in large aligned buffers, which
+                 * then bypass the host page cache. */
+                qemu_opt_set(hdb_opts, "cache", "none");
+            } else {
+                /* See comment above to understand why this is needed. */
+                qemu_opt_set(hdb_opts, "cache", "unsafe");
+            }
         }
     }
 
@@ -30,6 +30,11 @@
 #include "qemu-timer.h"
 #include "acl.h"
 
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#endif
+
 #define VNC_REFRESH_INTERVAL (1000 / 30)
 
 #include "vnc_keysym.h"
@@ -221,7 +226,9 @@ static inline uint32_t vnc_has_feature(VncState *vs, int feature) {
    3) resolutions > 1024
 */
 
-static void vnc_update_client(void *opaque);
+static void vnc_update_client(VncState *vs);
+static int vnc_refresh_server_surface(VncDisplay *vd);
+static void vnc_jobs_join(VncState *vs);
 static void vnc_disconnect_start(VncState *vs);
 static void vnc_disconnect_finish(VncState *vs);
 
@@ -268,9 +275,8 @@ static inline int vnc_and_bits(const uint32_t *d1, const uint32_t *d2,
     return 0;
 }
 
-static void vnc_update(VncState *vs, int x, int y, int w, int h)
+static void vnc_update(struct VncSurface *s, int x, int y, int w, int h)
 {
-    struct VncSurface *s = &vs->guest;
     int i;
 
     h += y;
@@ -295,15 +301,12 @@ static void vnc_update(VncState *vs, int x, int y, int w, int h)
 static void vnc_dpy_update(DisplayState *ds, int x, int y, int w, int h)
 {
     VncDisplay *vd = ds->opaque;
-    VncState *vs = vd->clients;
-    while (vs != NULL) {
-        vnc_update(vs, x, y, w, h);
-        vs = vs->next;
-    }
+
+    vnc_update(&vd->guest, x, y, w, h);
 }
 
-static void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
-                                   int32_t encoding)
+void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
+                            int32_t encoding)
 {
     vnc_write_u16(vs, x);
     vnc_write_u16(vs, y);
@@ -351,15 +354,12 @@ static void vnc_resize(VncState *vs)
     DisplayState *ds = vs->ds;
     int size_changed;
 
-    /* guest surface */
-    if (!vs->guest.ds)
-        vs->guest.ds = qemu_mallocz(sizeof(*vs->guest.ds));
-    if (ds_get_bytes_per_pixel(ds) != vs->guest.ds->pf.bytes_per_pixel)
-        console_color_init(ds);
+    vnc_jobs_join(vs);
+
     vnc_colordepth(vs);
-    size_changed = ds_get_width(ds) != vs->guest.ds->width ||
-                   ds_get_height(ds) != vs->guest.ds->height;
-    *(vs->guest.ds) = *(ds->surface);
+    size_changed = !vs->server.ds ||
+                   ds_get_width(ds) != vs->server.ds->width ||
+                   ds_get_height(ds) != vs->server.ds->height;
     if (size_changed) {
         if (vs->csock != -1 && vnc_has_feature(vs, VNC_FEATURE_RESIZE)) {
             vnc_write_u8(vs, 0);  /* msg id */
@@ -370,9 +370,8 @@ static void vnc_resize(VncState *vs)
             vnc_flush(vs);
         }
     }
-    memset(vs->guest.dirty, 0xFF, sizeof(vs->guest.dirty));
 
-    /* server surface */
+    /* copy of the server surface */
     if (!vs->server.ds)
         vs->server.ds = qemu_mallocz(sizeof(*vs->server.ds));
     if (vs->server.ds->data)
@@ -380,16 +379,33 @@ static void vnc_resize(VncState *vs)
     *(vs->server.ds) = *(ds->surface);
     vs->server.ds->data = qemu_mallocz(vs->server.ds->linesize *
                                        vs->server.ds->height);
-    memset(vs->server.dirty, 0xFF, sizeof(vs->guest.dirty));
+    memset(vs->server.dirty, 0xFF, sizeof(vs->server.dirty));
 }
 
 static void vnc_dpy_resize(DisplayState *ds)
 {
     VncDisplay *vd = ds->opaque;
-    VncState *vs = vd->clients;
-    while (vs != NULL) {
+    VncState *vs;
+
+    /* guest surface */
+    if (!vd->guest.ds)
+        vd->guest.ds = qemu_mallocz(sizeof(*vd->guest.ds));
+    if (ds_get_bytes_per_pixel(ds) != vd->guest.ds->pf.bytes_per_pixel)
+        console_color_init(ds);
+    *(vd->guest.ds) = *(ds->surface);
+    memset(vd->guest.dirty, 0xFF, sizeof(vd->guest.dirty));
+
+    /* server surface */
+    if (!vd->server)
+        vd->server = qemu_mallocz(sizeof(*vd->server));
+    if (vd->server->data)
+        qemu_free(vd->server->data);
+    *(vd->server) = *(ds->surface);
+    vd->server->data = qemu_mallocz(vd->server->linesize *
+                                    vd->server->height);
+
+    for (vs = vd->clients; vs != NULL; vs = vs->next) {
         vnc_resize(vs);
-        vs = vs->next;
     }
 }
 
@@ -400,7 +416,7 @@ static void vnc_write_pixels_copy(VncState *vs, void *pixels, int size)
 }
 
 /* slowest but generic code. */
-static void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v)
+void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v)
 {
     uint8_t r, g, b;
 
@@ -476,6 +492,34 @@ static void vnc_write_pixels_generic(VncState *vs, void *pixels1, int size)
     }
 }
 
+/* Reads server surface pixels into an array of w * h native values. */
+void vnc_read_pixels(VncState *vs, int x, int y, int w, int h,
+                     uint32_t *pixels)
+{
+    int bpp = ds_get_bytes_per_pixel(vs->ds);
+    uint8_t *row;
+    int i, j;
+
+    row = vs->server.ds->data + y * ds_get_linesize(vs->ds) + x * bpp;
+    for (j = 0; j < h; j++) {
+        switch (bpp) {
+        case 4:
+            memcpy(pixels, row, w * 4);
+            break;
+        case 2:
+            for (i = 0; i < w; i++)
+                pixels[i] = ((uint16_t *)row)[i];
+            break;
+        default:
+            for (i = 0; i < w; i++)
+                pixels[i] = row[i];
+            break;
+        }
+        pixels += w;
+        row += ds_get_linesize(vs->ds);
+    }
+}
+
 static void send_framebuffer_update_raw(VncState *vs, int x, int y, int w, int h)
 {
     int i;
@@ -545,14 +589,29 @@ static void send_framebuffer_update_hextile(VncState *vs, int x, int y, int w, i
 
 }
 
-static void vnc_zlib_init(VncState *vs)
+/*
+ * An initialized stream points its opaque field at itself, which survives
+ * the copies of VncState made for update jobs.
+ */
+static void vnc_zlib_reset(z_streamp zstream)
+{
+    if (zstream->opaque == zstream)
+        deflateEnd(zstream);
+    zstream->opaque = NULL;
+}
+
+static void vnc_zlib_clear(VncState *vs)
 {
     int i;
-    for (i=0; i<(sizeof(vs->zlib_stream) / sizeof(z_stream)); i++)
-        vs->zlib_stream[i].opaque = NULL;
+
+    for (i = 0; i < ARRAY_SIZE(vs->streams->zlib); i++)
+        vnc_zlib_reset(&vs->streams->zlib[i]);
+    vnc_zlib_reset(&vs->streams->zrle);
+    for (i = 0; i < ARRAY_SIZE(vs->streams->tight); i++)
+        vnc_zlib_reset(&vs->streams->tight[i]);
 }
 
-static void vnc_zlib_start(VncState *vs)
+void vnc_zlib_start(VncState *vs)
 {
     buffer_reset(&vs->zlib);
 
@@ -561,9 +620,8 @@ static void vnc_zlib_start(VncState *vs)
     vs->output = vs->zlib;
 }
 
-static int vnc_zlib_stop(VncState *vs, int stream_id)
+int vnc_zlib_stop(VncState *vs, z_streamp zstream)
 {
-    z_streamp zstream = &vs->zlib_stream[stream_id];
     int previous_out;
 
     // switch back to normal output/zlib buffers
@@ -573,12 +631,10 @@ static int vnc_zlib_stop(VncState *vs, int stream_id)
     // compress the zlib buffer
 
     // initialize the stream
-    // XXX need one stream per session
-    if (zstream->opaque != vs) {
+    if (zstream->opaque != zstream) {
         int err;
 
-        VNC_DEBUG("VNC: initializing zlib stream %d\n", stream_id);
-        VNC_DEBUG("VNC: opaque = %p | vs = %p\n", zstream->opaque, vs);
+        VNC_DEBUG("VNC: initializing zlib stream %p\n", zstream);
         zstream->zalloc = Z_NULL;
         zstream->zfree = Z_NULL;
 
@@ -590,10 +646,11 @@ static int vnc_zlib_stop(VncState *vs, int stream_id)
             return -1;
         }
 
-        zstream->opaque = vs;
+        zstream->opaque = zstream;
     }
 
-    // XXX what to do if tight_compression changed in between?
+    /* tight_compression only changes in set_encodings, which resets the
+       streams */
 
     // reserve memory in output buffer
     buffer_reserve(&vs->output, vs->zlib.offset + 64);
@@ -629,7 +686,7 @@ static void send_framebuffer_update_zlib(VncState *vs, int x, int y, int w, int
     // compress the stream
     vnc_zlib_start(vs);
     send_framebuffer_update_raw(vs, x, y, w, h);
-    bytes_written = vnc_zlib_stop(vs, 0);
+    bytes_written = vnc_zlib_stop(vs, &vs->streams->zlib[0]);
 
     if (bytes_written == -1)
         return;
@@ -641,9 +698,14 @@ static void send_framebuffer_update_zlib(VncState *vs, int x, int y, int w, int
     vs->output.offset = new_offset;
 }
 
-static void send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+/* Returns the number of rectangles sent. */
+static int send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
 {
     switch(vs->vnc_encoding) {
+        case VNC_ENCODING_TIGHT:
+            return vnc_tight_send_framebuffer_update(vs, x, y, w, h);
+        case VNC_ENCODING_ZRLE:
+            return vnc_zrle_send_framebuffer_update(vs, x, y, w, h);
         case VNC_ENCODING_ZLIB:
             send_framebuffer_update_zlib(vs, x, y, w, h);
             break;
@@ -656,6 +718,7 @@ static void send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
             send_framebuffer_update_raw(vs, x, y, w, h);
             break;
     }
+    return 1;
 }
 
 static void vnc_copy(VncState *vs, int src_x, int src_y, int dst_x, int dst_y, int w, int h)
@@ -669,14 +732,43 @@ static void vnc_copy(VncState *vs, int src_x, int src_y, int dst_x, int dst_y, i
     vnc_flush(vs);
 }
 
+/* Applies a copy to the server surface, as the clients will see it. */
+static void vnc_server_copy(VncDisplay *vd, int src_x, int src_y,
+                            int dst_x, int dst_y, int w, int h)
+{
+    DisplaySurface *s = vd->server;
+    int bpp = s->pf.bytes_per_pixel;
+    int linesize = s->linesize;
+    uint8_t *src, *dst;
+    int i;
+
+    src = s->data + src_y * linesize + src_x * bpp;
+    dst = s->data + dst_y * linesize + dst_x * bpp;
+    if (dst_y > src_y) {
+        /* copy from the bottom up, the rows may overlap */
+        src += (h - 1) * linesize;
+        dst += (h - 1) * linesize;
+        linesize = -linesize;
+    }
+    for (i = 0; i < h; i++) {
+        memmove(dst, src, w * bpp);
+        src += linesize;
+        dst += linesize;
+    }
+}
+
 static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int dst_y, int w, int h)
 {
     VncDisplay *vd = ds->opaque;
     VncState *vs, *vn;
 
+    vga_hw_update();
+    vnc_refresh_server_surface(vd);
+
     for (vs = vd->clients; vs != NULL; vs = vn) {
         vn = vs->next;
         if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
+            vnc_jobs_join(vs);
             vs->force_update = 1;
             vnc_update_client(vs);
             /* vs might be free()ed here */
@@ -684,11 +776,17 @@ static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int
     }
 
     for (vs = vd->clients; vs != NULL; vs = vs->next) {
-        if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT))
+        if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
+            /* the copy applies to the update just queued */
+            vnc_jobs_join(vs);
             vnc_copy(vs, src_x, src_y, dst_x, dst_y, w, h);
-        else /* TODO */
-            vnc_update(vs, dst_x, dst_y, w, h);
+        } else /* TODO */
+            vnc_update(&vs->server, dst_x, dst_y, w, h);
     }
+
+    vnc_server_copy(vd, src_x, src_y, dst_x, dst_y, w, h);
+    /* check the result against the guest surface */
+    vnc_update(&vd->guest, dst_x, dst_y, w, h);
 }
 
 static int find_and_clear_dirty_height(struct VncSurface *s,
@@ -707,115 +805,391 @@ static int find_and_clear_dirty_height(struct VncSurface *s,
     return h;
 }
 
-static void vnc_update_client(void *opaque)
+/*
+ * Update jobs
+ *
+ * Updates are encoded on worker threads. The main loop copies the changed
+ * parts of the guest surface into the server surface, hands the server
+ * dirty map over to a job, and appends the encoded update to the client
+ * output once the job is done. While a client has a job in flight its
+ * server surface is left alone; guest changes made in the meantime build
+ * up in the guest dirty map and go out with the next update.
+ *
+ * A job encodes from a snapshot of VncState that has its own output buffer
+ * and no socket. The zlib streams are shared through vs->streams, and the
+ * zlib scratch buffer is handed back when the job is collected.
+ */
+
+struct VncJob
+{
+    VncState *vs;
+    VncState local;
+    DisplayState ds;
+    DisplaySurface surface;
+    int done;
+    QTAILQ_ENTRY(VncJob) next;
+};
+
+#define VNC_JOB_THREADS_MAX 4
+
+#ifndef _WIN32
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    /* 0 until the threads are started, -1 if that failed */
+    int nthreads;
+    /* written by the threads to wake up the main loop */
+    int notify[2];
+    QTAILQ_HEAD(, VncJob) queue;
+} vnc_jobs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .job_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+#endif
+
+static void vnc_job_run(VncJob *job)
 {
-    VncState *vs = opaque;
-    if (vs->need_update && vs->csock != -1) {
-        int y;
-        uint8_t *guest_row;
-        uint8_t *server_row;
-        int cmp_bytes;
-        uint32_t width_mask[VNC_DIRTY_WORDS];
-        int n_rectangles;
-        int saved_offset;
-        int has_dirty = 0;
+    VncState *vs = &job->local;
+    int y;
+    int n_rectangles;
+    int saved_offset;
 
-        if (vs->output.offset && !vs->audio_cap && !vs->force_update) {
-            /* kernel send buffers are full -> drop frames to throttle */
-            qemu_mod_timer(vs->timer, qemu_get_clock_ms(rt_clock) + VNC_REFRESH_INTERVAL);
-            return;
+    n_rectangles = 0;
+    vnc_write_u8(vs, 0);  /* msg id */
+    vnc_write_u8(vs, 0);
+    saved_offset = vs->output.offset;
+    vnc_write_u16(vs, 0);
+
+    for (y = 0; y < vs->server.ds->height; y++) {
+        int x;
+        int last_x = -1;
+        for (x = 0; x < vs->server.ds->width / 16; x++) {
+            if (vnc_get_bit(vs->server.dirty[y], x)) {
+                if (last_x == -1) {
+                    last_x = x;
+                }
+                vnc_clear_bit(vs->server.dirty[y], x);
+            } else {
+                if (last_x != -1) {
+                    int h = find_and_clear_dirty_height(&vs->server, y, last_x, x);
+                    n_rectangles += send_framebuffer_update(vs, last_x * 16, y,
+                                                            (x - last_x) * 16, h);
+                }
+                last_x = -1;
+            }
         }
+        if (last_x != -1) {
+            int h = find_and_clear_dirty_height(&vs->server, y, last_x, x);
+            n_rectangles += send_framebuffer_update(vs, last_x * 16, y,
+                                                    (x - last_x) * 16, h);
+        }
+    }
+    vs->output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
+    vs->output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
+}
 
-        vga_hw_update();
+/* Takes over the server dirty map of 'vs', which must have no job. */
+static VncJob *vnc_job_new(VncState *vs)
+{
+    VncJob *job = qemu_malloc(sizeof(*job));
 
-        /*
-         * Walk through the guest dirty map.
-         * Check and copy modified bits from guest to server surface.
-         * Update server dirty map.
-         */
-        vnc_set_bits(width_mask, (ds_get_width(vs->ds) / 16), VNC_DIRTY_WORDS);
-        cmp_bytes = 16 * ds_get_bytes_per_pixel(vs->ds);
-        guest_row  = vs->guest.ds->data;
-        server_row = vs->server.ds->data;
-        for (y = 0; y < vs->guest.ds->height; y++) {
-            if (vnc_and_bits(vs->guest.dirty[y], width_mask, VNC_DIRTY_WORDS)) {
-                int x;
-                uint8_t *guest_ptr;
-                uint8_t *server_ptr;
-
-                guest_ptr  = guest_row;
-                server_ptr = server_row;
-
-                for (x = 0; x < vs->guest.ds->width;
-                     x += 16, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-                    if (!vnc_get_bit(vs->guest.dirty[y], (x / 16)))
-                        continue;
-                    vnc_clear_bit(vs->guest.dirty[y], (x / 16));
-                    if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
-                        continue;
-                    memcpy(server_ptr, guest_ptr, cmp_bytes);
-                    vnc_set_bit(vs->server.dirty[y], (x / 16));
-                    has_dirty++;
+    job->vs = vs;
+    job->local = *vs;
+    job->surface = *vs->server.ds;
+    job->ds = *vs->ds;
+    job->ds.surface = &job->surface;
+    job->local.ds = &job->ds;
+    job->local.server.ds = &job->surface;
+    job->local.csock = -1;
+    job->local.output = vs->job_buffer;
+    buffer_reset(&job->local.output);
+    memset(&vs->job_buffer, 0, sizeof(vs->job_buffer));
+    job->done = 0;
+
+    memset(vs->server.dirty, 0, sizeof(vs->server.dirty));
+    vs->job = job;
+    return job;
+}
+
+static void vnc_job_finish(VncState *vs)
+{
+    VncJob *job = vs->job;
+
+    vs->job = NULL;
+    vs->zlib = job->local.zlib;
+    vnc_write(vs, job->local.output.buffer, job->local.output.offset);
+    vs->job_buffer = job->local.output;
+    qemu_free(job);
+    vnc_flush(vs);
+}
+
+#ifndef _WIN32
+static int vnc_job_done(VncJob *job)
+{
+    int done;
+
+    pthread_mutex_lock(&vnc_jobs.lock);
+    done = job->done;
+    pthread_mutex_unlock(&vnc_jobs.lock);
+    return done;
+}
+
+static void *vnc_job_thread(void *opaque)
+{
+    VncJob *job;
+    char byte = 0;
+
+    pthread_mutex_lock(&vnc_jobs.lock);
+    for (;;) {
+        while (QTAILQ_EMPTY(&vnc_jobs.queue)) {
+            pthread_cond_wait(&vnc_jobs.job_cond, &vnc_jobs.lock);
+        }
+        job = QTAILQ_FIRST(&vnc_jobs.queue);
+        QTAILQ_REMOVE(&vnc_jobs.queue, job, next);
+        pthread_mutex_unlock(&vnc_jobs.lock);
+
+        vnc_job_run(job);
+
+        pthread_mutex_lock(&vnc_jobs.lock);
+        job->done = 1;
+        pthread_cond_broadcast(&vnc_jobs.done_cond);
+        /* a full pipe already has a wakeup pending */
+        if (write(vnc_jobs.notify[1], &byte, 1) < 0) {
+        }
+    }
+    return NULL;
+}
+
+static void vnc_jobs_notify_read(void *opaque)
+{
+    VncState *vs, *vn;
+    char buf[64];
+
+    while (read(vnc_jobs.notify[0], buf, sizeof(buf)) > 0) {
+    }
+
+    for (vs = vnc_display->clients; vs != NULL; vs = vn) {
+        vn = vs->next;
+        if (vs->job && vnc_job_done(vs->job))
+            vnc_job_finish(vs);
+    }
+}
+
+/* One thread per host CPU, within VNC_JOB_THREADS_MAX. */
+static int vnc_jobs_start_threads(void)
+{
+    sigset_t set, oldset;
+    pthread_t thread;
+    long ncpus;
+    int i, max;
+
+    if (vnc_jobs.nthreads)
+        return vnc_jobs.nthreads > 0 ? 0 : -1;
+
+    vnc_jobs.nthreads = -1;
+    if (qemu_pipe(vnc_jobs.notify) < 0)
+        return -1;
+    fcntl(vnc_jobs.notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(vnc_jobs.notify[1], F_SETFL, O_NONBLOCK);
+    QTAILQ_INIT(&vnc_jobs.queue);
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    max = ncpus < 1 ? 1 : MIN(ncpus, VNC_JOB_THREADS_MAX);
+
+    /* block all signals, they are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for (i = 0; i < max; i++) {
+        if (pthread_create(&thread, NULL, vnc_job_thread, NULL) != 0)
+            break;
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (i == 0) {
+        close(vnc_jobs.notify[0]);
+        close(vnc_jobs.notify[1]);
+        return -1;
+    }
+    vnc_jobs.nthreads = i;
+    qemu_set_fd_handler2(vnc_jobs.notify[0], NULL, vnc_jobs_notify_read,
+                         NULL, NULL);
+    return 0;
+}
+#endif
+
+/* Without worker threads the update is encoded right away. */
+static void vnc_job_push(VncJob *job)
+{
+#ifndef _WIN32
+    if (vnc_jobs_start_threads() == 0) {
+        pthread_mutex_lock(&vnc_jobs.lock);
+        QTAILQ_INSERT_TAIL(&vnc_jobs.queue, job, next);
+        pthread_cond_signal(&vnc_jobs.job_cond);
+        pthread_mutex_unlock(&vnc_jobs.lock);
+        return;
+    }
+#endif
+    vnc_job_run(job);
+    job->done = 1;
+    vnc_job_finish(job->vs);
+}
+
+/* Waits for the update job of 'vs', if any, and sends its output. */
+static void vnc_jobs_join(VncState *vs)
+{
+    if (!vs->job)
+        return;
+#ifndef _WIN32
+    pthread_mutex_lock(&vnc_jobs.lock);
+    while (!vs->job->done) {
+        pthread_cond_wait(&vnc_jobs.done_cond, &vnc_jobs.lock);
+    }
+    pthread_mutex_unlock(&vnc_jobs.lock);
+#endif
+    vnc_job_finish(vs);
+}
+
+/*
+ * Walks through the guest dirty map, copies the modified parts of the guest
+ * surface to the server surface and marks them in the dirty map of every
+ * client. This is done once per refresh, whatever the number of clients.
+ * Returns the number of modified tiles.
+ */
+static int vnc_refresh_server_surface(VncDisplay *vd)
+{
+    int y;
+    uint8_t *guest_row;
+    uint8_t *server_row;
+    int cmp_bytes;
+    uint32_t width_mask[VNC_DIRTY_WORDS];
+    uint32_t changed[VNC_DIRTY_WORDS];
+    VncState *vs;
+    int has_dirty = 0;
+
+    vnc_set_bits(width_mask, (ds_get_width(vd->ds) / 16), VNC_DIRTY_WORDS);
+    cmp_bytes = 16 * ds_get_bytes_per_pixel(vd->ds);
+    guest_row  = vd->guest.ds->data;
+    server_row = vd->server->data;
+    for (y = 0; y < vd->guest.ds->height; y++) {
+        if (vnc_and_bits(vd->guest.dirty[y], width_mask, VNC_DIRTY_WORDS)) {
+            int x, i, n = 0;
+            uint8_t *guest_ptr;
+            uint8_t *server_ptr;
+
+            guest_ptr  = guest_row;
+            server_ptr = server_row;
+            memset(changed, 0, sizeof(changed));
+
+            for (x = 0; x < vd->guest.ds->width;
+                 x += 16, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
+                if (!vnc_get_bit(vd->guest.dirty[y], (x / 16)))
+                    continue;
+                vnc_clear_bit(vd->guest.dirty[y], (x / 16));
+                if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
+                    continue;
+                memcpy(server_ptr, guest_ptr, cmp_bytes);
+                vnc_set_bit(changed, (x / 16));
+                n++;
+            }
+            if (n) {
+                for (vs = vd->clients; vs != NULL; vs = vs->next) {
+                    for (i = 0; i < VNC_DIRTY_WORDS; i++)
+                        vs->server.dirty[y][i] |= changed[i];
                 }
+                has_dirty += n;
             }
-            guest_row  += ds_get_linesize(vs->ds);
-            server_row += ds_get_linesize(vs->ds);
         }
+        guest_row  += ds_get_linesize(vd->ds);
+        server_row += ds_get_linesize(vd->ds);
+    }
+    return has_dirty;
+}
 
+/*
+ * Brings the tiles the client still has to receive up to date in its copy
+ * of the server surface. Returns the number of such tiles.
+ */
+static int vnc_copy_dirty_tiles(VncState *vs)
+{
+    DisplaySurface *server = vs->vd->server;
+    int tile_bytes = 16 * server->pf.bytes_per_pixel;
+    int width = server->width / 16;
+    int y, x, last_x;
+    int n = 0;
+
+    for (y = 0; y < server->height; y++) {
+        size_t offset = y * server->linesize;
+
+        for (x = 0; x < width; x++) {
+            if (!vnc_get_bit(vs->server.dirty[y], x))
+                continue;
+            for (last_x = x; x < width && vnc_get_bit(vs->server.dirty[y], x); x++) {
+            }
+            memcpy(vs->server.ds->data + offset + last_x * tile_bytes,
+                   server->data + offset + last_x * tile_bytes,
+                   (x - last_x) * tile_bytes);
+            n += x - last_x;
+        }
+    }
+    return n;
+}
+
+static void vnc_update_client(VncState *vs)
+{
+#ifndef _WIN32
+    if (vs->job && vnc_job_done(vs->job))
+        vnc_job_finish(vs);
+#endif
+
+    if (vs->need_update && vs->csock != -1 && !vs->job) {
+        int has_dirty;
+
+        if (vs->output.offset && !vs->audio_cap && !vs->force_update) {
+            /* kernel send buffers are full -> drop frames to throttle */
+            return;
+        }
+
+        has_dirty = vnc_copy_dirty_tiles(vs);
         if (!has_dirty && !vs->audio_cap && !vs->force_update) {
-            qemu_mod_timer(vs->timer, qemu_get_clock_ms(rt_clock) + VNC_REFRESH_INTERVAL);
             return;
         }
 
         /*
-         * Send screen updates to the vnc client using the server
-         * surface and server dirty map.  guest surface updates
+         * Send screen updates to the vnc client using the copy of the
+         * server surface and the client dirty map.  guest surface updates
          * happening in parallel don't disturb us, the next pass will
          * send them to the client.
          */
-        n_rectangles = 0;
-        vnc_write_u8(vs, 0);  /* msg id */
-        vnc_write_u8(vs, 0);
-        saved_offset = vs->output.offset;
-        vnc_write_u16(vs, 0);
-
-        for (y = 0; y < vs->server.ds->height; y++) {
-            int x;
-            int last_x = -1;
-            for (x = 0; x < vs->server.ds->width / 16; x++) {
-                if (vnc_get_bit(vs->server.dirty[y], x)) {
-                    if (last_x == -1) {
-                        last_x = x;
-                    }
-                    vnc_clear_bit(vs->server.dirty[y], x);
-                } else {
-                    if (last_x != -1) {
-                        int h = find_and_clear_dirty_height(&vs->server, y, last_x, x);
-                        send_framebuffer_update(vs, last_x * 16, y, (x - last_x) * 16, h);
-                        n_rectangles++;
-                    }
-                    last_x = -1;
-                }
-            }
-            if (last_x != -1) {
-                int h = find_and_clear_dirty_height(&vs->server, y, last_x, x);
-                send_framebuffer_update(vs, last_x * 16, y, (x - last_x) * 16, h);
-                n_rectangles++;
-            }
-        }
-        vs->output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
-        vs->output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
-        vnc_flush(vs);
         vs->force_update = 0;
-
+        vnc_job_push(vnc_job_new(vs));
     }
 
-    if (vs->csock != -1) {
-        qemu_mod_timer(vs->timer, qemu_get_clock_ms(rt_clock) + VNC_REFRESH_INTERVAL);
-    } else {
+    /* a client is freed once its update job is done */
+    if (vs->csock == -1 && !vs->job) {
         vnc_disconnect_finish(vs);
     }
+}
+
+static void vnc_refresh(void *opaque)
+{
+    VncDisplay *vd = opaque;
+    VncState *vs, *vn;
+
+    vga_hw_update();
+    vnc_refresh_server_surface(vd);
+
+    for (vs = vd->clients; vs != NULL; vs = vn) {
+        vn = vs->next;
+        vnc_update_client(vs);
+        /* vs might be free()ed here */
+    }
 
+    if (vd->clients) {
+        qemu_mod_timer(vd->timer, qemu_get_clock_ms(rt_clock) + VNC_REFRESH_INTERVAL);
+    }
 }
 
 /* audio */
@@ -895,10 +1269,16 @@ static void vnc_disconnect_start(VncState *vs)
 
 static void vnc_disconnect_finish(VncState *vs)
 {
-    qemu_del_timer(vs->timer);
-    qemu_free_timer(vs->timer);
+    if (vs->job) {
+        /* vnc_update_client frees the client once the job is done */
+        return;
+    }
     if (vs->input.buffer) qemu_free(vs->input.buffer);
     if (vs->output.buffer) qemu_free(vs->output.buffer);
+    if (vs->zlib.buffer) qemu_free(vs->zlib.buffer);
+    if (vs->job_buffer.buffer) qemu_free(vs->job_buffer.buffer);
+    vnc_zlib_clear(vs);
+    qemu_free(vs->streams);
 #ifdef CONFIG_VNC_TLS
     vnc_tls_client_cleanup(vs);
 #endif /* CONFIG_VNC_TLS */
@@ -923,7 +1303,6 @@ static void vnc_disconnect_finish(VncState *vs)
 
     qemu_free(vs->server.ds->data);
     qemu_free(vs->server.ds);
-    qemu_free(vs->guest.ds);
     qemu_free(vs);
 }
 
@@ -1501,7 +1880,7 @@ static void framebuffer_update_request(VncState *vs, int incremental,
     if (!incremental) {
         vs->force_update = 1;
         for (i = 0; i < h; i++) {
-            vnc_set_bits(vs->guest.dirty[y_position + i],
+            vnc_set_bits(vs->vd->guest.dirty[y_position + i],
                          (ds_get_width(vs->ds) / 16), VNC_DIRTY_WORDS);
             vnc_set_bits(vs->server.dirty[y_position + i],
                          (ds_get_width(vs->ds) / 16), VNC_DIRTY_WORDS);
@@ -1534,7 +1913,8 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
     int i;
     unsigned int enc = 0;
 
-    vnc_zlib_init(vs);
+    vnc_jobs_join(vs);
+    vnc_zlib_clear(vs);
     vs->features = 0;
     vs->vnc_encoding = 0;
     vs->tight_compression = 9;
@@ -1558,6 +1938,14 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
             vs->features |= VNC_FEATURE_ZLIB_MASK;
             vs->vnc_encoding = enc;
             break;
+        case VNC_ENCODING_TIGHT:
+            vs->features |= VNC_FEATURE_TIGHT_MASK;
+            vs->vnc_encoding = enc;
+            break;
+        case VNC_ENCODING_ZRLE:
+            vs->features |= VNC_FEATURE_ZRLE_MASK;
+            vs->vnc_encoding = enc;
+            break;
         case VNC_ENCODING_DESKTOPRESIZE:
             vs->features |= VNC_FEATURE_RESIZE_MASK;
             break;
@@ -1632,7 +2020,10 @@ static void set_pixel_format(VncState *vs,
         return;
     }
 
-    vs->clientds = *(vs->guest.ds);
+    /* updates encoded for the old format must go out first */
+    vnc_jobs_join(vs);
+
+    vs->clientds = *(vs->vd->guest.ds);
     vs->clientds.pf.rmax = red_max;
     count_bits(vs->clientds.pf.rbits, red_max);
     vs->clientds.pf.rshift = red_shift;
@@ -2073,7 +2464,7 @@ static void vnc_connect(VncDisplay *vd, int csock)
 
     vs->vd = vd;
     vs->ds = vd->ds;
-    vs->timer = qemu_new_timer_ms(rt_clock, vnc_update_client, vs);
+    vs->streams = qemu_mallocz(sizeof(*vs->streams));
     vs->last_x = -1;
     vs->last_y = -1;
 
@@ -2091,8 +2482,9 @@ static void vnc_connect(VncDisplay *vd, int csock)
     vs->next = vd->clients;
     vd->clients = vs;
 
-    vnc_update_client(vs);
-    /* vs might be free()ed here */
+    if (!qemu_timer_pending(vd->timer)) {
+        qemu_mod_timer(vd->timer, qemu_get_clock_ms(rt_clock) + VNC_REFRESH_INTERVAL);
+    }
 }
 
 static void vnc_listen_read(void *opaque)
@@ -2135,6 +2527,9 @@ void vnc_display_init(DisplayState *ds)
     dcl->dpy_resize = vnc_dpy_resize;
     dcl->dpy_setdata = vnc_dpy_setdata;
     register_displaychangelistener(ds, dcl);
+
+    vs->timer = qemu_new_timer_ms(rt_clock, vnc_refresh, vs);
+    vnc_dpy_resize(ds);
 }
 
 
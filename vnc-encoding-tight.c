@@ -0,0 +1,215 @@
+/*
+ * QEMU VNC display driver: Tight encoding
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "vnc.h"
+
+/*
+ * Rectangles are sent as a solid fill, or through the basic compression
+ * with either the palette filter (two colors, or up to 256 colors on large
+ * enough rectangles) or the copy filter. JPEG is not used.
+ *
+ * Streams 0, 1 and 2 respectively carry full color, two color and indexed
+ * data, so that each one keeps a dictionary suited to its contents.
+ */
+
+#define TIGHT_MAX_RECT_SIZE     65536
+#define TIGHT_MIN_TO_COMPRESS   12
+
+#define TIGHT_STREAM_FULL       0
+#define TIGHT_STREAM_MONO       1
+#define TIGHT_STREAM_INDEXED    2
+
+#define TIGHT_FILTER_PALETTE    1
+
+/* TPIXELs are packed as R, G, B for 24-bit depth, 32 bpp clients */
+static int tight_pixel_size(VncState *vs)
+{
+    PixelFormat *pf = &vs->clientds.pf;
+
+    if (pf->bytes_per_pixel == 4 && pf->depth == 24 &&
+        pf->rmax == 255 && pf->gmax == 255 && pf->bmax == 255) {
+        return 3;
+    }
+    return pf->bytes_per_pixel;
+}
+
+static void tight_write_pixel(VncState *vs, uint32_t v, int size)
+{
+    PixelFormat *pf = &vs->server.ds->pf;
+    uint8_t buf[4];
+
+    if (size == 3) {
+        buf[0] = ((v & pf->rmask) >> pf->rshift) << (8 - pf->rbits);
+        buf[1] = ((v & pf->gmask) >> pf->gshift) << (8 - pf->gbits);
+        buf[2] = ((v & pf->bmask) >> pf->bshift) << (8 - pf->bbits);
+    } else {
+        vnc_convert_pixel(vs, buf, v);
+    }
+    vnc_write(vs, buf, size);
+}
+
+/*
+ * Compresses the data written since vnc_zlib_start() and appends it to the
+ * output at 'offset', after its compact length. Short data is not worth a
+ * zlib block and goes out as is.
+ */
+static void tight_compress_data(VncState *vs, int stream, size_t offset)
+{
+    uint8_t len_buf[3];
+    int len, n;
+
+    if (vs->output.offset < TIGHT_MIN_TO_COMPRESS) {
+        Buffer data = vs->output;
+
+        vs->zlib = data;
+        vs->output = vs->zlib_tmp;
+        vnc_write(vs, data.buffer, data.offset);
+        return;
+    }
+
+    len = vnc_zlib_stop(vs, &vs->streams->tight[stream]);
+    if (len == -1)
+        return;
+
+    n = 0;
+    len_buf[n++] = len & 0x7f;
+    if (len > 0x7f) {
+        len_buf[n - 1] |= 0x80;
+        len_buf[n++] = (len >> 7) & 0x7f;
+        if (len > 0x3fff) {
+            len_buf[n - 1] |= 0x80;
+            len_buf[n++] = (len >> 14) & 0xff;
+        }
+    }
+
+    buffer_reserve(&vs->output, n);
+    memmove(vs->output.buffer + offset + n, vs->output.buffer + offset, len);
+    memcpy(vs->output.buffer + offset, len_buf, n);
+    vs->output.offset += n;
+}
+
+static void tight_send_subrect(VncState *vs, int x, int y, int w, int h,
+                               uint32_t *pixels)
+{
+    VncPalette palette;
+    int n = w * h;
+    int i, j, has_palette, stream, ccb, tpx;
+    size_t offset;
+
+    vnc_read_pixels(vs, x, y, w, h, pixels);
+    palette_init(&palette, VNC_PALETTE_MAX);
+    has_palette = 1;
+    for (i = 0; i < n; i++) {
+        if (palette_put(&palette, pixels[i]) < 0) {
+            has_palette = 0;
+            break;
+        }
+    }
+
+    tpx = tight_pixel_size(vs);
+    vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_TIGHT);
+
+    if (has_palette && palette.size == 1) {
+        vnc_write_u8(vs, VNC_TIGHT_CCB_TYPE_FILL);
+        tight_write_pixel(vs, pixels[0], tpx);
+        return;
+    }
+
+    if (has_palette && palette.size == 2) {
+        stream = TIGHT_STREAM_MONO;
+    } else if (has_palette && palette.size * 2 <= n) {
+        stream = TIGHT_STREAM_INDEXED;
+    } else {
+        stream = TIGHT_STREAM_FULL;
+        has_palette = 0;
+    }
+
+    ccb = stream << 4;
+    if (has_palette) {
+        ccb |= VNC_TIGHT_CCB_BASIC_FILTER;
+    }
+    /* a stream we are about to (re)initialize must be reset by the client
+       too (see vnc_zlib_stop for the initialization marker) */
+    if (vs->streams->tight[stream].opaque != &vs->streams->tight[stream]) {
+        ccb |= 1 << stream;
+    }
+    vnc_write_u8(vs, ccb);
+
+    if (has_palette) {
+        vnc_write_u8(vs, TIGHT_FILTER_PALETTE);
+        vnc_write_u8(vs, palette.size - 1);
+        for (i = 0; i < palette.size; i++) {
+            tight_write_pixel(vs, palette.colors[i], tpx);
+        }
+    }
+
+    offset = vs->output.offset;
+    vnc_zlib_start(vs);
+    if (stream == TIGHT_STREAM_MONO) {
+        for (j = 0; j < h; j++) {
+            uint8_t byte = 0;
+            for (i = 0; i < w; i++) {
+                byte = (byte << 1) | (pixels[i] != palette.colors[0]);
+                if ((i & 7) == 7) {
+                    vnc_write_u8(vs, byte);
+                    byte = 0;
+                }
+            }
+            if (w & 7) {
+                vnc_write_u8(vs, byte << (8 - (w & 7)));
+            }
+            pixels += w;
+        }
+    } else if (stream == TIGHT_STREAM_INDEXED) {
+        buffer_reserve(&vs->output, n);
+        for (i = 0; i < n; i++) {
+            vs->output.buffer[vs->output.offset + i] =
+                palette_idx(&palette, pixels[i]);
+        }
+        vs->output.offset += n;
+    } else {
+        for (i = 0; i < n; i++) {
+            tight_write_pixel(vs, pixels[i], tpx);
+        }
+    }
+    tight_compress_data(vs, stream, offset);
+}
+
+/*
+ * Clients only accept rectangles of limited size; large updates are split
+ * in bands. Returns the number of rectangles sent.
+ */
+int vnc_tight_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+{
+    uint32_t *pixels;
+    int dy, rows, n = 0;
+
+    rows = MAX(1, TIGHT_MAX_RECT_SIZE / w);
+    pixels = qemu_malloc(w * MIN(rows, h) * sizeof(uint32_t));
+    for (dy = 0; dy < h; dy += rows) {
+        tight_send_subrect(vs, x, y + dy, w, MIN(rows, h - dy), pixels);
+        n++;
+    }
+    qemu_free(pixels);
+
+    return n;
+}
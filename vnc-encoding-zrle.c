@@ -0,0 +1,238 @@
+/*
+ * QEMU VNC display driver: ZRLE encoding
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "vnc.h"
+
+#define ZRLE_TILE_SIZE          64
+/* palette RLE has room for 127 colors, packed palettes for 16 */
+#define ZRLE_PALETTE_MAX        127
+#define ZRLE_PACKED_MAX         16
+
+#define ZRLE_SUBENC_RAW         0
+#define ZRLE_SUBENC_SOLID       1
+#define ZRLE_SUBENC_PLAIN_RLE   128
+
+/*
+ * A CPIXEL drops the unused byte of 32-bit pixels whose colors fit in the
+ * three least or most significant bytes; 'offset' is where the three kept
+ * bytes start in the client byte order.
+ */
+static int zrle_cpixel_size(VncState *vs, int *offset)
+{
+    PixelFormat *pf = &vs->clientds.pf;
+    uint32_t mask = pf->rmask | pf->gmask | pf->bmask;
+    int big_endian = vs->clientds.flags & QEMU_BIG_ENDIAN_FLAG;
+
+    *offset = 0;
+    if (pf->bytes_per_pixel != 4 || pf->depth > 24) {
+        return pf->bytes_per_pixel;
+    }
+    if (mask < (1 << 24)) {
+        *offset = big_endian ? 1 : 0;
+        return 3;
+    }
+    if ((mask & 0xff) == 0) {
+        *offset = big_endian ? 0 : 1;
+        return 3;
+    }
+    return 4;
+}
+
+static void zrle_write_cpixel(VncState *vs, uint32_t v, int size, int offset)
+{
+    uint8_t buf[4];
+
+    vnc_convert_pixel(vs, buf, v);
+    vnc_write(vs, buf + offset, size);
+}
+
+static inline int zrle_run_length_size(int len)
+{
+    return (len - 1) / 255 + 1;
+}
+
+static void zrle_write_run_length(VncState *vs, int len)
+{
+    len--;
+    while (len >= 255) {
+        vnc_write_u8(vs, 255);
+        len -= 255;
+    }
+    vnc_write_u8(vs, len);
+}
+
+static void zrle_write_packed(VncState *vs, uint32_t *pixels, int w, int h,
+                              VncPalette *palette)
+{
+    int bits = palette->size <= 2 ? 1 : palette->size <= 4 ? 2 : 4;
+    int x, y, nbits;
+    uint8_t byte;
+
+    for (y = 0; y < h; y++) {
+        byte = 0;
+        nbits = 0;
+        for (x = 0; x < w; x++) {
+            byte = (byte << bits) | palette_idx(palette, *pixels++);
+            nbits += bits;
+            if (nbits == 8) {
+                vnc_write_u8(vs, byte);
+                byte = 0;
+                nbits = 0;
+            }
+        }
+        if (nbits) {
+            vnc_write_u8(vs, byte << (8 - nbits));
+        }
+    }
+}
+
+static void zrle_write_rle(VncState *vs, uint32_t *pixels, int n,
+                           VncPalette *palette, int cpx, int coff)
+{
+    int i, j, len;
+
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && pixels[j] == pixels[i]; j++) {
+        }
+        len = j - i;
+        if (palette == NULL) {
+            zrle_write_cpixel(vs, pixels[i], cpx, coff);
+            zrle_write_run_length(vs, len);
+        } else if (len == 1) {
+            vnc_write_u8(vs, palette_idx(palette, pixels[i]));
+        } else {
+            vnc_write_u8(vs, palette_idx(palette, pixels[i]) | 128);
+            zrle_write_run_length(vs, len);
+        }
+    }
+}
+
+/*
+ * Picks the smallest of the raw, solid, packed palette, plain RLE and
+ * palette RLE subencodings for one tile, based on its colors and runs.
+ */
+static void zrle_encode_tile(VncState *vs, uint32_t *pixels, int w, int h,
+                             int cpx, int coff)
+{
+    VncPalette palette;
+    int n = w * h;
+    int i, j, len, has_palette;
+    int plain_rle = 0, palette_rle = 0;
+    int best, subenc;
+
+    palette_init(&palette, ZRLE_PALETTE_MAX);
+    has_palette = 1;
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && pixels[j] == pixels[i]; j++) {
+        }
+        len = j - i;
+        plain_rle += cpx + zrle_run_length_size(len);
+        palette_rle += 1 + (len > 1 ? zrle_run_length_size(len) : 0);
+        if (has_palette && palette_put(&palette, pixels[i]) < 0) {
+            has_palette = 0;
+        }
+    }
+
+    if (has_palette && palette.size == 1) {
+        vnc_write_u8(vs, ZRLE_SUBENC_SOLID);
+        zrle_write_cpixel(vs, pixels[0], cpx, coff);
+        return;
+    }
+
+    best = n * cpx;
+    subenc = ZRLE_SUBENC_RAW;
+    if (plain_rle < best) {
+        best = plain_rle;
+        subenc = ZRLE_SUBENC_PLAIN_RLE;
+    }
+    if (has_palette) {
+        int bits = palette.size <= 2 ? 1 : palette.size <= 4 ? 2 : 4;
+        int packed = palette.size * cpx + h * ((w * bits + 7) / 8);
+
+        palette_rle += palette.size * cpx;
+        if (palette.size <= ZRLE_PACKED_MAX && packed < best) {
+            best = packed;
+            subenc = palette.size;
+        }
+        if (palette_rle < best) {
+            best = palette_rle;
+            subenc = ZRLE_SUBENC_PLAIN_RLE + palette.size;
+        }
+    }
+
+    vnc_write_u8(vs, subenc);
+    if (subenc == ZRLE_SUBENC_RAW) {
+        for (i = 0; i < n; i++) {
+            zrle_write_cpixel(vs, pixels[i], cpx, coff);
+        }
+        return;
+    }
+    if (subenc == ZRLE_SUBENC_PLAIN_RLE) {
+        zrle_write_rle(vs, pixels, n, NULL, cpx, coff);
+        return;
+    }
+
+    for (i = 0; i < palette.size; i++) {
+        zrle_write_cpixel(vs, palette.colors[i], cpx, coff);
+    }
+    if (subenc <= ZRLE_PACKED_MAX) {
+        zrle_write_packed(vs, pixels, w, h, &palette);
+    } else {
+        zrle_write_rle(vs, pixels, n, &palette, cpx, coff);
+    }
+}
+
+int vnc_zrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+{
+    uint32_t pixels[ZRLE_TILE_SIZE * ZRLE_TILE_SIZE];
+    int old_offset, new_offset, bytes_written;
+    int i, j, cpx, coff;
+
+    vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_ZRLE);
+
+    // remember where we put in the follow-up size
+    old_offset = vs->output.offset;
+    vnc_write_s32(vs, 0);
+
+    cpx = zrle_cpixel_size(vs, &coff);
+    vnc_zlib_start(vs);
+    for (j = y; j < y + h; j += ZRLE_TILE_SIZE) {
+        int th = MIN(ZRLE_TILE_SIZE, y + h - j);
+        for (i = x; i < x + w; i += ZRLE_TILE_SIZE) {
+            int tw = MIN(ZRLE_TILE_SIZE, x + w - i);
+            vnc_read_pixels(vs, i, j, tw, th, pixels);
+            zrle_encode_tile(vs, pixels, tw, th, cpx, coff);
+        }
+    }
+    bytes_written = vnc_zlib_stop(vs, &vs->streams->zrle);
+
+    if (bytes_written == -1)
+        return 1;
+
+    // hack in the size
+    new_offset = vs->output.offset;
+    vs->output.offset = old_offset;
+    vnc_write_u32(vs, bytes_written);
+    vs->output.offset = new_offset;
+
+    return 1;
+}
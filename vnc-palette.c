@@ -0,0 +1,75 @@
+/*
+ * QEMU VNC display driver: color palettes for the ZRLE and Tight encodings
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "vnc.h"
+
+/*
+ * Colors are found through a small open addressing hash; the index table
+ * keeps (position in colors[] + 1), 0 marking a free slot.
+ */
+
+static inline int palette_hash(uint32_t color)
+{
+    return (color * 2654435761u) >> (32 - VNC_PALETTE_HASH_BITS);
+}
+
+void palette_init(VncPalette *p, int max)
+{
+    p->size = 0;
+    p->max = MIN(max, VNC_PALETTE_MAX);
+    memset(p->index, 0, sizeof(p->index));
+}
+
+int palette_idx(const VncPalette *p, uint32_t color)
+{
+    int h = palette_hash(color);
+
+    while (p->index[h]) {
+        if (p->colors[p->index[h] - 1] == color) {
+            return p->index[h] - 1;
+        }
+        h = (h + 1) & (VNC_PALETTE_HASH_SIZE - 1);
+    }
+    return -1;
+}
+
+/*
+ * Returns the index of 'color', adding it if needed, or -1 when the palette
+ * already holds 'max' other colors.
+ */
+int palette_put(VncPalette *p, uint32_t color)
+{
+    int h = palette_hash(color);
+
+    while (p->index[h]) {
+        if (p->colors[p->index[h] - 1] == color) {
+            return p->index[h] - 1;
+        }
+        h = (h + 1) & (VNC_PALETTE_HASH_SIZE - 1);
+    }
+    if (p->size == p->max) {
+        return -1;
+    }
+    p->colors[p->size] = color;
+    p->index[h] = ++p->size;
+    return p->size - 1;
+}
@@ -57,6 +57,7 @@ typedef struct Buffer
 } Buffer;
 
 typedef struct VncState VncState;
+typedef struct VncJob VncJob;
 
 typedef int VncReadEvent(VncState *vs, uint8_t *data, size_t len);
 
@@ -85,6 +86,12 @@ typedef struct VncDisplay VncDisplay;
 #endif
 
 
+struct VncSurface
+{
+    uint32_t dirty[VNC_MAX_HEIGHT][VNC_DIRTY_WORDS];
+    DisplaySurface *ds;
+};
+
 struct VncDisplay
 {
     int lsock;
@@ -92,6 +99,11 @@ struct VncDisplay
     VncState *clients;
     kbd_layout_t *kbd_layout;
 
+    /* refresh of all the clients */
+    QEMUTimer *timer;
+    struct VncSurface guest;   /* guest visible surface (aka ds->surface) */
+    DisplaySurface *server;    /* vnc server surface, shared by the clients */
+
     char *display;
     char *password;
     int auth;
@@ -104,20 +116,25 @@ struct VncDisplay
 #endif
 };
 
-struct VncSurface
+/*
+ * zlib streams of a client. They live outside of VncState because update
+ * jobs encode from a copy of it, and an initialized z_stream cannot move.
+ */
+typedef struct VncStreams
 {
-    uint32_t dirty[VNC_MAX_HEIGHT][VNC_DIRTY_WORDS];
-    DisplaySurface *ds;
-};
+    z_stream zlib[4];
+    z_stream zrle;
+    z_stream tight[4];
+} VncStreams;
 
 struct VncState
 {
-    QEMUTimer *timer;
     int csock;
 
     DisplayState *ds;
-    struct VncSurface guest;   /* guest visible surface (aka ds->surface) */
-    struct VncSurface server;  /* vnc server surface */
+    /* copy of the server surface that updates are encoded from, with the
+       tiles still to be sent to the client */
+    struct VncSurface server;
 
     VncDisplay *vd;
     int need_update;
@@ -159,7 +176,12 @@ struct VncState
 
     Buffer zlib;
     Buffer zlib_tmp;
-    z_stream zlib_stream[4];
+    VncStreams *streams;
+
+    /* update being encoded on a worker thread, if any */
+    VncJob *job;
+    /* output buffer recycled between update jobs */
+    Buffer job_buffer;
 
     VncState *next;
 };
@@ -257,6 +279,7 @@ enum {
 #define VNC_FEATURE_TIGHT                    4
 #define VNC_FEATURE_ZLIB                     5
 #define VNC_FEATURE_COPYRECT                 6
+#define VNC_FEATURE_ZRLE                     7
 
 #define VNC_FEATURE_RESIZE_MASK              (1 << VNC_FEATURE_RESIZE)
 #define VNC_FEATURE_HEXTILE_MASK             (1 << VNC_FEATURE_HEXTILE)
@@ -265,6 +288,7 @@ enum {
 #define VNC_FEATURE_TIGHT_MASK               (1 << VNC_FEATURE_TIGHT)
 #define VNC_FEATURE_ZLIB_MASK                (1 << VNC_FEATURE_ZLIB)
 #define VNC_FEATURE_COPYRECT_MASK            (1 << VNC_FEATURE_COPYRECT)
+#define VNC_FEATURE_ZRLE_MASK                (1 << VNC_FEATURE_ZRLE)
 
 
 /*****************************************************************************
@@ -311,6 +335,35 @@ void buffer_reset(Buffer *buffer);
 void buffer_append(Buffer *buffer, const void *data, size_t len);
 
 
+/* Encodings */
+void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
+                            int32_t encoding);
+void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v);
+void vnc_read_pixels(VncState *vs, int x, int y, int w, int h,
+                     uint32_t *pixels);
+void vnc_zlib_start(VncState *vs);
+int vnc_zlib_stop(VncState *vs, z_streamp zstream);
+
+int vnc_zrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
+int vnc_tight_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
+
+/* Color palettes */
+#define VNC_PALETTE_MAX        256
+#define VNC_PALETTE_HASH_BITS  10
+#define VNC_PALETTE_HASH_SIZE  (1 << VNC_PALETTE_HASH_BITS)
+
+typedef struct VncPalette {
+    int size;
+    int max;
+    uint32_t colors[VNC_PALETTE_MAX];
+    uint16_t index[VNC_PALETTE_HASH_SIZE];
+} VncPalette;
+
+void palette_init(VncPalette *p, int max);
+int palette_idx(const VncPalette *p, uint32_t color);
+int palette_put(VncPalette *p, uint32_t color);
+
+
 /* Misc helpers */
 
 char *vnc_socket_local_addr(const char *format, int fd);